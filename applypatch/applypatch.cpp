@@ -41,6 +41,7 @@
 #include <openssl/sha.h>
 
 #include "edify/expr.h"
+#include "otautil/hash.h"
 #include "otautil/paths.h"
 #include "otautil/print_sha1.h"
 
@@ -62,7 +63,7 @@ bool LoadFileContents(const std::string& filename, FileContents* file) {
   }
 
   file->data = std::vector<unsigned char>(data.begin(), data.end());
-  SHA1(file->data.data(), file->data.size(), file->sha1);
+  ComputeHash(HashAlgorithm::kSha1, file->data.data(), file->data.size(), file->sha1);
   return true;
 }
 
@@ -84,7 +85,7 @@ static bool ReadPartitionToBuffer(const Partition& partition, FileContents* out,
       PLOG(ERROR) << "Failed to read " << buffer.size() << " bytes of data for partition "
                   << partition;
     } else {
-      SHA1(buffer.data(), buffer.size(), out->sha1);
+      ComputeHash(HashAlgorithm::kSha1, buffer.data(), buffer.size(), out->sha1);
       if (memcmp(out->sha1, expected_sha1, SHA_DIGEST_LENGTH) == 0) {
         out->data = std::move(buffer);
         return true;
@@ -362,10 +363,9 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
 
   // We store the decoded output in memory.
   FileContents patched;
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
-  SinkFn sink = [&patched, &ctx](const unsigned char* data, size_t len) {
-    SHA1_Update(&ctx, data, len);
+  Hasher hasher(HashAlgorithm::kSha1);
+  SinkFn sink = [&patched, &hasher](const unsigned char* data, size_t len) {
+    hasher.Update(data, len);
     patched.data.insert(patched.data.end(), data, data + len);
     return len;
   };
@@ -383,7 +383,8 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
     return false;
   }
 
-  SHA1_Final(patched.sha1, &ctx);
+  Digest patched_digest = hasher.Final();
+  memcpy(patched.sha1, patched_digest.data(), patched_digest.size());
   if (memcmp(patched.sha1, expected_sha1, SHA_DIGEST_LENGTH) != 0) {
     LOG(ERROR) << "Patching did not produce the expected SHA-1 of " << short_sha1(expected_sha1);
 
@@ -24,6 +24,7 @@
 #include <sys/types.h>
 
 #include <string>
+#include <string_view>
 
 #include <android-base/logging.h>
 #include <bsdiff/bspatch.h>
@@ -67,18 +68,23 @@ void ShowBSDiffLicense() {
 
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink) {
-  CHECK_LE(patch_offset, patch.data.size());
+  return ApplyBSDiffPatch(old_data, old_size, std::string_view(patch.data), patch_offset, sink);
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, std::string_view patch,
+                     size_t patch_offset, SinkFn sink) {
+  CHECK_LE(patch_offset, patch.size());
 
   int result = bsdiff::bspatch(old_data, old_size,
-                               reinterpret_cast<const uint8_t*>(&patch.data[patch_offset]),
-                               patch.data.size() - patch_offset, sink);
+                               reinterpret_cast<const uint8_t*>(patch.data() + patch_offset),
+                               patch.size() - patch_offset, sink);
   if (result != 0) {
     LOG(ERROR) << "bspatch failed, result: " << result;
     // print SHA1 of the patch in the case of a data error.
     if (result == 2) {
       uint8_t digest[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const uint8_t*>(patch.data.data() + patch_offset),
-           patch.data.size() - patch_offset, digest);
+      SHA1(reinterpret_cast<const uint8_t*>(patch.data() + patch_offset),
+           patch.size() - patch_offset, digest);
       std::string patch_sha1 = print_sha1(digest);
       LOG(ERROR) << "Patch may be corrupted, offset: " << patch_offset << ", SHA1: " << patch_sha1;
     }
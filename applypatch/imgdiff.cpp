@@ -153,7 +153,14 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/file.h>
@@ -167,7 +174,9 @@
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
+#include "applypatch/imgdiff_cache.h"
 #include "applypatch/imgdiff_image.h"
+#include "otautil/hash.h"
 #include "otautil/rangeset.h"
 
 using android::base::get_unaligned;
@@ -251,6 +260,9 @@ static const struct option OPTIONS[] = {
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "threads", required_argument, nullptr, 0 },
+  { "cache-dir", required_argument, nullptr, 0 },
+  { "cache-size", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
@@ -377,22 +389,222 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   return true;
 }
 
-bool ImageChunk::ReconstructDeflateChunk() {
+// Calls |fn| with each index in [0, |count|), in order, from up to |threads| threads.
+static void RunOnThreads(size_t count, size_t threads, const std::function<void(size_t)>& fn) {
+  threads = std::min(threads, count);
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next{ 0 };
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (size_t i = next++; i < count; i = next++) {
+        fn(i);
+      }
+    });
+  }
+  for (auto& thread : workers) {
+    thread.join();
+  }
+}
+
+// A target chunk to compute a bsdiff patch for, against either a source chunk of its own or the
+// pseudo source of the image, whose suffix array is shared by all the jobs with
+// |shares_suffix_array|.
+struct PatchJob {
+  size_t index;
+  const ImageChunk* tgt;
+  const ImageChunk* src;
+  bool shares_suffix_array;
+};
+
+// Bump this when bsdiff starts producing different patches, to stop using the cached ones.
+static constexpr const char* kPatchCacheVersion = "bsdiff-1";
+
+static std::string ChunkDigest(const ImageChunk& chunk) {
+  Digest digest =
+      ComputeHash(HashAlgorithm::kSha256, chunk.DataForPatch(), chunk.DataLengthForPatch());
+  return std::string(digest.begin(), digest.end());
+}
+
+// Computes the patches of |jobs| into the matching |patches|, on up to |options.threads| threads.
+// The suffix array of the pseudo source is built once by the first job that needs it, and then
+// only read by the others, concurrently. Patches are looked up in / added to |options.cache|.
+static bool MakePatches(const std::vector<PatchJob>& jobs, const ImgdiffOptions& options,
+                        std::vector<std::vector<uint8_t>>* patches) {
+  patches->assign(jobs.size(), {});
+
+  // Look up the patches that were computed in previous runs. The key of a patch covers both
+  // inputs, through their digests; the one of the pseudo source is only computed once.
+  std::vector<std::string> keys(jobs.size());
+  std::vector<uint8_t> cached(jobs.size());
+  if (options.cache != nullptr) {
+    std::string pseudo_source_digest;
+    for (const auto& job : jobs) {
+      if (job.shares_suffix_array) {
+        pseudo_source_digest = ChunkDigest(*job.src);
+        break;
+      }
+    }
+    RunOnThreads(jobs.size(), options.threads, [&](size_t i) {
+      const auto& job = jobs[i];
+      std::string src_digest =
+          job.shares_suffix_array ? pseudo_source_digest : ChunkDigest(*job.src);
+      keys[i] = ImgdiffCache::Key({ kPatchCacheVersion, src_digest, ChunkDigest(*job.tgt) });
+      std::string value;
+      if (options.cache->Get("patch", keys[i], &value)) {
+        (*patches)[i].assign(value.begin(), value.end());
+        cached[i] = 1;
+      }
+    });
+  }
+
+  // The job that builds the suffix array goes first, so that the ones waiting for it don't hold up
+  // the workers for long.
+  std::vector<size_t> order;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (!cached[i]) {
+      order.push_back(i);
+    }
+  }
+  auto first_sharing = std::find_if(order.begin(), order.end(), [&jobs](size_t i) {
+    return jobs[i].shares_suffix_array;
+  });
+  if (first_sharing != order.end()) {
+    std::rotate(order.begin(), first_sharing, first_sharing + 1);
+  }
+  LOG(INFO) << "Computing " << order.size() << " patches (" << jobs.size() - order.size()
+            << " cached) on up to " << options.threads << " threads...";
+
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool cache_ready = (first_sharing == order.end());
+  bool failed = false;
+
+  RunOnThreads(order.size(), options.threads, [&](size_t n) {
+    const auto& job = jobs[order[n]];
+    auto& patch_data = (*patches)[order[n]];
+    bool builds_cache = job.shares_suffix_array && n == 0;
+
+    // bsdiff() only sets the cache if it's empty, so the other jobs get a copy of the pointer.
+    bsdiff::SuffixArrayIndexInterface* cache = nullptr;
+    bsdiff::SuffixArrayIndexInterface** cache_ptr = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (job.shares_suffix_array && !builds_cache) {
+        cv.wait(lock, [&]() { return cache_ready || failed; });
+        cache = bsdiff_cache;
+      }
+      if (failed) {
+        return;
+      }
+    }
+    if (job.shares_suffix_array) {
+      cache_ptr = builds_cache ? &bsdiff_cache : &cache;
+    }
+
+    bool success = ImageChunk::MakePatch(*job.tgt, *job.src, &patch_data, cache_ptr);
+    if (!success) {
+      LOG(ERROR) << "Failed to generate patch for target chunk " << job.index
+                 << ", name: " << job.tgt->GetEntryName();
+    } else {
+      LOG(INFO) << "patch " << job.index << " is " << patch_data.size() << " bytes (of "
+                << job.tgt->GetRawDataLength() << ")";
+      if (options.cache != nullptr) {
+        options.cache->Put(
+            "patch", keys[order[n]],
+            std::string_view(reinterpret_cast<const char*>(patch_data.data()), patch_data.size()));
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      failed |= !success;
+      cache_ready |= builds_cache;
+    }
+    cv.notify_all();
+  });
+  delete bsdiff_cache;
+
+  return !failed;
+}
+
+bool ImageChunk::ReconstructDeflateChunk(const ImgdiffCache* cache) {
   if (type_ != CHUNK_DEFLATE) {
     LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
     return false;
   }
 
+  // The outcome only depends on the compressed data and on how zlib compresses, which is given by
+  // its version and the parameters. The level that worked is cached, or -1 if none did.
+  static const std::string kParams = android::base::StringPrintf(
+      "zlib %s %d %d %d %d", zlibVersion(), METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
+  std::string key;
+  if (cache != nullptr) {
+    key = ImgdiffCache::Key(
+        { kParams, std::string_view(reinterpret_cast<const char*>(GetRawData()), raw_data_len_) });
+    std::string value;
+    int level;
+    if (cache->Get("deflate", key, &value) && android::base::ParseInt(value, &level, -1, 9)) {
+      if (level == -1) {
+        return false;
+      }
+      compress_level_ = level;
+      return true;
+    }
+  }
+
   // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
-  // (the maximum).
+  // (the maximum). TryReconstruction() gives up at the first mismatching output buffer, so ruling
+  // out a level only costs compressing about a deflate block of the input.
+  int found_level = -1;
   for (int level = 6; level <= 9; level += 3) {
     if (TryReconstruction(level)) {
-      compress_level_ = level;
-      return true;
+      found_level = level;
+      break;
     }
   }
 
-  return false;
+  if (cache != nullptr) {
+    cache->Put("deflate", key, std::to_string(found_level));
+  }
+  if (found_level == -1) {
+    return false;
+  }
+  compress_level_ = found_level;
+  return true;
+}
+
+// Calls ReconstructDeflateChunk() on |chunks| on up to |options.threads| threads. Returns the
+// outcome for each chunk.
+static std::unordered_map<const ImageChunk*, bool> ReconstructDeflateChunks(
+    const std::vector<ImageChunk*>& chunks, const ImgdiffOptions& options) {
+  std::vector<uint8_t> results(chunks.size());
+  RunOnThreads(chunks.size(), options.threads, [&](size_t i) {
+    results[i] = chunks[i]->ReconstructDeflateChunk(options.cache);
+  });
+
+  std::unordered_map<const ImageChunk*, bool> reconstructed;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    reconstructed.emplace(chunks[i], results[i] != 0);
+  }
+  return reconstructed;
+}
+
+// Returns the outcome of ReconstructDeflateChunks() for |chunk|, or reconstructs it now if it
+// wasn't among the chunks.
+static bool IsReconstructed(const std::unordered_map<const ImageChunk*, bool>& reconstructed,
+                            ImageChunk* chunk, const ImgdiffOptions& options) {
+  auto it = reconstructed.find(chunk);
+  if (it != reconstructed.end()) {
+    return it->second;
+  }
+  return chunk->ReconstructDeflateChunk(options.cache);
 }
 
 /*
@@ -886,7 +1098,22 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
       static_cast<const ZipModeImage*>(this)->FindChunkByName(name, find_normal));
 }
 
-bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
+bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                         const ImgdiffOptions& options) {
+  // Try to reconstruct all the deflate chunks that may need it upfront, as that's where most of the
+  // time goes. The loop below may still find out that some of them don't need it after all.
+  std::vector<ImageChunk*> candidates;
+  for (auto& tgt_chunk : *tgt_image) {
+    if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
+      continue;
+    }
+    const ImageChunk* src_chunk = src_image->FindChunkByName(tgt_chunk.GetEntryName());
+    if (src_chunk != nullptr && tgt_chunk != *src_chunk) {
+      candidates.push_back(&tgt_chunk);
+    }
+  }
+  auto reconstructed = ReconstructDeflateChunks(candidates, options);
+
   for (auto& tgt_chunk : *tgt_image) {
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
@@ -902,7 +1129,7 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
       // trivial patch to the uncompressed data.
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!IsReconstructed(reconstructed, &tgt_chunk, options)) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image. Treat the chunk as a normal non-deflated chunk.
       LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk.GetEntryName()
@@ -1123,53 +1350,63 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
 
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
+                                           std::vector<PatchChunk>* patch_chunks,
+                                           const ImgdiffOptions& options) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  const ImageChunk pseudo_source = src_image.PseudoSource();
+  std::vector<PatchJob> jobs;
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
 
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
 
     const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
                                       ? nullptr
                                       : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    if (src_chunk == nullptr) {
+      jobs.push_back({ i, &tgt_chunk, &pseudo_source, true });
+    } else {
+      jobs.push_back({ i, &tgt_chunk, src_chunk, false });
+    }
+  }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
-    bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
+  std::vector<std::vector<uint8_t>> patches;
+  if (!MakePatches(jobs, options, &patches)) {
+    return false;
+  }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
-      LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
-      return false;
+  auto job = jobs.begin();
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (job == jobs.end() || job->index != i) {
+      patch_chunks->emplace_back(tgt_chunk);
+      continue;
     }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
-              << tgt_chunk.GetRawDataLength() << ")";
-
+    auto& patch_data = patches[job - jobs.begin()];
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      patch_chunks->emplace_back(tgt_chunk, *job->src, std::move(patch_data));
     }
+    ++job;
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
+                                   const std::string& patch_name, const ImgdiffOptions& options) {
   std::vector<PatchChunk> patch_chunks;
 
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+  if (!ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks, options)) {
+    return false;
+  }
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
@@ -1188,7 +1425,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir, const ImgdiffOptions& options) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
   android::base::unique_fd patch_fd(
@@ -1202,7 +1439,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
   for (size_t i = 0; i < split_tgt_images.size(); i++) {
     std::vector<PatchChunk> patch_chunks;
     if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
+                                               &patch_chunks, options)) {
       LOG(ERROR) << "Failed to generate split patch";
       return false;
     }
@@ -1398,7 +1635,8 @@ bool ImageModeImage::SetBonusData(const std::vector<uint8_t>& bonus_data) {
 
 // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
 // same sequence of deflate and normal chunks).
-bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image) {
+bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                           const ImgdiffOptions& options) {
   // In image mode, merge the gzip header and footer in with any adjacent normal chunks.
   tgt_image->MergeAdjacentNormalChunks();
   src_image->MergeAdjacentNormalChunks();
@@ -1418,6 +1656,15 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     }
   }
 
+  std::vector<ImageChunk*> candidates;
+  for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
+    auto& tgt_chunk = (*tgt_image)[i];
+    if (tgt_chunk.GetType() == CHUNK_DEFLATE && tgt_chunk != (*src_image)[i]) {
+      candidates.push_back(&tgt_chunk);
+    }
+  }
+  auto reconstructed = ReconstructDeflateChunks(candidates, options);
+
   for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
     auto& tgt_chunk = (*tgt_image)[i];
     auto& src_chunk = (*src_image)[i];
@@ -1429,7 +1676,7 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     if (tgt_chunk == src_chunk) {
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk.ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!IsReconstructed(reconstructed, &tgt_chunk, options)) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image, fall back to normal
       LOG(WARNING) << "Failed to reconstruct target deflate chunk " << i << " ["
@@ -1456,33 +1703,38 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name,
+                                     const ImgdiffOptions& options) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
+  std::vector<PatchJob> jobs;
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    if (!PatchChunk::RawDataIsSmaller(tgt_image[i], 0)) {
+      jobs.push_back({ i, &tgt_image[i], &src_image[i], false });
+    }
+  }
+
+  std::vector<std::vector<uint8_t>> patches;
+  if (!MakePatches(jobs, options, &patches)) {
+    return false;
+  }
+
   std::vector<PatchChunk> patch_chunks;
   patch_chunks.reserve(tgt_image.NumOfChunks());
-
+  auto job = jobs.begin();
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
-    const auto& src_chunk = src_image[i];
-
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
+    if (job == jobs.end() || job->index != i) {
       patch_chunks.emplace_back(tgt_chunk);
       continue;
     }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
-      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
-      return false;
-    }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
-              << tgt_chunk.GetRawDataLength() << ")";
-
+    auto& patch_data = patches[job - jobs.begin()];
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_image[i], std::move(patch_data));
     }
+    ++job;
   }
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
@@ -1504,6 +1756,10 @@ int imgdiff(int argc, const char** argv) {
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
+  ImgdiffOptions options;
+  std::string cache_dir;
+  // 4 GiB by default.
+  size_t cache_size = static_cast<size_t>(4) << 30;
 
   int opt;
   int option_index;
@@ -1547,6 +1803,15 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "threads" &&
+                   (!android::base::ParseUint(optarg, &options.threads) || options.threads == 0)) {
+          LOG(ERROR) << "Failed to parse threads: " << optarg;
+          return 1;
+        } else if (name == "cache-dir") {
+          cache_dir = optarg;
+        } else if (name == "cache-size" && !android::base::ParseUint(optarg, &cache_size)) {
+          LOG(ERROR) << "Failed to parse cache size: " << optarg;
+          return 1;
         }
         break;
       }
@@ -1572,10 +1837,19 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --threads,        Number of threads to process the chunks on (default 1).\n"
+           "  --cache-dir,      Directory to keep results for the next runs in.\n"
+           "  --cache-size,     Size limit in bytes of the cache directory (default 4 GiB).\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
 
+  std::unique_ptr<ImgdiffCache> cache;
+  if (!cache_dir.empty()) {
+    cache = std::make_unique<ImgdiffCache>(cache_dir, cache_size);
+    options.cache = cache.get();
+  }
+
   if (zip_mode) {
     ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE);
     ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE);
@@ -1587,7 +1861,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
+    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image, options)) {
       return 1;
     }
 
@@ -1606,11 +1880,11 @@ int imgdiff(int argc, const char** argv) {
                                                &split_src_images, &split_src_ranges);
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir, options)) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], options)) {
       return 1;
     }
   } else {
@@ -1624,7 +1898,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
+    if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image, options)) {
       return 1;
     }
 
@@ -1632,10 +1906,13 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], options)) {
       return 1;
     }
   }
 
+  if (cache) {
+    cache->Trim();
+  }
   return 0;
 }
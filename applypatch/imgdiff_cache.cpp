@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/imgdiff_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <tuple>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#include "otautil/hash.h"
+#include "otautil/print_sha1.h"
+
+std::string ImgdiffCache::Key(const std::vector<std::string_view>& parts) {
+  Hasher hasher(HashAlgorithm::kSha256);
+  for (const auto& part : parts) {
+    // Prefix each part with its size, so that moving bytes between parts changes the key.
+    uint64_t size = part.size();
+    hasher.Update(&size, sizeof(size));
+    hasher.Update(part.data(), part.size());
+  }
+  Digest digest = hasher.Final();
+  return print_hex(digest.data(), digest.size());
+}
+
+// Each entry starts with the size and the SHA-256 of its value, so that a truncated or otherwise
+// damaged entry (e.g. after a crash) is detected rather than taken as a result.
+struct ImgdiffCacheHeader {
+  uint64_t size;
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+};
+
+bool ImgdiffCache::Get(const std::string& kind, const std::string& key, std::string* value) const {
+  std::string path = Path(kind, key);
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return false;
+  }
+
+  ImgdiffCacheHeader header;
+  if (content.size() < sizeof(header)) {
+    LOG(WARNING) << "Ignoring truncated cache entry " << path;
+    return false;
+  }
+  memcpy(&header, content.data(), sizeof(header));
+  std::string_view data(content.data() + sizeof(header), content.size() - sizeof(header));
+  Digest digest = ComputeHash(HashAlgorithm::kSha256, data.data(), data.size());
+  if (header.size != data.size() || memcmp(header.digest, digest.data(), digest.size()) != 0) {
+    LOG(WARNING) << "Ignoring corrupted cache entry " << path;
+    return false;
+  }
+  value->assign(data);
+
+  // Mark the entry as recently used, for Trim().
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  return true;
+}
+
+bool ImgdiffCache::Put(const std::string& kind, const std::string& key,
+                       std::string_view value) const {
+  std::string kind_dir = dir_ + "/" + kind;
+  if (mkdir(dir_.c_str(), 0755) == -1 && errno != EEXIST) {
+    PLOG(WARNING) << "Failed to create " << dir_;
+    return false;
+  }
+  if (mkdir(kind_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+    PLOG(WARNING) << "Failed to create " << kind_dir;
+    return false;
+  }
+
+  ImgdiffCacheHeader header;
+  header.size = value.size();
+  Digest digest = ComputeHash(HashAlgorithm::kSha256, value.data(), value.size());
+  memcpy(header.digest, digest.data(), digest.size());
+
+  std::string temp_path = kind_dir + "/.tmp-XXXXXX";
+  android::base::unique_fd fd(mkstemp(temp_path.data()));
+  if (fd == -1) {
+    PLOG(WARNING) << "Failed to create a temporary file in " << kind_dir;
+    return false;
+  }
+  // The data must be on storage before the entry appears under its name.
+  if (!android::base::WriteFully(fd, &header, sizeof(header)) ||
+      !android::base::WriteFully(fd, value.data(), value.size()) || fsync(fd) == -1 ||
+      close(fd.release()) == -1 || rename(temp_path.c_str(), Path(kind, key).c_str()) == -1) {
+    PLOG(WARNING) << "Failed to write " << Path(kind, key);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+size_t ImgdiffCache::Trim() const {
+  if (max_bytes_ == 0) {
+    return 0;
+  }
+
+  // The modification time, size and path of each entry.
+  std::vector<std::tuple<struct timespec, size_t, std::string>> entries;
+  size_t total_bytes = 0;
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(dir_.c_str()), closedir);
+  if (!dir) {
+    return 0;
+  }
+  dirent* kind;
+  while ((kind = readdir(dir.get())) != nullptr) {
+    if (kind->d_name[0] == '.') {
+      continue;
+    }
+    std::string kind_dir = dir_ + "/" + kind->d_name;
+    std::unique_ptr<DIR, decltype(&closedir)> entry_dir(opendir(kind_dir.c_str()), closedir);
+    if (!entry_dir) {
+      continue;
+    }
+    dirent* entry;
+    while ((entry = readdir(entry_dir.get())) != nullptr) {
+      // Skips the temporary files too, which may be written to by other processes.
+      if (entry->d_name[0] == '.') {
+        continue;
+      }
+      std::string path = kind_dir + "/" + entry->d_name;
+      struct stat sb;
+      if (stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+        entries.emplace_back(sb.st_mtim, sb.st_size, path);
+        total_bytes += sb.st_size;
+      }
+    }
+  }
+  if (total_bytes <= max_bytes_) {
+    return 0;
+  }
+
+  std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+    const auto& ta = std::get<0>(a);
+    const auto& tb = std::get<0>(b);
+    return std::tie(ta.tv_sec, ta.tv_nsec) < std::tie(tb.tv_sec, tb.tv_nsec);
+  });
+  size_t removed = 0;
+  for (const auto& [mtime, size, path] : entries) {
+    if (total_bytes <= max_bytes_) {
+      break;
+    }
+    if (unlink(path.c_str()) == 0) {
+      total_bytes -= size;
+      removed++;
+    }
+  }
+  LOG(INFO) << "Removed " << removed << " entries from " << dir_ << ", which now holds "
+            << total_bytes << " bytes";
+  return removed;
+}
@@ -20,18 +20,29 @@
 #include <applypatch/imgpatch.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/cdefs.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/memory.h>
+#include <android-base/unique_fd.h>
 #include <applypatch/applypatch.h>
 #include <applypatch/imgdiff.h>
 #include <openssl/sha.h>
@@ -48,11 +59,199 @@ static inline int32_t Read4(const void *address) {
   return android::base::get_unaligned<int32_t>(address);
 }
 
+bool ImagePatchSpillSpace::Reserve(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (bytes > available_bytes_) {
+    return false;
+  }
+  available_bytes_ -= bytes;
+  return true;
+}
+
+void ImagePatchSpillSpace::Release(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  available_bytes_ += bytes;
+}
+
+// ImagePatchScratch holds the buffers and zlib streams of one ApplyImagePatch() call, which are
+// reused across its chunks rather than allocated (and page-faulted in) again for each of them.
+class ImagePatchScratch {
+ public:
+  static constexpr size_t kDeflateBufferSize = 32768;
+
+  // 'options' must outlive the object.
+  explicit ImagePatchScratch(const ImagePatchOptions& options) : options_(options) {}
+
+  ~ImagePatchScratch() {
+    UnmapSpill();
+    // The spill file is unlinked, so closing it gives its space back.
+    spill_fd_.reset();
+    if (spill_file_size_ > 0) {
+      options_.spill_space->Release(spill_file_size_);
+    }
+    if (inflate_initialized_) {
+      inflateEnd(&inflate_strm_);
+    }
+    if (deflate_initialized_) {
+      deflateEnd(&deflate_strm_);
+    }
+  }
+
+  // Returns a buffer of at least 'size' bytes with undefined contents, for the expanded source of
+  // a deflate chunk. Large buffers are backed by a file if the options say so, and if there's
+  // enough space for it. Returns nullptr on failure.
+  uint8_t* ExpandedSource(size_t size) {
+    const std::string& dir = options_.spill_dir;
+    if (options_.max_in_memory_bytes != 0 && size > options_.max_in_memory_bytes &&
+        !dir.empty() && options_.spill_space != nullptr) {
+      uint8_t* spill = MapSpill(dir, size);
+      if (spill != nullptr) {
+        return spill;
+      }
+      LOG(WARNING) << "Failed to spill " << size << " bytes to " << dir << "; using memory";
+    }
+
+    if (size > expanded_capacity_) {
+      // Release the old buffer first, so that the two don't need to fit in memory together.
+      expanded_.reset();
+      expanded_.reset(new (std::nothrow) uint8_t[size]);
+      if (expanded_ == nullptr) {
+        expanded_capacity_ = 0;
+        LOG(ERROR) << "Failed to allocate " << size << " bytes";
+        return nullptr;
+      }
+      expanded_capacity_ = size;
+    }
+    return expanded_.get();
+  }
+
+  // Returns the raw inflate stream, reset for a new chunk.
+  z_stream* Inflater() {
+    if (!inflate_initialized_) {
+      inflate_strm_ = {};
+      int ret = inflateInit2(&inflate_strm_, -15);
+      if (ret != Z_OK) {
+        LOG(ERROR) << "Failed to init source inflation: " << ret;
+        return nullptr;
+      }
+      inflate_initialized_ = true;
+    } else if (inflateReset(&inflate_strm_) != Z_OK) {
+      return nullptr;
+    }
+    return &inflate_strm_;
+  }
+
+  // Returns a deflate stream with the given parameters, reset for a new chunk. The stream is
+  // reused as long as the parameters stay the same, which they usually do within an image.
+  z_stream* Deflater(int level, int method, int window_bits, int mem_level, int strategy) {
+    std::array<int, 5> params{ level, method, window_bits, mem_level, strategy };
+    if (deflate_initialized_ && params == deflate_params_) {
+      if (deflateReset(&deflate_strm_) != Z_OK) {
+        return nullptr;
+      }
+      return &deflate_strm_;
+    }
+    if (deflate_initialized_) {
+      deflateEnd(&deflate_strm_);
+      deflate_initialized_ = false;
+    }
+    deflate_strm_ = {};
+    int ret = deflateInit2(&deflate_strm_, level, method, window_bits, mem_level, strategy);
+    if (ret != Z_OK) {
+      LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
+      return nullptr;
+    }
+    deflate_initialized_ = true;
+    deflate_params_ = params;
+    return &deflate_strm_;
+  }
+
+  uint8_t* DeflateBuffer() {
+    return deflate_buffer_.data();
+  }
+
+ private:
+  // Maps an unlinked file of 'size' bytes in 'dir', reusing the current one if it's large enough.
+  // The file is fully allocated first: a write to a hole through the mapping would raise SIGBUS if
+  // the filesystem runs out of space.
+  uint8_t* MapSpill(const std::string& dir, size_t size) {
+    if (spill_map_ != nullptr && size <= spill_size_) {
+      return static_cast<uint8_t*>(spill_map_);
+    }
+    UnmapSpill();
+    if (spill_fd_ == -1) {
+      spill_fd_.reset(open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600));
+      if (spill_fd_ == -1) {
+        std::string path = dir + "/imgpatch-XXXXXX";
+        spill_fd_.reset(mkstemp(path.data()));
+        if (spill_fd_ == -1) {
+          PLOG(ERROR) << "Failed to create a spill file in " << dir;
+          return nullptr;
+        }
+        unlink(path.c_str());
+      }
+    }
+    if (size > spill_file_size_) {
+      if (!options_.spill_space->Reserve(size - spill_file_size_)) {
+        LOG(WARNING) << "Not enough space left to spill " << size << " bytes";
+        return nullptr;
+      }
+      if (int err = posix_fallocate(spill_fd_, 0, size); err != 0) {
+        LOG(ERROR) << "Failed to allocate " << size << " bytes for the spill file: "
+                   << strerror(err);
+        options_.spill_space->Release(size - spill_file_size_);
+        // Give back whatever was allocated beyond the previous size.
+        if (ftruncate(spill_fd_, spill_file_size_) == -1) {
+          PLOG(WARNING) << "Failed to truncate the spill file";
+        }
+        return nullptr;
+      }
+      spill_file_size_ = size;
+    }
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd_, 0);
+    if (map == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to map the spill file";
+      return nullptr;
+    }
+    spill_map_ = map;
+    spill_size_ = size;
+    return static_cast<uint8_t*>(spill_map_);
+  }
+
+  void UnmapSpill() {
+    if (spill_map_ != nullptr) {
+      munmap(spill_map_, spill_size_);
+      spill_map_ = nullptr;
+      spill_size_ = 0;
+    }
+  }
+
+  const ImagePatchOptions& options_;
+
+  std::unique_ptr<uint8_t[]> expanded_;
+  size_t expanded_capacity_{ 0 };
+
+  android::base::unique_fd spill_fd_;
+  // The allocated size of the spill file, which is taken out of the space available for spilling.
+  size_t spill_file_size_{ 0 };
+  void* spill_map_{ nullptr };
+  size_t spill_size_{ 0 };
+
+  z_stream inflate_strm_;
+  bool inflate_initialized_{ false };
+  z_stream deflate_strm_;
+  bool deflate_initialized_{ false };
+  std::array<int, 5> deflate_params_;
+
+  std::vector<uint8_t> deflate_buffer_ = std::vector<uint8_t>(kDeflateBufferSize);
+};
+
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
 // patched data and stream the deflated data to output.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
-                                            const Value& patch, size_t patch_offset,
-                                            const char* deflate_header, SinkFn sink) {
+                                            std::string_view patch, size_t patch_offset,
+                                            const char* deflate_header, SinkFn sink,
+                                            ImagePatchScratch* scratch) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   CHECK_GT(expected_target_length, static_cast<size_t>(0));
   int level = Read4(deflate_header + 40);
@@ -61,36 +260,30 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   int mem_level = Read4(deflate_header + 52);
   int strategy = Read4(deflate_header + 56);
 
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = nullptr;
-  int ret = deflateInit2(&strm, level, method, window_bits, mem_level, strategy);
-  if (ret != Z_OK) {
-    LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
+  z_stream* strm = scratch->Deflater(level, method, window_bits, mem_level, strategy);
+  if (strm == nullptr) {
     return false;
   }
+  int ret = Z_OK;
 
   // Define a custom sink wrapper that feeds to bspatch. It deflates the available patch data on
   // the fly and outputs the compressed data to the given sink.
   size_t actual_target_length = 0;
   size_t total_written = 0;
-  static constexpr size_t buffer_size = 32768;
-  auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &sink](const uint8_t* data, size_t len) -> size_t {
+  static constexpr size_t buffer_size = ImagePatchScratch::kDeflateBufferSize;
+  uint8_t* buffer = scratch->DeflateBuffer();
+  auto compression_sink = [strm, buffer, &actual_target_length, &expected_target_length,
+                           &total_written, &ret, &sink](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
-    strm.avail_in = len;
-    strm.next_in = data;
+    strm->avail_in = len;
+    strm->next_in = data;
     do {
-      std::vector<uint8_t> buffer(buffer_size);
-      strm.avail_out = buffer_size;
-      strm.next_out = buffer.data();
+      strm->avail_out = buffer_size;
+      strm->next_out = buffer;
       if (actual_target_length + len < expected_target_length) {
-        ret = deflate(&strm, Z_NO_FLUSH);
+        ret = deflate(strm, Z_NO_FLUSH);
       } else {
-        ret = deflate(&strm, Z_FINISH);
+        ret = deflate(strm, Z_FINISH);
       }
       if (ret != Z_OK && ret != Z_STREAM_END) {
         LOG(ERROR) << "Failed to deflate stream: " << ret;
@@ -98,20 +291,19 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
         return 0;
       }
 
-      size_t have = buffer_size - strm.avail_out;
+      size_t have = buffer_size - strm->avail_out;
       total_written += have;
-      if (sink(buffer.data(), have) != have) {
+      if (sink(buffer, have) != have) {
         LOG(ERROR) << "Failed to write " << have << " compressed bytes to output.";
         return 0;
       }
-    } while ((strm.avail_in != 0 || strm.avail_out == 0) && ret != Z_STREAM_END);
+    } while ((strm->avail_in != 0 || strm->avail_out == 0) && ret != Z_STREAM_END);
 
     actual_target_length += len;
     return len;
   };
 
   int bspatch_result = ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink);
-  deflateEnd(&strm);
 
   if (bspatch_result != 0) {
     return false;
@@ -132,162 +324,326 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   return true;
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
-                    size_t patch_size, SinkFn sink) {
-  Value patch(Value::Type::BLOB,
-              std::string(reinterpret_cast<const char*>(patch_data), patch_size));
-  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr);
-}
-
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    const Value* bonus_data) {
-  if (patch.data.size() < 12) {
-    printf("patch too short to contain header\n");
-    return -1;
-  }
-
-  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
-  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
-  const char* const patch_header = patch.data.data();
-  if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
-    printf("corrupt patch file header (magic number)\n");
-    return -1;
-  }
-
+// A chunk of an image patch, with its header checked against the patch and the source sizes.
+struct ImagePatchChunk {
+  size_t index;
+  int type;
+  // The type-specific header of the chunk, following its type.
+  const char* header;
+  // For raw chunks, where the data is in the patch.
+  size_t raw_offset;
+  size_t raw_len;
+};
+
+static bool ParseImagePatchChunks(size_t old_size, std::string_view patch,
+                                  std::vector<ImagePatchChunk>* chunks) {
+  const char* const patch_header = patch.data();
   int num_chunks = Read4(patch_header + 8);
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
+    if (pos + 4 > patch.size()) {
       printf("failed to read chunk %d record\n", i);
-      return -1;
+      return false;
     }
-    int type = Read4(patch_header + pos);
+    ImagePatchChunk chunk{ static_cast<size_t>(i), Read4(patch_header + pos), nullptr, 0, 0 };
     pos += 4;
+    chunk.header = patch_header + pos;
 
-    if (type == CHUNK_NORMAL) {
-      const char* normal_header = patch_header + pos;
+    if (chunk.type == CHUNK_NORMAL) {
       pos += 24;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d normal header data\n", i);
-        return -1;
+        return false;
       }
-
-      size_t src_start = static_cast<size_t>(Read8(normal_header));
-      size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
-
+      size_t src_start = static_cast<size_t>(Read8(chunk.header));
+      size_t src_len = static_cast<size_t>(Read8(chunk.header + 8));
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
-        return -1;
-      }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
+        return false;
       }
-
-      LOG(DEBUG) << "Processed chunk type normal";
-    } else if (type == CHUNK_RAW) {
-      const char* raw_header = patch_header + pos;
+    } else if (chunk.type == CHUNK_RAW) {
       pos += 4;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d raw header data\n", i);
-        return -1;
+        return false;
       }
-
-      size_t data_len = static_cast<size_t>(Read4(raw_header));
-
-      if (pos + data_len > patch.data.size()) {
+      chunk.raw_offset = pos;
+      chunk.raw_len = static_cast<size_t>(Read4(chunk.header));
+      if (pos + chunk.raw_len > patch.size()) {
         printf("failed to read chunk %d raw data\n", i);
-        return -1;
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
-        return -1;
+        return false;
       }
-      pos += data_len;
-
-      LOG(DEBUG) << "Processed chunk type raw";
-    } else if (type == CHUNK_DEFLATE) {
+      pos += chunk.raw_len;
+    } else if (chunk.type == CHUNK_DEFLATE) {
       // deflate chunks have an additional 60 bytes in their chunk header.
-      const char* deflate_header = patch_header + pos;
       pos += 60;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d deflate header data\n", i);
-        return -1;
+        return false;
       }
-
-      size_t src_start = static_cast<size_t>(Read8(deflate_header));
-      size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
-
+      size_t src_start = static_cast<size_t>(Read8(chunk.header));
+      size_t src_len = static_cast<size_t>(Read8(chunk.header + 8));
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
-        return -1;
+        return false;
       }
+    } else {
+      printf("patch chunk %d is unknown type %d\n", i, chunk.type);
+      return false;
+    }
+    chunks->push_back(chunk);
+  }
+  return true;
+}
 
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if the patch was constructed with
-      // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
-      // from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != nullptr) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
+// Applies a single chunk, as parsed by ParseImagePatchChunks(), and writes its output to 'sink'.
+static bool ApplyImagePatchChunk(const ImagePatchChunk& chunk, const unsigned char* old_data,
+                                 std::string_view patch, const Value* bonus_data,
+                                 const SinkFn& sink, ImagePatchScratch* scratch) {
+  if (chunk.type == CHUNK_NORMAL) {
+    size_t src_start = static_cast<size_t>(Read8(chunk.header));
+    size_t src_len = static_cast<size_t>(Read8(chunk.header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(chunk.header + 16));
+    if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink) != 0) {
+      printf("Failed to apply bsdiff patch.\n");
+      return false;
+    }
 
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
-        inflateEnd(&strm);
+    LOG(DEBUG) << "Processed chunk type normal";
+  } else if (chunk.type == CHUNK_RAW) {
+    if (sink(reinterpret_cast<const unsigned char*>(patch.data() + chunk.raw_offset),
+             chunk.raw_len) != chunk.raw_len) {
+      printf("failed to write chunk %zu raw data\n", chunk.index);
+      return false;
+    }
+
+    LOG(DEBUG) << "Processed chunk type raw";
+  } else {
+    const char* deflate_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(deflate_header));
+    size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+    size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if the patch was constructed with
+    // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
+    // from the bonus_data value.
+    size_t bonus_size = (chunk.index == 1 && bonus_data != nullptr) ? bonus_data->data.size() : 0;
+
+    uint8_t* expanded_source = nullptr;
+
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (expanded_len != 0) {
+      expanded_source = scratch->ExpandedSource(expanded_len);
+      z_stream* strm = scratch->Inflater();
+      if (expanded_source == nullptr || strm == nullptr) {
+        printf("failed to set up source inflation\n");
+        return false;
+      }
+      strm->avail_in = src_len;
+      strm->next_in = old_data + src_start;
+      strm->avail_out = expanded_len;
+      strm->next_out = expanded_source;
+
+      // Because we've provided enough room to accommodate the output
+      // data, we expect one call to inflate() to suffice.
+      int ret = inflate(strm, Z_SYNC_FLUSH);
+      if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        return false;
+      }
+      // We should have filled the output buffer exactly, except
+      // for the bonus_size.
+      if (strm->avail_out != bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm->avail_out - bonus_size);
+        return false;
+      }
 
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), bonus_data->data.data(),
-                 bonus_size);
+      if (bonus_size) {
+        memcpy(expanded_source + (expanded_len - bonus_size), bonus_data->data.data(),
+               bonus_size);
+      }
+    }
+
+    if (!ApplyBSDiffPatchAndStreamOutput(expanded_source, expanded_len, patch, patch_offset,
+                                         deflate_header, sink, scratch)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return false;
+    }
+
+    LOG(DEBUG) << "Processed chunk type deflate";
+  }
+  return true;
+}
+
+// Applies the normal and deflate chunks on 'threads' threads, each into an output buffer of its
+// own, while the calling thread writes the outputs to 'sink' in order. Up to two chunks per thread
+// are applied ahead of the one being written. The outputs that wait to be written count against
+// the memory given to the threads, and no other chunk is started while they take more than that.
+static bool ApplyImagePatchChunksConcurrently(const std::vector<ImagePatchChunk>& chunks,
+                                              const unsigned char* old_data,
+                                              std::string_view patch, const Value* bonus_data,
+                                              const SinkFn& sink, size_t threads,
+                                              const ImagePatchOptions& options) {
+  struct ChunkOutput {
+    std::string data;
+    bool done{ false };
+  };
+  std::vector<ChunkOutput> outputs(chunks.size());
+  const size_t window = threads * 2;
+  const size_t max_buffered_bytes = options.max_in_memory_bytes == 0
+                                        ? std::numeric_limits<size_t>::max()
+                                        : threads * options.max_in_memory_bytes;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next_chunk = 0;
+  size_t written_chunks = 0;
+  size_t buffered_bytes = 0;
+  bool failed = false;
+
+  auto worker = [&]() {
+    ImagePatchScratch scratch(options);
+    while (true) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        // The chunk to be written next is always started, so that the outputs can drain.
+        cv.wait(lock, [&]() {
+          return failed || next_chunk == chunks.size() ||
+                 (next_chunk < written_chunks + window &&
+                  (next_chunk == written_chunks || buffered_bytes < max_buffered_bytes));
+        });
+        if (failed || next_chunk == chunks.size()) {
+          return;
         }
+        i = next_chunk++;
       }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
-        return -1;
+      // Raw chunks are written straight from the patch.
+      bool success = true;
+      std::string data;
+      if (chunks[i].type != CHUNK_RAW) {
+        auto buffer_sink = [&data](const unsigned char* out, size_t len) {
+          data.append(reinterpret_cast<const char*>(out), len);
+          return len;
+        };
+        success = ApplyImagePatchChunk(chunks[i], old_data, patch, bonus_data, buffer_sink,
+                                       &scratch);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        failed |= !success;
+        buffered_bytes += data.size();
+        outputs[i].data = std::move(data);
+        outputs[i].done = true;
       }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back(worker);
+  }
+
+  bool success = true;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    std::string data;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return failed || outputs[i].done; });
+      if (failed) {
+        success = false;
+        break;
+      }
+      data = std::move(outputs[i].data);
+      buffered_bytes -= data.size();
+    }
 
-      LOG(DEBUG) << "Processed chunk type deflate";
+    bool written;
+    if (chunks[i].type == CHUNK_RAW) {
+      written = ApplyImagePatchChunk(chunks[i], old_data, patch, bonus_data, sink, nullptr);
     } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
-      return -1;
+      written = sink(reinterpret_cast<const unsigned char*>(data.data()), data.size()) ==
+                data.size();
+      if (!written) {
+        printf("failed to write chunk %zu output\n", i);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (written) {
+        written_chunks = i + 1;
+      } else {
+        failed = true;
+      }
+    }
+    cv.notify_all();
+    if (!written) {
+      success = false;
+      break;
     }
   }
 
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  return success;
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
+                    size_t patch_size, SinkFn sink) {
+  std::string_view patch(reinterpret_cast<const char*>(patch_data), patch_size);
+  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr);
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    const Value* bonus_data) {
+  return ApplyImagePatch(old_data, old_size, std::string_view(patch.data), sink, bonus_data);
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, std::string_view patch,
+                    SinkFn sink, const Value* bonus_data, const ImagePatchOptions& options) {
+  if (patch.size() < 12) {
+    printf("patch too short to contain header\n");
+    return -1;
+  }
+
+  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
+  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
+  const char* const patch_header = patch.data();
+  if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
+    printf("corrupt patch file header (magic number)\n");
+    return -1;
+  }
+
+  std::vector<ImagePatchChunk> chunks;
+  if (!ParseImagePatchChunks(old_size, patch, &chunks)) {
+    return -1;
+  }
+
+  size_t patched_chunks = std::count_if(chunks.begin(), chunks.end(), [](const auto& chunk) {
+    return chunk.type != CHUNK_RAW;
+  });
+  size_t threads = std::min(options.threads, patched_chunks);
+  if (threads > 1) {
+    return ApplyImagePatchChunksConcurrently(chunks, old_data, patch, bonus_data, sink, threads,
+                                             options)
+               ? 0
+               : -1;
+  }
+
+  ImagePatchScratch scratch(options);
+  for (const auto& chunk : chunks) {
+    if (!ApplyImagePatchChunk(chunk, old_data, patch, bonus_data, sink, &scratch)) {
+      return -1;
+    }
+  }
   return 0;
 }
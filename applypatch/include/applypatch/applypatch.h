@@ -21,8 +21,10 @@
 
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <openssl/sha.h>
@@ -109,14 +111,58 @@ void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink);
 
+// Same as above, but reads the patch from a non-owning view (e.g. a region of the mmapped OTA
+// package), which avoids copying the patch data.
+int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, std::string_view patch,
+                     size_t patch_offset, SinkFn sink);
+
 // imgpatch.cpp
 
+// The space that the spill files of ApplyImagePatch() may take up, shared by the calls that are
+// given the same object, e.g. the patches being applied concurrently.
+class ImagePatchSpillSpace {
+ public:
+  explicit ImagePatchSpillSpace(size_t bytes) : available_bytes_(bytes) {}
+
+  // Takes 'bytes' out of the space. Returns false if there isn't as much left.
+  bool Reserve(size_t bytes);
+
+  void Release(size_t bytes);
+
+ private:
+  std::mutex mutex_;
+  size_t available_bytes_;
+};
+
+// How ApplyImagePatch() applies a patch. None of it changes the patched output.
+struct ImagePatchOptions {
+  // Number of threads to apply the normal and deflate chunks on, with the output still written to
+  // the sink in order. Chunks are independent of each other, and the time is mostly spent in
+  // recompressing the deflate ones. 1 patches in the calling thread.
+  size_t threads{ 1 };
+  // The deflate chunks of an image patch are patched against their expanded source, which has to
+  // be held in full. By default it's held in memory. Chunks that expand to more than
+  // 'max_in_memory_bytes' (if non-zero) are expanded into an unlinked file in 'spill_dir' instead,
+  // and mapped from there, so that the kernel can write back and drop their pages under memory
+  // pressure. With several threads, it's also what each of them may hold in patched outputs that
+  // wait to be written.
+  size_t max_in_memory_bytes{ 0 };
+  std::string spill_dir;
+  // Where the spill files take their space from; chunks that don't fit are held in memory. Nothing
+  // is spilled without it.
+  ImagePatchSpillSpace* spill_space{ nullptr };
+};
+
 // Applies the imgdiff-patch given in 'patch' to the source data given by (old_data, old_size), with
 // the optional bonus data. Writes the patched output through the given 'sink'. Returns 0 on
 // success.
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
                     const Value* bonus_data);
 
+// Same as above, but reads the patch from a non-owning view without copying it.
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, std::string_view patch,
+                    SinkFn sink, const Value* bonus_data, const ImagePatchOptions& options = {});
+
 // freecache.cpp
 
 // Checks whether /cache partition has at least 'bytes'-byte free space. Returns true immediately
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_IMGDIFF_CACHE_H
+#define _APPLYPATCH_IMGDIFF_CACHE_H
+
+#include <stddef.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ImgdiffCache keeps results that imgdiff computed in previous runs in a directory, so that they
+// can be reused when the same inputs come up again (e.g. between consecutive builds). Entries are
+// content-addressed: the key of an entry is the SHA-256 of everything the result depends on, so
+// they never need to be invalidated. Each kind of result goes into a subdirectory of its own.
+//
+// Entries are written to a temporary file and renamed into place, so that several imgdiff
+// processes (or threads) can share a cache directory. They carry the size and the digest of their
+// value, and an entry that doesn't match them is treated as missing. Reading an entry updates its
+// modification time, and Trim() removes the least recently used entries beyond 'max_bytes'.
+class ImgdiffCache {
+ public:
+  // 'max_bytes' of 0 doesn't limit the size of the cache.
+  explicit ImgdiffCache(const std::string& dir, size_t max_bytes = 0)
+      : dir_(dir), max_bytes_(max_bytes) {}
+
+  // Returns the key for a result that depends on the given parts, in order.
+  static std::string Key(const std::vector<std::string_view>& parts);
+
+  // Reads the entry 'key' of the given kind into 'value'. Returns false if there's none, or if it's
+  // damaged.
+  bool Get(const std::string& kind, const std::string& key, std::string* value) const;
+
+  // Stores 'value' as the entry 'key' of the given kind. Returns false on failure, which only
+  // means that the result will be computed again next time.
+  bool Put(const std::string& kind, const std::string& key, std::string_view value) const;
+
+  // Removes the least recently used entries until the cache holds at most 'max_bytes' bytes.
+  // Returns the number of entries removed.
+  size_t Trim() const;
+
+ private:
+  std::string Path(const std::string& kind, const std::string& key) const {
+    return dir_ + "/" + kind + "/" + key;
+  }
+
+  const std::string dir_;
+  const size_t max_bytes_;
+};
+
+#endif  // _APPLYPATCH_IMGDIFF_CACHE_H
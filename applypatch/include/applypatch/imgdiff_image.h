@@ -29,8 +29,17 @@
 #include <zlib.h>
 
 #include "imgdiff.h"
+#include "imgdiff_cache.h"
 #include "otautil/rangeset.h"
 
+// How imgdiff computes the patches. None of it changes the resulting patch.
+struct ImgdiffOptions {
+  // Number of threads to reconstruct the deflate chunks and compute the chunk patches on.
+  size_t threads{ 1 };
+  // Results from previous runs, if any.
+  const ImgdiffCache* cache{ nullptr };
+};
+
 class ImageChunk {
  public:
   static constexpr auto WINDOWBITS = -15;  // 32kb window; negative to indicate a raw stream.
@@ -85,9 +94,10 @@ class ImageChunk {
   /*
    * Verify that we can reproduce exactly the same compressed data that we started with.  Sets the
    * level, method, windowBits, memLevel, and strategy fields in the chunk to the encoding
-   * parameters needed to produce the right output.
+   * parameters needed to produce the right output. The outcome is looked up in / added to |cache|
+   * if it's not nullptr.
    */
-  bool ReconstructDeflateChunk();
+  bool ReconstructDeflateChunk(const ImgdiffCache* cache = nullptr);
   bool IsAdjacentNormal(const ImageChunk& other) const;
   void MergeAdjacentNormal(const ImageChunk& other);
 
@@ -231,11 +241,12 @@ class ZipModeImage : public Image {
 
   // Verify that we can reconstruct the deflate chunks; also change the type to CHUNK_NORMAL if
   // src and tgt are identical.
-  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
+  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                    const ImgdiffOptions& options = {});
 
   // Compute the patch between tgt & src images, and write the data into |patch_name|.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, const ImgdiffOptions& options = {});
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
@@ -244,7 +255,7 @@ class ZipModeImage : public Image {
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
+                              const std::string& debug_dir, const ImgdiffOptions& options = {});
 
   // Split the tgt chunks and src chunks based on the size limit.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
@@ -279,7 +290,8 @@ class ZipModeImage : public Image {
 
   // Function that actually iterates the tgt_chunks and makes patches.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      std::vector<PatchChunk>* patch_chunks,
+                                      const ImgdiffOptions& options);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
@@ -297,12 +309,13 @@ class ImageModeImage : public Image {
 
   // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
   // same sequence of deflate and normal chunks).
-  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
+  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                    const ImgdiffOptions& options = {});
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
   // result to |patch_name|.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, const ImgdiffOptions& options = {});
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
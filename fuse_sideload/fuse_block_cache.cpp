@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fuse_block_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+std::unique_ptr<FuseBlockCache> FuseBlockCache::Create(uint32_t capacity, uint32_t block_size) {
+  if (capacity == 0) {
+    return nullptr;
+  }
+  uint8_t* data = static_cast<uint8_t*>(malloc(static_cast<size_t>(capacity) * block_size));
+  if (data == nullptr) {
+    return nullptr;
+  }
+  return std::unique_ptr<FuseBlockCache>(new FuseBlockCache(capacity, block_size, data));
+}
+
+FuseBlockCache::FuseBlockCache(uint32_t capacity, uint32_t block_size, uint8_t* data)
+    : capacity_(capacity), block_size_(block_size), data_(data), slots_(capacity) {
+  index_.reserve(capacity);
+}
+
+FuseBlockCache::~FuseBlockCache() {
+  free(data_);
+}
+
+bool FuseBlockCache::Contains(uint32_t block) const {
+  return index_.find(block) != index_.end();
+}
+
+void FuseBlockCache::Unlink(uint32_t slot) {
+  Slot& s = slots_[slot];
+  if (s.prev == kNoSlot) {
+    mru_ = s.next;
+  } else {
+    slots_[s.prev].next = s.next;
+  }
+  if (s.next == kNoSlot) {
+    lru_ = s.prev;
+  } else {
+    slots_[s.next].prev = s.prev;
+  }
+}
+
+void FuseBlockCache::PushFront(uint32_t slot) {
+  Slot& s = slots_[slot];
+  s.prev = kNoSlot;
+  s.next = mru_;
+  if (s.next == kNoSlot) {
+    lru_ = slot;
+  } else {
+    slots_[s.next].prev = slot;
+  }
+  mru_ = slot;
+}
+
+bool FuseBlockCache::Fetch(uint32_t block, uint8_t* data) {
+  auto it = index_.find(block);
+  if (it == index_.end()) {
+    return false;
+  }
+  uint32_t slot = it->second;
+  memcpy(data, data_ + static_cast<size_t>(slot) * block_size_, block_size_);
+  Unlink(slot);
+  PushFront(slot);
+  hits_++;
+  return true;
+}
+
+void FuseBlockCache::Enter(uint32_t block, const uint8_t* data) {
+  uint32_t slot;
+  if (size_ < capacity_) {
+    slot = size_++;
+  } else {
+    slot = lru_;
+    Unlink(slot);
+    index_.erase(slots_[slot].block);
+    evictions_++;
+  }
+
+  memcpy(data_ + static_cast<size_t>(slot) * block_size_, data, block_size_);
+  slots_[slot].block = block;
+  index_.emplace(block, slot);
+  PushFront(slot);
+}
@@ -45,6 +45,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>  // PATH_MAX
 #include <linux/fuse.h>
 #include <stdint.h>
@@ -57,14 +58,22 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
 
+#include "fuse_block_cache.h"
+#include "otautil/hash.h"
+
 static constexpr uint64_t PACKAGE_FILE_ID = FUSE_ROOT_ID + 1;
 static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
 
@@ -73,12 +82,26 @@ static constexpr int NO_STATUS_EXIT = 2;
 
 using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
+// The hashes of the blocks are kept in pages, allocated when a block of the page is first read, so
+// that their memory is proportional to the part of the file that's read rather than to its size.
+static constexpr uint32_t HASH_PAGE_BLOCKS = 1024;
+using HashPage = std::array<SHA256Digest, HASH_PAGE_BLOCKS>;
+
 #define INSTALL_REQUIRED_MEMORY (400 * 1024 * 1024)
 
+// The largest read to ask the kernel for (capped at 256 pages by the kernel). Each read is served
+// with as few provider calls as possible, which matters when every call is a round trip to the
+// host.
+static constexpr uint32_t MAX_READ_SIZE = 1024 * 1024;
+
+// The most data to prefetch ahead of sequential reads.
+static constexpr uint32_t MAX_PREFETCH_SIZE = 8 * 1024 * 1024;
+
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
 
   FuseDataProvider* provider;  // Provider of the source data.
+  std::mutex provider_mu;      // serializes the calls to the provider
 
   uint64_t file_size;  // bytes
 
@@ -88,18 +111,36 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently used
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
-
-  std::vector<SHA256Digest>
-      hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
-
-  // Block cache
-  uint32_t block_cache_max_size;  // Max allowed block cache size
-  uint32_t block_cache_size;      // Current block cache size
-  uint8_t** block_cache;          // Block cache data
+  uint32_t max_read;         // the largest read the kernel may send us, a multiple of block_size
+  uint32_t max_read_blocks;  // the most blocks a read may span (one more when it's not aligned)
+  uint32_t hash_threads;     // the most threads to hash the blocks of a fetch on
+
+  uint32_t curr_block;   // the first of the blocks most recently used
+  uint32_t curr_blocks;  // the number of blocks in block_data
+  uint8_t* block_data;   // storage for max_read_blocks blocks
+
+  // Guards the hashes, the block cache and the prefetch state, which are shared with the
+  // prefetcher thread.
+  std::mutex mu;
+
+  std::vector<std::unique_ptr<HashPage>>
+      hash_pages;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+
+  std::unique_ptr<FuseBlockCache> block_cache;  // nullptr if there's no memory for one
+  uint64_t block_cache_misses;
+
+  // Prefetcher. Sequential reads grow the window of blocks fetched ahead of them into the block
+  // cache, which the prefetcher thread fills between the reads; any other read cancels it.
+  std::thread prefetch_thread;
+  std::condition_variable prefetch_cv;
+  uint32_t prefetch_max_blocks;  // the largest prefetch window
+  uint32_t prefetch_window;      // the current window, 0 if the reads aren't sequential
+  uint32_t prefetch_next;        // the next block to prefetch
+  uint32_t prefetch_end;         // the end of the blocks to prefetch
+  uint32_t last_read_first;      // the blocks of the last read, to detect sequential ones
+  uint32_t last_read_end;
+  bool reader_waiting;           // the reader is waiting for the provider, which it gets first
+  bool prefetch_stop;
 };
 
 static uint64_t free_memory() {
@@ -129,41 +170,18 @@ static uint64_t free_memory() {
   return mem;
 }
 
-static int block_cache_fetch(struct fuse_data* fd, uint32_t block) {
-  if (fd->block_cache == nullptr) {
-    return -1;
-  }
-  if (fd->block_cache[block] == nullptr) {
-    return -1;
-  }
-  memcpy(fd->block_data, fd->block_cache[block], fd->block_size);
-  return 0;
+static bool block_cache_contains(const struct fuse_data* fd, uint32_t block) {
+  return fd->block_cache != nullptr && fd->block_cache->Contains(block);
 }
 
-static void block_cache_enter(struct fuse_data* fd, uint32_t block) {
-  if (!fd->block_cache) return;
-  if (fd->block_cache_size == fd->block_cache_max_size) {
-    // Evict a block from the cache.  Since the file is typically read
-    // sequentially, start looking from the block behind the current
-    // block and proceed backward.
-    int n;
-    for (n = fd->curr_block - 1; n != (int)fd->curr_block; --n) {
-      if (n < 0) {
-        n = fd->file_blocks - 1;
-      }
-      if (fd->block_cache[n]) {
-        free(fd->block_cache[n]);
-        fd->block_cache[n] = nullptr;
-        fd->block_cache_size--;
-        break;
-      }
-    }
-  }
-
-  fd->block_cache[block] = (uint8_t*)malloc(fd->block_size);
-  memcpy(fd->block_cache[block], fd->block_data, fd->block_size);
+static int block_cache_fetch(struct fuse_data* fd, uint32_t block, uint8_t* data) {
+  return fd->block_cache != nullptr && fd->block_cache->Fetch(block, data) ? 0 : -1;
+}
 
-  fd->block_cache_size++;
+static void block_cache_enter(struct fuse_data* fd, uint32_t block, const uint8_t* data) {
+  if (fd->block_cache != nullptr) {
+    fd->block_cache->Enter(block, data);
+  }
 }
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -196,7 +214,7 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
     return -1;
   }
 
-  fuse_init_out out;
+  fuse_init_out out = {};
   out.minor = MIN(req->minor, FUSE_KERNEL_MINOR_VERSION);
   size_t fuse_struct_size = sizeof(out);
 #if defined(FUSE_COMPAT_22_INIT_OUT_SIZE)
@@ -215,6 +233,14 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
+#if defined(FUSE_MAX_PAGES)
+  // Without FUSE_MAX_PAGES (7.28+), the kernel doesn't send reads of more than 32 pages no matter
+  // what max_read says.
+  if (req->minor >= 28 && (req->flags & FUSE_MAX_PAGES)) {
+    out.flags |= FUSE_MAX_PAGES;
+    out.max_pages = fd->max_read / getpagesize();
+  }
+#endif
   fuse_reply(fd, hdr->unique, &out, fuse_struct_size);
 
   return NO_STATUS;
@@ -294,63 +320,217 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint32_t block) {
-  if (block == fd->curr_block) {
-    return 0;
+// Verifies the hashes of the |count| blocks starting at |block|, whose data we just got from the
+// host, and adds them to the block cache. The blocks are hashed on up to fd->hash_threads threads.
+//
+// - If the hash of the just-received data matches the stored hash for the block, accept it.
+// - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
+//   time we've read this block).
+// - Otherwise, return -EIO for the read. The blocks before the failed one have been accepted.
+static int verify_blocks(fuse_data* fd, uint32_t block, uint32_t count, const uint8_t* data) {
+  std::vector<SHA256Digest> hashes(count);
+  static_assert(sizeof(SHA256Digest) == SHA256_DIGEST_LENGTH);
+  ComputeBlockHashes(HashAlgorithm::kSha256, data, fd->block_size, count, hashes[0].data(),
+                     fd->hash_threads);
+
+  std::lock_guard<std::mutex> lock(fd->mu);
+  for (uint32_t i = 0; i < count; i++) {
+    std::unique_ptr<HashPage>& hash_page = fd->hash_pages[(block + i) / HASH_PAGE_BLOCKS];
+    if (!hash_page) {
+      hash_page = std::make_unique<HashPage>();
+    }
+    SHA256Digest& blockhash = (*hash_page)[(block + i) % HASH_PAGE_BLOCKS];
+    if (hashes[i] != blockhash) {
+      for (uint8_t b : blockhash) {
+        if (b != 0) {
+          return -EIO;
+        }
+      }
+      blockhash = hashes[i];
+    }
+
+    if (!block_cache_contains(fd, block + i)) {
+      block_cache_enter(fd, block + i, data + static_cast<size_t>(i) * fd->block_size);
+    }
   }
+  return 0;
+}
 
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
+// Fetch the |count| blocks starting at |block| into fd->block_data, from the block cache or the
+// host. Each run of consecutive blocks that aren't cached is fetched with a single provider call,
+// and verified block by block. Returns 0 on successful fetch, negative otherwise.
+static int fetch_blocks(fuse_data* fd, uint32_t block, uint32_t count) {
+  uint32_t done = 0;
+  if (fd->curr_blocks > 0 && block == fd->curr_block) {
+    done = std::min(count, fd->curr_blocks);
+  } else if (fd->curr_blocks > 0 && block == fd->curr_block + fd->curr_blocks - 1) {
+    // A sequential read that isn't block aligned starts with the last block of the previous one.
+    memmove(fd->block_data, fd->block_data + (fd->curr_blocks - 1) * fd->block_size,
+            fd->block_size);
     fd->curr_block = block;
+    fd->curr_blocks = 1;
+    done = 1;
+  }
+  if (done == count) {
     return 0;
   }
 
-  if (block_cache_fetch(fd, block) == 0) {
-    fd->curr_block = block;
-    return 0;
+  fd->curr_block = block;
+  fd->curr_blocks = 0;
+  while (done < count) {
+    uint32_t first = block + done;
+    uint8_t* data = fd->block_data + done * fd->block_size;
+
+    if (first >= fd->file_blocks) {
+      memset(data, 0, fd->block_size);
+      done++;
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(fd->mu);
+      if (block_cache_fetch(fd, first, data) == 0) {
+        done++;
+        continue;
+      }
+      fd->reader_waiting = true;
+    }
+
+    // The prefetcher may be fetching the block already, in which case it's cached by the time we
+    // get the provider.
+    std::unique_lock<std::mutex> provider_lock(fd->provider_mu);
+    uint32_t run = 1;
+    {
+      std::lock_guard<std::mutex> lock(fd->mu);
+      fd->reader_waiting = false;
+      fd->prefetch_cv.notify_one();
+      if (block_cache_fetch(fd, first, data) == 0) {
+        done++;
+        continue;
+      }
+      while (done + run < count && first + run < fd->file_blocks &&
+             !block_cache_contains(fd, first + run)) {
+        run++;
+      }
+      fd->block_cache_misses += run;
+    }
+
+    uint64_t run_offset = static_cast<uint64_t>(first) * fd->block_size;
+    uint32_t fetch_size = run * fd->block_size;
+    if (run_offset + fetch_size > fd->file_size) {
+      // If we're reading the last (partial) block of the file, expect a shorter response from the
+      // host, and pad the rest of the block with zeroes.
+      fetch_size = fd->file_size - run_offset;
+      memset(data + fetch_size, 0, run * fd->block_size - fetch_size);
+    }
+
+    if (!fd->provider->ReadBlockAlignedData(data, fetch_size, first)) {
+      return -EIO;
+    }
+    provider_lock.unlock();
+    fd->prefetch_cv.notify_one();
+
+    int result = verify_blocks(fd, first, run, data);
+    if (result != 0) return result;
+    done += run;
+  }
+
+  fd->curr_blocks = count;
+  return 0;
+}
+
+// Updates the prefetch window after a read of the |count| blocks starting at |block|.
+static void schedule_prefetch(fuse_data* fd, uint32_t block, uint32_t count) {
+  if (!fd->prefetch_thread.joinable()) {
+    return;
   }
 
-  uint32_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+  std::lock_guard<std::mutex> lock(fd->mu);
+  uint32_t end = block + count;
+  // Reads that aren't block aligned start within the last block of the previous one.
+  if (block >= fd->last_read_first && block <= fd->last_read_end) {
+    fd->prefetch_window =
+        std::min(std::max(fd->prefetch_window * 2, count), fd->prefetch_max_blocks);
+  } else {
+    fd->prefetch_window = 0;
   }
+  fd->last_read_first = block;
+  fd->last_read_end = end;
 
-  if (!fd->provider->ReadBlockAlignedData(fd->block_data, fetch_size, block)) {
-    return -EIO;
+  if (fd->prefetch_window == 0) {
+    fd->prefetch_next = fd->prefetch_end = 0;
+    return;
   }
+  fd->prefetch_next = std::max(fd->prefetch_next, end);
+  fd->prefetch_end = std::min(end + fd->prefetch_window, fd->file_blocks);
+  fd->prefetch_cv.notify_one();
+}
 
-  fd->curr_block = block;
+// The prefetcher thread. Fetches the blocks in the prefetch window into the block cache, verifying
+// them off the request thread. A block that fails to fetch or verify is left for the reader, which
+// fails the read that needs it.
+static void prefetch_blocks(fuse_data* fd) {
+  std::vector<uint8_t> buffer(static_cast<size_t>(fd->max_read_blocks) * fd->block_size);
+  std::unique_lock<std::mutex> lock(fd->mu);
+  for (;;) {
+    fd->prefetch_cv.wait(lock, [fd] {
+      return fd->prefetch_stop || (!fd->reader_waiting && fd->prefetch_next < fd->prefetch_end);
+    });
+    if (fd->prefetch_stop) {
+      return;
+    }
 
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+    uint32_t first = fd->prefetch_next;
+    while (first < fd->prefetch_end && block_cache_contains(fd, first)) {
+      first++;
+    }
+    fd->prefetch_next = first;
+    if (first == fd->prefetch_end) {
+      continue;
+    }
 
-  SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
+    lock.unlock();
+    std::unique_lock<std::mutex> provider_lock(fd->provider_mu);
+    lock.lock();
+    // The window may have moved, or the reader may have fetched the block, while we waited.
+    if (fd->prefetch_stop || fd->reader_waiting || first < fd->prefetch_next ||
+        first >= fd->prefetch_end || block_cache_contains(fd, first)) {
+      continue;
+    }
 
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
-    return 0;
-  }
+    uint32_t run = 1;
+    while (run < fd->max_read_blocks && first + run < fd->prefetch_end &&
+           !block_cache_contains(fd, first + run)) {
+      run++;
+    }
+    fd->prefetch_next = first + run;
+    lock.unlock();
+
+    uint64_t run_offset = static_cast<uint64_t>(first) * fd->block_size;
+    uint32_t fetch_size = run * fd->block_size;
+    if (run_offset + fetch_size > fd->file_size) {
+      fetch_size = fd->file_size - run_offset;
+      memset(buffer.data() + fetch_size, 0, run * fd->block_size - fetch_size);
+    }
+    bool fetched = fd->provider->ReadBlockAlignedData(buffer.data(), fetch_size, first);
+    provider_lock.unlock();
 
-  for (uint8_t i : blockhash) {
-    if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
+    if (fetched) {
+      verify_blocks(fd, first, run, buffer.data());
     }
+    lock.lock();
   }
+}
 
-  fd->hashes[block] = hash;
-  block_cache_enter(fd, block);
-  return 0;
+static void stop_prefetch(fuse_data* fd) {
+  if (!fd->prefetch_thread.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(fd->mu);
+    fd->prefetch_stop = true;
+  }
+  fd->prefetch_cv.notify_one();
+  fd->prefetch_thread.join();
 }
 
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
@@ -373,46 +553,31 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
-  vec[0].iov_base = &outhdr;
-  vec[0].iov_len = sizeof(outhdr);
-
+  if (offset / fd->block_size > UINT32_MAX - fd->max_read_blocks) {
+    return -EINVAL;
+  }
   uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
-
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
-
-  uint32_t block_offset = offset - (block * fd->block_size);
-
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
-
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
+  uint32_t block_offset = offset - (static_cast<uint64_t>(block) * fd->block_size);
+  uint32_t count =
+      (static_cast<uint64_t>(block_offset) + size + fd->block_size - 1) / fd->block_size;
+  if (count > fd->max_read_blocks) {
+    fprintf(stderr, "read of %u bytes at %" PRIu64 " is larger than max_read\n", size, offset);
+    return -EINVAL;
+  }
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
+  int result = fetch_blocks(fd, block, count);
+  if (result != 0) return result;
+  schedule_prefetch(fd, block, count);
 
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
-  }
+  // The blocks are contiguous in block_data, so the reply is a single writev no matter how many
+  // of them the read spans.
+  struct iovec vec[2];
+  vec[0].iov_base = &outhdr;
+  vec[0].iov_len = sizeof(outhdr);
+  vec[1].iov_base = fd->block_data + block_offset;
+  vec[1].iov_len = size;
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
+  if (writev(fd->ffd, vec, 2) == -1) {
     printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
   }
   return NO_STATUS;
@@ -440,53 +605,54 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   fd.provider = provider.get();
   fd.file_size = file_size;
   fd.block_size = block_size;
-  fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
+  fd.max_read = std::max(block_size, MAX_READ_SIZE / block_size * block_size);
+  fd.max_read_blocks = fd.max_read / block_size + 1;
+  fd.hash_threads = std::clamp(std::thread::hardware_concurrency() / 2, 1U, 4U);
+
+  // Leave room past the last block for reads that extend beyond the end of the file.
+  uint64_t file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
+  if (file_blocks > UINT32_MAX - fd.max_read_blocks) {
+    fprintf(stderr, "file has too many blocks (%" PRIu64 ")\n", file_blocks);
+    return -1;
+  }
+  fd.file_blocks = file_blocks;
 
+  // Set aside the memory for the hashes of all the blocks, in case the whole file is read.
   uint64_t mem = free_memory();
-  uint64_t avail = mem - (INSTALL_REQUIRED_MEMORY + fd.file_blocks * sizeof(uint8_t*));
+  uint64_t avail = mem - (INSTALL_REQUIRED_MEMORY + file_blocks * sizeof(SHA256Digest));
 
   int result;
-  if (fd.file_blocks > (1 << 18)) {
-    fprintf(stderr, "file has too many blocks (%u)\n", fd.file_blocks);
-    result = -1;
-    goto done;
-  }
 
   // All hashes will be zero-initialized.
-  fd.hashes.resize(fd.file_blocks);
+  fd.hash_pages.resize((fd.file_blocks + HASH_PAGE_BLOCKS - 1) / HASH_PAGE_BLOCKS);
   fd.uid = getuid();
   fd.gid = getgid();
 
   fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
+  fd.curr_blocks = 0;
+  fd.block_data =
+      static_cast<uint8_t*>(malloc(static_cast<size_t>(fd.max_read_blocks) * block_size));
   if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
-  }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
+    fprintf(stderr, "failed to allocate %u blocks for block_data\n", fd.max_read_blocks);
     result = -1;
     goto done;
   }
 
-  fd.block_cache_max_size = 0;
-  fd.block_cache_size = 0;
-  fd.block_cache = nullptr;
   if (mem > avail) {
-    uint32_t max_size = avail / fd.block_size;
-    if (max_size > fd.file_blocks) {
-      max_size = fd.file_blocks;
-    }
-    // The cache must be at least 1% of the file size or two blocks,
-    // whichever is larger.
-    if (max_size >= fd.file_blocks / 100 && max_size >= 2) {
-      fd.block_cache_max_size = max_size;
-      fd.block_cache = (uint8_t**)calloc(fd.file_blocks, sizeof(uint8_t*));
+    // The cache takes whatever memory is available, up to the size of the file. It must be at
+    // least two blocks; LRU eviction keeps a cache that's small compared to the file useful.
+    uint32_t max_size = std::min<uint64_t>(avail / fd.block_size, fd.file_blocks);
+    if (max_size >= 2) {
+      fd.block_cache = FuseBlockCache::Create(max_size, block_size);
     }
   }
 
+  if (fd.block_cache != nullptr) {
+    // Keep the prefetched blocks from pushing each other out of the cache before they're read.
+    fd.prefetch_max_blocks =
+        std::min(MAX_PREFETCH_SIZE / block_size, fd.block_cache->capacity() / 2);
+  }
+
   fd.ffd.reset(open("/dev/fuse", O_RDWR));
   if (fd.ffd == -1) {
     perror("open /dev/fuse");
@@ -497,7 +663,7 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   {
     std::string opts = android::base::StringPrintf(
         "fd=%d,user_id=%d,group_id=%d,max_read=%u,allow_other,rootmode=040000", fd.ffd.get(),
-        fd.uid, fd.gid, block_size);
+        fd.uid, fd.gid, fd.max_read);
 
     result = mount("/dev/fuse", mount_point, "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC,
                    opts.c_str());
@@ -507,6 +673,10 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     }
   }
 
+  if (fd.prefetch_max_blocks > 0) {
+    fd.prefetch_thread = std::thread(prefetch_blocks, &fd);
+  }
+
   uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
   for (;;) {
     ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
@@ -578,6 +748,7 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   }
 
 done:
+  stop_prefetch(&fd);
   provider->Close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
@@ -585,15 +756,11 @@ done:
   }
 
   if (fd.block_cache) {
-    uint32_t n;
-    for (n = 0; n < fd.file_blocks; ++n) {
-      free(fd.block_cache[n]);
-    }
-    free(fd.block_cache);
+    printf("block cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+           fd.block_cache->hits(), fd.block_cache_misses, fd.block_cache->evictions());
   }
 
   free(fd.block_data);
-  free(fd.extra_block);
 
   return result;
 }
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Caches the blocks of the sideloaded package. The data of the cached blocks lives in a slab of
+// 'capacity' slots that's allocated once; when it's full, the least recently used block is evicted
+// to make room for a new one. Entering or fetching a block makes it the most recently used one.
+//
+// The cache isn't thread-safe; fuse_sideload guards it with its own lock.
+class FuseBlockCache {
+ public:
+  // Returns nullptr if the slab can't be allocated.
+  static std::unique_ptr<FuseBlockCache> Create(uint32_t capacity, uint32_t block_size);
+
+  ~FuseBlockCache();
+
+  bool Contains(uint32_t block) const;
+
+  // Copies the cached 'block' to 'data'. Returns false if the block isn't cached.
+  bool Fetch(uint32_t block, uint8_t* data);
+
+  // Caches 'block' with the contents in 'data', which must not be cached already.
+  void Enter(uint32_t block, const uint8_t* data);
+
+  uint32_t capacity() const {
+    return capacity_;
+  }
+  uint32_t size() const {
+    return size_;
+  }
+  uint64_t hits() const {
+    return hits_;
+  }
+  uint64_t evictions() const {
+    return evictions_;
+  }
+
+ private:
+  static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+  // A slot of the slab, linked into the list of slots in LRU order.
+  struct Slot {
+    uint32_t block;
+    uint32_t prev;  // the slot used next more recently, or kNoSlot
+    uint32_t next;  // the slot used next less recently, or kNoSlot
+  };
+
+  FuseBlockCache(uint32_t capacity, uint32_t block_size, uint8_t* data);
+
+  void Unlink(uint32_t slot);
+  void PushFront(uint32_t slot);
+
+  const uint32_t capacity_;
+  const uint32_t block_size_;
+  uint8_t* const data_;
+  uint32_t size_{ 0 };
+  std::vector<Slot> slots_;
+  std::unordered_map<uint32_t, uint32_t> index_;  // block -> slot
+  uint32_t mru_{ kNoSlot };
+  uint32_t lru_{ kNoSlot };
+  uint64_t hits_{ 0 };
+  uint64_t evictions_{ 0 };
+};
@@ -125,6 +125,20 @@ asn1_context* asn1_context::asn1_set_get() {
   return new asn1_context(p_, length);
 }
 
+/**
+ * Returns the contents of the sequence, without advancing past them.
+ */
+bool asn1_context::asn1_sequence_contents_get(const uint8_t** contents, size_t* length) {
+  if ((get_byte() & kMaskTag) != kTagSequence) {
+    return false;
+  }
+  if (!decode_length(length) || *length == 0 || *length > length_) {
+    return false;
+  }
+  *contents = p_;
+  return true;
+}
+
 bool asn1_context::asn1_sequence_next() {
   size_t length;
   if (get_byte() == -1 || !decode_length(&length) || !skip_bytes(length)) {
@@ -20,6 +20,7 @@
 
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <openssl/ec_key.h>
@@ -28,8 +29,13 @@
 
 constexpr size_t MiB = 1024 * 1024;
 
+// Updates a hash context with |size| bytes at |addr|. The callbacks passed together to
+// UpdateHashAtOffset() may be called concurrently, so they must not share a context.
 using HasherUpdateCallback = std::function<void(const uint8_t* addr, uint64_t size)>;
 
+// Reports the number of bytes that UpdateHashAtOffset() has hashed so far.
+using HashProgressCallback = std::function<void(uint64_t hashed)>;
+
 struct RSADeleter {
   void operator()(RSA* rsa) const {
     RSA_free(rsa);
@@ -57,6 +63,9 @@ struct Certificate {
   KeyType key_type;
   std::unique_ptr<RSA, RSADeleter> rsa;
   std::unique_ptr<EC_KEY, ECKEYDeleter> ec;
+  // The DER encoded issuer name and serial number of the certificate, which is how the signer info
+  // of a package signature identifies the certificate to verify it against.
+  std::vector<uint8_t> issuer_and_serial;
 };
 
 class VerifierInterface {
@@ -69,9 +78,10 @@ class VerifierInterface {
   // Reads |byte_count| data starting from |offset|, and puts the result in |buffer|.
   virtual bool ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) = 0;
 
-  // Updates the hash contexts for |length| bytes data starting from |start|.
+  // Updates the hash contexts for |length| bytes data starting from |start|, calling the optional
+  // |progress| as the data gets hashed.
   virtual bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
-                                  uint64_t length) = 0;
+                                  uint64_t length, const HashProgressCallback& progress) = 0;
 
   // Updates the progress in fraction during package verification.
   virtual void SetProgress(float progress) = 0;
@@ -97,5 +107,11 @@ bool LoadCertificateFromBuffer(const std::vector<uint8_t>& pem_content, Certific
 // certificates. Returns an empty list if we fail to parse any of the entries.
 std::vector<Certificate> LoadKeysFromZipfile(const std::string& zip_name);
 
+// Returns the keys from |zip_name| like LoadKeysFromZipfile(), but keeps them for the lifetime of
+// the process, so that the file is only parsed again when it changes. Returns nullptr if no key is
+// loaded.
+std::shared_ptr<const std::vector<Certificate>> LoadKeysFromZipfileCached(
+    const std::string& zip_name);
+
 #define VERIFY_SUCCESS 0
 #define VERIFY_FAILURE 1
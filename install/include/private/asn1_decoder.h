@@ -28,6 +28,7 @@ class asn1_context {
   bool asn1_constructed_skip_all();
   asn1_context* asn1_sequence_get();
   asn1_context* asn1_set_get();
+  bool asn1_sequence_contents_get(const uint8_t** contents, size_t* length);
   bool asn1_sequence_next();
   bool asn1_oid_get(const uint8_t** oid, size_t* length);
   bool asn1_octet_string_get(const uint8_t** octet_string, size_t* length);
@@ -23,6 +23,10 @@
 
 #include <ziparchive/zip_archive.h>
 
+#include "install/install.h"
+#include "install/package.h"
+#include "recovery_ui/ui.h"
+
 // Sets up the commands for a non-A/B update. Extracts the updater binary from the open zip archive
 // |zip| located at |package|. Stores the command line that should be called into |cmd|. The
 // |status_fd| is the file descriptor the child process should use to report back the progress of
@@ -30,6 +34,18 @@
 bool SetUpNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int retry_count,
                               int status_fd, std::vector<std::string>* cmd);
 
+// Same as SetUpNonAbUpdateCommands(), except that the update binary is extracted into a staging
+// file next to its final path, which only its owner can access, e.g. while the package is still
+// being verified. Stores the path of the staging file into |staged_binary|. The command in |cmd|
+// runs the update binary from its final path, where CommitStagedUpdateBinary() moves it.
+bool StageNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int retry_count,
+                              int status_fd, std::vector<std::string>* cmd,
+                              std::string* staged_binary);
+
+// Moves the update binary staged by StageNonAbUpdateCommands() at |staged_binary| to its final
+// path, and makes it executable. Nothing is left at either path on failure.
+bool CommitStagedUpdateBinary(const std::string& staged_binary);
+
 // Sets up the commands for an A/B update. Extracts the needed entries from the open zip archive
 // |zip| located at |package|. Stores the command line that should be called into |cmd|. The
 // |status_fd| is the file descriptor the child process should use to report back the progress of
@@ -37,3 +53,10 @@ bool SetUpNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip,
 // parameter |retry_count| than the non-A/B version.
 bool SetUpAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int status_fd,
                            std::vector<std::string>* cmd);
+
+// Verifies |package| and runs the update in it, as InstallPackage() does once the install mounts are
+// set up. The update is prepared while the package is verified, if that's safe to do before the
+// package is trusted.
+InstallResult VerifyAndInstallPackage(Package* package, bool* wipe_cache,
+                                      std::vector<std::string>* log_buffer, int retry_count,
+                                      int* max_temperature, RecoveryUI* ui);
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Private headers exposed for testing purpose only.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "install/verifier.h"
+
+// Returns the DER encoded issuer name and serial number of the certificate that the signature of
+// |package| names as its signer, in the form of Certificate::issuer_and_serial. Returns an empty
+// vector if the signature can't be read or doesn't name one.
+std::vector<uint8_t> GetPackageSigner(VerifierInterface* package);
+
+// Returns the indices of |keys| in the order that verify_file() tries them for a signature by
+// |signer|: the keys of the matching certificates first, then the others, in their original order.
+std::vector<size_t> OrderKeysBySigner(const std::vector<Certificate>& keys,
+                                      const std::vector<uint8_t>& signer);
@@ -32,6 +32,7 @@
 #include <condition_variable>
 #include <filesystem>
 #include <functional>
+#include <future>
 #include <limits>
 #include <mutex>
 #include <thread>
@@ -190,7 +191,7 @@ static bool CheckAbSpecificMetadata(const std::map<std::string, std::string>& me
   }
 
   if (undeclared_downgrade &&
-      !(ui->IsTextVisible() && ask_to_continue_downgrade(ui->GetDevice()))) {
+      !(ui != nullptr && ui->IsTextVisible() && ask_to_continue_downgrade(ui->GetDevice()))) {
     return false;
   }
 
@@ -289,11 +290,9 @@ bool SetUpAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int
   return true;
 }
 
-bool SetUpNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int retry_count,
-                              int status_fd, std::vector<std::string>* cmd) {
-  CHECK(cmd != nullptr);
-
-  // In non-A/B updates we extract the update binary from the package.
+// Extracts the update binary of a non-A/B package into a new file at |path|, created with |mode|.
+// Nothing is left at |path| on failure.
+static bool ExtractUpdateBinary(ZipArchiveHandle zip, const std::string& path, mode_t mode) {
   static constexpr const char* UPDATE_BINARY_NAME = "META-INF/com/google/android/update-binary";
   ZipEntry64 binary_entry;
   if (FindEntry(zip, UPDATE_BINARY_NAME, &binary_entry) != 0) {
@@ -301,27 +300,35 @@ bool SetUpNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip,
     return false;
   }
 
-  const std::string binary_path = Paths::Get().temporary_update_binary();
-  unlink(binary_path.c_str());
-  android::base::unique_fd fd(
-      open(binary_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0755));
+  unlink(path.c_str());
+  android::base::unique_fd fd(open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, mode));
   if (fd == -1) {
-    PLOG(ERROR) << "Failed to create " << binary_path;
+    PLOG(ERROR) << "Failed to create " << path;
     return false;
   }
 
   if (auto error = ExtractEntryToFile(zip, &binary_entry, fd); error != 0) {
     LOG(ERROR) << "Failed to extract " << UPDATE_BINARY_NAME << ": " << ErrorCodeString(error);
+    unlink(path.c_str());
     return false;
   }
+  return true;
+}
+
+// Returns the path that StageNonAbUpdateCommands() extracts the update binary to.
+static std::string GetStagedUpdateBinaryPath() {
+  return Paths::Get().temporary_update_binary() + ".unverified";
+}
 
+static void SetNonAbUpdateCommands(const std::string& package, int retry_count, int status_fd,
+                                   std::vector<std::string>* cmd) {
   // When executing the update binary contained in the package, the arguments passed are:
   //   - the version number for this interface
   //   - an FD to which the program can write in order to update the progress bar.
   //   - the name of the package zip file.
   //   - an optional argument "retry" if this update is a retry of a failed update attempt.
   *cmd = {
-    binary_path,
+    Paths::Get().temporary_update_binary(),
     std::to_string(kRecoveryApiVersion),
     std::to_string(status_fd),
     package,
@@ -329,6 +336,47 @@ bool SetUpNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip,
   if (retry_count > 0) {
     cmd->push_back("retry");
   }
+}
+
+bool SetUpNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int retry_count,
+                              int status_fd, std::vector<std::string>* cmd) {
+  CHECK(cmd != nullptr);
+
+  // In non-A/B updates we extract the update binary from the package.
+  if (!ExtractUpdateBinary(zip, Paths::Get().temporary_update_binary(), 0755)) {
+    return false;
+  }
+  SetNonAbUpdateCommands(package, retry_count, status_fd, cmd);
+  return true;
+}
+
+bool StageNonAbUpdateCommands(const std::string& package, ZipArchiveHandle zip, int retry_count,
+                              int status_fd, std::vector<std::string>* cmd,
+                              std::string* staged_binary) {
+  CHECK(cmd != nullptr);
+  CHECK(staged_binary != nullptr);
+
+  std::string path = GetStagedUpdateBinaryPath();
+  if (!ExtractUpdateBinary(zip, path, 0700)) {
+    return false;
+  }
+  *staged_binary = path;
+  SetNonAbUpdateCommands(package, retry_count, status_fd, cmd);
+  return true;
+}
+
+bool CommitStagedUpdateBinary(const std::string& staged_binary) {
+  const std::string binary_path = Paths::Get().temporary_update_binary();
+  if (rename(staged_binary.c_str(), binary_path.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename " << staged_binary << " to " << binary_path;
+    unlink(staged_binary.c_str());
+    return false;
+  }
+  if (chmod(binary_path.c_str(), 0755) == -1) {
+    PLOG(ERROR) << "Failed to chmod " << binary_path;
+    unlink(binary_path.c_str());
+    return false;
+  }
   return true;
 }
 
@@ -342,15 +390,47 @@ static void log_max_temperature(int* max_temperature, const std::atomic<bool>& l
   }
 }
 
-// If the package contains an update binary, extract it and run it.
-static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
-                                     std::vector<std::string>* log_buffer, int retry_count,
-                                     int* max_temperature, RecoveryUI* ui) {
+// What's needed to run the update in a package, as set up by PrepareUpdate().
+struct UpdateSetup {
+  ~UpdateSetup() {
+    // A staged update binary that's never committed is removed, e.g. when the package fails the
+    // verification.
+    if (!staged_binary.empty()) {
+      unlink(staged_binary.c_str());
+    }
+  }
+
+  // The lines to add to last_install.
+  std::vector<std::string> log_buffer;
+  // The pipe the updater writes its commands to.
+  android::base::unique_fd pipe_read;
+  android::base::unique_fd pipe_write;
+  // The command line of the updater.
+  std::vector<std::string> args;
+  // The update binary extracted by StageNonAbUpdateCommands(), if not committed yet.
+  std::string staged_binary;
+};
+
+// Returns whether the metadata of |package| declares an A/B update.
+static bool IsAbPackage(Package* package) {
+  std::map<std::string, std::string> metadata;
+  return ReadMetadataFromPackage(package->GetZipArchiveHandle(), &metadata) &&
+         get_value(metadata, "ota-type") == OtaTypeToString(OtaType::AB);
+}
+
+// Checks the metadata of the package, and extracts what's needed to run the update from it (e.g.
+// the update binary) into |setup|. Nothing from the package is run. It's called with a null |ui|
+// while the package is still being verified, in which case the checks that would otherwise ask the
+// user whether to continue fail instead, and the update binary is only staged.
+static InstallResult PrepareUpdate(Package* package, int retry_count, RecoveryUI* ui,
+                                   UpdateSetup* setup) {
+  auto* log_buffer = &setup->log_buffer;
   std::map<std::string, std::string> metadata;
   auto zip = package->GetZipArchiveHandle();
   bool has_metadata = ReadMetadataFromPackage(zip, &metadata);
 
-  bool package_is_ab = has_metadata && get_value(metadata, "ota-type") == OtaTypeToString(OtaType::AB);
+  bool package_is_ab =
+      has_metadata && get_value(metadata, "ota-type") == OtaTypeToString(OtaType::AB);
   bool device_supports_ab = android::base::GetBoolProperty("ro.build.ab_update", false);
   bool ab_device_supports_nonab = true;
   bool device_only_supports_ab = device_supports_ab && !ab_device_supports_nonab;
@@ -361,8 +441,12 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
     return INSTALL_ERROR;
   }
 
-  if (package_is_ab) {
-    CHECK(package->GetType() == PackageType::kFile);
+  // A/B updates stream the payload from the package file, so a package in memory can't be one.
+  // Without |ui|, this runs before the package is verified, so nothing about it is trusted yet.
+  if (package_is_ab && package->GetType() != PackageType::kFile) {
+    LOG(ERROR) << "A/B update package must be a file";
+    log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
+    return INSTALL_CORRUPT;
   }
 
   // Verify against the metadata in the package first. Expects A/B metadata if:
@@ -379,14 +463,42 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
   ReadSourceTargetBuild(metadata, log_buffer);
 
   // The updater in child process writes to the pipe to communicate with recovery.
-  android::base::unique_fd pipe_read, pipe_write;
   // Explicitly disable O_CLOEXEC using 0 as the flags (last) parameter to Pipe
   // so that the child updater process will recieve a non-closed fd.
-  if (!android::base::Pipe(&pipe_read, &pipe_write, 0)) {
+  if (!android::base::Pipe(&setup->pipe_read, &setup->pipe_write, 0)) {
     PLOG(ERROR) << "Failed to create pipe for updater-recovery communication";
     return INSTALL_CORRUPT;
   }
 
+  std::string package_path = package->GetPath();
+  int status_fd = setup->pipe_write.get();
+  bool setup_result;
+  if (package_is_ab) {
+    setup_result = SetUpAbUpdateCommands(package_path, zip, status_fd, &setup->args);
+  } else if (ui == nullptr) {
+    setup_result = StageNonAbUpdateCommands(package_path, zip, retry_count, status_fd,
+                                            &setup->args, &setup->staged_binary);
+  } else {
+    setup_result =
+        SetUpNonAbUpdateCommands(package_path, zip, retry_count, status_fd, &setup->args);
+  }
+  if (!setup_result) {
+    log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
+    return INSTALL_CORRUPT;
+  }
+
+  return INSTALL_SUCCESS;
+}
+
+// Runs the update that PrepareUpdate() set up in |setup|.
+static InstallResult TryUpdateBinary(Package* package, UpdateSetup* setup, bool* wipe_cache,
+                                     std::vector<std::string>* log_buffer, int* max_temperature,
+                                     RecoveryUI* ui) {
+  std::string package_path = package->GetPath();
+  auto& pipe_read = setup->pipe_read;
+  auto& pipe_write = setup->pipe_write;
+  const auto& args = setup->args;
+
   // The updater-recovery communication protocol.
   //
   //   progress <frac> <secs>
@@ -419,18 +531,6 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
   //       updater requests logging the string (e.g. cause of the failure).
   //
 
-  std::string package_path = package->GetPath();
-
-  std::vector<std::string> args;
-  if (auto setup_result =
-          package_is_ab
-              ? SetUpAbUpdateCommands(package_path, zip, pipe_write.get(), &args)
-              : SetUpNonAbUpdateCommands(package_path, zip, retry_count, pipe_write.get(), &args);
-      !setup_result) {
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
-    return INSTALL_CORRUPT;
-  }
-
   pid_t pid = fork();
   if (pid == -1) {
     PLOG(ERROR) << "Failed to fork update binary";
@@ -540,16 +640,32 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
   return INSTALL_SUCCESS;
 }
 
-static InstallResult VerifyAndInstallPackage(Package* package, bool* wipe_cache,
-                                             std::vector<std::string>* log_buffer, int retry_count,
-                                             int* max_temperature, RecoveryUI* ui) {
+InstallResult VerifyAndInstallPackage(Package* package, bool* wipe_cache,
+                                      std::vector<std::string>* log_buffer, int retry_count,
+                                      int* max_temperature, RecoveryUI* ui) {
   ui->SetBackground(RecoveryUI::INSTALLING_UPDATE);
   // Give verification half the progress bar...
   ui->SetProgressType(RecoveryUI::DETERMINATE);
   ui->ShowProgress(VERIFICATION_PROGRESS_FRACTION, VERIFICATION_PROGRESS_TIME);
 
+  // Check the metadata and set up the update while the package is verified, which takes much
+  // longer. Nothing of it is used, let alone run, unless the package passes the verification (or
+  // the user chooses to install it anyway): the update binary is only staged meanwhile, and it's
+  // removed along with |setup| otherwise. It can't ask the user anything meanwhile, so it's done
+  // again with the UI if it fails. Packages sideloaded through FUSE are set up afterwards, as
+  // reading them out of order would defeat the read ahead of fuse_sideload. So are A/B packages,
+  // which can only be installed from a file, and the package isn't trusted to say it's not one.
+  auto setup = std::make_unique<UpdateSetup>();
+  std::future<InstallResult> prepared;
+  if (package->GetType() == PackageType::kMemory && !IsAbPackage(package)) {
+    prepared = std::async(std::launch::async, PrepareUpdate, package, retry_count, nullptr,
+                          setup.get());
+  }
+
   // Verify package.
-  if (!verify_package(package, ui)) {
+  bool verified = verify_package(package, ui);
+  bool prepared_in_advance = prepared.valid() && prepared.get() == INSTALL_SUCCESS;
+  if (!verified) {
     log_buffer->push_back(android::base::StringPrintf("error: %d", kZipVerificationFailure));
     if (!ui->IsTextVisible() || !ask_to_continue_unverified(ui->GetDevice())) {
         return INSTALL_CORRUPT;
@@ -562,7 +678,23 @@ static InstallResult VerifyAndInstallPackage(Package* package, bool* wipe_cache,
     ui->Print("Retry attempt: %d\n", retry_count);
   }
   ui->SetEnableReboot(false);
-  auto result = TryUpdateBinary(package, wipe_cache, log_buffer, retry_count, max_temperature, ui);
+  InstallResult result = INSTALL_SUCCESS;
+  if (!prepared_in_advance) {
+    setup = std::make_unique<UpdateSetup>();
+    result = PrepareUpdate(package, retry_count, ui, setup.get());
+  } else if (!setup->staged_binary.empty()) {
+    bool committed = CommitStagedUpdateBinary(setup->staged_binary);
+    setup->staged_binary.clear();
+    if (!committed) {
+      setup->log_buffer.push_back(
+          android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
+      result = INSTALL_CORRUPT;
+    }
+  }
+  log_buffer->insert(log_buffer->end(), setup->log_buffer.begin(), setup->log_buffer.end());
+  if (result == INSTALL_SUCCESS) {
+    result = TryUpdateBinary(package, setup.get(), wipe_cache, log_buffer, max_temperature, ui);
+  }
   ui->SetEnableReboot(true);
   ui->Print("\n");
 
@@ -659,17 +791,17 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
 
 bool verify_package(Package* package, RecoveryUI* ui) {
   static constexpr const char* CERTIFICATE_ZIP_FILE = "/system/etc/security/otacerts.zip";
-  std::vector<Certificate> loaded_keys = LoadKeysFromZipfile(CERTIFICATE_ZIP_FILE);
-  if (loaded_keys.empty()) {
+  auto loaded_keys = LoadKeysFromZipfileCached(CERTIFICATE_ZIP_FILE);
+  if (!loaded_keys) {
     LOG(ERROR) << "Failed to load keys";
     return false;
   }
-  LOG(INFO) << loaded_keys.size() << " key(s) loaded from " << CERTIFICATE_ZIP_FILE;
+  LOG(INFO) << loaded_keys->size() << " key(s) loaded from " << CERTIFICATE_ZIP_FILE;
 
   // Verify package.
   ui->Print("Verifying update package...\n");
   auto t0 = std::chrono::system_clock::now();
-  int err = verify_file(package, loaded_keys);
+  int err = verify_file(package, *loaded_keys);
   std::chrono::duration<double> duration = std::chrono::system_clock::now() - t0;
   ui->Print("Update package verification took %.1f s (result %d).\n", duration.count(), err);
   if (err != VERIFY_SUCCESS) {
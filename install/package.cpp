@@ -16,9 +16,16 @@
 
 #include "install/package.h"
 
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
@@ -59,7 +66,7 @@ class MemoryPackage : public Package {
   ZipArchiveHandle GetZipArchiveHandle() override;
 
   bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
-                          uint64_t length) override;
+                          uint64_t length, const HashProgressCallback& progress) override;
 
  private:
   const uint8_t* addr_;    // Start address of the package in memory.
@@ -83,6 +90,9 @@ void Package::SetProgress(float progress) {
   }
 }
 
+// This class reads the package from an fd with pread. It serves the packages sideloaded through
+// FUSE, whose reads fail with EIO on an adb disconnect or a hash mismatch; the package isn't memory
+// mapped, since such a failure would then raise SIGBUS instead of failing the install.
 class FilePackage : public Package {
  public:
   FilePackage(android::base::unique_fd&& fd, uint64_t file_size, const std::string& path,
@@ -107,7 +117,7 @@ class FilePackage : public Package {
   ZipArchiveHandle GetZipArchiveHandle() override;
 
   bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
-                          uint64_t length) override;
+                          uint64_t length, const HashProgressCallback& progress) override;
 
  private:
   android::base::unique_fd fd_;  // The underlying fd to the open package.
@@ -117,6 +127,10 @@ class FilePackage : public Package {
   ZipArchiveHandle zip_handle_;
 };
 
+// The size of the slices that UpdateHashAtOffset() hashes at a time. FilePackage allocates two of
+// them while it runs, so that the next slice of the range is read while the current one is hashed.
+static constexpr uint64_t kHashSliceSize = 4 * MiB;
+
 std::unique_ptr<Package> Package::CreateMemoryPackage(
     const std::string& path, const std::function<void(float)>& set_progress) {
   std::unique_ptr<MemMapping> mmap = std::make_unique<MemMapping>();
@@ -183,18 +197,104 @@ bool MemoryPackage::ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint
   return true;
 }
 
+// Returns the address of the |size| bytes at |offset| into the range being hashed, reading them into
+// the buffer |slot| of a pair if needed, or nullptr on failure.
+using SliceReader = std::function<const uint8_t*(size_t slot, uint64_t offset, uint64_t size)>;
+
+// Hashes |length| bytes in slices of kHashSliceSize, which |read_slice| provides. The slices are
+// read on a thread of their own, one slice ahead of the hashing, and every hasher but the first runs
+// on a thread of its own too (e.g. SHA-256 next to SHA-1 for a mix of keys). So reading and each
+// hasher overlap, and it takes as long as the slowest of them rather than all of them together.
+static bool HashSlices(const std::vector<HasherUpdateCallback>& hashers, uint64_t length,
+                       const SliceReader& read_slice, const HashProgressCallback& progress) {
+  if (hashers.empty()) {
+    return true;
+  }
+
+  auto slice_size = [length](size_t index) {
+    return std::min<uint64_t>(length - index * kHashSliceSize, kHashSliceSize);
+  };
+  size_t slices = (length + kHashSliceSize - 1) / kHashSliceSize;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  const uint8_t* data[2] = {};  // The slices in the pair of slots, by slice index modulo 2.
+  size_t read = 0;              // The number of slices read so far.
+  std::vector<size_t> hashed(hashers.size(), 0);  // The number of slices each hasher has hashed.
+  bool failed = false;
+
+  std::thread reader([&]() {
+    for (size_t i = 0; i < slices; i++) {
+      {
+        // The slot is free once every hasher is done with the slice before the previous one.
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return *std::min_element(hashed.begin(), hashed.end()) + 2 > i; });
+      }
+      const uint8_t* slice = read_slice(i % 2, i * kHashSliceSize, slice_size(i));
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slice == nullptr) {
+          failed = true;
+        } else {
+          data[i % 2] = slice;
+          read++;
+        }
+      }
+      cv.notify_all();
+      if (slice == nullptr) {
+        return;
+      }
+    }
+  });
+
+  auto hash = [&](size_t hasher) {
+    for (size_t i = 0; i < slices; i++) {
+      const uint8_t* slice;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return failed || read > i; });
+        if (failed) {
+          return;
+        }
+        slice = data[i % 2];
+      }
+      hashers[hasher](slice, slice_size(i));
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        hashed[hasher]++;
+      }
+      cv.notify_all();
+      if (hasher == 0 && progress) {
+        progress(i * kHashSliceSize + slice_size(i));
+      }
+    }
+  };
+
+  std::vector<std::thread> others;
+  for (size_t i = 1; i < hashers.size(); i++) {
+    others.emplace_back(hash, i);
+  }
+  hash(0);
+  for (auto& other : others) {
+    other.join();
+  }
+  reader.join();
+  return !failed;
+}
+
 bool MemoryPackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers,
-                                       uint64_t start, uint64_t length) {
+                                       uint64_t start, uint64_t length,
+                                       const HashProgressCallback& progress) {
   if (length > package_size_ || start > package_size_ - length) {
     LOG(ERROR) << "Out of bound read, offset: " << start << ", size: " << length
                << ", total package_size: " << package_size_;
     return false;
   }
 
-  for (const auto& hasher : hashers) {
-    hasher(addr_ + start, length);
-  }
-  return true;
+  return HashSlices(
+      hashers, length,
+      [this, start](size_t, uint64_t offset, uint64_t) { return addr_ + start + offset; },
+      progress);
 }
 
 ZipArchiveHandle MemoryPackage::GetZipArchiveHandle() {
@@ -240,28 +340,36 @@ bool FilePackage::ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64
 }
 
 bool FilePackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers,
-                                     uint64_t start, uint64_t length) {
+                                     uint64_t start, uint64_t length,
+                                     const HashProgressCallback& progress) {
   if (length > package_size_ || start > package_size_ - length) {
     LOG(ERROR) << "Out of bound read, offset: " << start << ", size: " << length
                << ", total package_size: " << package_size_;
     return false;
   }
 
-  uint64_t so_far = 0;
-  while (so_far < length) {
-    uint64_t read_size = std::min<uint64_t>(length - so_far, 16 * MiB);
-    std::vector<uint8_t> buffer(read_size);
-    if (!ReadFullyAtOffset(buffer.data(), read_size, start + so_far)) {
-      return false;
-    }
+  posix_fadvise(fd_.get(), start, length, POSIX_FADV_SEQUENTIAL);
 
-    for (const auto& hasher : hashers) {
-      hasher(buffer.data(), read_size);
+  // The pair of page aligned buffers is reused for all the slices of the range, which verify_file()
+  // hashes in a single call, and freed at the end. The second one is only needed for a second slice.
+  size_t slice_size = std::min<uint64_t>(length, kHashSliceSize);
+  std::unique_ptr<uint8_t, decltype(&free)> buffers[2] = { { nullptr, free }, { nullptr, free } };
+  for (size_t i = 0; i < 2 && i * kHashSliceSize < length; i++) {
+    void* buffer;
+    if (int err = posix_memalign(&buffer, getpagesize(), slice_size); err != 0) {
+      LOG(ERROR) << "Failed to allocate " << slice_size << " bytes: " << strerror(err);
+      return false;
     }
-    so_far += read_size;
+    buffers[i].reset(static_cast<uint8_t*>(buffer));
   }
 
-  return true;
+  return HashSlices(
+      hashers, length,
+      [this, start, &buffers](size_t slot, uint64_t offset, uint64_t size) -> const uint8_t* {
+        uint8_t* buffer = buffers[slot].get();
+        return ReadFullyAtOffset(buffer, size, start + offset) ? buffer : nullptr;
+      },
+      progress);
 }
 
 ZipArchiveHandle FilePackage::GetZipArchiveHandle() {
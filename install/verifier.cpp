@@ -20,10 +20,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <algorithm>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -31,13 +37,16 @@
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
 #include <openssl/evp.h>
+#include <openssl/mem.h>
 #include <openssl/obj_mac.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
 #include <ziparchive/zip_archive.h>
 
+#include "otautil/hash.h"
 #include "otautil/print_sha1.h"
 #include "private/asn1_decoder.h"
+#include "private/verifier.h"
 
 /*
  * Simple version of PKCS#7 SignedData extraction. This extracts the
@@ -59,15 +68,17 @@
  *         SET (SignerInfos)
  *           SEQUENCE (SignerInfo)
  *             INTEGER (CMSVersion)
- *             SEQUENCE (SignerIdentifier)
+ *             SEQUENCE (SignerIdentifier, IssuerAndSerialNumber as written by signapk)
  *             SEQUENCE (DigestAlgorithmIdentifier)
  *             SEQUENCE (SignatureAlgorithmIdentifier)
  *             OCTET STRING (SignatureValue)
  */
 static bool read_pkcs7(const uint8_t* pkcs7_der, size_t pkcs7_der_len,
-                       std::vector<uint8_t>* sig_der) {
+                       std::vector<uint8_t>* sig_der, std::vector<uint8_t>* signer) {
   CHECK(sig_der != nullptr);
+  CHECK(signer != nullptr);
   sig_der->clear();
+  signer->clear();
 
   asn1_context ctx(pkcs7_der, pkcs7_der_len);
 
@@ -94,8 +105,20 @@ static bool read_pkcs7(const uint8_t* pkcs7_der, size_t pkcs7_der_len,
   }
 
   std::unique_ptr<asn1_context> sig_seq(sig_set->asn1_sequence_get());
-  if (sig_seq == nullptr || !sig_seq->asn1_sequence_next() || !sig_seq->asn1_sequence_next() ||
-      !sig_seq->asn1_sequence_next() || !sig_seq->asn1_sequence_next()) {
+  if (sig_seq == nullptr || !sig_seq->asn1_sequence_next()) {
+    return false;
+  }
+
+  // The signer is only a hint of which key to try first, so it's fine not to find one.
+  asn1_context signer_id = *sig_seq;
+  const uint8_t* signer_ptr;
+  size_t signer_length;
+  if (signer_id.asn1_sequence_contents_get(&signer_ptr, &signer_length)) {
+    signer->assign(signer_ptr, signer_ptr + signer_length);
+  }
+
+  if (!sig_seq->asn1_sequence_next() || !sig_seq->asn1_sequence_next() ||
+      !sig_seq->asn1_sequence_next()) {
     return false;
   }
 
@@ -110,10 +133,11 @@ static bool read_pkcs7(const uint8_t* pkcs7_der, size_t pkcs7_der_len,
   return true;
 }
 
-int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys) {
-  CHECK(package);
-  package->SetProgress(0.0);
-
+// Reads the whole-file signature of |package| out of the archive comment, after checking that the
+// comment is where the EOCD says. Stores the PKCS#7 signature block into |signature|, and the number
+// of bytes at the start of the package that it covers into |signed_len|.
+static bool ReadSignature(VerifierInterface* package, std::vector<uint8_t>* signature,
+                          uint64_t* signed_len) {
   // An archive with a whole-file signature will end in six bytes:
   //
   //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -127,18 +151,18 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
 
   if (length < FOOTER_SIZE) {
     LOG(ERROR) << "not big enough to contain footer";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   uint8_t footer[FOOTER_SIZE];
   if (!package->ReadFullyAtOffset(footer, FOOTER_SIZE, length - FOOTER_SIZE)) {
     LOG(ERROR) << "Failed to read footer";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   if (footer[2] != 0xff || footer[3] != 0xff) {
     LOG(ERROR) << "footer is wrong";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   size_t comment_size = footer[4] + (footer[5] << 8);
@@ -149,12 +173,12 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
   if (signature_start > comment_size) {
     LOG(ERROR) << "signature start: " << signature_start
                << " is larger than comment size: " << comment_size;
-    return VERIFY_FAILURE;
+    return false;
   }
 
   if (signature_start <= FOOTER_SIZE) {
     LOG(ERROR) << "Signature start is in the footer";
-    return VERIFY_FAILURE;
+    return false;
   }
 
 #define EOCD_HEADER_SIZE 22
@@ -164,24 +188,24 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
 
   if (length < eocd_size) {
     LOG(ERROR) << "not big enough to contain EOCD";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   // Determine how much of the file is covered by the signature. This is everything except the
   // signature data and length, which includes all of the EOCD except for the comment length field
   // (2 bytes) and the comment data.
-  uint64_t signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
+  *signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-  uint8_t eocd[eocd_size];
-  if (!package->ReadFullyAtOffset(eocd, eocd_size, length - eocd_size)) {
+  std::vector<uint8_t> eocd(eocd_size);
+  if (!package->ReadFullyAtOffset(eocd.data(), eocd_size, length - eocd_size)) {
     LOG(ERROR) << "Failed to read EOCD of " << eocd_size << " bytes";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   // If this is really is the EOCD record, it will begin with the magic number $50 $4b $05 $06.
   if (eocd[0] != 0x50 || eocd[1] != 0x4b || eocd[2] != 0x05 || eocd[3] != 0x06) {
     LOG(ERROR) << "signature length doesn't match EOCD marker";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   for (size_t i = 4; i < eocd_size - 3; ++i) {
@@ -190,10 +214,53 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
       // find the later (wrong) one, which could be exploitable. Fail the verification if this
       // sequence occurs anywhere after the real one.
       LOG(ERROR) << "EOCD marker occurs after start of EOCD";
-      return VERIFY_FAILURE;
+      return false;
     }
   }
 
+  const uint8_t* signature_ptr = eocd.data() + eocd_size - signature_start;
+  size_t signature_size = signature_start - FOOTER_SIZE;
+
+  LOG(INFO) << "signature (offset: " << std::hex << (length - signature_start)
+            << ", length: " << signature_size << "): " << print_hex(signature_ptr, signature_size);
+  signature->assign(signature_ptr, signature_ptr + signature_size);
+  return true;
+}
+
+std::vector<uint8_t> GetPackageSigner(VerifierInterface* package) {
+  std::vector<uint8_t> signature;
+  uint64_t signed_len;
+  std::vector<uint8_t> sig_der;
+  std::vector<uint8_t> signer;
+  if (!ReadSignature(package, &signature, &signed_len) ||
+      !read_pkcs7(signature.data(), signature.size(), &sig_der, &signer)) {
+    return {};
+  }
+  return signer;
+}
+
+std::vector<size_t> OrderKeysBySigner(const std::vector<Certificate>& keys,
+                                      const std::vector<uint8_t>& signer) {
+  std::vector<size_t> order(keys.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (!signer.empty()) {
+    std::stable_partition(order.begin(), order.end(), [&keys, &signer](size_t i) {
+      return keys[i].issuer_and_serial == signer;
+    });
+  }
+  return order;
+}
+
+int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys) {
+  CHECK(package);
+  package->SetProgress(0.0);
+
+  std::vector<uint8_t> signature;
+  uint64_t signed_len;
+  if (!ReadSignature(package, &signature, &signed_len)) {
+    return VERIFY_FAILURE;
+  }
+
   bool need_sha1 = false;
   bool need_sha256 = false;
   for (const auto& key : keys) {
@@ -207,58 +274,51 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
     }
   }
 
-  SHA_CTX sha1_ctx;
-  SHA256_CTX sha256_ctx;
-  SHA1_Init(&sha1_ctx);
-  SHA256_Init(&sha256_ctx);
+  Hasher sha1_hasher(HashAlgorithm::kSha1);
+  Hasher sha256_hasher(HashAlgorithm::kSha256);
 
   std::vector<HasherUpdateCallback> hashers;
   if (need_sha1) {
     hashers.emplace_back(
-        std::bind(&SHA1_Update, &sha1_ctx, std::placeholders::_1, std::placeholders::_2));
+        [&sha1_hasher](const uint8_t* addr, uint64_t size) { sha1_hasher.Update(addr, size); });
   }
   if (need_sha256) {
     hashers.emplace_back(
-        std::bind(&SHA256_Update, &sha256_ctx, std::placeholders::_1, std::placeholders::_2));
+        [&sha256_hasher](const uint8_t* addr, uint64_t size) { sha256_hasher.Update(addr, size); });
   }
 
+  // The signed range is hashed in one go, so that the package keeps reading ahead of the hashing
+  // throughout.
   double frac = -1.0;
-  uint64_t so_far = 0;
-  while (so_far < signed_len) {
-    // On a Nexus 5X, experiment showed 16MiB beat 1MiB by 6% faster for a 1196MiB full OTA and
-    // 60% for an 89MiB incremental OTA. http://b/28135231.
-    uint64_t read_size = std::min<uint64_t>(signed_len - so_far, 16 * MiB);
-    package->UpdateHashAtOffset(hashers, so_far, read_size);
-    so_far += read_size;
-
+  auto progress = [package, signed_len, &frac](uint64_t so_far) {
     double f = so_far / static_cast<double>(signed_len);
-    if (f > frac + 0.02 || read_size == so_far) {
+    if (f > frac + 0.02 || so_far == signed_len) {
       package->SetProgress(f);
       frac = f;
     }
+  };
+  if (!package->UpdateHashAtOffset(hashers, 0, signed_len, progress)) {
+    LOG(ERROR) << "Failed to hash " << signed_len << " bytes of the package";
+    return VERIFY_FAILURE;
   }
 
-  uint8_t sha1[SHA_DIGEST_LENGTH];
-  SHA1_Final(sha1, &sha1_ctx);
-  uint8_t sha256[SHA256_DIGEST_LENGTH];
-  SHA256_Final(sha256, &sha256_ctx);
-
-  const uint8_t* signature = eocd + eocd_size - signature_start;
-  size_t signature_size = signature_start - FOOTER_SIZE;
-
-  LOG(INFO) << "signature (offset: " << std::hex << (length - signature_start)
-            << ", length: " << signature_size << "): " << print_hex(signature, signature_size);
+  Digest sha1_digest = sha1_hasher.Final();
+  const uint8_t* sha1 = sha1_digest.data();
+  Digest sha256_digest = sha256_hasher.Final();
+  const uint8_t* sha256 = sha256_digest.data();
 
   std::vector<uint8_t> sig_der;
-  if (!read_pkcs7(signature, signature_size, &sig_der)) {
+  std::vector<uint8_t> signer;
+  if (!read_pkcs7(signature.data(), signature.size(), &sig_der, &signer)) {
     LOG(ERROR) << "Could not find signature DER block";
     return VERIFY_FAILURE;
   }
 
   // Check to make sure at least one of the keys matches the signature. Since any key can match,
-  // we need to try each before determining a verification failure has happened.
-  size_t i = 0;
-  for (const auto& key : keys) {
+  // we need to try each before determining a verification failure has happened. The key of the
+  // certificate that the signer info names is tried first, which normally is the one that matches.
+  for (size_t i : OrderKeysBySigner(keys, signer)) {
+    const auto& key = keys[i];
     const uint8_t* hash;
     int hash_nid;
     switch (key.hash_len) {
@@ -296,7 +356,6 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
     } else {
       LOG(INFO) << "Unknown key type " << key.key_type;
     }
-    i++;
   }
 
   if (need_sha1) {
@@ -367,6 +426,35 @@ std::vector<Certificate> LoadKeysFromZipfile(const std::string& zip_name) {
   return result;
 }
 
+std::shared_ptr<const std::vector<Certificate>> LoadKeysFromZipfileCached(
+    const std::string& zip_name) {
+  // The file is parsed again if any of these change.
+  using FileId = std::tuple<dev_t, ino_t, off_t, time_t, long>;
+  static std::mutex mu;
+  static std::map<std::string, std::pair<FileId, std::shared_ptr<const std::vector<Certificate>>>>
+      cache;
+
+  struct stat sb;
+  if (stat(zip_name.c_str(), &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat " << zip_name;
+    return nullptr;
+  }
+  FileId id(sb.st_dev, sb.st_ino, sb.st_size, sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec);
+
+  std::lock_guard<std::mutex> lock(mu);
+  if (auto it = cache.find(zip_name); it != cache.end() && it->second.first == id) {
+    return it->second.second;
+  }
+
+  auto keys = std::make_shared<const std::vector<Certificate>>(LoadKeysFromZipfile(zip_name));
+  if (keys->empty()) {
+    cache.erase(zip_name);
+    return nullptr;
+  }
+  cache[zip_name] = { id, keys };
+  return keys;
+}
+
 bool CheckRSAKey(const std::unique_ptr<RSA, RSADeleter>& rsa) {
   if (!rsa) {
     return false;
@@ -439,6 +527,19 @@ bool LoadCertificateFromBuffer(const std::vector<uint8_t>& pem_content, Certific
       return false;
   }
 
+  // Matches the IssuerAndSerialNumber of the signer info, see read_pkcs7().
+  uint8_t* issuer = nullptr;
+  int issuer_length = i2d_X509_NAME(X509_get_issuer_name(x509.get()), &issuer);
+  uint8_t* serial = nullptr;
+  int serial_length = i2d_ASN1_INTEGER(X509_get_serialNumber(x509.get()), &serial);
+  cert->issuer_and_serial.clear();
+  if (issuer_length > 0 && serial_length > 0) {
+    cert->issuer_and_serial.insert(cert->issuer_and_serial.end(), issuer, issuer + issuer_length);
+    cert->issuer_and_serial.insert(cert->issuer_and_serial.end(), serial, serial + serial_length);
+  }
+  OPENSSL_free(issuer);
+  OPENSSL_free(serial);
+
   std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> public_key(X509_get_pubkey(x509.get()),
                                                                  EVP_PKEY_free);
   if (!public_key) {
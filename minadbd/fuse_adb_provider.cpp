@@ -20,12 +20,24 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <string>
+
+#include <android-base/stringprintf.h>
+
 #include "adb.h"
 #include "adb_io.h"
 
 bool FuseAdbDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                                                uint32_t start_block) const {
-  if (!WriteFdFmt(fd_, "%08u", start_block)) {
+  // The host serves one block per request, so a read of several blocks sends all their requests
+  // at once and then reads the replies back to back. This costs one round trip instead of one per
+  // block; the last (partial) block of the file is the only short reply, which always comes last.
+  uint32_t blocks = (fetch_size + fuse_block_size_ - 1) / fuse_block_size_;
+  std::string requests;
+  for (uint32_t i = 0; i < blocks; i++) {
+    requests += android::base::StringPrintf("%08u", start_block + i);
+  }
+  if (!WriteFdExactly(fd_, requests)) {
     fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
     return false;
   }
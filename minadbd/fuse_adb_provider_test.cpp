@@ -32,7 +32,7 @@ TEST(fuse_adb_provider, read_block_adb) {
   android::base::unique_fd host_socket;
 
   ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
-  FuseAdbDataProvider data(std::move(device_socket), 0, 0);
+  FuseAdbDataProvider data(std::move(device_socket), 4096, 4096);
 
   fcntl(host_socket, F_SETFL, O_NONBLOCK);
 
@@ -67,12 +67,42 @@ TEST(fuse_adb_provider, read_block_adb) {
   ASSERT_EQ(EWOULDBLOCK, errno);
 }
 
+TEST(fuse_adb_provider, read_blocks_adb) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 10, 4);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // The replies of the three blocks, the last one being partial.
+  const char expected_data[] = "abcdefghij";
+  ASSERT_TRUE(WriteFdExactly(host_socket, expected_data, strlen(expected_data)));
+
+  char block_data[sizeof(expected_data)] = {};
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data),
+                                        sizeof(expected_data) - 1, 7));
+  ASSERT_STREQ(expected_data, block_data);
+
+  // All the blocks were requested at once.
+  const char expected_requests[] = "000000070000000800000009";
+  char requests[sizeof(expected_requests)] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, requests, strlen(expected_requests)));
+  ASSERT_STREQ(expected_requests, requests);
+
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+}
+
 TEST(fuse_adb_provider, read_block_adb_fail_write) {
   android::base::unique_fd device_socket;
   android::base::unique_fd host_socket;
 
   ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
-  FuseAdbDataProvider data(std::move(device_socket), 0, 0);
+  FuseAdbDataProvider data(std::move(device_socket), 4096, 4096);
 
   host_socket.reset();
 
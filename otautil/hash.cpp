@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/hash.h"
+
+#include <algorithm>
+#include <future>
+#include <vector>
+
+// Below this much data per thread, starting the threads costs more than hashing on one core.
+static constexpr size_t kMinBytesPerThread = 256 * 1024;
+
+size_t DigestLength(HashAlgorithm algorithm) {
+  return algorithm == HashAlgorithm::kSha1 ? SHA_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
+}
+
+Hasher::Hasher(HashAlgorithm algorithm) : algorithm_(algorithm) {
+  if (algorithm_ == HashAlgorithm::kSha1) {
+    SHA1_Init(&ctx_.sha1);
+  } else {
+    SHA256_Init(&ctx_.sha256);
+  }
+}
+
+void Hasher::Update(const void* data, size_t size) {
+  if (algorithm_ == HashAlgorithm::kSha1) {
+    SHA1_Update(&ctx_.sha1, data, size);
+  } else {
+    SHA256_Update(&ctx_.sha256, data, size);
+  }
+}
+
+Digest Hasher::Final() {
+  Digest digest(DigestLength(algorithm_));
+  if (algorithm_ == HashAlgorithm::kSha1) {
+    SHA1_Final(digest.data(), &ctx_.sha1);
+  } else {
+    SHA256_Final(digest.data(), &ctx_.sha256);
+  }
+  return digest;
+}
+
+Digest ComputeHash(HashAlgorithm algorithm, const void* data, size_t size) {
+  Digest digest(DigestLength(algorithm));
+  ComputeHash(algorithm, data, size, digest.data());
+  return digest;
+}
+
+void ComputeHash(HashAlgorithm algorithm, const void* data, size_t size, uint8_t* digest) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  if (algorithm == HashAlgorithm::kSha1) {
+    SHA1(bytes, size, digest);
+  } else {
+    SHA256(bytes, size, digest);
+  }
+}
+
+void ComputeBlockHashes(HashAlgorithm algorithm, const void* data, size_t block_size, size_t blocks,
+                        uint8_t* digests, size_t threads) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  size_t digest_length = DigestLength(algorithm);
+  auto hash_blocks = [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      ComputeHash(algorithm, bytes + i * block_size, block_size, digests + i * digest_length);
+    }
+  };
+
+  size_t thread_count = std::max<size_t>(
+      std::min({ threads, blocks, blocks * block_size / kMinBytesPerThread }), 1);
+  // The blocks are of the same size, so each thread takes a contiguous share of them, and the
+  // calling thread hashes the first one.
+  size_t share = (blocks + thread_count - 1) / thread_count;
+  std::vector<std::future<void>> workers;
+  for (size_t begin = share; begin < blocks; begin += share) {
+    workers.push_back(
+        std::async(std::launch::async, hash_blocks, begin, std::min(begin + share, blocks)));
+  }
+  hash_blocks(0, std::min(share, blocks));
+  for (auto& worker : workers) {
+    worker.get();
+  }
+}
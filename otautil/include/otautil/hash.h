@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <openssl/sha.h>
+
+// The SHA-1 / SHA-256 digests used by the updater, applypatch, the installer and fuse_sideload.
+// They are computed by BoringSSL, which detects the SHA instructions of the CPU (the ARMv8 Crypto
+// Extensions, or the SHA extensions on x86) at runtime and uses them when available.
+//
+// A single SHA-1 or SHA-256 stream can't be split across cores, so only data that's hashed in
+// independent pieces, like the per-block hashes of fuse_sideload, is hashed concurrently.
+
+enum class HashAlgorithm {
+  kSha1,
+  kSha256,
+};
+
+using Digest = std::vector<uint8_t>;
+
+// Returns the length in bytes of the digests of 'algorithm'.
+size_t DigestLength(HashAlgorithm algorithm);
+
+// Hasher computes a digest incrementally, for data that isn't available in one piece.
+class Hasher {
+ public:
+  explicit Hasher(HashAlgorithm algorithm);
+
+  void Update(const void* data, size_t size);
+
+  // Returns the digest of the data so far, after which the Hasher can't be updated anymore.
+  Digest Final();
+
+ private:
+  HashAlgorithm algorithm_;
+  union {
+    SHA_CTX sha1;
+    SHA256_CTX sha256;
+  } ctx_;
+};
+
+// Returns the digest of 'size' bytes at 'data'.
+Digest ComputeHash(HashAlgorithm algorithm, const void* data, size_t size);
+
+// Writes the digest of 'size' bytes at 'data' to 'digest', which must have room for
+// DigestLength(algorithm) bytes.
+void ComputeHash(HashAlgorithm algorithm, const void* data, size_t size, uint8_t* digest);
+
+// Writes the digests of the 'blocks' blocks of 'block_size' bytes at 'data' to 'digests', one after
+// another, which must have room for blocks * DigestLength(algorithm) bytes. The blocks are split
+// among up to 'threads' threads, as long as each of them gets enough data to be worth starting.
+void ComputeBlockHashes(HashAlgorithm algorithm, const void* data, size_t block_size, size_t blocks,
+                        uint8_t* digests, size_t threads);
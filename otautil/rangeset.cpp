@@ -18,9 +18,11 @@
 
 #include <limits.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <algorithm>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -44,15 +46,36 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
   }
 }
 
+// Parses a number in a range text. Transfer lists hold many of them, so the token is copied to the
+// stack rather than into a std::string.
+static bool ParseRangeNumber(std::string_view token, size_t* value) {
+  char buf[32];
+  if (token.size() >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, token.data(), token.size());
+  buf[token.size()] = '\0';
+  return android::base::ParseUint(buf, value, static_cast<size_t>(INT_MAX));
+}
+
 RangeSet RangeSet::Parse(const std::string& range_text) {
-  std::vector<std::string> pieces = android::base::Split(range_text, ",");
-  if (pieces.size() < 3) {
+  std::string_view text(range_text);
+  size_t pieces = std::count(text.begin(), text.end(), ',') + 1;
+  if (pieces < 3) {
     LOG(ERROR) << "Invalid range text: " << range_text;
     return {};
   }
 
+  // Returns the next comma-separated token of 'text'.
+  auto next_token = [&text]() {
+    size_t comma = text.find(',');
+    std::string_view token = text.substr(0, comma);
+    text.remove_prefix(comma == std::string_view::npos ? text.size() : comma + 1);
+    return token;
+  };
+
   size_t num;
-  if (!android::base::ParseUint(pieces[0], &num, static_cast<size_t>(INT_MAX))) {
+  if (!ParseRangeNumber(next_token(), &num)) {
     LOG(ERROR) << "Failed to parse the number of tokens: " << range_text;
     return {};
   }
@@ -64,17 +87,17 @@ RangeSet RangeSet::Parse(const std::string& range_text) {
     LOG(ERROR) << "Number of tokens must be even: " << range_text;
     return {};
   }
-  if (num != pieces.size() - 1) {
+  if (num != pieces - 1) {
     LOG(ERROR) << "Mismatching number of tokens: " << range_text;
     return {};
   }
 
   std::vector<Range> pairs;
+  pairs.reserve(num / 2);
   for (size_t i = 0; i < num; i += 2) {
     size_t first;
     size_t second;
-    if (!android::base::ParseUint(pieces[i + 1], &first, static_cast<size_t>(INT_MAX)) ||
-        !android::base::ParseUint(pieces[i + 2], &second, static_cast<size_t>(INT_MAX))) {
+    if (!ParseRangeNumber(next_token(), &first) || !ParseRangeNumber(next_token(), &second)) {
       return {};
     }
     pairs.emplace_back(first, second);
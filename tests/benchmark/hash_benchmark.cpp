@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "otautil/hash.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+static std::vector<uint8_t> GenerateData(size_t size) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = static_cast<uint8_t>(i * 31 + i / kBlockSize);
+  }
+  return data;
+}
+
+// Hashes one buffer of range(0) bytes.
+static void BM_ComputeHash(benchmark::State& state, HashAlgorithm algorithm) {
+  std::vector<uint8_t> data = GenerateData(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ComputeHash(algorithm, data.data(), data.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK_CAPTURE(BM_ComputeHash, sha1, HashAlgorithm::kSha1)->Range(kBlockSize, 64 << 20);
+BENCHMARK_CAPTURE(BM_ComputeHash, sha256, HashAlgorithm::kSha256)->Range(kBlockSize, 64 << 20);
+
+// Hashes 64 MiB of data in 4 KiB blocks, like the per-block hashes of fuse_sideload and the
+// updater.
+static void BM_ComputeBlockHash(benchmark::State& state, HashAlgorithm algorithm) {
+  std::vector<uint8_t> data = GenerateData(64 << 20);
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  for (auto _ : state) {
+    for (size_t offset = 0; offset < data.size(); offset += kBlockSize) {
+      ComputeHash(algorithm, data.data() + offset, kBlockSize, digest);
+      benchmark::DoNotOptimize(digest);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK_CAPTURE(BM_ComputeBlockHash, sha1, HashAlgorithm::kSha1);
+BENCHMARK_CAPTURE(BM_ComputeBlockHash, sha256, HashAlgorithm::kSha256);
+
+// Hashes the 4 KiB blocks of a 1 MiB run, the largest fetch of fuse_sideload, on range(0) threads.
+static void BM_ComputeBlockHashes(benchmark::State& state, HashAlgorithm algorithm) {
+  std::vector<uint8_t> data = GenerateData(1 << 20);
+  size_t blocks = data.size() / kBlockSize;
+  std::vector<uint8_t> digests(blocks * DigestLength(algorithm));
+  for (auto _ : state) {
+    ComputeBlockHashes(algorithm, data.data(), kBlockSize, blocks, digests.data(), state.range(0));
+    benchmark::DoNotOptimize(digests.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK_CAPTURE(BM_ComputeBlockHashes, sha1, HashAlgorithm::kSha1)
+    ->RangeMultiplier(2)
+    ->Range(1, 4);
+BENCHMARK_CAPTURE(BM_ComputeBlockHashes, sha256, HashAlgorithm::kSha256)
+    ->RangeMultiplier(2)
+    ->Range(1, 4);
+
+BENCHMARK_MAIN();
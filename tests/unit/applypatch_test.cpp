@@ -27,6 +27,7 @@
 #include <algorithm>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <android-base/file.h>
@@ -154,6 +155,31 @@ TEST_F(ApplyPatchTest, PatchPartitionWithoutBonusFile) {
   ASSERT_TRUE(PatchPartition(target_partition, source_partition, patch, nullptr, false));
 }
 
+// Tests applying a patch from a non-owning view of the patch data, which is how block-based
+// updates read patches from the mmapped package.
+TEST_F(ApplyPatchTest, ApplyImagePatch_StringView) {
+  FileContents source_fc;
+  ASSERT_TRUE(LoadFileContents(source_file, &source_fc));
+  FileContents patch_fc;
+  ASSERT_TRUE(LoadFileContents(from_testdata_base("recovery-from-boot-with-bonus.p"), &patch_fc));
+  std::string_view patch(reinterpret_cast<const char*>(patch_fc.data.data()), patch_fc.data.size());
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  size_t written = 0;
+  auto sink = [&ctx, &written](const unsigned char* data, size_t len) {
+    SHA1_Update(&ctx, data, len);
+    written += len;
+    return len;
+  };
+  ASSERT_EQ(0, ApplyImagePatch(source_fc.data.data(), source_fc.data.size(), patch, sink, nullptr));
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  ASSERT_EQ(target_size, written);
+  ASSERT_EQ(target_sha1, print_sha1(digest));
+}
+
 class FreeCacheTest : public ::testing::Test {
  protected:
   static constexpr size_t PARTITION_SIZE = 4096 * 10;
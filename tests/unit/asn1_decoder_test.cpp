@@ -199,3 +199,21 @@ TEST(Asn1DecoderTest, OctetStringGet_Success) {
   ASSERT_EQ(1U, length);
   ASSERT_EQ(0xAAU, *string);
 }
+
+TEST(Asn1DecoderTest, SequenceContentsGet_TooSmall_Failure) {
+  uint8_t data[] = { 0x30, 0x02, 0xAA };
+  asn1_context ctx(data, sizeof(data));
+  const uint8_t* contents;
+  size_t length;
+  ASSERT_FALSE(ctx.asn1_sequence_contents_get(&contents, &length));
+}
+
+TEST(Asn1DecoderTest, SequenceContentsGet_Success) {
+  uint8_t data[] = { 0x30, 0x03, 0x02, 0x01, 0x01, 0x04 };
+  asn1_context ctx(data, sizeof(data));
+  const uint8_t* contents;
+  size_t length;
+  ASSERT_TRUE(ctx.asn1_sequence_contents_get(&contents, &length));
+  ASSERT_EQ(3U, length);
+  ASSERT_EQ(data + 2, contents);
+}
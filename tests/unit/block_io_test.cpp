@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "otautil/rangeset.h"
+#include "private/block_io.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+class BlockIoTest : public ::testing::TestWithParam<BlockIo::Backend> {
+ protected:
+  void SetUp() override {
+    // Fill the image with a distinct byte per block.
+    for (size_t i = 0; i < kBlocks; i++) {
+      image_.append(kBlockSize, static_cast<char>('a' + i));
+    }
+    ASSERT_TRUE(android::base::WriteStringToFd(image_, image_file_.fd));
+    io_ = BlockIo::Create(image_file_.fd, kBlockSize, GetParam());
+    ASSERT_NE(nullptr, io_);
+  }
+
+  static constexpr size_t kBlocks = 16;
+
+  TemporaryFile image_file_;
+  std::string image_;
+  std::unique_ptr<BlockIo> io_;
+};
+
+TEST_P(BlockIoTest, Read) {
+  RangeSet ranges = RangeSet::Parse("6,9,10,0,2,14,15");
+  ASSERT_TRUE(static_cast<bool>(ranges));
+
+  std::vector<uint8_t> buffer(ranges.blocks() * kBlockSize);
+  ASSERT_TRUE(io_->Read(ranges, buffer.data()));
+
+  std::string expected = image_.substr(9 * kBlockSize, kBlockSize) +
+                         image_.substr(0, 2 * kBlockSize) +
+                         image_.substr(14 * kBlockSize, kBlockSize);
+  ASSERT_EQ(expected, std::string(buffer.begin(), buffer.end()));
+
+  // The file offset is left untouched.
+  ASSERT_EQ(static_cast<off64_t>(image_.size()), lseek64(image_file_.fd, 0, SEEK_CUR));
+}
+
+TEST_P(BlockIoTest, Read_PastEnd) {
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  ASSERT_FALSE(io_->Read(RangeSet({ { kBlocks - 1, kBlocks + 1 } }), buffer.data()));
+}
+
+TEST_P(BlockIoTest, Write) {
+  RangeSet ranges = RangeSet::Parse("4,12,13,3,5");
+  ASSERT_TRUE(static_cast<bool>(ranges));
+
+  std::string data = std::string(kBlockSize, 'x') + std::string(2 * kBlockSize, 'y');
+  ASSERT_TRUE(io_->Write(ranges, reinterpret_cast<const uint8_t*>(data.data())));
+
+  image_.replace(12 * kBlockSize, kBlockSize, kBlockSize, 'x');
+  image_.replace(3 * kBlockSize, 2 * kBlockSize, 2 * kBlockSize, 'y');
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_.path, &content));
+  ASSERT_EQ(image_, content);
+}
+
+TEST_P(BlockIoTest, AdjacentRanges) {
+  // Adjacent ranges are transferred together.
+  RangeSet ranges = RangeSet::Parse("6,2,4,4,6,10,11");
+  ASSERT_TRUE(static_cast<bool>(ranges));
+
+  std::vector<uint8_t> buffer(ranges.blocks() * kBlockSize);
+  ASSERT_TRUE(io_->Read(ranges, buffer.data()));
+  std::string expected =
+      image_.substr(2 * kBlockSize, 4 * kBlockSize) + image_.substr(10 * kBlockSize, kBlockSize);
+  ASSERT_EQ(expected, std::string(buffer.begin(), buffer.end()));
+
+  std::string data = std::string(3 * kBlockSize, 'x') + std::string(2 * kBlockSize, 'y');
+  ASSERT_TRUE(io_->Write(ranges, reinterpret_cast<const uint8_t*>(data.data())));
+  image_.replace(2 * kBlockSize, 4 * kBlockSize, data.substr(0, 4 * kBlockSize));
+  image_.replace(10 * kBlockSize, kBlockSize, data.substr(4 * kBlockSize));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_.path, &content));
+  ASSERT_EQ(image_, content);
+}
+
+TEST_P(BlockIoTest, ManyRanges) {
+  // More ranges than the io_uring backend keeps in flight at a time.
+  std::vector<Range> pairs;
+  for (size_t i = 0; i < 200; i++) {
+    pairs.emplace_back(i % kBlocks, i % kBlocks + 1);
+  }
+  RangeSet ranges(std::move(pairs));
+
+  std::vector<uint8_t> buffer(ranges.blocks() * kBlockSize);
+  ASSERT_TRUE(io_->Read(ranges, buffer.data()));
+  for (size_t i = 0; i < 200; i++) {
+    ASSERT_EQ(static_cast<uint8_t>('a' + i % kBlocks), buffer[i * kBlockSize]);
+  }
+}
+
+TEST_P(BlockIoTest, Zero) {
+  RangeSet ranges = RangeSet::Parse("4,1,3,7,8");
+  ASSERT_TRUE(static_cast<bool>(ranges));
+  ASSERT_TRUE(io_->Zero(ranges));
+
+  image_.replace(1 * kBlockSize, 2 * kBlockSize, 2 * kBlockSize, '\0');
+  image_.replace(7 * kBlockSize, kBlockSize, kBlockSize, '\0');
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_.path, &content));
+  ASSERT_EQ(image_, content);
+}
+
+TEST_P(BlockIoTest, Zero_ExtendsFile) {
+  ASSERT_TRUE(io_->Zero(RangeSet({ { kBlocks - 1, kBlocks + 2 } })));
+
+  image_.replace((kBlocks - 1) * kBlockSize, kBlockSize, kBlockSize, '\0');
+  image_.append(2 * kBlockSize, '\0');
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_.path, &content));
+  ASSERT_EQ(image_, content);
+}
+
+INSTANTIATE_TEST_CASE_P(Backends, BlockIoTest,
+                        ::testing::Values(BlockIo::Backend::kPread, BlockIo::Backend::kIoUring));
@@ -552,3 +552,195 @@ TEST(TransferListTest, Parse_ZeroTotalBlocks) {
   ASSERT_EQ(0, transfer_list.stash_max_blocks());
   ASSERT_TRUE(transfer_list.commands().empty());
 }
+
+TEST(CompactTransferListTest, Parse) {
+  std::vector<std::string> input_lines{
+    "4",  // version
+    "6",  // total blocks
+    "1",  // max stashed entries
+    "1",  // max stashed blocks
+    "stash 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,0,1",
+    "",
+    "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,0,1 1 2,0,1",
+    "bsdiff 0 10 2ae8b8c9e1d1c7f5c0a6c4a1e7e4c0a5f2b1d3e4 "
+    "6f1c2b3a4d5e6f708192a3b4c5d6e7f8091a2b3c 2,2,4 1 - "
+    "1d74d1a60332fd38cf9405f1bae67917888da6cb:2,0,1",
+    "free 1d74d1a60332fd38cf9405f1bae67917888da6cb",
+    "zero 4,4,5,8,9",
+    "invalid 2,0,1",
+    "",
+  };
+
+  std::string text = android::base::Join(input_lines, '\n');
+  auto transfer_list = CompactTransferList::Parse(std::string(text));
+  ASSERT_NE(nullptr, transfer_list);
+  ASSERT_EQ(text, transfer_list->text());
+  ASSERT_EQ(input_lines.size(), transfer_list->line_count());
+  ASSERT_EQ("4", transfer_list->line(0));
+  ASSERT_EQ(input_lines.size() - TransferList::kTransferListHeaderLines, transfer_list->size());
+
+  ASSERT_EQ(Command::Type::STASH, transfer_list->type(0));
+  ASSERT_EQ(input_lines[4], transfer_list->cmdline(0));
+  auto reads = transfer_list->reads(0);
+  ASSERT_EQ((std::vector<Range>{ { 0, 1 } }), std::vector<Range>(reads.begin(), reads.end()));
+  ASSERT_TRUE(transfer_list->writes(0).empty());
+
+  ASSERT_EQ(Command::Type::LAST, transfer_list->type(1));
+  ASSERT_TRUE(transfer_list->cmdline(1).empty());
+
+  ASSERT_EQ(Command::Type::MOVE, transfer_list->type(2));
+  ASSERT_TRUE(transfer_list->overlaps(2));
+  ASSERT_TRUE(transfer_list->stash_ids(2).empty());
+
+  ASSERT_EQ(Command::Type::BSDIFF, transfer_list->type(3));
+  ASSERT_FALSE(transfer_list->overlaps(3));
+  ASSERT_TRUE(transfer_list->reads(3).empty());
+  auto writes = transfer_list->writes(3);
+  ASSERT_EQ((std::vector<Range>{ { 2, 4 } }), std::vector<Range>(writes.begin(), writes.end()));
+  auto stash_ids = transfer_list->stash_ids(3);
+  ASSERT_EQ(1U, stash_ids.size());
+  ASSERT_EQ("1d74d1a60332fd38cf9405f1bae67917888da6cb", *stash_ids.begin());
+
+  ASSERT_EQ(Command::Type::FREE, transfer_list->type(4));
+  ASSERT_TRUE(transfer_list->reads(4).empty());
+  ASSERT_TRUE(transfer_list->writes(4).empty());
+
+  ASSERT_EQ(Command::Type::ZERO, transfer_list->type(5));
+  writes = transfer_list->writes(5);
+  ASSERT_EQ((std::vector<Range>{ { 4, 5 }, { 8, 9 } }),
+            std::vector<Range>(writes.begin(), writes.end()));
+
+  // Invalid commands are kept for the caller to report.
+  ASSERT_EQ(Command::Type::LAST, transfer_list->type(6));
+  ASSERT_EQ("invalid 2,0,1", transfer_list->cmdline(6));
+  ASSERT_TRUE(transfer_list->cmdline(7).empty());
+}
+
+TEST(CompactTransferListTest, Parse_TooFewLines) {
+  ASSERT_EQ(nullptr, CompactTransferList::Parse("4\n0\n0"));
+  ASSERT_NE(nullptr, CompactTransferList::Parse("4\n0\n0\n0"));
+}
+
+TEST(CompactTransferListTest, GetCommand) {
+  Command::abort_allowed_ = true;
+
+  std::vector<std::string> input_lines{
+    "4",  // version
+    "2",  // total blocks
+    "1",  // max stashed entries
+    "1",  // max stashed blocks
+    "stash 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,0,1",
+    "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,0,1 1 2,0,1",
+    "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,5,8 3 2,0,2 4,0,1,2,3 "
+    "e4ff8e1b4b0e3e7a0b4e2bd1fa2e28d0a1fd6a2b:2,1,2",
+    "bsdiff 0 10 2ae8b8c9e1d1c7f5c0a6c4a1e7e4c0a5f2b1d3e4 "
+    "6f1c2b3a4d5e6f708192a3b4c5d6e7f8091a2b3c 2,2,4 1 - "
+    "1d74d1a60332fd38cf9405f1bae67917888da6cb:2,0,1",
+    "imgdiff 10 20 2ae8b8c9e1d1c7f5c0a6c4a1e7e4c0a5f2b1d3e4 "
+    "6f1c2b3a4d5e6f708192a3b4c5d6e7f8091a2b3c 2,4,6 2 2,6,8",
+    "free 1d74d1a60332fd38cf9405f1bae67917888da6cb",
+    "zero 4,4,5,8,9",
+    "new 2,9,10",
+    "erase 2,10,12",
+    "compute_hash_tree 2,0,1 2,3,4 sha1 unknown-salt unknown-root-hash",
+    "abort",
+    "",
+    "invalid 2,0,1",
+    "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,0,1",
+  };
+
+  auto transfer_list =
+      CompactTransferList::Parse(android::base::Join(input_lines, '\n'));
+  ASSERT_NE(nullptr, transfer_list);
+  ASSERT_EQ(input_lines.size() - TransferList::kTransferListHeaderLines, transfer_list->size());
+
+  for (size_t i = 0; i < transfer_list->size(); i++) {
+    const std::string& line = input_lines[i + TransferList::kTransferListHeaderLines];
+    SCOPED_TRACE(line);
+    std::string err;
+    Command expected = Command::Parse(line, i, &err);
+    Command command = transfer_list->GetCommand(i);
+    ASSERT_EQ(static_cast<bool>(expected), static_cast<bool>(command));
+    if (!expected) {
+      continue;
+    }
+
+    ASSERT_EQ(expected.type(), command.type());
+    ASSERT_EQ(expected.index(), command.index());
+    ASSERT_EQ(expected.cmdline(), command.cmdline());
+    ASSERT_EQ(expected.patch(), command.patch());
+    ASSERT_EQ(expected.target(), command.target());
+    ASSERT_EQ(expected.source(), command.source());
+    ASSERT_EQ(expected.stash(), command.stash());
+    ASSERT_EQ(expected.hash_tree_info(), command.hash_tree_info());
+  }
+}
+
+TEST(CommandDependenciesTest, IndependentCommands) {
+  std::vector<Command> commands;
+  std::string err;
+  for (const auto& line : {
+           "bsdiff 0 100 d2c1b4e6fe2a3d10a8a7d4a5c0a4b0a5e3c0d7a1 "
+           "0f5c9d1a1d0c1a3f43a0bb1a7a5d2d9c8c1e6d0b 2,10,12 2 2,0,2",
+           "bsdiff 100 50 a1b2c3d4e5f60718293a4b5c6d7e8f9011223344 "
+           "55667788990011223344556677889900aabbccdd 2,12,13 1 2,2,3",
+           "zero 2,20,30",
+       }) {
+    commands.push_back(Command::Parse(line, commands.size(), &err));
+    ASSERT_TRUE(static_cast<bool>(commands.back())) << err;
+  }
+
+  std::vector<std::vector<size_t>> dependencies = BuildCommandDependencies(commands);
+  ASSERT_EQ(3U, dependencies.size());
+  for (const auto& dependency : dependencies) {
+    ASSERT_TRUE(dependency.empty());
+  }
+}
+
+TEST(CommandDependenciesTest, OverlappingBlocks) {
+  std::vector<Command> commands;
+  std::string err;
+  for (const auto& line : {
+           // Writes blocks 10-11.
+           "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,10,12 2 2,0,2",
+           // Reads block 11, which is written by command 0.
+           "move 1d74d1a60332fd38cf9405f1bae67917888da6cb 2,20,21 1 2,11,12",
+           // Writes block 0, which is read by command 0.
+           "zero 2,0,1",
+           // Writes blocks 20-21, which overlap with the target of command 1.
+           "new 2,20,22",
+       }) {
+    commands.push_back(Command::Parse(line, commands.size(), &err));
+    ASSERT_TRUE(static_cast<bool>(commands.back())) << err;
+  }
+
+  std::vector<std::vector<size_t>> dependencies = BuildCommandDependencies(commands);
+  ASSERT_EQ(4U, dependencies.size());
+  ASSERT_TRUE(dependencies[0].empty());
+  ASSERT_EQ(std::vector<size_t>{ 0 }, dependencies[1]);
+  ASSERT_EQ(std::vector<size_t>{ 0 }, dependencies[2]);
+  ASSERT_EQ(std::vector<size_t>{ 1 }, dependencies[3]);
+}
+
+TEST(CommandDependenciesTest, Stashes) {
+  const std::string stash_id = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  const std::vector<std::string> lines{
+    "stash " + stash_id + " 2,0,1",
+    "move " + stash_id + " 2,10,11 1 - " + stash_id + ":2,0,1",
+    "zero 2,30,31",
+    "free " + stash_id,
+  };
+  std::vector<Command> commands;
+  std::string err;
+  for (const auto& line : lines) {
+    commands.push_back(Command::Parse(line, commands.size(), &err));
+    ASSERT_TRUE(static_cast<bool>(commands.back())) << err;
+  }
+
+  std::vector<std::vector<size_t>> dependencies = BuildCommandDependencies(commands);
+  ASSERT_EQ(4U, dependencies.size());
+  ASSERT_TRUE(dependencies[0].empty());
+  ASSERT_EQ(std::vector<size_t>{ 0 }, dependencies[1]);
+  ASSERT_TRUE(dependencies[2].empty());
+  ASSERT_EQ((std::vector<size_t>{ 0, 1 }), dependencies[3]);
+}
@@ -14,16 +14,21 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
+#include "fuse_block_cache.h"
 #include "fuse_provider.h"
 #include "fuse_sideload.h"
 
@@ -31,6 +36,51 @@ TEST(SideloadTest, fuse_device) {
   ASSERT_EQ(0, access("/dev/fuse", R_OK | W_OK));
 }
 
+TEST(SideloadTest, FuseBlockCache) {
+  static constexpr uint32_t kBlockSize = 4096;
+  auto cache = FuseBlockCache::Create(3, kBlockSize);
+  ASSERT_NE(nullptr, cache);
+  ASSERT_EQ(3u, cache->capacity());
+
+  auto block = [](char c) { return std::vector<uint8_t>(kBlockSize, static_cast<uint8_t>(c)); };
+  for (uint32_t i = 0; i < 3; i++) {
+    cache->Enter(i, block('a' + i).data());
+  }
+  ASSERT_EQ(3u, cache->size());
+
+  // A hit moves block 0 to the front, so block 1 is now the least recently used one.
+  std::vector<uint8_t> data(kBlockSize);
+  ASSERT_TRUE(cache->Fetch(0, data.data()));
+  ASSERT_EQ(block('a'), data);
+  ASSERT_EQ(1u, cache->hits());
+
+  // The cache stays at its capacity, evicting in LRU order.
+  cache->Enter(3, block('d').data());
+  ASSERT_EQ(3u, cache->size());
+  ASSERT_FALSE(cache->Contains(1));
+  ASSERT_FALSE(cache->Fetch(1, data.data()));
+  cache->Enter(4, block('e').data());
+  ASSERT_EQ(3u, cache->size());
+  ASSERT_FALSE(cache->Contains(2));
+  ASSERT_EQ(2u, cache->evictions());
+
+  // The remaining blocks kept their own contents when the slots were reused.
+  for (const auto& [i, c] : std::vector<std::pair<uint32_t, char>>{ { 0, 'a' }, { 3, 'd' },
+                                                                   { 4, 'e' } }) {
+    ASSERT_TRUE(cache->Fetch(i, data.data())) << i;
+    ASSERT_EQ(block(c), data) << i;
+  }
+
+  // Block 0 was fetched least recently, and goes next.
+  cache->Enter(5, block('f').data());
+  ASSERT_FALSE(cache->Contains(0));
+  ASSERT_TRUE(cache->Contains(3));
+  ASSERT_TRUE(cache->Contains(4));
+  ASSERT_TRUE(cache->Contains(5));
+
+  ASSERT_EQ(nullptr, FuseBlockCache::Create(0, kBlockSize));
+}
+
 class FuseTestDataProvider : public FuseDataProvider {
  public:
   FuseTestDataProvider(uint64_t file_size, uint32_t block_size)
@@ -46,6 +96,69 @@ class FuseTestDataProvider : public FuseDataProvider {
   }
 };
 
+// Logs the blocks of each read to a file, which can be checked from outside of the process running
+// run_fuse_sideload().
+class FuseLoggingDataProvider : public FuseFileDataProvider {
+ public:
+  FuseLoggingDataProvider(const std::string& path, uint32_t block_size, std::string log_path)
+      : FuseFileDataProvider(path, block_size), log_path_(std::move(log_path)) {}
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override {
+    uint32_t blocks = (fetch_size + fuse_block_size_ - 1) / fuse_block_size_;
+    android::base::unique_fd log_fd(open(log_path_.c_str(), O_WRONLY | O_APPEND));
+    if (!android::base::WriteStringToFd(
+            std::to_string(start_block) + " " + std::to_string(blocks) + "\n", log_fd)) {
+      return false;
+    }
+    return FuseFileDataProvider::ReadBlockAlignedData(buffer, fetch_size, start_block);
+  }
+
+ private:
+  std::string log_path_;
+};
+
+// Runs run_fuse_sideload() with |provider| in a child process, and waits for the package to show up
+// under |mount_point|.
+static void StartFuseSideload(std::unique_ptr<FuseDataProvider>&& provider,
+                              const char* mount_point, pid_t* pid) {
+  *pid = fork();
+  if (*pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  int status;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    ASSERT_NE(-1, waitpid(*pid, &status, WNOHANG));
+
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+}
+
+// Tells the run_fuse_sideload() child process to exit, and checks that it exits successfully.
+static void StopFuseSideload(const char* mount_point, pid_t pid) {
+  std::string exit_flag = std::string(mount_point) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+
+  int status;
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(0, WEXITSTATUS(status));
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+}
+
 TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   auto provider_small_block = std::make_unique<FuseTestDataProvider>(4096, 4095);
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_small_block)));
@@ -54,7 +167,7 @@ TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_large_block)));
 
   auto provider_too_many_blocks =
-      std::make_unique<FuseTestDataProvider>(((1 << 18) + 1) * 4096, 4096);
+      std::make_unique<FuseTestDataProvider>((static_cast<uint64_t>(UINT32_MAX) + 1) * 4096, 4096);
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_too_many_blocks)));
 }
 
@@ -74,39 +187,172 @@ TEST(SideloadTest, run_fuse_sideload) {
   auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
   ASSERT_TRUE(provider->Valid());
   TemporaryDir mount_point;
-  pid_t pid = fork();
-  if (pid == 0) {
-    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point.path));
-    _exit(EXIT_SUCCESS);
-  }
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, &pid));
 
   std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
-  int status;
-  static constexpr int kSideloadInstallTimeout = 10;
-  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
-    ASSERT_NE(-1, waitpid(pid, &status, WNOHANG));
+  std::string content_via_fuse;
+  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+  ASSERT_EQ(content, content_via_fuse);
 
-    struct stat sb;
-    if (stat(package.c_str(), &sb) == 0) {
-      break;
-    }
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
 
-    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
-      sleep(1);
-      continue;
-    }
-    FAIL() << "Timed out waiting for the fuse-provided package.";
+TEST(SideloadTest, run_fuse_sideload_multi_block_reads) {
+  std::string content;
+  for (size_t i = 0; i < 100 * 4096 + 1000; i++) {
+    content.push_back(static_cast<char>(i * 7 + i / 4096));
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, &pid));
+
+  // Reads that span many blocks, aligned or not, and that go past the end of the file. Direct I/O
+  // gets them to the daemon as is instead of through the page cache.
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY | O_DIRECT));
+  if (fd == -1) {
+    fd.reset(open(package.c_str(), O_RDONLY));
   }
+  ASSERT_NE(-1, fd);
+  const std::vector<std::pair<off_t, size_t>> reads = {
+    { 0, 65536 }, { 1000, 70000 }, { 4095, 4097 }, { 90 * 4096, 65536 }, { 0, content.size() },
+  };
+  for (const auto& [offset, size] : reads) {
+    std::string buffer(size, '\0');
+    size_t expected = std::min(size, content.size() - offset);
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), expected, offset));
+    buffer.resize(expected);
+    ASSERT_EQ(content.substr(offset, expected), buffer) << offset << " " << size;
+  }
+  fd.reset();
 
   std::string content_via_fuse;
   ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
   ASSERT_EQ(content, content_via_fuse);
 
-  std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
-  struct stat sb;
-  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
 
-  waitpid(pid, &status, 0);
-  ASSERT_EQ(0, WEXITSTATUS(status));
-  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+TEST(SideloadTest, run_fuse_sideload_reread_blocks) {
+  std::string content;
+  for (size_t i = 0; i < 8 * 4096; i++) {
+    content.push_back(static_cast<char>(i * 11 + i / 4096));
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, &pid));
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY | O_DIRECT));
+  if (fd == -1) {
+    ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+    GTEST_SKIP() << "Direct I/O isn't supported";
+  }
+  // Blocks [0, 1], then block 1 alone, which starts with the last block of the previous read, then
+  // block 0 again.
+  const std::vector<std::pair<off_t, size_t>> reads = {
+    { 0, 8192 }, { 4096, 4096 }, { 0, 4096 }, { 4096, 8192 }, { 8192, 4096 }, { 4096, 4096 },
+  };
+  for (const auto& [offset, size] : reads) {
+    std::string buffer(size, '\0');
+    EXPECT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), size, offset));
+    EXPECT_EQ(content.substr(offset, size), buffer) << offset << " " << size;
+  }
+  fd.reset();
+
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
+
+TEST(SideloadTest, run_fuse_sideload_prefetch) {
+  std::string content;
+  for (size_t i = 0; i < 64 * 4096; i++) {
+    content.push_back(static_cast<char>(i * 13 + i / 4096));
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  TemporaryFile log_file;
+
+  auto provider = std::make_unique<FuseLoggingDataProvider>(temp_file.path, 4096, log_file.path);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, &pid));
+
+  // Read the package a block at a time.
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY | O_DIRECT));
+  if (fd == -1) {
+    ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+    GTEST_SKIP() << "Direct I/O isn't supported";
+  }
+  std::string content_via_fuse(content.size(), '\0');
+  for (size_t offset = 0; offset < content.size(); offset += 4096) {
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, &content_via_fuse[offset], 4096, offset));
+  }
+  fd.reset();
+  ASSERT_EQ(content, content_via_fuse);
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+
+  // The blocks ahead of the reads were fetched together, and no block was fetched twice.
+  std::string log;
+  ASSERT_TRUE(android::base::ReadFileToString(log_file.path, &log));
+  std::vector<bool> fetched(64);
+  size_t multi_block_fetches = 0;
+  for (const auto& line : android::base::Split(android::base::Trim(log), "\n")) {
+    std::vector<std::string> fields = android::base::Split(line, " ");
+    ASSERT_EQ(2u, fields.size());
+    size_t start = std::stoul(fields[0]);
+    size_t blocks = std::stoul(fields[1]);
+    for (size_t i = start; i < start + blocks; i++) {
+      ASSERT_FALSE(fetched[i]) << i;
+      fetched[i] = true;
+    }
+    if (blocks > 1) {
+      multi_block_fetches++;
+    }
+  }
+  ASSERT_NE(0u, multi_block_fetches);
+}
+
+TEST(SideloadTest, run_fuse_sideload_many_blocks) {
+  // A sparse file of more than 1 << 18 blocks, with some data in its last blocks.
+  static constexpr uint64_t kFileSize = ((1 << 18) + 10) * 4096ULL;
+  const std::string tail = std::string(4096, 'a') + std::string(4096, 'b') + std::string(100, 'c');
+  TemporaryFile temp_file;
+  ASSERT_EQ(0, ftruncate(temp_file.fd, kFileSize));
+  ASSERT_TRUE(android::base::WriteFullyAtOffset(temp_file.fd, tail.data(), tail.size(),
+                                                kFileSize - tail.size()));
+
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, &pid));
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, fd);
+  std::string buffer(tail.size(), '\0');
+  ASSERT_TRUE(
+      android::base::ReadFullyAtOffset(fd, buffer.data(), buffer.size(), kFileSize - tail.size()));
+  ASSERT_EQ(tail, buffer);
+  ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), 4096, 0));
+  ASSERT_EQ(std::string(4096, '\0'), buffer.substr(0, 4096));
+  fd.reset();
+
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
 }
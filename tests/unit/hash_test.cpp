@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "otautil/hash.h"
+#include "otautil/print_sha1.h"
+
+static std::string Hex(const Digest& digest) {
+  return print_hex(digest.data(), digest.size());
+}
+
+TEST(HashTest, ComputeHash) {
+  std::string data = "abc";
+  ASSERT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d",
+            Hex(ComputeHash(HashAlgorithm::kSha1, data.data(), data.size())));
+  ASSERT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+            Hex(ComputeHash(HashAlgorithm::kSha256, data.data(), data.size())));
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  ComputeHash(HashAlgorithm::kSha256, data.data(), data.size(), digest);
+  ASSERT_EQ(ComputeHash(HashAlgorithm::kSha256, data.data(), data.size()),
+            Digest(digest, digest + sizeof(digest)));
+}
+
+TEST(HashTest, Hasher) {
+  std::string data(10000, 'x');
+  for (auto algorithm : { HashAlgorithm::kSha1, HashAlgorithm::kSha256 }) {
+    Hasher hasher(algorithm);
+    hasher.Update(data.data(), 1234);
+    hasher.Update(data.data() + 1234, data.size() - 1234);
+    Digest digest = hasher.Final();
+    ASSERT_EQ(DigestLength(algorithm), digest.size());
+    ASSERT_EQ(ComputeHash(algorithm, data.data(), data.size()), digest);
+  }
+}
+
+TEST(HashTest, ComputeBlockHashes) {
+  static constexpr size_t kBlockSize = 4096;
+  static constexpr size_t kBlocks = 300;
+  std::vector<uint8_t> data(kBlocks * kBlockSize);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 31 + i / kBlockSize);
+  }
+
+  // On one thread, on as many as there's data for, and on more threads than blocks.
+  for (auto algorithm : { HashAlgorithm::kSha1, HashAlgorithm::kSha256 }) {
+    size_t length = DigestLength(algorithm);
+    for (size_t blocks : { size_t{ 1 }, size_t{ 7 }, kBlocks }) {
+      for (size_t threads : { 1, 3, 4, 1000 }) {
+        std::vector<uint8_t> digests(blocks * length);
+        ComputeBlockHashes(algorithm, data.data(), kBlockSize, blocks, digests.data(), threads);
+        for (size_t i = 0; i < blocks; i++) {
+          ASSERT_EQ(ComputeHash(algorithm, data.data() + i * kBlockSize, kBlockSize),
+                    Digest(digests.begin() + i * length, digests.begin() + (i + 1) * length))
+              << blocks << " " << threads << " " << i;
+        }
+      }
+    }
+  }
+}
@@ -14,9 +14,15 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <limits>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -25,7 +31,9 @@
 #include <android-base/memory.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <applypatch/applypatch.h>
 #include <applypatch/imgdiff.h>
+#include <applypatch/imgdiff_cache.h>
 #include <applypatch/imgdiff_image.h>
 #include <applypatch/imgpatch.h>
 #include <gtest/gtest.h>
@@ -80,20 +88,22 @@ static void verify_patch_header(const std::string& patch, size_t* num_normal, si
   if (num_deflate != nullptr) *num_deflate = deflate;
 }
 
-static void GenerateTarget(const std::string& src, const std::string& patch, std::string* patched) {
+static void GenerateTarget(const std::string& src, const std::string& patch, std::string* patched,
+                           const ImagePatchOptions& options = {}) {
   patched->clear();
-  ASSERT_EQ(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
-                               reinterpret_cast<const unsigned char*>(patch.data()), patch.size(),
-                               [&](const unsigned char* data, size_t len) {
-                                 patched->append(reinterpret_cast<const char*>(data), len);
-                                 return len;
-                               }));
+  ASSERT_EQ(0, ApplyImagePatch(
+                   reinterpret_cast<const unsigned char*>(src.data()), src.size(), patch,
+                   [&](const unsigned char* data, size_t len) {
+                     patched->append(reinterpret_cast<const char*>(data), len);
+                     return len;
+                   },
+                   nullptr, options));
 }
 
 static void verify_patched_image(const std::string& src, const std::string& patch,
-                                 const std::string& tgt) {
+                                 const std::string& tgt, const ImagePatchOptions& options = {}) {
   std::string patched;
-  GenerateTarget(src, patch, &patched);
+  GenerateTarget(src, patch, &patched, options);
   ASSERT_EQ(tgt, patched);
 }
 
@@ -248,6 +258,231 @@ TEST(ImgdiffTest, zip_mode_smoke_compressed) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_threads) {
+  // Deflated entries that are patched against their source entries, and stored ones that are
+  // patched against the whole source zip.
+  std::vector<std::string> contents;
+  for (size_t i = 0; i < 6; i++) {
+    std::string data;
+    generate_n(back_inserter(data), 4096 * (i + 1), []() { return rand() % 256; });
+    contents.push_back(data);
+  }
+
+  auto write_zip = [&contents](FILE* fp, const std::string& suffix) {
+    ZipWriter writer(fp);
+    for (size_t i = 0; i < contents.size(); i++) {
+      std::string name = "file" + std::to_string(i);
+      ASSERT_EQ(0, writer.StartEntry(name.c_str(), (i % 2 == 0) ? ZipWriter::kCompress : 0));
+      std::string data = contents[i] + suffix;
+      ASSERT_EQ(0, writer.WriteBytes(data.data(), data.size()));
+      ASSERT_EQ(0, writer.FinishEntry());
+    }
+    ASSERT_EQ(0, writer.Finish());
+    ASSERT_EQ(0, fclose(fp));
+  };
+  TemporaryFile src_file;
+  write_zip(fdopen(src_file.release(), "wb"), "");
+  TemporaryFile tgt_file;
+  write_zip(fdopen(tgt_file.release(), "wb"), "extra contents");
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  // The patch doesn't depend on the number of threads.
+  TemporaryFile threaded_patch_file;
+  args = {
+    "imgdiff", "-z", "--threads=4", src_file.path, tgt_file.path, threaded_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string threaded_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(threaded_patch_file.path, &threaded_patch));
+  ASSERT_EQ(patch, threaded_patch);
+
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  verify_patched_image(src, threaded_patch, tgt);
+
+  args = {
+    "imgdiff", "-z", "--threads=0", src_file.path, tgt_file.path, threaded_patch_file.path,
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
+TEST(ImgdiffCacheTest, PutGet) {
+  TemporaryDir cache_dir;
+  ImgdiffCache cache(cache_dir.path);
+
+  std::string key = ImgdiffCache::Key({ "abc", "def" });
+  ASSERT_EQ(64U, key.size());
+  ASSERT_NE(key, ImgdiffCache::Key({ "ab", "cdef" }));
+  ASSERT_EQ(key, ImgdiffCache::Key({ "abc", "def" }));
+
+  std::string value;
+  ASSERT_FALSE(cache.Get("deflate", key, &value));
+  ASSERT_TRUE(cache.Put("deflate", key, "9"));
+  ASSERT_TRUE(cache.Get("deflate", key, &value));
+  ASSERT_EQ("9", value);
+  ASSERT_FALSE(cache.Get("patch", key, &value));
+
+  // An empty value is a valid entry too.
+  ASSERT_TRUE(cache.Put("patch", key, ""));
+  ASSERT_TRUE(cache.Get("patch", key, &value));
+  ASSERT_EQ("", value);
+}
+
+TEST(ImgdiffCacheTest, DamagedEntries) {
+  TemporaryDir cache_dir;
+  ImgdiffCache cache(cache_dir.path);
+  ASSERT_TRUE(cache.Put("patch", "a", "abcdefg"));
+  std::string path = std::string(cache_dir.path) + "/patch/a";
+  std::string entry;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &entry));
+
+  std::string value;
+  // An empty entry, e.g. left behind by a crash.
+  ASSERT_TRUE(android::base::WriteStringToFile("", path));
+  ASSERT_FALSE(cache.Get("patch", "a", &value));
+  // A truncated one.
+  ASSERT_TRUE(android::base::WriteStringToFile(entry.substr(0, entry.size() - 1), path));
+  ASSERT_FALSE(cache.Get("patch", "a", &value));
+  // One with a modified value.
+  std::string modified = entry;
+  modified.back() = 'x';
+  ASSERT_TRUE(android::base::WriteStringToFile(modified, path));
+  ASSERT_FALSE(cache.Get("patch", "a", &value));
+
+  ASSERT_TRUE(android::base::WriteStringToFile(entry, path));
+  ASSERT_TRUE(cache.Get("patch", "a", &value));
+  ASSERT_EQ("abcdefg", value);
+}
+
+TEST(ImgdiffCacheTest, Trim) {
+  TemporaryDir cache_dir;
+  for (const auto& key : { "a", "b", "c" }) {
+    ASSERT_TRUE(ImgdiffCache(cache_dir.path).Put("patch", key, std::string(10, 'x')));
+  }
+  // Leave room for two and a half entries.
+  struct stat sb;
+  ASSERT_EQ(0, stat((std::string(cache_dir.path) + "/patch/a").c_str(), &sb));
+  ImgdiffCache cache(cache_dir.path, sb.st_size * 5 / 2);
+  // Make "b" the least recently used one, and "a" the most recently used one.
+  auto set_mtime = [&cache_dir](const std::string& key, time_t mtime) {
+    std::string path = std::string(cache_dir.path) + "/patch/" + key;
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    ASSERT_EQ(0, utimensat(AT_FDCWD, path.c_str(), times, 0));
+  };
+  set_mtime("a", 1000);
+  set_mtime("b", 1000);
+  set_mtime("c", 2000);
+  std::string value;
+  ASSERT_TRUE(cache.Get("patch", "a", &value));
+
+  ASSERT_EQ(1U, cache.Trim());
+  ASSERT_FALSE(cache.Get("patch", "b", &value));
+  ASSERT_TRUE(cache.Get("patch", "a", &value));
+  ASSERT_TRUE(cache.Get("patch", "c", &value));
+  ASSERT_EQ(0U, cache.Trim());
+}
+
+// Returns the paths of the entries of the given kind in the imgdiff cache 'dir'.
+static std::vector<std::string> ListCacheEntries(const std::string& dir, const std::string& kind) {
+  std::vector<std::string> entries;
+  std::string kind_dir = dir + "/" + kind;
+  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(kind_dir.c_str()), closedir);
+  if (d == nullptr) {
+    return entries;
+  }
+  while (struct dirent* de = readdir(d.get())) {
+    if (de->d_name[0] != '.') {
+      entries.push_back(kind_dir + "/" + de->d_name);
+    }
+  }
+  return entries;
+}
+
+TEST(ImgdiffTest, image_mode_cache_dir) {
+  std::string gzipped_source;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_source"), &gzipped_source));
+  std::string gzipped_target;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_target"), &gzipped_target));
+
+  const std::string src = "abcdefg" + gzipped_source;
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  const std::string tgt = "abcdefgxyz" + gzipped_target;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  TemporaryDir cache_dir;
+  std::string cache_arg = std::string("--cache-dir=") + cache_dir.path;
+  auto run_cached = [&]() {
+    TemporaryFile cached_patch_file;
+    args = {
+      "imgdiff", cache_arg.c_str(), src_file.path, tgt_file.path, cached_patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+    std::string cached_patch;
+    ASSERT_TRUE(android::base::ReadFileToString(cached_patch_file.path, &cached_patch));
+    ASSERT_EQ(patch, cached_patch);
+  };
+
+  // The first run stores the deflate level of the chunk and the patches.
+  ASSERT_NO_FATAL_FAILURE(run_cached());
+  std::vector<std::string> entries = ListCacheEntries(cache_dir.path, "deflate");
+  ASSERT_FALSE(entries.empty());
+  std::vector<std::string> patch_entries = ListCacheEntries(cache_dir.path, "patch");
+  ASSERT_FALSE(patch_entries.empty());
+  entries.insert(entries.end(), patch_entries.begin(), patch_entries.end());
+
+  // The second run reads every entry, which marks it as used, and rewrites none, i.e. each lookup
+  // is a hit.
+  std::vector<ino_t> inodes;
+  for (const auto& entry : entries) {
+    struct stat sb;
+    ASSERT_EQ(0, stat(entry.c_str(), &sb));
+    inodes.push_back(sb.st_ino);
+    const struct timespec times[2] = { { 0, 0 }, { 0, 0 } };
+    ASSERT_EQ(0, utimensat(AT_FDCWD, entry.c_str(), times, 0));
+  }
+  ASSERT_NO_FATAL_FAILURE(run_cached());
+  for (size_t i = 0; i < entries.size(); i++) {
+    struct stat sb;
+    ASSERT_EQ(0, stat(entries[i].c_str(), &sb));
+    ASSERT_EQ(inodes[i], sb.st_ino) << entries[i];
+    ASSERT_NE(0, sb.st_mtime) << entries[i];
+  }
+
+  // A damaged entry is a miss; the result is computed again and the entry is replaced.
+  std::string entry_content;
+  ASSERT_TRUE(android::base::ReadFileToString(entries[0], &entry_content));
+  std::string damaged = entry_content;
+  damaged.back() ^= 1;
+  ASSERT_TRUE(android::base::WriteStringToFile(damaged, entries[0]));
+  ASSERT_NO_FATAL_FAILURE(run_cached());
+  std::string replaced_content;
+  ASSERT_TRUE(android::base::ReadFileToString(entries[0], &replaced_content));
+  ASSERT_EQ(entry_content, replaced_content);
+
+  verify_patched_image(src, patch, tgt);
+}
+
 TEST(ImgdiffTest, zip_mode_empty_target) {
   TemporaryFile src_file;
   FILE* src_file_ptr = fdopen(src_file.release(), "wb");
@@ -383,6 +618,158 @@ TEST(ImgdiffTest, image_mode_simple) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, image_mode_multiple_deflate_chunks_spilled_or_concurrent) {
+  std::string gzipped_source;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_source"), &gzipped_source));
+  std::string gzipped_target;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_target"), &gzipped_target));
+
+  // Two deflate chunks, of which the second one reuses the buffers of the first.
+  const std::string src = "abcdefg" + gzipped_source + "hijklmn" + gzipped_target;
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  const std::string tgt = "abcdefgxyz" + gzipped_target + "hijklmn" + gzipped_source;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  size_t num_deflate;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate);
+  ASSERT_EQ(2U, num_deflate);
+
+  verify_patched_image(src, patch, tgt);
+
+  // Expand every deflate chunk into a file instead.
+  TemporaryDir spill_dir;
+  ImagePatchSpillSpace spill_space(std::numeric_limits<size_t>::max());
+  ImagePatchOptions options;
+  options.max_in_memory_bytes = 1;
+  options.spill_dir = spill_dir.path;
+  options.spill_space = &spill_space;
+  verify_patched_image(src, patch, tgt, options);
+
+  // The spill files have given their space back.
+  ASSERT_TRUE(spill_space.Reserve(std::numeric_limits<size_t>::max()));
+
+  // Chunks that don't fit in the space given for spilling are expanded in memory.
+  ImagePatchSpillSpace small_spill_space(1);
+  options.spill_space = &small_spill_space;
+  verify_patched_image(src, patch, tgt, options);
+
+  // The spill files are unlinked.
+  ASSERT_EQ(0, rmdir(spill_dir.path));
+
+  // Apply the chunks concurrently, with more threads than chunks.
+  ImagePatchOptions concurrent_options;
+  concurrent_options.threads = 8;
+  verify_patched_image(src, patch, tgt, concurrent_options);
+}
+
+// Builds a source and a target image of 'count' gzipped members, with the source and the target
+// contents of the testdata swapped between them, and an image patch for them. Sets
+// 'deflate_starts' to the offsets of the deflate data in the target, in chunk order.
+static void GenerateMultipleDeflateChunks(size_t count, std::string* src, std::string* tgt,
+                                          std::string* patch, std::vector<size_t>* deflate_starts) {
+  std::string gzipped_source;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_source"), &gzipped_source));
+  std::string gzipped_target;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_target"), &gzipped_target));
+
+  src->clear();
+  tgt->clear();
+  deflate_starts->clear();
+  for (size_t i = 0; i < count; i++) {
+    std::string prefix = android::base::StringPrintf("member %zu", i);
+    *src += prefix + (i % 2 == 0 ? gzipped_source : gzipped_target);
+    *tgt += prefix;
+    // The testdata members have a 10-byte gzip header, without any optional fields.
+    deflate_starts->push_back(tgt->size() + 10);
+    *tgt += (i % 2 == 0 ? gzipped_target : gzipped_source);
+  }
+
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(*src, src_file.path));
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(*tgt, tgt_file.path));
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, patch));
+
+  size_t num_deflate;
+  verify_patch_header(*patch, nullptr, nullptr, &num_deflate);
+  ASSERT_EQ(count, num_deflate);
+}
+
+TEST(ImgpatchTest, image_mode_concurrent_chunks_in_order) {
+  std::string src;
+  std::string tgt;
+  std::string patch;
+  std::vector<size_t> deflate_starts;
+  GenerateMultipleDeflateChunks(7, &src, &tgt, &patch, &deflate_starts);
+
+  // With more chunks than threads, the workers run ahead of the chunk being written and wait for
+  // it to catch up, while the output still comes out in chunk order.
+  ImagePatchOptions options;
+  for (size_t threads : { 2, 3 }) {
+    options.threads = threads;
+    verify_patched_image(src, patch, tgt, options);
+  }
+
+  // Without memory for the outputs waiting to be written, only the next chunk to be written is
+  // started after the first one.
+  options.max_in_memory_bytes = 1;
+  verify_patched_image(src, patch, tgt, options);
+}
+
+TEST(ImgpatchTest, image_mode_concurrent_chunk_failure) {
+  std::string src;
+  std::string tgt;
+  std::string patch;
+  std::vector<size_t> deflate_starts;
+  GenerateMultipleDeflateChunks(7, &src, &tgt, &patch, &deflate_starts);
+
+  // Corrupt the deflate data of the source member for the middle chunk, which fails its inflation.
+  const size_t failed_chunk = 3;
+  const std::string prefix = android::base::StringPrintf("member %zu", failed_chunk);
+  size_t src_member = src.find(prefix);
+  ASSERT_NE(std::string::npos, src_member);
+  size_t src_deflate = src_member + prefix.size() + 10;
+  std::fill_n(src.begin() + src_deflate, 16, '\xff');
+
+  ImagePatchOptions options;
+  for (size_t threads : { 1, 2, 8 }) {
+    options.threads = threads;
+    std::string patched;
+    ASSERT_EQ(-1, ApplyImagePatch(
+                      reinterpret_cast<const unsigned char*>(src.data()), src.size(), patch,
+                      [&](const unsigned char* data, size_t len) {
+                        patched.append(reinterpret_cast<const char*>(data), len);
+                        return len;
+                      },
+                      nullptr, options))
+        << "threads: " << threads;
+
+    // Whatever got written is the output of the chunks before the failed one, in order; nothing
+    // from the failed chunk or the chunks after it.
+    ASSERT_LE(patched.size(), deflate_starts[failed_chunk]) << "threads: " << threads;
+    ASSERT_EQ(tgt.substr(0, patched.size()), patched) << "threads: " << threads;
+  }
+}
+
 TEST(ImgdiffTest, image_mode_bad_gzip) {
   // Modify the uncompressed length in the gzip footer.
   const std::vector<char> src_data = { 'a',    'b',    'c',    'd',    'e',    'f',    'g',
@@ -32,9 +32,12 @@
 #include <ziparchive/zip_writer.h>
 
 #include "install/install.h"
+#include "install/package.h"
 #include "install/wipe_device.h"
+#include "otautil/error_code.h"
 #include "otautil/paths.h"
 #include "private/setup_commands.h"
+#include "recovery_ui/stub_ui.h"
 #include "recovery_utils/roots.h"
 
 static void BuildZipArchive(const std::map<std::string, std::string>& file_map, int fd,
@@ -167,6 +170,91 @@ TEST(InstallTest, SetUpNonAbUpdateCommands_MissingUpdateBinary) {
   CloseArchive(zip);
 }
 
+TEST(InstallTest, StageNonAbUpdateCommands) {
+  TemporaryFile temp_file;
+  static constexpr const char* UPDATE_BINARY_NAME = "META-INF/com/google/android/update-binary";
+  BuildZipArchive({ { UPDATE_BINARY_NAME, "binary" } }, temp_file.release(), kCompressStored);
+
+  ZipArchiveHandle zip;
+  ASSERT_EQ(0, OpenArchive(temp_file.path, &zip));
+  int status_fd = 10;
+  std::string package = "/path/to/update.zip";
+  TemporaryDir td;
+  std::string binary_path = std::string(td.path) + "/update_binary";
+  Paths::Get().set_temporary_update_binary(binary_path);
+  std::vector<std::string> cmd;
+  std::string staged_binary;
+  ASSERT_TRUE(StageNonAbUpdateCommands(package, zip, 2, status_fd, &cmd, &staged_binary));
+  CloseArchive(zip);
+  ASSERT_EQ(5U, cmd.size());
+  ASSERT_EQ(binary_path, cmd[0]);
+  ASSERT_EQ("retry", cmd[4]);
+
+  // The update binary is only staged, and can't be run by anyone else.
+  struct stat sb;
+  ASSERT_EQ(-1, stat(binary_path.c_str(), &sb));
+  ASSERT_NE(binary_path, staged_binary);
+  ASSERT_EQ(0, stat(staged_binary.c_str(), &sb));
+  ASSERT_EQ(static_cast<mode_t>(0700), sb.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+
+  ASSERT_TRUE(CommitStagedUpdateBinary(staged_binary));
+  ASSERT_EQ(-1, stat(staged_binary.c_str(), &sb));
+  ASSERT_EQ(0, stat(binary_path.c_str(), &sb));
+  ASSERT_EQ(static_cast<mode_t>(0755), sb.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(binary_path, &content));
+  ASSERT_EQ("binary", content);
+
+  ASSERT_EQ(0, unlink(binary_path.c_str()));
+}
+
+TEST(InstallTest, StageNonAbUpdateCommands_MissingUpdateBinary) {
+  TemporaryFile temp_file;
+  BuildZipArchive({ { "fake_entry", "" } }, temp_file.release(), kCompressStored);
+
+  ZipArchiveHandle zip;
+  ASSERT_EQ(0, OpenArchive(temp_file.path, &zip));
+  TemporaryDir td;
+  std::string binary_path = std::string(td.path) + "/update_binary";
+  Paths::Get().set_temporary_update_binary(binary_path);
+  std::vector<std::string> cmd;
+  std::string staged_binary;
+  ASSERT_FALSE(StageNonAbUpdateCommands("/path/to/update.zip", zip, 0, 10, &cmd, &staged_binary));
+  CloseArchive(zip);
+  ASSERT_TRUE(staged_binary.empty());
+
+  // Nothing is left behind, and a missing staged binary can't be committed.
+  ASSERT_FALSE(CommitStagedUpdateBinary(binary_path + ".unverified"));
+  struct stat sb;
+  ASSERT_EQ(-1, stat(binary_path.c_str(), &sb));
+  ASSERT_EQ(-1, stat((binary_path + ".unverified").c_str(), &sb));
+}
+
+TEST(InstallTest, VerifyAndInstallPackage_UnsignedAbMemoryPackage) {
+  TemporaryFile temp_file;
+  BuildZipArchive({ { "payload.bin", "" },
+                    { "payload_properties.txt", "some_properties" },
+                    { "META-INF/com/android/metadata", "ota-type=AB" } },
+                  temp_file.release(), kCompressStored);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  auto package = Package::CreateMemoryPackage(std::vector<uint8_t>(content.begin(), content.end()),
+                                              nullptr);
+  ASSERT_NE(nullptr, package);
+  ASSERT_EQ(PackageType::kMemory, package->GetType());
+
+  // The unsigned package fails the verification, instead of aborting while its update is prepared.
+  StubRecoveryUI ui;
+  bool wipe_cache = false;
+  std::vector<std::string> log_buffer;
+  int max_temperature = 0;
+  ASSERT_EQ(INSTALL_CORRUPT, VerifyAndInstallPackage(package.get(), &wipe_cache, &log_buffer, 0,
+                                                     &max_temperature, &ui));
+  ASSERT_NE(log_buffer.end(),
+            std::find(log_buffer.begin(), log_buffer.end(),
+                      "error: " + std::to_string(kZipVerificationFailure)));
+}
+
 static void VerifyAbUpdateCommands(const std::string& serialno, bool success = true) {
   TemporaryFile temp_file;
 
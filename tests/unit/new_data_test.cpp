@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/memory.h>
+#include <brotli/encode.h>
+#include <gtest/gtest.h>
+
+#include "private/new_data.h"
+
+static std::string BrotliCompress(const std::string& data) {
+  size_t encoded_size = BrotliEncoderMaxCompressedSize(data.size());
+  std::string encoded(encoded_size, '\0');
+  CHECK(BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE,
+                              data.size(), reinterpret_cast<const uint8_t*>(data.data()),
+                              &encoded_size, reinterpret_cast<uint8_t*>(encoded.data())));
+  encoded.resize(encoded_size);
+  return encoded;
+}
+
+// Compresses 'data' into frames of up to 'frame_size' bytes for NewDataDecoder::kChunkedBrotli.
+static std::string ChunkedBrotliCompress(const std::string& data, size_t frame_size) {
+  std::string result;
+  for (size_t offset = 0; offset < data.size(); offset += frame_size) {
+    std::string frame = data.substr(offset, frame_size);
+    std::string encoded = BrotliCompress(frame);
+    char header[8];
+    android::base::put_unaligned<uint32_t>(header, encoded.size());
+    android::base::put_unaligned<uint32_t>(header + 4, frame.size());
+    result.append(header, sizeof(header));
+    result += encoded;
+  }
+  return result;
+}
+
+static std::string GenerateData(size_t size) {
+  std::string data;
+  data.reserve(size);
+  std::generate_n(std::back_inserter(data), size, []() { return rand() % 128; });
+  return data;
+}
+
+// Feeds 'input' to a decoder in pieces of 'piece_size' bytes on a separate thread, and returns the
+// output read from the queue of 'max_chunks' 4096-byte chunks. Sets 'success' to the result of the
+// decoding, and 'peak_bytes' to the most bytes the queue held at once.
+static std::string Decode(NewDataDecoder::Format format, const std::string& input,
+                          size_t piece_size, bool* success, size_t max_chunks = 32,
+                          size_t* peak_bytes = nullptr) {
+  NewDataQueue queue(4096, max_chunks);
+  std::thread producer([&]() {
+    auto decoder = NewDataDecoder::Create(format, &queue, 4);
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(input.data());
+    for (size_t offset = 0; offset < input.size(); offset += piece_size) {
+      if (!decoder->Feed(data + offset, std::min(piece_size, input.size() - offset))) {
+        decoder->Abort();
+        *success = false;
+        return;
+      }
+    }
+    *success = decoder->Finish();
+  });
+
+  std::string output;
+  const uint8_t* data;
+  size_t size;
+  // Consume in odd-sized pieces to exercise partial reads of a chunk.
+  while (queue.Peek(&data, &size)) {
+    size = std::min<size_t>(size, 1000);
+    output.append(reinterpret_cast<const char*>(data), size);
+    queue.Consume(size);
+  }
+  producer.join();
+  EXPECT_TRUE(queue.Drained());
+  EXPECT_EQ(!*success, queue.Failed());
+  if (peak_bytes != nullptr) {
+    *peak_bytes = queue.peak_bytes();
+  }
+  return output;
+}
+
+TEST(NewDataTest, GetFormat) {
+  ASSERT_EQ(NewDataDecoder::Format::kRaw, NewDataDecoder::GetFormat("system.new.dat"));
+  ASSERT_EQ(NewDataDecoder::Format::kBrotli, NewDataDecoder::GetFormat("system.new.dat.br"));
+  ASSERT_EQ(NewDataDecoder::Format::kChunkedBrotli,
+            NewDataDecoder::GetFormat("system.new.dat.mbr"));
+}
+
+TEST(NewDataTest, Raw) {
+  std::string data = GenerateData(4096 * 10 + 123);
+  bool success;
+  ASSERT_EQ(data, Decode(NewDataDecoder::Format::kRaw, data, 5000, &success));
+  ASSERT_TRUE(success);
+}
+
+TEST(NewDataTest, Brotli) {
+  std::string data = GenerateData(4096 * 100);
+  bool success;
+  ASSERT_EQ(data, Decode(NewDataDecoder::Format::kBrotli, BrotliCompress(data), 777, &success));
+  ASSERT_TRUE(success);
+}
+
+TEST(NewDataTest, Brotli_Truncated) {
+  std::string data = GenerateData(4096 * 100);
+  std::string encoded = BrotliCompress(data);
+  encoded.resize(encoded.size() - 10);
+  bool success;
+  std::string output = Decode(NewDataDecoder::Format::kBrotli, encoded, 777, &success);
+  ASSERT_FALSE(success);
+  // Whatever was delivered before the end of the input is correct.
+  ASSERT_LT(output.size(), data.size());
+  ASSERT_EQ(data.substr(0, output.size()), output);
+}
+
+TEST(NewDataTest, ChunkedBrotli) {
+  std::string data = GenerateData(4096 * 100 + 10);
+  std::string encoded = ChunkedBrotliCompress(data, 4096 * 7);
+  bool success;
+  // Pieces that split the frame headers, as well as pieces that span several frames.
+  for (size_t piece_size : { 3, 4096, 1024 * 1024 }) {
+    ASSERT_EQ(data, Decode(NewDataDecoder::Format::kChunkedBrotli, encoded, piece_size, &success));
+    ASSERT_TRUE(success);
+  }
+}
+
+TEST(NewDataTest, ChunkedBrotli_LargeFrames) {
+  // Frames that don't fit in the 16 KiB queue, between ones that are decompressed concurrently.
+  std::string data = GenerateData(4096 * 100);
+  std::string encoded = ChunkedBrotliCompress(data.substr(0, 4096 * 10), 4096) +
+                        ChunkedBrotliCompress(data.substr(4096 * 10, 4096 * 80), 4096 * 32) +
+                        ChunkedBrotliCompress(data.substr(4096 * 90), 4096);
+  bool success;
+  size_t peak_bytes;
+  for (size_t piece_size : { 3, 4096, 1024 * 1024 }) {
+    ASSERT_EQ(data, Decode(NewDataDecoder::Format::kChunkedBrotli, encoded, piece_size, &success,
+                           4, &peak_bytes));
+    ASSERT_TRUE(success);
+    ASSERT_GT(peak_bytes, 0u);
+    ASSERT_LE(peak_bytes, 4096u * 4);
+  }
+}
+
+TEST(NewDataTest, ChunkedBrotli_LargeFrameCorrupted) {
+  std::string data = GenerateData(4096 * 32);
+  std::string encoded = ChunkedBrotliCompress(data, 4096 * 32);
+  // Claim a larger uncompressed size for the frame than it decodes to.
+  android::base::put_unaligned<uint32_t>(encoded.data() + 4, 4096 * 33);
+  bool success;
+  Decode(NewDataDecoder::Format::kChunkedBrotli, encoded, 4096, &success, 4);
+  ASSERT_FALSE(success);
+}
+
+TEST(NewDataTest, ChunkedBrotli_Truncated) {
+  std::string data = GenerateData(4096 * 10);
+  std::string encoded = ChunkedBrotliCompress(data, 4096 * 4);
+  encoded.resize(encoded.size() - 10);
+  bool success;
+  std::string output = Decode(NewDataDecoder::Format::kChunkedBrotli, encoded, 4096, &success);
+  ASSERT_FALSE(success);
+  // The complete frames are still delivered.
+  ASSERT_EQ(data.substr(0, 4096 * 8), output);
+}
+
+TEST(NewDataTest, ChunkedBrotli_Corrupted) {
+  std::string data = GenerateData(4096 * 10);
+  std::string encoded = ChunkedBrotliCompress(data, 4096 * 4);
+  // Claim a larger uncompressed size for the first frame than it decodes to.
+  android::base::put_unaligned<uint32_t>(encoded.data() + 4, 4096 * 5);
+  bool success;
+  Decode(NewDataDecoder::Format::kChunkedBrotli, encoded, 4096, &success);
+  ASSERT_FALSE(success);
+}
+
+TEST(NewDataTest, Cancel) {
+  NewDataQueue queue(4096, 2);
+  std::thread producer([&queue]() {
+    auto decoder = NewDataDecoder::Create(NewDataDecoder::Format::kRaw, &queue, 1);
+    std::string data(4096 * 10, 'a');
+    // The queue fills up after two chunks, and the remaining ones are blocked until cancelled.
+    ASSERT_FALSE(decoder->Feed(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+    decoder->Abort();
+  });
+
+  const uint8_t* data;
+  size_t size;
+  ASSERT_TRUE(queue.Peek(&data, &size));
+  ASSERT_EQ(4096u, size);
+  queue.Cancel();
+  producer.join();
+  ASSERT_FALSE(queue.Drained());
+  ASSERT_TRUE(queue.Failed());
+}
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <functional>
 #include <string>
 #include <vector>
@@ -91,7 +92,7 @@ TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
     SHA1_Init(&ctx);
     std::vector<HasherUpdateCallback> hashers{ std::bind(&SHA1_Update, &ctx, std::placeholders::_1,
                                                          std::placeholders::_2) };
-    package->UpdateHashAtOffset(hashers, 0, hash_size);
+    package->UpdateHashAtOffset(hashers, 0, hash_size, nullptr);
 
     std::vector<uint8_t> calculated_sha(SHA_DIGEST_LENGTH);
     SHA1_Final(calculated_sha.data(), &ctx);
@@ -99,6 +100,124 @@ TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
   }
 }
 
+TEST_F(PackageTest, UpdateHashAtOffset_sha1_and_sha256_hash) {
+  std::vector<uint8_t> expected_sha1(SHA_DIGEST_LENGTH);
+  SHA1(reinterpret_cast<uint8_t*>(file_content_.data()), file_content_.size(),
+       expected_sha1.data());
+  std::vector<uint8_t> expected_sha256(SHA256_DIGEST_LENGTH);
+  SHA256(reinterpret_cast<uint8_t*>(file_content_.data()), file_content_.size(),
+         expected_sha256.data());
+
+  for (const auto& package : packages_) {
+    SHA_CTX sha1_ctx;
+    SHA1_Init(&sha1_ctx);
+    SHA256_CTX sha256_ctx;
+    SHA256_Init(&sha256_ctx);
+    std::vector<HasherUpdateCallback> hashers{
+      std::bind(&SHA1_Update, &sha1_ctx, std::placeholders::_1, std::placeholders::_2),
+      std::bind(&SHA256_Update, &sha256_ctx, std::placeholders::_1, std::placeholders::_2),
+    };
+    ASSERT_TRUE(package->UpdateHashAtOffset(hashers, 0, file_content_.size(), nullptr));
+
+    std::vector<uint8_t> calculated_sha1(SHA_DIGEST_LENGTH);
+    SHA1_Final(calculated_sha1.data(), &sha1_ctx);
+    ASSERT_EQ(expected_sha1, calculated_sha1);
+    std::vector<uint8_t> calculated_sha256(SHA256_DIGEST_LENGTH);
+    SHA256_Final(calculated_sha256.data(), &sha256_ctx);
+    ASSERT_EQ(expected_sha256, calculated_sha256);
+  }
+}
+
+TEST_F(PackageTest, UpdateHashAtOffset_ranges) {
+  std::vector<uint8_t> expected_sha(SHA_DIGEST_LENGTH);
+  SHA1(reinterpret_cast<uint8_t*>(file_content_.data()), file_content_.size(),
+       expected_sha.data());
+
+  for (const auto& package : packages_) {
+    // Hash the file in consecutive ranges, except for a detour that hashes some bytes out of order
+    // into a separate context.
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    std::vector<HasherUpdateCallback> hashers{ std::bind(&SHA1_Update, &ctx, std::placeholders::_1,
+                                                         std::placeholders::_2) };
+    SHA_CTX detour_ctx;
+    SHA1_Init(&detour_ctx);
+    std::vector<HasherUpdateCallback> detour_hashers{ std::bind(
+        &SHA1_Update, &detour_ctx, std::placeholders::_1, std::placeholders::_2) };
+
+    uint64_t so_far = 0;
+    for (uint64_t size = 7; so_far < file_content_.size(); size = size * 2 + 1) {
+      uint64_t read_size = std::min<uint64_t>(size, file_content_.size() - so_far);
+      ASSERT_TRUE(package->UpdateHashAtOffset(hashers, so_far, read_size, nullptr));
+      so_far += read_size;
+      if (size == 15) {
+        ASSERT_TRUE(package->UpdateHashAtOffset(detour_hashers, 3, 5, nullptr));
+      }
+    }
+
+    std::vector<uint8_t> calculated_sha(SHA_DIGEST_LENGTH);
+    SHA1_Final(calculated_sha.data(), &ctx);
+    ASSERT_EQ(expected_sha, calculated_sha);
+
+    std::vector<uint8_t> detour_sha(SHA_DIGEST_LENGTH);
+    SHA1_Final(detour_sha.data(), &detour_ctx);
+    std::vector<uint8_t> expected_detour_sha(SHA_DIGEST_LENGTH);
+    SHA1(reinterpret_cast<uint8_t*>(file_content_.data()) + 3, 5, expected_detour_sha.data());
+    ASSERT_EQ(expected_detour_sha, detour_sha);
+
+    // Out of bound.
+    ASSERT_FALSE(package->UpdateHashAtOffset(hashers, 1, file_content_.size(), nullptr));
+  }
+}
+
+TEST_F(PackageTest, UpdateHashAtOffset_large_range) {
+  // A package of several hash slices, the last one partial.
+  std::string content(10 * 1024 * 1024 + 123, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 7 + i / 4096);
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  std::vector<uint8_t> expected_sha1(SHA_DIGEST_LENGTH);
+  SHA1(reinterpret_cast<uint8_t*>(content.data()) + 1, content.size() - 1, expected_sha1.data());
+  std::vector<uint8_t> expected_sha256(SHA256_DIGEST_LENGTH);
+  SHA256(reinterpret_cast<uint8_t*>(content.data()) + 1, content.size() - 1,
+         expected_sha256.data());
+
+  std::vector<std::unique_ptr<Package>> packages;
+  packages.emplace_back(Package::CreateMemoryPackage(temp_file.path, nullptr));
+  packages.emplace_back(Package::CreateFilePackage(temp_file.path, nullptr));
+  for (const auto& package : packages) {
+    ASSERT_TRUE(package);
+    SHA_CTX sha1_ctx;
+    SHA1_Init(&sha1_ctx);
+    SHA256_CTX sha256_ctx;
+    SHA256_Init(&sha256_ctx);
+    std::vector<HasherUpdateCallback> hashers{
+      std::bind(&SHA1_Update, &sha1_ctx, std::placeholders::_1, std::placeholders::_2),
+      std::bind(&SHA256_Update, &sha256_ctx, std::placeholders::_1, std::placeholders::_2),
+    };
+    std::vector<uint64_t> progress;
+    ASSERT_TRUE(package->UpdateHashAtOffset(hashers, 1, content.size() - 1,
+                                            [&progress](uint64_t hashed) {
+                                              progress.push_back(hashed);
+                                            }));
+
+    std::vector<uint8_t> calculated_sha1(SHA_DIGEST_LENGTH);
+    SHA1_Final(calculated_sha1.data(), &sha1_ctx);
+    ASSERT_EQ(expected_sha1, calculated_sha1);
+    std::vector<uint8_t> calculated_sha256(SHA256_DIGEST_LENGTH);
+    SHA256_Final(calculated_sha256.data(), &sha256_ctx);
+    ASSERT_EQ(expected_sha256, calculated_sha256);
+
+    // The progress is reported as each slice gets hashed.
+    ASSERT_LT(1U, progress.size());
+    ASSERT_TRUE(std::is_sorted(progress.begin(), progress.end()));
+    ASSERT_EQ(content.size() - 1, progress.back());
+  }
+}
+
 TEST_F(PackageTest, GetZipArchiveHandle_extract_entry) {
   for (const auto& package : packages_) {
     ZipArchiveHandle zip = package->GetZipArchiveHandle();
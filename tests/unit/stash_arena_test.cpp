@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "private/stash_arena.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+class StashArenaTest : public ::testing::Test {
+ protected:
+  std::unique_ptr<StashArena> Open(size_t max_blocks) {
+    return StashArena::Open(stash_dir_.path, max_blocks, kBlockSize, getuid(), getgid());
+  }
+
+  static std::vector<uint8_t> Blocks(const std::string& fill) {
+    std::vector<uint8_t> data;
+    for (char c : fill) {
+      data.insert(data.end(), kBlockSize, static_cast<uint8_t>(c));
+    }
+    return data;
+  }
+
+  static void ExpectStash(StashArena* arena, const std::string& id, const std::string& fill) {
+    std::vector<uint8_t> buffer;
+    size_t blocks;
+    ASSERT_TRUE(arena->Read(id, &buffer, &blocks));
+    ASSERT_EQ(fill.size(), blocks);
+    buffer.resize(blocks * kBlockSize);
+    ASSERT_EQ(Blocks(fill), buffer);
+  }
+
+  std::string IndexPath() const {
+    return std::string(stash_dir_.path) + "/" + StashArena::kIndexFile;
+  }
+
+  TemporaryDir stash_dir_;
+};
+
+TEST_F(StashArenaTest, WriteReadFree) {
+  ASSERT_FALSE(StashArena::Exists(stash_dir_.path));
+  auto arena = Open(8);
+  ASSERT_NE(nullptr, arena);
+  ASSERT_TRUE(StashArena::Exists(stash_dir_.path));
+  ASSERT_EQ(8u, arena->total_blocks());
+  ASSERT_EQ(8u, arena->free_blocks());
+
+  ASSERT_TRUE(arena->Write("a", Blocks("aaa").data(), 3));
+  ASSERT_TRUE(arena->Write("b", Blocks("bc").data(), 2));
+  ASSERT_EQ(3u, arena->free_blocks());
+  ASSERT_EQ(3u, arena->GetBlocks("a"));
+  ExpectStash(arena.get(), "a", "aaa");
+  ExpectStash(arena.get(), "b", "bc");
+
+  ASSERT_TRUE(arena->Free("a"));
+  ASSERT_FALSE(arena->Free("a"));
+  ASSERT_EQ(6u, arena->free_blocks());
+  std::vector<uint8_t> buffer;
+  size_t blocks;
+  ASSERT_FALSE(arena->Read("a", &buffer, &blocks));
+  ASSERT_EQ(ENOENT, errno);
+
+  // The arena file is preallocated, and doesn't change size.
+  struct stat sb;
+  ASSERT_EQ(0, stat((std::string(stash_dir_.path) + "/" + StashArena::kArenaFile).c_str(), &sb));
+  ASSERT_EQ(static_cast<off_t>(8 * kBlockSize), sb.st_size);
+}
+
+TEST_F(StashArenaTest, Reopen) {
+  {
+    auto arena = Open(8);
+    ASSERT_NE(nullptr, arena);
+    ASSERT_TRUE(arena->Write("a", Blocks("aa").data(), 2));
+    ASSERT_TRUE(arena->Write("b", Blocks("b").data(), 1));
+    ASSERT_TRUE(arena->Write("c", Blocks("cc").data(), 2));
+    ASSERT_TRUE(arena->Free("b"));
+    ASSERT_TRUE(arena->Sync());
+  }
+
+  auto arena = Open(8);
+  ASSERT_NE(nullptr, arena);
+  ASSERT_EQ(0u, arena->GetBlocks("b"));
+  ExpectStash(arena.get(), "a", "aa");
+  ExpectStash(arena.get(), "c", "cc");
+  ASSERT_EQ(4u, arena->free_blocks());
+
+  // The freed blocks are reused.
+  ASSERT_TRUE(arena->Write("d", Blocks("dddd").data(), 4));
+  ASSERT_EQ(0u, arena->free_blocks());
+  ExpectStash(arena.get(), "a", "aa");
+  ExpectStash(arena.get(), "c", "cc");
+  ExpectStash(arena.get(), "d", "dddd");
+}
+
+TEST_F(StashArenaTest, Fragmented) {
+  auto arena = Open(6);
+  ASSERT_NE(nullptr, arena);
+  ASSERT_TRUE(arena->Write("a", Blocks("a").data(), 1));
+  ASSERT_TRUE(arena->Write("b", Blocks("b").data(), 1));
+  ASSERT_TRUE(arena->Write("c", Blocks("c").data(), 1));
+  ASSERT_TRUE(arena->Write("d", Blocks("d").data(), 1));
+  ASSERT_TRUE(arena->Free("a"));
+  ASSERT_TRUE(arena->Free("c"));
+
+  // No free extent holds 4 blocks, so the stash is spread over them.
+  ASSERT_TRUE(arena->Write("e", Blocks("efgh").data(), 4));
+  ASSERT_EQ(0u, arena->free_blocks());
+  ExpectStash(arena.get(), "b", "b");
+  ExpectStash(arena.get(), "d", "d");
+  ExpectStash(arena.get(), "e", "efgh");
+}
+
+TEST_F(StashArenaTest, Grow) {
+  auto arena = Open(2);
+  ASSERT_NE(nullptr, arena);
+  ASSERT_TRUE(arena->Write("a", Blocks("a").data(), 1));
+  ASSERT_TRUE(arena->Write("b", Blocks("bcd").data(), 3));
+  ASSERT_EQ(4u, arena->total_blocks());
+  ExpectStash(arena.get(), "a", "a");
+  ExpectStash(arena.get(), "b", "bcd");
+}
+
+TEST_F(StashArenaTest, TornRecord) {
+  {
+    auto arena = Open(4);
+    ASSERT_NE(nullptr, arena);
+    ASSERT_TRUE(arena->Write("a", Blocks("a").data(), 1));
+    ASSERT_TRUE(arena->Write("b", Blocks("b").data(), 1));
+  }
+
+  // Cut the last record in the middle.
+  struct stat sb;
+  ASSERT_EQ(0, stat(IndexPath().c_str(), &sb));
+  ASSERT_EQ(0, truncate(IndexPath().c_str(), sb.st_size - 3));
+
+  auto arena = Open(4);
+  ASSERT_NE(nullptr, arena);
+  ExpectStash(arena.get(), "a", "a");
+  ASSERT_EQ(0u, arena->GetBlocks("b"));
+  ASSERT_EQ(3u, arena->free_blocks());
+
+  // New records go after the last valid one.
+  ASSERT_TRUE(arena->Write("c", Blocks("cc").data(), 2));
+  arena.reset();
+  arena = Open(4);
+  ASSERT_NE(nullptr, arena);
+  ExpectStash(arena.get(), "a", "a");
+  ExpectStash(arena.get(), "c", "cc");
+}
+
+TEST_F(StashArenaTest, OpenReadOnly) {
+  // There's nothing to read, and nothing is created.
+  ASSERT_EQ(nullptr, StashArena::OpenReadOnly(stash_dir_.path, kBlockSize));
+  ASSERT_FALSE(StashArena::Exists(stash_dir_.path));
+
+  {
+    auto arena = Open(4);
+    ASSERT_NE(nullptr, arena);
+    ASSERT_TRUE(arena->Write("a", Blocks("a").data(), 1));
+    ASSERT_TRUE(arena->Write("b", Blocks("b").data(), 1));
+  }
+  struct stat sb;
+  ASSERT_EQ(0, stat(IndexPath().c_str(), &sb));
+  ASSERT_EQ(0, truncate(IndexPath().c_str(), sb.st_size - 3));
+  std::string index;
+  ASSERT_TRUE(android::base::ReadFileToString(IndexPath(), &index));
+
+  auto arena = StashArena::OpenReadOnly(stash_dir_.path, kBlockSize);
+  ASSERT_NE(nullptr, arena);
+  ExpectStash(arena.get(), "a", "a");
+  ASSERT_EQ(0u, arena->GetBlocks("b"));
+  ASSERT_FALSE(arena->Write("c", Blocks("c").data(), 1));
+  ASSERT_EQ(EROFS, errno);
+  ASSERT_FALSE(arena->Free("a"));
+  ExpectStash(arena.get(), "a", "a");
+
+  // The torn record is left in place.
+  std::string index_after;
+  ASSERT_TRUE(android::base::ReadFileToString(IndexPath(), &index_after));
+  ASSERT_EQ(index, index_after);
+}
+
+TEST_F(StashArenaTest, LostFreeRecord) {
+  std::string index_before_free;
+  {
+    auto arena = Open(2);
+    ASSERT_NE(nullptr, arena);
+    ASSERT_TRUE(arena->Write("a", Blocks("aa").data(), 2));
+    ASSERT_TRUE(android::base::ReadFileToString(IndexPath(), &index_before_free));
+    ASSERT_TRUE(arena->Free("a"));
+    ASSERT_TRUE(arena->Write("b", Blocks("bb").data(), 2));
+  }
+
+  // Drop the "free" record, as if it had been lost in a crash while the next one made it.
+  std::string index;
+  ASSERT_TRUE(android::base::ReadFileToString(IndexPath(), &index));
+  size_t free_end = index.find('\n', index_before_free.size()) + 1;
+  index.erase(index_before_free.size(), free_end - index_before_free.size());
+  ASSERT_TRUE(android::base::WriteStringToFile(index, IndexPath()));
+
+  // The blocks of "a" have been given to "b", which takes precedence.
+  auto arena = Open(2);
+  ASSERT_NE(nullptr, arena);
+  ASSERT_EQ(0u, arena->GetBlocks("a"));
+  ExpectStash(arena.get(), "b", "bb");
+}
+
+TEST_F(StashArenaTest, CompactIndex) {
+  {
+    auto arena = Open(4);
+    ASSERT_NE(nullptr, arena);
+    for (size_t i = 0; i < 100; i++) {
+      ASSERT_TRUE(arena->Write("a", Blocks("a").data(), 1));
+      ASSERT_TRUE(arena->Free("a"));
+    }
+    ASSERT_TRUE(arena->Write("b", Blocks("bb").data(), 2));
+  }
+
+  auto arena = Open(4);
+  ASSERT_NE(nullptr, arena);
+  ExpectStash(arena.get(), "b", "bb");
+
+  // Only the live stash is left in the index.
+  std::string index;
+  ASSERT_TRUE(android::base::ReadFileToString(IndexPath(), &index));
+  ASSERT_EQ(1, std::count(index.begin(), index.end(), '\n'));
+}
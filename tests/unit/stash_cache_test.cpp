@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "private/stash_cache.h"
+
+static std::vector<uint8_t> Data(char c, size_t size) {
+  return std::vector<uint8_t>(size, static_cast<uint8_t>(c));
+}
+
+static void ExpectCached(StashCache* cache, const std::string& id,
+                         const std::vector<uint8_t>& expected) {
+  std::vector<uint8_t> buffer;
+  size_t size;
+  ASSERT_TRUE(cache->Get(id, &buffer, &size));
+  ASSERT_EQ(expected.size(), size);
+  buffer.resize(size);
+  ASSERT_EQ(expected, buffer);
+}
+
+TEST(StashCacheTest, PutGetErase) {
+  StashCache cache(100);
+  ASSERT_TRUE(cache.Put("a", Data('a', 40).data(), 40));
+  ASSERT_TRUE(cache.Put("b", Data('b', 60).data(), 60));
+  ASSERT_TRUE(cache.Contains("a"));
+  ExpectCached(&cache, "a", Data('a', 40));
+  ExpectCached(&cache, "b", Data('b', 60));
+
+  // A larger buffer is kept as is.
+  std::vector<uint8_t> buffer(80, 'x');
+  size_t size;
+  ASSERT_TRUE(cache.Get("a", &buffer, &size));
+  ASSERT_EQ(40u, size);
+  ASSERT_EQ(80u, buffer.size());
+
+  ASSERT_TRUE(cache.Erase("a"));
+  ASSERT_FALSE(cache.Contains("a"));
+  ASSERT_FALSE(cache.Get("a", &buffer, &size));
+  ASSERT_FALSE(cache.Erase("a"));
+}
+
+TEST(StashCacheTest, DirtyStashesAreNotEvicted) {
+  StashCache cache(100);
+  ASSERT_TRUE(cache.Put("a", Data('a', 60).data(), 60));
+  ASSERT_TRUE(cache.Fits(40));
+  ASSERT_FALSE(cache.Fits(41));
+  ASSERT_FALSE(cache.Put("b", Data('b', 60).data(), 60));
+  ASSERT_FALSE(cache.Put("c", Data('c', 101).data(), 101));
+  ASSERT_TRUE(cache.Contains("a"));
+  ASSERT_FALSE(cache.Contains("b"));
+  ASSERT_EQ(std::vector<std::string>{ "a" }, cache.GetDirtyIds());
+}
+
+TEST(StashCacheTest, Flush) {
+  StashCache cache(100);
+  ASSERT_TRUE(cache.Put("a", Data('a', 30).data(), 30));
+  ASSERT_TRUE(cache.Put("b", Data('b', 30).data(), 30));
+
+  std::map<std::string, std::vector<uint8_t>> storage;
+  auto writer = [&storage](const std::string& id, const std::vector<uint8_t>& data) {
+    storage[id] = data;
+    return true;
+  };
+  ASSERT_FALSE(cache.Flush("a", [](const std::string&, const std::vector<uint8_t>&) {
+    return false;
+  }));
+  ASSERT_EQ(2u, cache.GetDirtyIds().size());
+  ASSERT_EQ(60u, cache.GetDirtyBytes());
+
+  ASSERT_TRUE(cache.Flush("a", writer));
+  ASSERT_EQ(Data('a', 30), storage["a"]);
+  ASSERT_EQ(std::vector<std::string>{ "b" }, cache.GetDirtyIds());
+  ASSERT_EQ(30u, cache.GetDirtyBytes());
+  // Clean stashes can be evicted to make room.
+  ASSERT_TRUE(cache.Fits(70));
+
+  // Flushing a clean or missing stash doesn't write anything.
+  storage.clear();
+  ASSERT_TRUE(cache.Flush("a", writer));
+  ASSERT_TRUE(cache.Flush("c", writer));
+  ASSERT_TRUE(storage.empty());
+
+  // A clean stash is still cached, and doesn't report being dirty when erased.
+  ExpectCached(&cache, "a", Data('a', 30));
+  ASSERT_FALSE(cache.Erase("a"));
+  ASSERT_TRUE(cache.Erase("b"));
+}
+
+TEST(StashCacheTest, EvictsLeastRecentlyUsedCleanStashes) {
+  StashCache cache(100);
+  auto writer = [](const std::string&, const std::vector<uint8_t>&) { return true; };
+  ASSERT_TRUE(cache.Put("a", Data('a', 30).data(), 30));
+  ASSERT_TRUE(cache.Put("b", Data('b', 30).data(), 30));
+  ASSERT_TRUE(cache.Put("c", Data('c', 30).data(), 30));
+  ASSERT_TRUE(cache.Flush("a", writer));
+  ASSERT_TRUE(cache.Flush("b", writer));
+
+  // "a" is used after "b", so "b" goes first.
+  ExpectCached(&cache, "a", Data('a', 30));
+  ASSERT_TRUE(cache.Put("d", Data('d', 30).data(), 30));
+  ASSERT_TRUE(cache.Contains("a"));
+  ASSERT_FALSE(cache.Contains("b"));
+  ASSERT_TRUE(cache.Contains("c"));
+
+  ASSERT_TRUE(cache.Put("e", Data('e', 10).data(), 10));
+  ASSERT_TRUE(cache.Contains("a"));
+  ASSERT_TRUE(cache.Put("f", Data('f', 10).data(), 10));
+  ASSERT_FALSE(cache.Contains("a"));
+  ExpectCached(&cache, "c", Data('c', 30));
+  ExpectCached(&cache, "d", Data('d', 30));
+}
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -29,6 +30,7 @@
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/memory.h>
 #include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
@@ -131,9 +133,29 @@ static Value* BlobToString(const char* name, State* state,
   return args[0].release();
 }
 
+// Returns the properties set by a test, e.g. to tune block_image_update, and the system ones
+// otherwise.
+class TestUpdaterRuntime : public UpdaterRuntime {
+ public:
+  explicit TestUpdaterRuntime(const std::unordered_map<std::string, std::string>* properties)
+      : UpdaterRuntime(nullptr), properties_(properties) {}
+
+  std::string GetProperty(const std::string_view key,
+                          const std::string_view default_value) const override {
+    auto it = properties_->find(std::string(key));
+    if (it != properties_->end()) {
+      return it->second;
+    }
+    return UpdaterRuntime::GetProperty(key, default_value);
+  }
+
+ private:
+  const std::unordered_map<std::string, std::string>* properties_;
+};
+
 class UpdaterTestBase {
  protected:
-  UpdaterTestBase() : updater_(std::make_unique<UpdaterRuntime>(nullptr)) {}
+  UpdaterTestBase() : updater_(std::make_unique<TestUpdaterRuntime>(&properties_)) {}
 
   void SetUp() {
     RegisterBuiltins();
@@ -198,6 +220,8 @@ class UpdaterTestBase {
   std::string last_command_file_;
   std::string image_file_;
 
+  // The properties seen by the updater, on top of the system ones.
+  std::unordered_map<std::string, std::string> properties_;
   Updater updater_;
 
  private:
@@ -232,6 +256,21 @@ class UpdaterTest : public UpdaterTestBase, public ::testing::Test {
   void FlushUpdaterCommandPipe() const {
     fflush(updater_.cmd_pipe_.get());
   }
+
+  // Runs block_image_update in a child process that gets killed as abruptly as by a power loss, as
+  // soon as it writes a stash of more than 5 blocks. The image blocks that are written have to be
+  // below that, as the file size limit applies to the offset in any file. Stashes are no longer
+  // kept in memory afterwards, so that they are written when created.
+  void RunInterruptedBlockImageUpdate(const PackageEntries& entries) {
+    properties_["ro.recovery.updater.stash_memory_bytes"] = "0";
+    auto run = [this, &entries]() {
+      struct rlimit limit = { 5 * 4096, 5 * 4096 };
+      setrlimit(RLIMIT_FSIZE, &limit);
+      RunBlockImageUpdate(false, entries, image_file_, "");
+      _exit(0);
+    };
+    ASSERT_EXIT(run(), ::testing::KilledBySignal(SIGXFSZ), "");
+  }
 };
 
 TEST_F(UpdaterTest, getprop) {
@@ -683,6 +722,24 @@ static void GetEntriesForBsdiff(std::string_view source, std::string_view target
   };
 }
 
+// Returns the bsdiff command that patches 'source' at 'source_range' into 'target' at
+// 'target_range', with the patch appended to 'patch_data'.
+static std::string GetBsdiffCommand(std::string_view source, const std::string& source_range,
+                                    std::string_view target, const std::string& target_range,
+                                    std::string* patch_data) {
+  TemporaryFile patch_file;
+  CHECK_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(source.data()), source.size(),
+                             reinterpret_cast<const uint8_t*>(target.data()), target.size(),
+                             patch_file.path, nullptr));
+  std::string patch;
+  CHECK(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string command = android::base::StringPrintf(
+      "bsdiff %zu %zu %s %s %s %zu %s", patch_data->size(), patch.size(), GetSha1(source).c_str(),
+      GetSha1(target).c_str(), target_range.c_str(), source.size() / 4096, source_range.c_str());
+  *patch_data += patch;
+  return command;
+}
+
 TEST_F(UpdaterTest, block_image_update_patch_data) {
   // Both source and target images have 10 blocks.
   std::string source =
@@ -702,6 +759,100 @@ TEST_F(UpdaterTest, block_image_update_patch_data) {
   ASSERT_EQ(target, updated);
 }
 
+TEST_F(UpdaterTest, block_image_update_patch_batch) {
+  std::string block_a(4096, 'a');
+  std::string block_x = std::string(2048, 'x') + std::string(2048, 'a');
+  std::string block_y = std::string(2048, 'x') + std::string(2048, 'y');
+  std::string block_z = std::string(2048, 'z') + std::string(2048, 'a');
+
+  // The second command reads the block written by the first one, so it's only started once that's
+  // written, while the third one is patched along with the first one.
+  std::string patch_data;
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "3",
+    "0",
+    "0",
+    GetBsdiffCommand(block_a, "2,0,1", block_x, "2,1,2", &patch_data),
+    GetBsdiffCommand(block_x, "2,1,2", block_y, "2,2,3", &patch_data),
+    GetBsdiffCommand(block_a, "2,0,1", block_z, "2,3,4", &patch_data),
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", patch_data },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  for (const char* patch_threads : { "1", "4" }) {
+    SCOPED_TRACE(patch_threads);
+    properties_["ro.recovery.updater.patch_threads"] = patch_threads;
+
+    ASSERT_TRUE(android::base::WriteStringToFile(block_a + std::string(4096 * 3, '\0'),
+                                                 image_file_));
+    RunBlockImageUpdate(false, entries, image_file_, "t");
+
+    std::string updated_contents;
+    ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+    ASSERT_EQ(block_a + block_x + block_y + block_z, updated_contents);
+  }
+}
+
+TEST_F(UpdaterTest, block_image_update_patch_batch_resume) {
+  std::string block1(4096, '1');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block6(4096, '6');
+  std::string block_x = std::string(2048, 'x') + std::string(2048, '1');
+  std::string block_y = std::string(2048, 'y') + std::string(2048, '3');
+  std::string block_z = std::string(2048, 'z') + std::string(2048, '4');
+
+  // The second command overwrites the source of the first one, so it's only started once that's
+  // written, and after a checkpoint that records it. The third one is patched along with the first
+  // one, and interrupted when it's written.
+  std::string patch_data;
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "3",
+    "0",
+    "0",
+    GetBsdiffCommand(block1, "2,0,1", block_x, "2,1,2", &patch_data),
+    GetBsdiffCommand(block3, "2,2,3", block_y, "2,0,1", &patch_data),
+    GetBsdiffCommand(block4, "2,3,4", block_z, "2,5,6", &patch_data),
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", patch_data },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  properties_["ro.recovery.updater.patch_threads"] = "4";
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      block1 + std::string(4096, '2') + block3 + block4 + std::string(4096, '5') + block6,
+      image_file_));
+  RunInterruptedBlockImageUpdate(entries);
+
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block_y + block_x + block3 + block4 + std::string(4096, '5') + block6,
+            updated_contents);
+
+  std::string last_command_actual;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file_, &last_command_actual));
+  ASSERT_EQ("0\n" + transfer_list[TransferList::kTransferListHeaderLines], last_command_actual);
+
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block_y + block_x + block3 + block4 + std::string(4096, '5') + block_z,
+            updated_contents);
+}
+
 TEST_F(UpdaterTest, block_image_update_patch_overrun) {
   // Both source and target images have 10 blocks.
   std::string source =
@@ -864,6 +1015,58 @@ TEST_F(UpdaterTest, brotli_new_data) {
   ASSERT_EQ(brotli_new_data, updated_content);
 }
 
+TEST_F(UpdaterTest, chunked_brotli_new_data) {
+  auto generator = []() { return rand() % 128; };
+  // Generate 100 blocks of random data.
+  std::string new_data;
+  new_data.reserve(4096 * 100);
+  generate_n(back_inserter(new_data), 4096 * 100, generator);
+
+  // Compress the data into frames of 16 blocks, each prefixed with its compressed and
+  // uncompressed sizes.
+  std::string encoded_data;
+  for (size_t offset = 0; offset < new_data.size(); offset += 4096 * 16) {
+    std::string frame = new_data.substr(offset, 4096 * 16);
+    size_t encoded_size = BrotliEncoderMaxCompressedSize(frame.size());
+    std::string encoded_frame(encoded_size, 0);
+    ASSERT_TRUE(BrotliEncoderCompress(
+        BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, frame.size(),
+        reinterpret_cast<const uint8_t*>(frame.data()), &encoded_size,
+        reinterpret_cast<uint8_t*>(const_cast<char*>(encoded_frame.data()))));
+    encoded_frame.resize(encoded_size);
+
+    char header[8];
+    android::base::put_unaligned<uint32_t>(header, encoded_frame.size());
+    android::base::put_unaligned<uint32_t>(header + 4, frame.size());
+    encoded_data.append(header, sizeof(header));
+    encoded_data += encoded_frame;
+  }
+
+  // Write ranges that don't line up with the frames.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "100",
+    "0",
+    "0",
+    "new 2,0,1",
+    "new 4,1,20,20,50",
+    "new 2,50,97",
+    "new 2,97,100",
+  };
+
+  PackageEntries entries{
+    { "new_data.mbr", std::move(encoded_data) },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_content));
+  ASSERT_EQ(new_data, updated_content);
+}
+
 TEST_F(UpdaterTest, last_command_update) {
   std::string block1(4096, '1');
   std::string block2(4096, '2');
@@ -1019,6 +1222,402 @@ TEST_F(UpdaterTest, last_command_verify) {
   ASSERT_EQ(-1, access(last_command_file_.c_str(), R_OK));
 }
 
+TEST_F(UpdaterTest, stash_arena_stays_within_max_stash) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block1_hash = GetSha1(block1);
+  std::string block2_hash = GetSha1(block2);
+  std::string block3_hash = GetSha1(block3);
+
+  // No more than two blocks are stashed at a time. But the freed stash is only deleted at a
+  // checkpoint, and the third stash is created before the next one is due.
+  std::vector<std::string> transfer_list_fail{
+    // clang-format off
+    "4",
+    "2",
+    "2",
+    "2",
+    "stash " + block1_hash + " 2,0,1",
+    "stash " + block2_hash + " 2,1,2",
+    "free " + block2_hash,
+    "stash " + block3_hash + " 2,2,3",
+    "abort",
+    // clang-format on
+  };
+
+  std::vector<std::string> transfer_list_continue{
+    // clang-format off
+    "4",
+    "2",
+    "2",
+    "2",
+    "stash " + block1_hash + " 2,0,1",
+    "stash " + block2_hash + " 2,1,2",
+    "free " + block2_hash,
+    "stash " + block3_hash + " 2,2,3",
+    "move " + block3_hash + " 2,0,1 1 - " + block3_hash + ":2,0,1",
+    "free " + block3_hash,
+    "move " + block1_hash + " 2,2,3 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+  };
+
+  std::string stash_dir = std::string(temp_stash_base_.path) + "/" + GetSha1(image_file_) + "/";
+  properties_["ro.recovery.updater.stash_backend"] = "arena";
+  // Without a stash in memory, and with one that is only written to the arena at the checkpoint.
+  for (const char* stash_memory_bytes : { "0", "4096" }) {
+    SCOPED_TRACE(stash_memory_bytes);
+    properties_["ro.recovery.updater.stash_memory_bytes"] = stash_memory_bytes;
+
+    ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3, image_file_));
+    entries["transfer_list"] = android::base::Join(transfer_list_fail, '\n');
+    RunBlockImageUpdate(false, entries, image_file_, "");
+
+    // The arena wasn't grown for the third stash.
+    struct stat sb;
+    ASSERT_EQ(0, stat((stash_dir + "stash.arena").c_str(), &sb));
+    ASSERT_EQ(2 * 4096, sb.st_size);
+
+    // The stashes that are still needed survived.
+    entries["transfer_list"] = android::base::Join(transfer_list_continue, '\n');
+    RunBlockImageUpdate(false, entries, image_file_, "t");
+
+    std::string updated_contents;
+    ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+    ASSERT_EQ(block3 + block2 + block1, updated_contents);
+  }
+}
+
+TEST_F(UpdaterTest, prefetch_sources_written_by_earlier_commands) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block1_hash = GetSha1(block1);
+
+  // Each command reads the block written by the one before it, which the prefetcher may have read
+  // ahead of the write.
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "3",
+    "1",
+    "1",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 2,1,2",
+    "stash " + block1_hash + " 2,2,3",
+    "move " + block1_hash + " 2,3,4 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  properties_["ro.recovery.updater.prefetch_commands"] = "16";
+  for (const char* stash_backend : { "", "arena" }) {
+    SCOPED_TRACE(stash_backend);
+    properties_["ro.recovery.updater.stash_backend"] = stash_backend;
+
+    ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3 + block4, image_file_));
+    RunBlockImageUpdate(false, entries, image_file_, "t");
+
+    std::string updated_contents;
+    ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+    ASSERT_EQ(block1 + block1 + block1 + block1, updated_contents);
+  }
+}
+
+TEST_F(UpdaterTest, prefetch_resumed_update) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block1_hash = GetSha1(block1);
+
+  std::vector<std::string> transfer_list_fail{
+    // clang-format off
+    "4",
+    "3",
+    "1",
+    "1",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 2,1,2",
+    "stash " + block1_hash + " 2,2,3",
+    "abort",
+    // clang-format on
+  };
+
+  std::vector<std::string> transfer_list_continue{
+    // clang-format off
+    "4",
+    "3",
+    "1",
+    "1",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 2,1,2",
+    "stash " + block1_hash + " 2,2,3",
+    "move " + block1_hash + " 2,3,4 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+  };
+
+  properties_["ro.recovery.updater.prefetch_commands"] = "16";
+  for (const char* stash_backend : { "", "arena" }) {
+    SCOPED_TRACE(stash_backend);
+    properties_["ro.recovery.updater.stash_backend"] = stash_backend;
+
+    ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3 + block4, image_file_));
+    entries["transfer_list"] = android::base::Join(transfer_list_fail, '\n');
+    RunBlockImageUpdate(false, entries, image_file_, "");
+
+    std::string last_command_actual;
+    ASSERT_TRUE(android::base::ReadFileToString(last_command_file_, &last_command_actual));
+    ASSERT_EQ("2\n" + transfer_list_fail[TransferList::kTransferListHeaderLines + 2],
+              last_command_actual);
+
+    // The prefetching starts after the last executed command, and the stash that the remaining
+    // move loads comes from the interrupted run.
+    entries["transfer_list"] = android::base::Join(transfer_list_continue, '\n');
+    RunBlockImageUpdate(false, entries, image_file_, "t");
+
+    std::string updated_contents;
+    ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+    ASSERT_EQ(block1 + block1 + block1 + block1, updated_contents);
+  }
+}
+
+TEST_F(UpdaterTest, prefetch_read_failure) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block1_hash = GetSha1(block1);
+
+  // The source of the second move is past the end of the image, so reading it ahead fails as well
+  // as reading it when the command is executed, with EIO for the short read. The commands that the
+  // prefetcher may have read ahead for are never reached.
+  std::vector<std::string> transfer_list_fail{
+    // clang-format off
+    "4",
+    "3",
+    "0",
+    "0",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 2,8,9",
+    "move " + block1_hash + " 2,3,4 1 2,0,1",
+    // clang-format on
+  };
+
+  std::vector<std::string> transfer_list_continue{
+    // clang-format off
+    "4",
+    "3",
+    "0",
+    "0",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 2,1,2",
+    "move " + block1_hash + " 2,3,4 1 2,0,1",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list_fail, '\n') },
+  };
+
+  properties_["ro.recovery.updater.prefetch_commands"] = "16";
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3 + block4, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "", kEioFailure);
+
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block1 + block1 + block3 + block4, updated_contents);
+
+  // The first move is recorded on the way out, and the update resumes after it.
+  std::string last_command_actual;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file_, &last_command_actual));
+  ASSERT_EQ("0\n" + transfer_list_fail[TransferList::kTransferListHeaderLines],
+            last_command_actual);
+
+  entries["transfer_list"] = android::base::Join(transfer_list_continue, '\n');
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block1 + block1 + block1 + block1, updated_contents);
+}
+
+TEST_F(UpdaterTest, checkpoint_by_bytes) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block5(4096, '5');
+  std::string block6(4096, '6');
+  std::string block1_hash = GetSha1(block1);
+  std::string block5_hash = GetSha1(block5);
+  std::string stash_hash = GetSha1(block1 + block1 + block1 + block1 + block5 + block6);
+
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "4",
+    "1",
+    "6",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 2,0,1",
+    "move " + block1_hash + " 2,3,4 1 2,0,1",
+    "stash " + stash_hash + " 2,0,6",
+    "free " + stash_hash,
+    "move " + block5_hash + " 2,0,1 1 2,4,5",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // The update is interrupted by the stash. Every command is recorded without a limit, and every
+  // other one with a limit of two blocks.
+  for (const auto& [checkpoint_bytes, last_command] :
+       std::vector<std::pair<std::string, size_t>>{ { "0", 2 }, { "8192", 1 } }) {
+    SCOPED_TRACE(checkpoint_bytes);
+    properties_["ro.recovery.updater.checkpoint_bytes"] = checkpoint_bytes;
+
+    ASSERT_TRUE(android::base::WriteStringToFile(
+        block1 + block2 + block3 + block4 + block5 + block6, image_file_));
+    RunInterruptedBlockImageUpdate(entries);
+
+    std::string last_command_actual;
+    ASSERT_TRUE(android::base::ReadFileToString(last_command_file_, &last_command_actual));
+    ASSERT_EQ(std::to_string(last_command) + "\n" +
+                  transfer_list[TransferList::kTransferListHeaderLines + last_command],
+              last_command_actual);
+
+    RunBlockImageUpdate(false, entries, image_file_, "t");
+
+    std::string updated_contents;
+    ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+    ASSERT_EQ(block5 + block1 + block1 + block1 + block5 + block6, updated_contents);
+  }
+}
+
+TEST_F(UpdaterTest, checkpoint_before_overlapping_move) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block5(4096, '5');
+  std::string block6(4096, '6');
+  std::string block7(4096, '7');
+  std::string block1_hash = GetSha1(block1);
+  std::string source_hash = GetSha1(block1 + block1 + block3 + block4 + block5 + block6);
+
+  // The second move overwrites its own source, so it's preceded by a checkpoint that deletes the
+  // freed stash, although little has been written. It's interrupted while stashing its source.
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "7",
+    "1",
+    "6",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    "move " + source_hash + " 2,1,7 6 2,0,6",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      block1 + block2 + block3 + block4 + block5 + block6 + block7, image_file_));
+  RunInterruptedBlockImageUpdate(entries);
+
+  std::string last_command_actual;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file_, &last_command_actual));
+  ASSERT_EQ("2\n" + transfer_list[TransferList::kTransferListHeaderLines + 2], last_command_actual);
+  std::string stash_dir = std::string(temp_stash_base_.path) + "/" + GetSha1(image_file_) + "/";
+  ASSERT_EQ(-1, access((stash_dir + block1_hash).c_str(), F_OK));
+
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block1 + block1 + block1 + block3 + block4 + block5 + block6, updated_contents);
+}
+
+TEST_F(UpdaterTest, checkpoint_resume_within_group) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block4(4096, '4');
+  std::string block5(4096, '5');
+  std::string block6(4096, '6');
+  std::string block1_hash = GetSha1(block1);
+  std::string block3_hash = GetSha1(block3);
+  std::string stash_hash = GetSha1(block3 + block1 + block3 + block4 + block5 + block6);
+
+  // The commands before the interruption are all in the first group, so they are executed again
+  // after it. The first stash is loaded from its file then, as its source has been overwritten.
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "4",
+    "2",
+    "7",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "move " + block3_hash + " 2,0,1 1 2,2,3",
+    "stash " + stash_hash + " 2,0,6",
+    "free " + stash_hash,
+    "move " + block1_hash + " 2,3,4 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3 + block4 + block5 + block6,
+                                               image_file_));
+  RunInterruptedBlockImageUpdate(entries);
+
+  ASSERT_EQ(-1, access(last_command_file_.c_str(), F_OK));
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block3 + block1 + block3 + block4 + block5 + block6, updated_contents);
+
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block3 + block1 + block3 + block1 + block5 + block6, updated_contents);
+}
+
 class ResumableUpdaterTest : public UpdaterTestBase, public testing::TestWithParam<size_t> {
  protected:
   void SetUp() override {
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -38,6 +39,7 @@
 #include "install/package.h"
 #include "install/verifier.h"
 #include "otautil/sysutil.h"
+#include "private/verifier.h"
 
 using namespace std::string_literals;
 
@@ -246,6 +248,72 @@ TEST(VerifierTest, LoadKeysFromZipfile_multiple_key) {
   VerifyPackageWithCertificates("otasigned_v5.zip", certs);
 }
 
+TEST(VerifierTest, LoadKeysFromZipfileCached) {
+  TemporaryFile otacerts;
+  BuildCertificateArchive({ from_testdata_base("testkey_v1.x509.pem") }, otacerts.release());
+  auto certs = LoadKeysFromZipfileCached(otacerts.path);
+  ASSERT_NE(nullptr, certs);
+  ASSERT_EQ(1, certs->size());
+  ASSERT_FALSE(certs->front().issuer_and_serial.empty());
+
+  // The parsed keys are reused while the file stays the same.
+  ASSERT_EQ(certs, LoadKeysFromZipfileCached(otacerts.path));
+
+  TemporaryFile new_otacerts;
+  BuildCertificateArchive(
+      { from_testdata_base("testkey_v3.x509.pem"), from_testdata_base("testkey_v5.x509.pem") },
+      new_otacerts.release());
+  ASSERT_EQ(0, rename(new_otacerts.path, otacerts.path));
+  auto new_certs = LoadKeysFromZipfileCached(otacerts.path);
+  ASSERT_NE(nullptr, new_certs);
+  ASSERT_EQ(2, new_certs->size());
+
+  VerifyPackageWithCertificates("otasigned_v3.zip", *new_certs);
+  VerifyPackageWithCertificates("otasigned_v5.zip", *new_certs);
+}
+
+TEST(VerifierTest, GetPackageSigner) {
+  // Each package names the certificate of its test key as the signer, and not one of another key
+  // pair. The v1 and v3 (also v2 and v4) test keys share a certificate subject and serial number.
+  std::vector<std::pair<std::string, std::string>> versions = {
+    { "v1", "v2" }, { "v2", "v3" }, { "v3", "v4" }, { "v4", "v5" }, { "v5", "v1" },
+    { "4096bits", "v5" },
+  };
+  for (const auto& [version, other_version] : versions) {
+    auto package =
+        Package::CreateMemoryPackage(from_testdata_base("otasigned_" + version + ".zip"), nullptr);
+    ASSERT_NE(nullptr, package);
+    std::vector<uint8_t> signer = GetPackageSigner(package.get());
+    ASSERT_FALSE(signer.empty());
+
+    Certificate cert(0, Certificate::KEY_TYPE_RSA, nullptr, nullptr);
+    LoadKeyFromFile(from_testdata_base("testkey_" + version + ".x509.pem"), &cert);
+    ASSERT_EQ(cert.issuer_and_serial, signer) << version;
+
+    Certificate other_cert(0, Certificate::KEY_TYPE_RSA, nullptr, nullptr);
+    LoadKeyFromFile(from_testdata_base("testkey_" + other_version + ".x509.pem"), &other_cert);
+    ASSERT_NE(other_cert.issuer_and_serial, signer) << version;
+  }
+}
+
+TEST(VerifierTest, OrderKeysBySigner) {
+  std::vector<Certificate> certs;
+  for (const auto& version : { "v2", "v5", "v3", "v4" }) {
+    certs.emplace_back(0, Certificate::KEY_TYPE_RSA, nullptr, nullptr);
+    LoadKeyFromFile(from_testdata_base("testkey_"s + version + ".x509.pem"), &certs.back());
+  }
+
+  auto package = Package::CreateMemoryPackage(from_testdata_base("otasigned_v3.zip"), nullptr);
+  ASSERT_NE(nullptr, package);
+  std::vector<uint8_t> signer = GetPackageSigner(package.get());
+  // The key of the signer is tried first, and the others keep their order.
+  ASSERT_EQ((std::vector<size_t>{ 2, 0, 1, 3 }), OrderKeysBySigner(certs, signer));
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(package.get(), certs));
+
+  // Without a signer, the keys are tried in order.
+  ASSERT_EQ((std::vector<size_t>{ 0, 1, 2, 3 }), OrderKeysBySigner(certs, {}));
+}
+
 class VerifierTest : public testing::TestWithParam<std::vector<std::string>> {
  protected:
   void SetUp() override {
@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/block_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+std::ostream& operator<<(std::ostream& os, BlockIo::Backend backend) {
+  switch (backend) {
+    case BlockIo::Backend::kPread:
+      return os << "pread";
+    case BlockIo::Backend::kIoUring:
+      return os << "io_uring";
+  }
+  return os << "unknown";
+}
+
+bool BlockIo::Discard(const RangeSet& ranges) {
+  for (const auto& [begin, end] : ranges) {
+    uint64_t args[2] = { static_cast<uint64_t>(begin) * block_size_,
+                         static_cast<uint64_t>(end - begin) * block_size_ };
+    if (ioctl(fd_, BLKDISCARD, &args) == -1) {
+      // On devices that does not support BLKDISCARD, ignore the error.
+      if (errno == EOPNOTSUPP) {
+        return true;
+      }
+      PLOG(ERROR) << "BLKDISCARD ioctl failed";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool BlockIo::Zero(const RangeSet& ranges) {
+  if (zero_method_ == ZeroMethod::kUnknown) {
+    struct stat sb;
+    if (fstat(fd_, &sb) == -1) {
+      return false;
+    }
+    if (S_ISBLK(sb.st_mode)) {
+      zero_method_ = ZeroMethod::kBlkZeroOut;
+    } else if (S_ISREG(sb.st_mode)) {
+      zero_method_ = ZeroMethod::kZeroRange;
+    } else {
+      zero_method_ = ZeroMethod::kWrite;
+    }
+  }
+
+  for (const auto& [begin, end] : ranges) {
+    if (!ZeroBytes(static_cast<off64_t>(begin) * block_size_,
+                   static_cast<uint64_t>(end - begin) * block_size_)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns whether the errno of a failed BLKZEROOUT / fallocate(2) means that the operation isn't
+// supported, as opposed to an I/O error or an invalid request (EINVAL), which fail the write.
+static bool IsUnsupported(int error) {
+  return error == EOPNOTSUPP || error == ENOTTY;
+}
+
+bool BlockIo::ZeroBytes(off64_t offset, uint64_t size) {
+  if (zero_method_ == ZeroMethod::kBlkZeroOut) {
+    uint64_t args[2] = { static_cast<uint64_t>(offset), size };
+    if (ioctl(fd_, BLKZEROOUT, &args) == 0) {
+      return true;
+    }
+    if (!IsUnsupported(errno)) {
+      PLOG(ERROR) << "BLKZEROOUT ioctl failed";
+      return false;
+    }
+    PLOG(INFO) << "BLKZEROOUT is unsupported; writing zeros instead";
+    zero_method_ = ZeroMethod::kWrite;
+  }
+
+  if (zero_method_ == ZeroMethod::kZeroRange) {
+    if (fallocate(fd_, FALLOC_FL_ZERO_RANGE, offset, size) == 0) {
+      return true;
+    }
+    if (!IsUnsupported(errno)) {
+      PLOG(ERROR) << "fallocate(FALLOC_FL_ZERO_RANGE) failed";
+      return false;
+    }
+    zero_method_ = ZeroMethod::kPunchHole;
+  }
+
+  // Punching holes can't extend the file.
+  struct stat sb;
+  if (zero_method_ == ZeroMethod::kPunchHole && fstat(fd_, &sb) == 0 &&
+      offset + static_cast<off64_t>(size) <= sb.st_size) {
+    if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+      return true;
+    }
+    if (!IsUnsupported(errno)) {
+      PLOG(ERROR) << "fallocate(FALLOC_FL_PUNCH_HOLE) failed";
+      return false;
+    }
+    zero_method_ = ZeroMethod::kWrite;
+  }
+
+  return WriteZeros(offset, size);
+}
+
+bool BlockIo::WriteZeros(off64_t offset, uint64_t size) {
+  static constexpr size_t kZeroPageSize = 4096;
+  static const uint8_t kZeroPage[kZeroPageSize] = {};
+
+  // Point all the iovecs at the same page, so that each syscall writes up to 4 MiB.
+  std::vector<iovec> iovs;
+  while (size > 0) {
+    iovs.clear();
+    uint64_t batch = 0;
+    while (iovs.size() < IOV_MAX && batch < size) {
+      size_t len = std::min<uint64_t>(kZeroPageSize, size - batch);
+      iovs.push_back({ const_cast<uint8_t*>(kZeroPage), len });
+      batch += len;
+    }
+
+    ssize_t n = TEMP_FAILURE_RETRY(pwritev64(fd_, iovs.data(), iovs.size(), offset));
+    if (n <= 0) {
+      if (n == 0) errno = EIO;
+      PLOG(ERROR) << "Failed to write " << batch << " bytes of zeros";
+      return false;
+    }
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+namespace {
+
+class PreadBlockIo : public BlockIo {
+ public:
+  PreadBlockIo(int fd, size_t block_size) : BlockIo(fd, block_size) {}
+
+  bool Read(const RangeSet& ranges, uint8_t* buffer) override {
+    for (const auto& [begin, end] : ranges) {
+      size_t size = (end - begin) * block_size_;
+      if (!android::base::ReadFullyAtOffset(fd_, buffer, size,
+                                            static_cast<off64_t>(begin) * block_size_)) {
+        return false;
+      }
+      buffer += size;
+    }
+    return true;
+  }
+
+  bool Write(const RangeSet& ranges, const uint8_t* buffer) override {
+    for (const auto& [begin, end] : ranges) {
+      size_t size = (end - begin) * block_size_;
+      if (!android::base::WriteFullyAtOffset(fd_, buffer, size,
+                                             static_cast<off64_t>(begin) * block_size_)) {
+        return false;
+      }
+      buffer += size;
+    }
+    return true;
+  }
+
+  Backend backend() const override {
+    return Backend::kPread;
+  }
+};
+
+#if HAVE_IO_URING
+
+// A minimal io_uring client on top of the raw syscalls, so that we don't depend on liburing. Each
+// Read() / Write() queues one readv / writev request per run of adjacent blocks, keeps up to
+// 'entries' of them in flight, and returns once all of them have completed.
+class IoUringBlockIo : public BlockIo {
+ public:
+  static std::unique_ptr<IoUringBlockIo> Create(int fd, size_t block_size, unsigned entries) {
+    std::unique_ptr<IoUringBlockIo> io(new IoUringBlockIo(fd, block_size));
+    if (!io->Init(entries)) {
+      return nullptr;
+    }
+    return io;
+  }
+
+  ~IoUringBlockIo() override {
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+  }
+
+  bool Read(const RangeSet& ranges, uint8_t* buffer) override {
+    return Submit(IORING_OP_READV, ranges, buffer);
+  }
+
+  bool Write(const RangeSet& ranges, const uint8_t* buffer) override {
+    // Requests in a batch may complete in any order, which is only fine if the ranges don't
+    // overlap. Transfer lists never contain such targets, but be safe regardless.
+    if (HasOverlappingRanges(ranges)) {
+      return fallback_.Write(ranges, buffer);
+    }
+    return Submit(IORING_OP_WRITEV, ranges, const_cast<uint8_t*>(buffer));
+  }
+
+  Backend backend() const override {
+    return disabled_ ? Backend::kPread : Backend::kIoUring;
+  }
+
+ private:
+  IoUringBlockIo(int fd, size_t block_size) : BlockIo(fd, block_size), fallback_(fd, block_size) {}
+
+  bool Init(unsigned entries) {
+    io_uring_params p = {};
+    ring_fd_.reset(syscall(__NR_io_uring_setup, entries, &p));
+    if (ring_fd_ == -1) {
+      PLOG(INFO) << "io_uring is unavailable";
+      return false;
+    }
+
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+#endif
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to map io_uring submission queue";
+      return false;
+    }
+    if (single_mmap) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to map io_uring completion queue";
+        return false;
+      }
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                 IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to map io_uring submission queue entries";
+      return false;
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    entries_ = p.sq_entries;
+    return true;
+  }
+
+  static bool HasOverlappingRanges(const RangeSet& ranges) {
+    std::vector<Range> sorted(ranges.cbegin(), ranges.cend());
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t i = 1; i < sorted.size(); i++) {
+      if (sorted[i].first < sorted[i - 1].second) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Submit(uint8_t opcode, const RangeSet& ranges, uint8_t* buffer) {
+    if (disabled_) {
+      return opcode == IORING_OP_READV ? fallback_.Read(ranges, buffer)
+                                       : fallback_.Write(ranges, buffer);
+    }
+
+    std::vector<iovec> iovs;
+    std::vector<off64_t> offsets;
+    iovs.reserve(ranges.size());
+    offsets.reserve(ranges.size());
+    uint8_t* data = buffer;
+    for (const auto& [begin, end] : ranges) {
+      size_t size = (end - begin) * block_size_;
+      off64_t offset = static_cast<off64_t>(begin) * block_size_;
+      // The data of adjacent ranges is adjacent in the buffer too, so they make a single request.
+      if (!iovs.empty() && offsets.back() + static_cast<off64_t>(iovs.back().iov_len) == offset) {
+        iovs.back().iov_len += size;
+      } else {
+        iovs.push_back({ data, size });
+        offsets.push_back(offset);
+      }
+      data += size;
+    }
+
+    size_t next = 0;
+    size_t in_flight = 0;
+    int error = 0;
+    while ((error == 0 && next < iovs.size()) || in_flight > 0) {
+      // Queue as many requests as the ring allows. The kernel consumes the queued entries during
+      // io_uring_enter(2), so the whole ring is available again afterwards.
+      unsigned tail = *sq_tail_;
+      while (error == 0 && next < iovs.size() && in_flight < entries_) {
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe* sqe = &static_cast<io_uring_sqe*>(sqes_)[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(&iovs[next]);
+        sqe->len = 1;
+        sqe->off = offsets[next];
+        sqe->user_data = next;
+        sq_array_[index] = index;
+        tail++;
+        next++;
+        in_flight++;
+      }
+      __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+      unsigned to_submit = tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+      if (syscall(__NR_io_uring_enter, ring_fd_.get(), to_submit, 1, IORING_ENTER_GETEVENTS,
+                  nullptr, 0) == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // Out of resources (EAGAIN, EBUSY, ENOMEM), or the ring is broken. Redo the whole batch,
+        // which is idempotent, with pread / pwrite once the requests already submitted are done
+        // with the buffer.
+        PLOG(WARNING) << "io_uring_enter failed, falling back to pread/pwrite";
+        Abandon(in_flight);
+        disabled_ = true;
+        return Submit(opcode, ranges, buffer);
+      }
+
+      unsigned head = *cq_head_;
+      unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; head++) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        const iovec& iov = iovs[cqe.user_data];
+        if (cqe.res < 0) {
+          if (error == 0) error = -cqe.res;
+        } else if (static_cast<size_t>(cqe.res) < iov.iov_len && error == 0) {
+          // Finish short transfers synchronously.
+          errno = 0;
+          if (!CompleteSynchronously(opcode, iov, offsets[cqe.user_data], cqe.res)) {
+            // Running into EOF doesn't set errno.
+            error = errno != 0 ? errno : EIO;
+          }
+        }
+        in_flight--;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    if (error == EINVAL || error == EOPNOTSUPP) {
+      // Kernels before 5.1 don't know about vectored requests (and some sandboxes reject them).
+      // Redo the whole batch, which is idempotent, and stop using io_uring.
+      LOG(WARNING) << "io_uring request rejected (" << strerror(error)
+                   << "), falling back to pread/pwrite";
+      disabled_ = true;
+      return Submit(opcode, ranges, buffer);
+    }
+    if (error != 0) {
+      errno = error;
+      return false;
+    }
+    return true;
+  }
+
+  // Takes back the queued requests that the kernel hasn't consumed, and waits for the 'in_flight'
+  // ones that it has to complete, without looking at their results.
+  void Abandon(size_t in_flight) {
+    unsigned sq_head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    in_flight -= *sq_tail_ - sq_head;
+    __atomic_store_n(sq_tail_, sq_head, __ATOMIC_RELEASE);
+
+    while (in_flight > 0) {
+      unsigned head = *cq_head_;
+      unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      if (head == cq_tail) {
+        // Completions are posted without io_uring_enter(2), but waiting there is cheaper.
+        if (syscall(__NR_io_uring_enter, ring_fd_.get(), 0, 1, IORING_ENTER_GETEVENTS, nullptr,
+                    0) == -1 &&
+            errno != EINTR) {
+          usleep(1000);
+        }
+        continue;
+      }
+      in_flight -= cq_tail - head;
+      __atomic_store_n(cq_head_, cq_tail, __ATOMIC_RELEASE);
+    }
+  }
+
+  bool CompleteSynchronously(uint8_t opcode, const iovec& iov, off64_t offset, size_t done) {
+    uint8_t* data = static_cast<uint8_t*>(iov.iov_base) + done;
+    size_t size = iov.iov_len - done;
+    if (opcode == IORING_OP_READV) {
+      return android::base::ReadFullyAtOffset(fd_, data, size, offset + done);
+    }
+    return android::base::WriteFullyAtOffset(fd_, data, size, offset + done);
+  }
+
+  PreadBlockIo fallback_;
+  bool disabled_{ false };
+
+  android::base::unique_fd ring_fd_;
+  unsigned entries_{ 0 };
+
+  void* sq_ring_{ MAP_FAILED };
+  size_t sq_ring_size_{ 0 };
+  unsigned* sq_head_{ nullptr };
+  unsigned* sq_tail_{ nullptr };
+  unsigned sq_mask_{ 0 };
+  unsigned* sq_array_{ nullptr };
+  void* sqes_{ MAP_FAILED };
+  size_t sqes_size_{ 0 };
+
+  void* cq_ring_{ MAP_FAILED };
+  size_t cq_ring_size_{ 0 };
+  unsigned* cq_head_{ nullptr };
+  unsigned* cq_tail_{ nullptr };
+  unsigned cq_mask_{ 0 };
+  io_uring_cqe* cqes_{ nullptr };
+};
+
+#endif  // HAVE_IO_URING
+
+}  // namespace
+
+std::unique_ptr<BlockIo> BlockIo::Create(int fd, size_t block_size, Backend backend) {
+#if HAVE_IO_URING
+  if (backend == Backend::kIoUring) {
+    // Deep enough to keep a device busy; most commands have far fewer ranges.
+    static constexpr unsigned kIoUringEntries = 64;
+    if (auto io = IoUringBlockIo::Create(fd, block_size, kIoUringEntries); io) {
+      return io;
+    }
+  }
+#endif
+  return std::make_unique<PreadBlockIo>(fd, block_size);
+}
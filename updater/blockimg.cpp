@@ -20,22 +20,29 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <linux/fs.h>
-#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <functional>
+#include <future>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -46,7 +53,6 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <applypatch/applypatch.h>
-#include <brotli/decode.h>
 #include <fec/io.h>
 #include <openssl/sha.h>
 #include <verity/hash_tree_builder.h>
@@ -54,12 +60,18 @@
 
 #include "edify/expr.h"
 #include "edify/updater_interface.h"
+#include "edify/updater_runtime_interface.h"
 #include "otautil/dirutil.h"
 #include "otautil/error_code.h"
+#include "otautil/hash.h"
 #include "otautil/paths.h"
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
+#include "private/block_io.h"
 #include "private/commands.h"
+#include "private/new_data.h"
+#include "private/stash_arena.h"
+#include "private/stash_cache.h"
 #include "updater/install.h"
 
 #ifdef __ANDROID__
@@ -192,32 +204,12 @@ bool SetUpdatedMarker(const std::string& marker) {
   return true;
 }
 
-static bool discard_blocks(int fd, off64_t offset, uint64_t size, bool force = false) {
+static bool discard_blocks(BlockIo* io, const RangeSet& ranges, bool force = false) {
   // Don't discard blocks unless the update is a retry run or force == true
   if (!is_retry && !force) {
     return true;
   }
-
-  uint64_t args[2] = { static_cast<uint64_t>(offset), size };
-  if (ioctl(fd, BLKDISCARD, &args) == -1) {
-    // On devices that does not support BLKDISCARD, ignore the error.
-    if (errno == EOPNOTSUPP) {
-      return true;
-    }
-    PLOG(ERROR) << "BLKDISCARD ioctl failed";
-    return false;
-  }
-  return true;
-}
-
-static bool check_lseek(int fd, off64_t offset, int whence) {
-    off64_t rc = TEMP_FAILURE_RETRY(lseek64(fd, offset, whence));
-    if (rc == -1) {
-        failure_type = kLseekFailure;
-        PLOG(ERROR) << "lseek64 failed";
-        return false;
-    }
-    return true;
+  return io->Discard(ranges);
 }
 
 static void allocate(size_t size, std::vector<uint8_t>* buffer) {
@@ -228,15 +220,19 @@ static void allocate(size_t size, std::vector<uint8_t>* buffer) {
 
 /**
  * RangeSinkWriter reads data from the given FD, and writes them to the destination specified by the
- * given RangeSet.
+ * given RangeSet. Whole blocks go straight to the BlockIo; a partial block is held back until the
+ * rest of it arrives.
  */
 class RangeSinkWriter {
  public:
-  RangeSinkWriter(int fd, const RangeSet& tgt)
-      : fd_(fd),
+  RangeSinkWriter(BlockIo* io, const RangeSet& tgt)
+      : io_(io),
         tgt_(tgt),
         next_range_(0),
+        current_block_(0),
         current_range_left_(0),
+        partial_(BLOCKSIZE),
+        partial_size_(0),
         bytes_written_(0) {
     CHECK_NE(tgt.size(), static_cast<size_t>(0));
   };
@@ -263,22 +259,31 @@ class RangeSinkWriter {
         break;
       }
 
-      size_t write_now = size;
-      if (current_range_left_ < write_now) {
-        write_now = current_range_left_;
+      // Complete a partial block, or start one if there isn't a whole block to write.
+      if (partial_size_ != 0 || size < BLOCKSIZE) {
+        size_t copy_now = std::min(size, BLOCKSIZE - partial_size_);
+        memcpy(partial_.data() + partial_size_, data, copy_now);
+        partial_size_ += copy_now;
+        data += copy_now;
+        size -= copy_now;
+        written += copy_now;
+        if (partial_size_ == BLOCKSIZE) {
+          if (!WriteOutput(partial_.data(), 1)) {
+            written -= copy_now;
+            break;
+          }
+          partial_size_ = 0;
+        }
+        continue;
       }
 
-      if (!android::base::WriteFully(fd_, data, write_now)) {
-        failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-        PLOG(ERROR) << "Failed to write " << write_now << " bytes of data";
+      size_t blocks = std::min(size / BLOCKSIZE, current_range_left_);
+      if (!WriteOutput(data, blocks)) {
         break;
       }
-
-      data += write_now;
-      size -= write_now;
-
-      current_range_left_ -= write_now;
-      written += write_now;
+      data += blocks * BLOCKSIZE;
+      size -= blocks * BLOCKSIZE;
+      written += blocks * BLOCKSIZE;
     }
 
     bytes_written_ += written;
@@ -303,27 +308,38 @@ class RangeSinkWriter {
     }
 
     const Range& range = tgt_[next_range_];
-    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
-    current_range_left_ = (range.second - range.first) * BLOCKSIZE;
+    current_block_ = range.first;
+    current_range_left_ = range.second - range.first;
     next_range_++;
 
-    if (!discard_blocks(fd_, offset, current_range_left_)) {
-      return false;
-    }
-    if (!check_lseek(fd_, offset, SEEK_SET)) {
+    return discard_blocks(io_, RangeSet({ range }));
+  }
+
+  // Writes the given number of blocks at the output cursor, and advances the cursor.
+  bool WriteOutput(const uint8_t* data, size_t blocks) {
+    if (!io_->Write(RangeSet({ { current_block_, current_block_ + blocks } }), data)) {
+      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+      PLOG(ERROR) << "Failed to write " << blocks * BLOCKSIZE << " bytes of data";
       return false;
     }
+    current_block_ += blocks;
+    current_range_left_ -= blocks;
     return true;
   }
 
-  // The output file descriptor.
-  int fd_;
+  // The output device.
+  BlockIo* io_;
   // The destination ranges for the data.
   const RangeSet& tgt_;
   // The next range that we should write to.
   size_t next_range_;
-  // The number of bytes to write before moving to the next range.
+  // The block to write the next whole block to.
+  size_t current_block_;
+  // The number of blocks to write before moving to the next range.
   size_t current_range_left_;
+  // The partial block at the output cursor, and the number of bytes in it.
+  std::vector<uint8_t> partial_;
+  size_t partial_size_;
   // Total bytes written by the writer.
   size_t bytes_written_;
 };
@@ -334,286 +350,338 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
- *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * To achieve this, we expand the new data from the archive in a background thread, which pushes the
+ * decompressed data into a bounded NewDataQueue. The queue lets the background thread keep
+ * decompressing up to new_data_buffer_bytes ahead of the main thread, instead of handing each
+ * section over in lockstep; the main thread takes data off the queue when it reaches a "new"
+ * command. Chunked brotli new data ("*.mbr") is further decompressed on several threads.
  */
-struct NewThreadInfo {
-  ZipArchiveHandle za;
-  ZipEntry64 entry{};
-  bool brotli_compressed;
-
-  std::unique_ptr<RangeSinkWriter> writer;
-  BrotliDecoderState* brotli_decoder_state;
-  bool receiver_available;
+static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
+  return static_cast<NewDataDecoder*>(cookie)->Feed(data, size);
+}
 
-  pthread_mutex_t mu;
-  pthread_cond_t cv;
-};
+static void unzip_new_data(ZipArchiveHandle za, ZipEntry64 entry,
+                           std::unique_ptr<NewDataDecoder> decoder) {
+  if (ProcessZipEntryContents(za, &entry, receive_new_data, decoder.get()) != 0) {
+    decoder->Abort();
+  } else if (!decoder->Finish()) {
+    LOG(ERROR) << "Failed to decode the new data";
+  }
+}
 
-static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
-
-  while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
+static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>* buffer, BlockIo* io) {
+  if (!io->Read(src, buffer->data())) {
+    failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+    PLOG(ERROR) << "Failed to read " << src.blocks() * BLOCKSIZE << " bytes of data";
+    return -1;
+  }
+  return 0;
+}
 
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
+static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, BlockIo* io) {
+  if (!discard_blocks(io, tgt)) {
+    return -1;
+  }
 
-    data += write_now;
-    size -= write_now;
+  if (!io->Write(tgt, buffer.data())) {
+    failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+    PLOG(ERROR) << "Failed to write " << tgt.blocks() * BLOCKSIZE << " bytes of data";
+    return -1;
+  }
+  return 0;
+}
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+/**
+ * SourcePrefetcher implements the pipelined execution of a transfer list. A background thread
+ * parses the commands ahead of the main thread, and reads the source blocks (as well as the stashes
+ * that already exist) of the upcoming move/bsdiff/imgdiff/stash commands. This keeps the storage
+ * busy while the main thread patches and writes out the current command.
+ *
+ * Reading ahead doesn't violate the ordering of the transfer list: its creator guarantees that no
+ * block is read after it has been written, so the source blocks of a command can't be modified by
+ * any of the commands before it. Regardless, prefetched data goes through the same hash check as
+ * usual, and the callers fall back to a synchronous read on mismatch.
+ */
+class SourcePrefetcher {
+ public:
+  // Reads the stash with the given id into the buffer. Returns false if it's unavailable.
+  using StashReader = std::function<bool(const std::string&, std::vector<uint8_t>*)>;
+
+  // 'io' is dedicated to the prefetching thread.
+  SourcePrefetcher(std::unique_ptr<BlockIo> io, size_t max_commands, size_t max_bytes,
+                   StashReader stash_reader)
+      : io_(std::move(io)),
+        max_commands_(max_commands),
+        max_bytes_(max_bytes),
+        stash_reader_(std::move(stash_reader)) {}
+
+  ~SourcePrefetcher() {
+    Stop();
+  }
+
+  // Starts prefetching the commands in 'transfer_list', beginning from the command at
+  // 'start_index'. 'transfer_list' must outlive the object.
+  bool Start(const CompactTransferList* transfer_list, size_t start_index) {
+    transfer_list_ = transfer_list;
+    current_ = start_index;
+    next_ = start_index;
+    thread_ = std::thread(&SourcePrefetcher::ThreadLoop, this);
+    return true;
+  }
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
     }
   }
 
-  return true;
-}
-
-static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+  // Notifies that the main thread is about to execute the command at 'cmdindex'. Data prefetched
+  // for the earlier commands will be dropped.
+  void Advance(size_t cmdindex) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      current_ = cmdindex;
+      while (!entries_.empty() && entries_.begin()->first < cmdindex) {
+        buffered_bytes_ -= entries_.begin()->second.bytes;
+        entries_.erase(entries_.begin());
+      }
+      taken_.erase(taken_.begin(), taken_.lower_bound(cmdindex));
+    }
+    cv_.notify_all();
+  }
 
-  while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
+  // Copies the prefetched contents of 'src' for the command at 'cmdindex' into 'buffer', waiting
+  // for the in-flight read if needed. Returns false if the data is unavailable, in which case the
+  // caller should read the blocks by itself.
+  bool TakeSourceBlocks(size_t cmdindex, const RangeSet& src, std::vector<uint8_t>* buffer) {
+    std::vector<uint8_t> data;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      Entry* entry = WaitForEntry(cmdindex, &lock);
+      if (entry == nullptr || entry->src != src || entry->src_data.empty()) {
         return false;
       }
-      pthread_cond_wait(&nti->cv, &nti->mu);
+      data = std::move(entry->src_data);
+      entry->bytes -= data.size();
+      buffered_bytes_ -= data.size();
     }
-    pthread_mutex_unlock(&nti->mu);
+    cv_.notify_all();
 
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
+    CHECK_LE(data.size(), buffer->size());
+    memcpy(buffer->data(), data.data(), data.size());
+    return true;
+  }
 
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
-      return false;
+  // Same as above, but for the stash 'id' to be loaded by the command at 'cmdindex'.
+  bool TakeStash(size_t cmdindex, const std::string& id, std::vector<uint8_t>* buffer) {
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      Entry* entry = WaitForEntry(cmdindex, &lock);
+      if (entry == nullptr) {
+        return false;
+      }
+      auto it = entry->stashes.find(id);
+      if (it == entry->stashes.end()) {
+        return false;
+      }
+      *buffer = std::move(it->second);
+      entry->stashes.erase(it);
+      entry->bytes -= buffer->size();
+      buffered_bytes_ -= buffer->size();
     }
-    uint8_t buffer[buffer_size];
-    size_t available_in = size;
-    size_t available_out = buffer_size;
-    uint8_t* next_out = buffer;
+    cv_.notify_all();
+    return true;
+  }
 
-    // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
-    BrotliDecoderResult result = BrotliDecoderDecompressStream(
-        nti->brotli_decoder_state, &available_in, &data, &available_out, &next_out, nullptr);
+ private:
+  struct Entry {
+    RangeSet src;
+    std::vector<uint8_t> src_data;
+    std::unordered_map<std::string, std::vector<uint8_t>> stashes;
+    size_t bytes{ 0 };
+  };
 
-    if (result == BROTLI_DECODER_RESULT_ERROR) {
-      LOG(ERROR) << "Decompression failed with "
-                 << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(nti->brotli_decoder_state));
-      return false;
+  // Returns the prefetched entry for 'cmdindex', or nullptr if there's none. Must be called with
+  // 'lock' held.
+  Entry* WaitForEntry(size_t cmdindex, std::unique_lock<std::mutex>* lock) {
+    cv_.wait(*lock, [this, cmdindex]() { return in_flight_ != cmdindex; });
+    auto it = entries_.find(cmdindex);
+    if (it == entries_.end()) {
+      // Don't let the background thread pick up a command that is being executed. The ones before
+      // it may still be ahead, when a batch of commands is started out of order.
+      if (cmdindex >= next_) {
+        taken_.insert(cmdindex);
+      }
+      return nullptr;
     }
+    return &it->second;
+  }
 
-    LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
-               << size - available_in << ", decoder status " << result;
-
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
+  // Returns the next command for the background thread to prefetch. Must be called with 'mu_' held.
+  size_t NextCommand() const {
+    size_t cmdindex = std::max(next_, current_);
+    while (taken_.count(cmdindex) != 0) {
+      cmdindex++;
     }
+    return cmdindex;
+  }
 
-    // Update the remaining size. The input data ptr is already updated by brotli decoder function.
-    size = available_in;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+  void ThreadLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+      cv_.wait(lock, [this]() {
+        return stopped_ || (NextCommand() < transfer_list_->size() &&
+                            NextCommand() < current_ + max_commands_ &&
+                            buffered_bytes_ < max_bytes_);
+      });
+      if (stopped_) {
+        return;
+      }
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
-  }
+      size_t cmdindex = NextCommand();
+      next_ = cmdindex + 1;
+      in_flight_ = cmdindex;
+      lock.unlock();
 
-  return true;
-}
+      Entry entry;
+      bool prefetched = PrefetchCommand(cmdindex, &entry);
 
-static void* unzip_new_data(void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
-  if (nti->brotli_compressed) {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti);
-  } else {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
-  }
-  pthread_mutex_lock(&nti->mu);
-  nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
+      lock.lock();
+      in_flight_ = std::numeric_limits<size_t>::max();
+      if (prefetched && cmdindex >= current_) {
+        buffered_bytes_ += entry.bytes;
+        entries_.emplace(cmdindex, std::move(entry));
+      }
+      cv_.notify_all();
+    }
   }
-  pthread_mutex_unlock(&nti->mu);
-  return nullptr;
-}
 
-static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>* buffer, int fd) {
-  size_t p = 0;
-  for (const auto& [begin, end] : src) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      return -1;
+  // Reads the source blocks and stashes needed by the given command into 'entry'. Returns false
+  // if there's nothing to prefetch.
+  bool PrefetchCommand(size_t cmdindex, Entry* entry) {
+    // Invalid commands are of type LAST, and left to the main thread to report.
+    Command::Type type = transfer_list_->type(cmdindex);
+    if (type != Command::Type::MOVE && type != Command::Type::BSDIFF &&
+        type != Command::Type::IMGDIFF && type != Command::Type::STASH) {
+      return false;
+    }
+    auto reads = transfer_list_->reads(cmdindex);
+    if (!reads.empty()) {
+      entry->src = RangeSet(std::vector<Range>(reads.begin(), reads.end()));
     }
 
-    size_t size = (end - begin) * BLOCKSIZE;
-    if (!android::base::ReadFully(fd, buffer->data() + p, size)) {
-      failure_type = errno == EIO ? kEioFailure : kFreadFailure;
-      PLOG(ERROR) << "Failed to read " << size << " bytes of data";
-      return -1;
+    size_t src_size = entry->src.blocks() * BLOCKSIZE;
+    if (src_size > 0 && src_size <= max_bytes_) {
+      entry->src_data.resize(src_size);
+      if (io_->Read(entry->src, entry->src_data.data())) {
+        entry->bytes += src_size;
+      } else {
+        PLOG(WARNING) << "Failed to prefetch " << src_size << " bytes of data";
+        entry->src_data.clear();
+      }
     }
 
-    p += size;
+    if (stash_reader_) {
+      for (const auto& id : transfer_list_->stash_ids(cmdindex)) {
+        std::vector<uint8_t> stash_data;
+        if (stash_reader_(std::string(id), &stash_data)) {
+          entry->bytes += stash_data.size();
+          entry->stashes.emplace(id, std::move(stash_data));
+        }
+      }
+    }
+    return entry->bytes > 0;
   }
 
-  return 0;
-}
+  std::unique_ptr<BlockIo> io_;
+  size_t max_commands_;
+  size_t max_bytes_;
+  StashReader stash_reader_;
 
-static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
-  size_t written = 0;
-  for (const auto& [begin, end] : tgt) {
-    off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-    size_t size = (end - begin) * BLOCKSIZE;
-    if (!discard_blocks(fd, offset, size)) {
-      return -1;
-    }
+  const CompactTransferList* transfer_list_{ nullptr };
 
-    if (!check_lseek(fd, offset, SEEK_SET)) {
-      return -1;
-    }
+  std::mutex mu_;
+  std::condition_variable cv_;
+  // Prefetched data, keyed by the command index.
+  std::map<size_t, Entry> entries_;
+  // The command that the main thread is executing.
+  size_t current_{ 0 };
+  // The next command to be prefetched.
+  size_t next_{ 0 };
+  // The commands from 'next_' on that the main thread has taken over, which aren't prefetched.
+  std::set<size_t> taken_;
+  // The command being prefetched by the background thread.
+  size_t in_flight_{ std::numeric_limits<size_t>::max() };
+  size_t buffered_bytes_{ 0 };
+  bool stopped_{ false };
 
-    if (!android::base::WriteFully(fd, buffer.data() + written, size)) {
-      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-      PLOG(ERROR) << "Failed to write " << size << " bytes of data";
-      return -1;
-    }
-
-    written += size;
-  }
+  std::thread thread_;
+};
 
-  return 0;
-}
+// Tracks the commands executed since the last checkpoint, i.e. the last time the writes to the
+// target were fsync'd and the last executed command was recorded for resuming.
+//
+// Commands between two checkpoints are re-executed after an interruption. That's safe as long as
+// none of them has destroyed the input of an earlier one in the same group: move/bsdiff/imgdiff
+// verify their target blocks first and skip if those are already in place, "new", "zero" and
+// "erase" simply redo their writes, and stash files are durable once created. So a checkpoint is
+// taken before any command that would overwrite the source blocks of a command in the current
+// group, and freeing stashes is deferred until the next checkpoint. As the space for stashes is
+// only reserved for the ones that are alive at the same time, deferred frees are also flushed
+// before a new stash needs their space. Stashes in a StashArena or a StashCache are only made
+// durable at checkpoints, so their source blocks are protected like those of a "move".
+struct CheckpointState {
+  // Bytes to write between checkpoints. 0 makes every command a checkpoint.
+  size_t max_bytes{ 0 };
+  // Whether there are executed commands that aren't recorded yet.
+  bool pending{ false };
+  // The last executed command.
+  size_t cmdindex{ 0 };
+  std::string cmdline;
+  // The value of CommandParameters::written at the last checkpoint.
+  size_t written{ 0 };
+  // The source blocks read by the commands since the last checkpoint.
+  SortedRangeSet sources;
+  // The stashes to be deleted at the next checkpoint.
+  std::vector<std::string> freed_stashes;
+};
 
 // Parameters for transfer list command functions
 struct CommandParameters {
-    std::vector<std::string> tokens;
-    size_t cpos;
-    std::string cmdname;
-    std::string cmdline;
+    // The command being executed.
+    const Command* cmd;
     std::string freestash;
     std::string stashbase;
+    // The arena that holds the stashes, or null if they are stored as individual files.
+    std::unique_ptr<StashArena> stash_arena;
+    // The stashes kept in memory, or null if they always go to storage right away.
+    std::unique_ptr<StashCache> stash_cache;
     bool canwrite;
     int createdstash;
     android::base::unique_fd fd;
+    std::unique_ptr<BlockIo> block_io;
     bool foundwrites;
     bool isunresumable;
     int version;
     size_t written;
     size_t stashed;
-    NewThreadInfo nti;
-    pthread_t thread;
+    std::unique_ptr<NewDataQueue> new_data;
+    std::thread new_data_thread;
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
     bool target_verified;  // The target blocks have expected contents already.
+    std::unique_ptr<SourcePrefetcher> prefetcher;
+    CheckpointState checkpoint;
+    // How imgdiff patches are applied, and the space in the stash directory for their spill files.
+    ImagePatchOptions imgpatch_options;
+    std::unique_ptr<ImagePatchSpillSpace> imgpatch_spill_space;
 };
 
-// Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
-// handled separately).
-static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
-                                              const std::vector<uint8_t>& buffer) {
-  LOG(INFO) << "unexpected contents of source blocks in cmd:\n" << params.cmdline;
-  CHECK(params.tokens[0] == "move" || params.tokens[0] == "bsdiff" ||
-        params.tokens[0] == "imgdiff");
-
-  size_t pos = 0;
-  // Command example:
-  // move <onehash> <tgt_range> <src_blk_count> <src_range> [<loc_range> <stashed_blocks>]
-  // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_blk_count> <src_range>
-  //        [<loc_range> <stashed_blocks>]
-  if (params.tokens[0] == "move") {
-    // src_range for move starts at the 4th position.
-    if (params.tokens.size() < 5) {
-      LOG(ERROR) << "failed to parse source range in cmd:\n" << params.cmdline;
-      return;
-    }
-    pos = 4;
-  } else {
-    // src_range for diff starts at the 7th position.
-    if (params.tokens.size() < 8) {
-      LOG(ERROR) << "failed to parse source range in cmd:\n" << params.cmdline;
-      return;
-    }
-    pos = 7;
-  }
-
-  // Source blocks in stash only, no work to do.
-  if (params.tokens[pos] == "-") {
-    return;
-  }
-
-  RangeSet src = RangeSet::Parse(params.tokens[pos++]);
-  if (!src) {
-    LOG(ERROR) << "Failed to parse range in " << params.cmdline;
-    return;
-  }
-
-  RangeSet locs;
-  // If there's no stashed blocks, content in the buffer is consecutive and has the same
-  // order as the source blocks.
-  if (pos == params.tokens.size()) {
-    locs = RangeSet(std::vector<Range>{ Range{ 0, src.blocks() } });
-  } else {
-    // Otherwise, the next token is the offset of the source blocks in the target range.
-    // Example: for the tokens <4,63946,63947,63948,63979> <4,6,7,8,39> <stashed_blocks>;
-    // We want to print SHA-1 for the data in buffer[6], buffer[8], buffer[9] ... buffer[38];
-    // this corresponds to the 32 src blocks #63946, #63948, #63949 ... #63978.
-    locs = RangeSet::Parse(params.tokens[pos++]);
-    CHECK_EQ(src.blocks(), locs.blocks());
-  }
-
-  LOG(INFO) << "printing hash in hex for " << src.blocks() << " source blocks";
-  for (size_t i = 0; i < src.blocks(); i++) {
-    size_t block_num = src.GetBlockNumber(i);
-    size_t buffer_index = locs.GetBlockNumber(i);
-    CHECK_LE((buffer_index + 1) * BLOCKSIZE, buffer.size());
-
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + buffer_index * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
-    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
-  }
-}
-
 // If the calculated hash for the whole stash doesn't match the stash id, print the SHA-1
 // in hex for each block.
 static void PrintHashForCorruptedStashedBlocks(const std::string& id,
@@ -626,7 +694,7 @@ static void PrintHashForCorruptedStashedBlocks(const std::string& id,
     size_t block_num = src.GetBlockNumber(i);
 
     uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
+    ComputeHash(HashAlgorithm::kSha1, buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
     std::string hexdigest = print_sha1(digest);
     LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
   }
@@ -634,7 +702,7 @@ static void PrintHashForCorruptedStashedBlocks(const std::string& id,
 
 // If the stash file doesn't exist, read the source blocks this stash contains and print the
 // SHA-1 for these blocks.
-static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
+static void PrintHashForMissingStashedBlocks(const std::string& id, BlockIo* io) {
   if (stash_map.find(id) == stash_map.end()) {
     LOG(ERROR) << "No stash saved for id: " << id;
     return;
@@ -643,7 +711,7 @@ static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
   LOG(INFO) << "print hash in hex for source blocks in missing stash: " << id;
   const RangeSet& src = stash_map[id];
   std::vector<uint8_t> buffer(src.blocks() * BLOCKSIZE);
-  if (ReadBlocks(src, &buffer, fd) == -1) {
+  if (ReadBlocks(src, &buffer, io) == -1) {
     LOG(ERROR) << "failed to read source blocks for stash: " << id;
     return;
   }
@@ -652,12 +720,8 @@ static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
 
 static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
                         const size_t blocks, bool printerror) {
-  uint8_t digest[SHA_DIGEST_LENGTH];
-  const uint8_t* data = buffer.data();
-
-  SHA1(data, blocks * BLOCKSIZE, digest);
-
-  std::string hexdigest = print_sha1(digest);
+  std::string hexdigest =
+      print_sha1(ComputeHash(HashAlgorithm::kSha1, buffer.data(), blocks * BLOCKSIZE).data());
 
   if (hexdigest != expected) {
     if (printerror) {
@@ -732,6 +796,35 @@ static void DeleteStash(const std::string& base) {
   }
 }
 
+// Loads the stash 'id' from params.stash_arena. See LoadStash().
+static int LoadArenaStash(const CommandParameters& params, const std::string& id, bool verify,
+                          std::vector<uint8_t>* buffer, bool printnoent) {
+  size_t blocks;
+  if (!params.stash_arena->Read(id, buffer, &blocks)) {
+    if (errno != ENOENT) {
+      failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+      PLOG(ERROR) << "Failed to read stash " << id;
+    } else if (printnoent) {
+      LOG(ERROR) << "No stash " << id << " in the arena";
+      PrintHashForMissingStashedBlocks(id, params.block_io.get());
+    }
+    return -1;
+  }
+
+  LOG(INFO) << " loading " << blocks << " blocks of stash " << id;
+
+  if (verify && VerifyBlocks(id, *buffer, blocks, true) != 0) {
+    LOG(ERROR) << "unexpected contents in stash " << id;
+    if (stash_map.find(id) != stash_map.end()) {
+      PrintHashForCorruptedStashedBlocks(id, *buffer, stash_map.at(id));
+    }
+    params.stash_arena->Free(id);
+    return -1;
+  }
+
+  return 0;
+}
+
 static int LoadStash(const CommandParameters& params, const std::string& id, bool verify,
                      std::vector<uint8_t>* buffer, bool printnoent) {
   // In verify mode, if source range_set was saved for the given hash, check contents in the source
@@ -741,7 +834,7 @@ static int LoadStash(const CommandParameters& params, const std::string& id, boo
       const RangeSet& src = stash_map[id];
       allocate(src.blocks() * BLOCKSIZE, buffer);
 
-      if (ReadBlocks(src, buffer, params.fd) == -1) {
+      if (ReadBlocks(src, buffer, params.block_io.get()) == -1) {
         LOG(ERROR) << "failed to read source blocks in stash map.";
         return -1;
       }
@@ -756,13 +849,24 @@ static int LoadStash(const CommandParameters& params, const std::string& id, boo
     }
   }
 
+  // Cached stashes were verified when they were created, and haven't left memory since.
+  size_t size;
+  if (params.stash_cache != nullptr && params.stash_cache->Get(id, buffer, &size)) {
+    LOG(INFO) << " loading " << size / BLOCKSIZE << " blocks of stash " << id << " from memory";
+    return 0;
+  }
+
+  if (params.stash_arena != nullptr) {
+    return LoadArenaStash(params, id, verify, buffer, printnoent);
+  }
+
   std::string fn = GetStashFileName(params.stashbase, id, "");
 
   struct stat sb;
   if (stat(fn.c_str(), &sb) == -1) {
     if (errno != ENOENT || printnoent) {
       PLOG(ERROR) << "stat \"" << fn << "\" failed";
-      PrintHashForMissingStashedBlocks(id, params.fd);
+      PrintHashForMissingStashedBlocks(id, params.block_io.get());
     }
     return -1;
   }
@@ -794,7 +898,7 @@ static int LoadStash(const CommandParameters& params, const std::string& id, boo
     LOG(ERROR) << "unexpected contents in " << fn;
     if (stash_map.find(id) == stash_map.end()) {
       LOG(ERROR) << "failed to find source blocks number for stash " << id
-                 << " when executing command: " << params.cmdname;
+                 << " when executing command: " << *params.cmd;
     } else {
       const RangeSet& src = stash_map[id];
       PrintHashForCorruptedStashedBlocks(id, *buffer, src);
@@ -806,12 +910,29 @@ static int LoadStash(const CommandParameters& params, const std::string& id, boo
   return 0;
 }
 
-static int WriteStash(const std::string& base, const std::string& id, int blocks,
+static int WriteStash(const CommandParameters& params, const std::string& id, int blocks,
                       const std::vector<uint8_t>& buffer, bool checkspace, bool* exists) {
+  const std::string& base = params.stashbase;
   if (base.empty()) {
     return -1;
   }
 
+  if (params.stash_arena != nullptr) {
+    if (exists) {
+      *exists = params.stash_arena->GetBlocks(id) != 0;
+      if (*exists) {
+        LOG(INFO) << " skipping " << blocks << " existing blocks in stash " << id;
+        return 0;
+      }
+    }
+    LOG(INFO) << " writing " << blocks << " blocks to stash " << id;
+    if (!params.stash_arena->Write(id, buffer.data(), blocks)) {
+      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+      return -1;
+    }
+    return 0;
+  }
+
   if (checkspace && !CheckAndFreeSpaceOnCache(blocks * BLOCKSIZE)) {
     LOG(ERROR) << "not enough space to write stash";
     return -1;
@@ -948,16 +1069,198 @@ static int CreateStash(State* state, size_t maxblocks, const std::string& base)
   return 0;  // Using existing directory
 }
 
-static int FreeStash(const std::string& base, const std::string& id) {
-  if (base.empty() || id.empty()) {
+static int FreeStash(const CommandParameters& params, const std::string& id) {
+  if (params.stashbase.empty() || id.empty()) {
     return -1;
   }
 
-  DeleteFile(GetStashFileName(base, id, ""));
+  // A stash that is freed while it's only in memory has never been written to storage.
+  if (params.stash_cache != nullptr && params.stash_cache->Erase(id)) {
+    return 0;
+  }
+
+  if (params.stash_arena != nullptr) {
+    params.stash_arena->Free(id);
+  } else {
+    DeleteFile(GetStashFileName(params.stashbase, id, ""));
+  }
 
   return 0;
 }
 
+// Frees the given stash once the command that uses it is made durable by the next checkpoint.
+static void ReleaseStash(CommandParameters& params, const std::string& id) {
+  if (params.checkpoint.max_bytes == 0) {
+    FreeStash(params, id);
+    return;
+  }
+  params.checkpoint.freed_stashes.push_back(id);
+}
+
+// Keeps a stash that is (re)created under the same id from being deleted at the next checkpoint.
+static void RetainStash(CommandParameters& params, const std::string& id) {
+  auto& freed = params.checkpoint.freed_stashes;
+  freed.erase(std::remove(freed.begin(), freed.end(), id), freed.end());
+}
+
+// Writes the stash 'id' to storage if it's only in params.stash_cache.
+static bool FlushCachedStash(const CommandParameters& params, const std::string& id) {
+  return params.stash_cache->Flush(
+      id, [&params](const std::string& id, const std::vector<uint8_t>& data) {
+        LOG(INFO) << "flushing stash " << id << " from memory";
+        return WriteStash(params, id, data.size() / BLOCKSIZE, data, false, nullptr) == 0;
+      });
+}
+
+// Flushes the writes of the commands executed so far, and records the last one of them so that an
+// interrupted update can be resumed from the next command. Returns false (with errno set) if the
+// writes can't be flushed.
+static bool Checkpoint(CommandParameters& params) {
+  CheckpointState& checkpoint = params.checkpoint;
+  if (!checkpoint.pending) {
+    return true;
+  }
+
+  // The stashes in memory that are still needed after this checkpoint go to storage. The ones
+  // waiting to be freed aren't needed by any of the commands after it.
+  if (params.stash_cache != nullptr) {
+    const auto& freed = checkpoint.freed_stashes;
+    for (const auto& id : params.stash_cache->GetDirtyIds()) {
+      if (std::find(freed.begin(), freed.end(), id) == freed.end() &&
+          !FlushCachedStash(params, id)) {
+        return false;
+      }
+    }
+  }
+
+  if (params.stash_arena != nullptr && !params.stash_arena->Sync()) {
+    return false;
+  }
+
+  if (fsync(params.fd) == -1) {
+    PLOG(ERROR) << "fsync failed";
+    return false;
+  }
+
+  if (!UpdateLastCommandIndex(checkpoint.cmdindex, checkpoint.cmdline)) {
+    LOG(WARNING) << "Failed to update the last command file.";
+  }
+
+  for (const auto& id : checkpoint.freed_stashes) {
+    FreeStash(params, id);
+  }
+  checkpoint.freed_stashes.clear();
+  checkpoint.sources.Clear();
+  checkpoint.written = params.written;
+  checkpoint.pending = false;
+  return true;
+}
+
+template <typename Ranges>
+static bool OverlapsSortedRanges(const SortedRangeSet& sorted, const Ranges& ranges) {
+  for (const auto& [begin, end] : ranges) {
+    // Find the first range in 'sorted' that ends after 'begin'.
+    auto it = std::lower_bound(sorted.cbegin(), sorted.cend(), begin,
+                               [](const Range& range, size_t block) {
+                                 return range.second <= block;
+                               });
+    if (it != sorted.cend() && it->first < end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Takes a checkpoint if any of the given commands (indices into 'transfer_list') would overwrite
+// the source blocks of a command since the last checkpoint, or would need room for a stash that's
+// held by others waiting to be freed. Then protects the source blocks of the commands. The commands
+// must not depend on each other. Returns false if the checkpoint fails.
+static bool CheckpointBeforeCommands(CommandParameters& params,
+                                     const CompactTransferList& transfer_list,
+                                     const std::vector<size_t>& cmdindices) {
+  CheckpointState& checkpoint = params.checkpoint;
+  if (checkpoint.max_bytes == 0) {
+    return true;
+  }
+
+  std::vector<CompactTransferList::Span<Range>> reads;
+  bool needs_checkpoint = false;
+  // The bytes of the stashes among 'cmdindices' that are expected to be kept in memory.
+  size_t cached_bytes = 0;
+  // The blocks of the stashes among 'cmdindices', which all end up in the arena if it's used.
+  size_t arena_blocks = 0;
+  for (size_t cmdindex : cmdindices) {
+    switch (transfer_list.type(cmdindex)) {
+      case Command::Type::MOVE:
+      case Command::Type::BSDIFF:
+      case Command::Type::IMGDIFF:
+        reads.push_back(transfer_list.reads(cmdindex));
+        if (transfer_list.overlaps(cmdindex) && !checkpoint.freed_stashes.empty()) {
+          needs_checkpoint = true;
+        }
+        break;
+      case Command::Type::STASH:
+        // Stashes in files are fsync'd on creation, so their source blocks don't need to be
+        // protected. Stashes in an arena or in memory are only made durable at the next checkpoint.
+        if (params.stash_arena != nullptr || params.stash_cache != nullptr) {
+          reads.push_back(transfer_list.reads(cmdindex));
+        }
+        // The freed stashes are only deleted at the checkpoint, which has to make room before
+        // another stash is written to a file. The arena is checked for room below.
+        if (params.stash_arena != nullptr) {
+          for (const auto& [begin, end] : transfer_list.reads(cmdindex)) {
+            arena_blocks += end - begin;
+          }
+        } else if (!checkpoint.freed_stashes.empty()) {
+          size_t stash_bytes = 0;
+          for (const auto& [begin, end] : transfer_list.reads(cmdindex)) {
+            stash_bytes += (end - begin) * BLOCKSIZE;
+          }
+          if (params.stash_cache != nullptr &&
+              params.stash_cache->Fits(cached_bytes + stash_bytes)) {
+            cached_bytes += stash_bytes;
+          } else {
+            needs_checkpoint = true;
+          }
+        }
+        break;
+      case Command::Type::COMPUTE_HASH_TREE:
+        reads.push_back(transfer_list.reads(cmdindex));
+        break;
+      case Command::Type::LAST:
+        // Take a checkpoint before anything we don't understand.
+        needs_checkpoint = true;
+        break;
+      default:
+        break;
+    }
+    if (OverlapsSortedRanges(checkpoint.sources, transfer_list.writes(cmdindex))) {
+      needs_checkpoint = true;
+    }
+  }
+
+  // The arena is sized for the stashes that are alive at the same time, and would have to grow if
+  // the freed ones kept their blocks. The stashes in memory go to the arena at the next checkpoint
+  // (which flushes them before it frees anything), so they need room too.
+  if (arena_blocks > 0 && !checkpoint.freed_stashes.empty()) {
+    size_t dirty_blocks =
+        params.stash_cache != nullptr ? params.stash_cache->GetDirtyBytes() / BLOCKSIZE : 0;
+    if (dirty_blocks + arena_blocks > params.stash_arena->free_blocks()) {
+      needs_checkpoint = true;
+    }
+  }
+
+  if (needs_checkpoint && !Checkpoint(params)) {
+    return false;
+  }
+  for (const auto& ranges : reads) {
+    for (const auto& range : ranges) {
+      checkpoint.sources.Insert(range);
+    }
+  }
+  return true;
+}
+
 // Source contains packed data, which we want to move to the locations given in locs in the dest
 // buffer. source and dest may be the same buffer.
 static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
@@ -974,102 +1277,60 @@ static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
 }
 
 /**
- * We expect to parse the remainder of the parameter tokens as one of:
- *
- *    <src_block_count> <src_range>
- *        (loads data from source image only)
- *
- *    <src_block_count> - <[stash_id:stash_range] ...>
- *        (loads data from stashes only)
- *
- *    <src_block_count> <src_range> <src_loc> <[stash_id:stash_range] ...>
- *        (loads data from both source image and stashes)
+ * Loads the source of the current move/bsdiff/imgdiff command (params.cmd->source()), which comes
+ * from the source image, from stashes, or both.
  *
  * On return, params.buffer is filled with the loaded source data (rearranged and combined with
  * stashed data as necessary). buffer may be reallocated if needed to accommodate the source data.
- * tgt is the target RangeSet for detecting overlaps. Any stashes required are loaded using
- * LoadStash.
+ * Any stashes required are loaded using LoadStash.
+ *
+ * If prefetched is not null, data that has been prefetched for the current command will be used,
+ * and *prefetched tells whether that happened. Otherwise everything is read synchronously.
  */
-static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size_t* src_blocks,
-                            bool* overlap) {
-  CHECK(src_blocks != nullptr);
-  CHECK(overlap != nullptr);
-
-  // <src_block_count>
-  const std::string& token = params.tokens[params.cpos++];
-  if (!android::base::ParseUint(token, src_blocks)) {
-    LOG(ERROR) << "invalid src_block_count \"" << token << "\"";
-    return -1;
+static int LoadSourceBlocks(CommandParameters& params, bool* prefetched) {
+  const SourceInfo& source = params.cmd->source();
+  size_t cmdindex = params.cmd->index();
+  SourcePrefetcher* prefetcher = prefetched != nullptr ? params.prefetcher.get() : nullptr;
+  if (prefetched != nullptr) {
+    *prefetched = false;
   }
 
-  allocate(*src_blocks * BLOCKSIZE, &params.buffer);
-
-  // "-" or <src_range> [<src_loc>]
-  if (params.tokens[params.cpos] == "-") {
-    // no source ranges, only stashes
-    params.cpos++;
-  } else {
-    RangeSet src = RangeSet::Parse(params.tokens[params.cpos++]);
-    CHECK(static_cast<bool>(src));
-    *overlap = src.Overlaps(tgt);
+  allocate(source.blocks() * BLOCKSIZE, &params.buffer);
 
-    if (ReadBlocks(src, &params.buffer, params.fd) == -1) {
+  if (source.ranges()) {
+    if (prefetcher != nullptr &&
+        prefetcher->TakeSourceBlocks(cmdindex, source.ranges(), &params.buffer)) {
+      *prefetched = true;
+    } else if (ReadBlocks(source.ranges(), &params.buffer, params.block_io.get()) == -1) {
       return -1;
     }
 
-    if (params.cpos >= params.tokens.size()) {
-      // no stashes, only source range
-      return 0;
+    if (source.location()) {
+      MoveRange(params.buffer, source.location(), params.buffer);
     }
-
-    RangeSet locs = RangeSet::Parse(params.tokens[params.cpos++]);
-    CHECK(static_cast<bool>(locs));
-    MoveRange(params.buffer, locs, params.buffer);
   }
 
-  // <[stash_id:stash_range]>
-  while (params.cpos < params.tokens.size()) {
-    // Each word is a an index into the stash table, a colon, and then a RangeSet describing where
-    // in the source block that stashed data should go.
-    std::vector<std::string> tokens = android::base::Split(params.tokens[params.cpos++], ":");
-    if (tokens.size() != 2) {
-      LOG(ERROR) << "invalid parameter";
-      return -1;
-    }
-
+  for (const auto& stash_info : source.stashes()) {
     std::vector<uint8_t> stash;
-    if (LoadStash(params, tokens[0], false, &stash, true) == -1) {
+    if (prefetcher != nullptr && prefetcher->TakeStash(cmdindex, stash_info.id(), &stash)) {
+      *prefetched = true;
+    } else if (LoadStash(params, stash_info.id(), false, &stash, true) == -1) {
       // These source blocks will fail verification if used later, but we
       // will let the caller decide if this is a fatal failure
-      LOG(ERROR) << "failed to load stash " << tokens[0];
+      LOG(ERROR) << "failed to load stash " << stash_info.id();
       continue;
     }
 
-    RangeSet locs = RangeSet::Parse(tokens[1]);
-    CHECK(static_cast<bool>(locs));
-    MoveRange(params.buffer, locs, stash);
+    MoveRange(params.buffer, stash_info.ranges(), stash);
   }
 
   return 0;
 }
 
 /**
- * Do a source/target load for move/bsdiff/imgdiff in version 3.
- *
- * We expect to parse the remainder of the parameter tokens as one of:
- *
- *    <tgt_range> <src_block_count> <src_range>
- *        (loads data from source image only)
- *
- *    <tgt_range> <src_block_count> - <[stash_id:stash_range] ...>
- *        (loads data from stashes only)
- *
- *    <tgt_range> <src_block_count> <src_range> <src_loc> <[stash_id:stash_range] ...>
- *        (loads data from both source image and stashes)
- *
- * 'onehash' tells whether to expect separate source and targe block hashes, or if they are both the
- * same and only one hash should be expected. params.isunresumable will be set to true if block
- * verification fails in a way that the update cannot be resumed anymore.
+ * Do a source/target load for move/bsdiff/imgdiff in version 3, as given by params.cmd.
+ * params.isunresumable will be set to true if block verification fails in a way that the update
+ * cannot be resumed anymore.
  *
  * If the function is unable to load the necessary blocks or their contents don't match the hashes,
  * the return value is -1 and the command should be aborted.
@@ -1079,70 +1340,66 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
  *
  * If the return value is 0, source blocks have expected content and the command can be performed.
  */
-static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t* src_blocks,
-                              bool onehash) {
-  CHECK(src_blocks != nullptr);
-
-  if (params.cpos >= params.tokens.size()) {
-    LOG(ERROR) << "missing source hash";
-    return -1;
-  }
-
-  std::string srchash = params.tokens[params.cpos++];
-  std::string tgthash;
-
-  if (onehash) {
-    tgthash = srchash;
-  } else {
-    if (params.cpos >= params.tokens.size()) {
-      LOG(ERROR) << "missing target hash";
-      return -1;
-    }
-    tgthash = params.tokens[params.cpos++];
-  }
-
-  // At least it needs to provide three parameters: <tgt_range>, <src_block_count> and
-  // "-"/<src_range>.
-  if (params.cpos + 2 >= params.tokens.size()) {
-    LOG(ERROR) << "invalid parameters";
-    return -1;
-  }
-
-  // <tgt_range>
-  *tgt = RangeSet::Parse(params.tokens[params.cpos++]);
-  CHECK(static_cast<bool>(*tgt));
+static int LoadSrcTgtVersion3(CommandParameters& params) {
+  const TargetInfo& tgt = params.cmd->target();
+  const SourceInfo& src = params.cmd->source();
+  const std::string& srchash = src.hash();
 
-  std::vector<uint8_t> tgtbuffer(tgt->blocks() * BLOCKSIZE);
-  if (ReadBlocks(*tgt, &tgtbuffer, params.fd) == -1) {
+  std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
+  if (ReadBlocks(tgt.ranges(), &tgtbuffer, params.block_io.get()) == -1) {
     return -1;
   }
 
   // Return now if target blocks already have expected content.
-  if (VerifyBlocks(tgthash, tgtbuffer, tgt->blocks(), false) == 0) {
+  if (VerifyBlocks(tgt.hash(), tgtbuffer, tgt.blocks(), false) == 0) {
     return 1;
   }
 
   // Load source blocks.
-  bool overlap = false;
-  if (LoadSourceBlocks(params, *tgt, src_blocks, &overlap) == -1) {
+  bool prefetched = false;
+  if (LoadSourceBlocks(params, &prefetched) == -1) {
     return -1;
   }
 
-  if (VerifyBlocks(srchash, params.buffer, *src_blocks, true) == 0) {
+  int verified = VerifyBlocks(srchash, params.buffer, src.blocks(), !prefetched);
+  if (verified != 0 && prefetched) {
+    LOG(WARNING) << "prefetched source blocks have unexpected contents; reading them again";
+    if (LoadSourceBlocks(params, nullptr) == -1) {
+      return -1;
+    }
+    verified = VerifyBlocks(srchash, params.buffer, src.blocks(), true);
+  }
+
+  bool overlap = src.Overlaps(tgt);
+  if (verified == 0) {
     // If source and target blocks overlap, stash the source blocks so we can resume from possible
     // write errors. In verify mode, we can skip stashing because the source blocks won't be
     // overwritten.
     if (overlap && params.canwrite) {
-      LOG(INFO) << "stashing " << *src_blocks << " overlapping blocks to " << srchash;
+      LOG(INFO) << "stashing " << src.blocks() << " overlapping blocks to " << srchash;
 
+      // The stash must be on storage before the command overwrites its source. If it's in memory,
+      // it's also an explicit stash that is freed by its own command.
       bool stash_exists = false;
-      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true,
-                     &stash_exists) != 0) {
+      int result;
+      if (params.stash_cache != nullptr && params.stash_cache->Contains(srchash)) {
+        stash_exists = true;
+        result = FlushCachedStash(params, srchash) ? 0 : -1;
+      } else {
+        result = WriteStash(params, srchash, src.blocks(), params.buffer, true, &stash_exists);
+      }
+      if (result != 0) {
         LOG(ERROR) << "failed to stash overlapping source blocks";
         return -1;
       }
+      // The command is about to overwrite its own source blocks.
+      if (params.stash_arena != nullptr && !params.stash_arena->Sync()) {
+        failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+        return -1;
+      }
 
-      params.stashed += *src_blocks;
+      RetainStash(params, srchash);
+      params.stashed += src.blocks();
       // Can be deleted when the write has completed.
       if (!stash_exists) {
         params.freestash = srchash;
@@ -1162,7 +1419,10 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
 
   // Valid source data not available, update cannot be resumed.
   LOG(ERROR) << "partition has unexpected contents";
-  PrintHashForCorruptedSourceBlocks(params, params.buffer);
+  if (src.ranges()) {
+    LOG(INFO) << "unexpected contents of source blocks in cmd:\n" << src;
+    src.DumpBuffer(params.buffer, BLOCKSIZE);
+  }
 
   params.isunresumable = true;
 
@@ -1170,9 +1430,9 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
 }
 
 static int PerformCommandMove(CommandParameters& params) {
-  size_t blocks = 0;
-  RangeSet tgt;
-  int status = LoadSrcTgtVersion3(params, &tgt, &blocks, true);
+  const RangeSet& tgt = params.cmd->target().ranges();
+  size_t blocks = params.cmd->source().blocks();
+  int status = LoadSrcTgtVersion3(params);
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for move";
@@ -1184,7 +1444,7 @@ static int PerformCommandMove(CommandParameters& params) {
   } else {
     params.target_verified = true;
     if (params.foundwrites) {
-      LOG(WARNING) << "warning: commands executed out of order [" << params.cmdname << "]";
+      LOG(WARNING) << "warning: commands executed out of order [" << *params.cmd << "]";
     }
   }
 
@@ -1192,7 +1452,7 @@ static int PerformCommandMove(CommandParameters& params) {
     if (status == 0) {
       LOG(INFO) << "  moving " << blocks << " blocks";
 
-      if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
+      if (WriteBlocks(tgt, params.buffer, params.block_io.get()) == -1) {
         return -1;
       }
     } else {
@@ -1201,7 +1461,7 @@ static int PerformCommandMove(CommandParameters& params) {
   }
 
   if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
+    ReleaseStash(params, params.freestash);
     params.freestash.clear();
   }
 
@@ -1211,30 +1471,34 @@ static int PerformCommandMove(CommandParameters& params) {
 }
 
 static int PerformCommandStash(CommandParameters& params) {
-  // <stash_id> <src_range>
-  if (params.cpos + 1 >= params.tokens.size()) {
-    LOG(ERROR) << "missing id and/or src range fields in stash command";
-    return -1;
-  }
-
-  const std::string& id = params.tokens[params.cpos++];
+  const std::string& id = params.cmd->stash().id();
+  RetainStash(params, id);
   if (LoadStash(params, id, true, &params.buffer, false) == 0) {
     // Stash file already exists and has expected contents. Do not read from source again, as the
     // source may have been already overwritten during a previous attempt.
     return 0;
   }
 
-  RangeSet src = RangeSet::Parse(params.tokens[params.cpos++]);
-  CHECK(static_cast<bool>(src));
-
+  const RangeSet& src = params.cmd->stash().ranges();
   size_t blocks = src.blocks();
   allocate(blocks * BLOCKSIZE, &params.buffer);
-  if (ReadBlocks(src, &params.buffer, params.fd) == -1) {
+  bool prefetched = params.prefetcher != nullptr &&
+                    params.prefetcher->TakeSourceBlocks(params.cmd->index(), src, &params.buffer);
+  if (!prefetched && ReadBlocks(src, &params.buffer, params.block_io.get()) == -1) {
     return -1;
   }
   stash_map[id] = src;
 
-  if (VerifyBlocks(id, params.buffer, blocks, true) != 0) {
+  int verified = VerifyBlocks(id, params.buffer, blocks, !prefetched);
+  if (verified != 0 && prefetched) {
+    LOG(WARNING) << "prefetched blocks for stash " << id << " are unexpected; reading them again";
+    if (ReadBlocks(src, &params.buffer, params.block_io.get()) == -1) {
+      return -1;
+    }
+    verified = VerifyBlocks(id, params.buffer, blocks, true);
+  }
+
+  if (verified != 0) {
     // Source blocks have unexpected contents. If we actually need this data later, this is an
     // unrecoverable error. However, the command that uses the data may have already completed
     // previously, so the possible failure will occur during source block verification.
@@ -1247,8 +1511,17 @@ static int PerformCommandStash(CommandParameters& params) {
     return 0;
   }
 
+  // Keep the stash in memory if there's room, until the next checkpoint at least. It's written to
+  // storage right away otherwise.
+  if (params.stash_cache != nullptr &&
+      params.stash_cache->Put(id, params.buffer.data(), blocks * BLOCKSIZE)) {
+    LOG(INFO) << "stashing " << blocks << " blocks to " << id << " in memory";
+    params.stashed += blocks;
+    return 0;
+  }
+
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
-  int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
+  int result = WriteStash(params, id, blocks, params.buffer, false, nullptr);
   if (result == 0) {
     params.stashed += blocks;
   }
@@ -1256,59 +1529,38 @@ static int PerformCommandStash(CommandParameters& params) {
 }
 
 static int PerformCommandFree(CommandParameters& params) {
-  // <stash_id>
-  if (params.cpos >= params.tokens.size()) {
-    LOG(ERROR) << "missing stash id in free command";
-    return -1;
-  }
-
-  const std::string& id = params.tokens[params.cpos++];
+  const std::string& id = params.cmd->stash().id();
   stash_map.erase(id);
 
-  if (params.createdstash || params.canwrite) {
-    return FreeStash(params.stashbase, id);
+  if (params.canwrite) {
+    ReleaseStash(params, id);
+    return 0;
+  }
+  if (params.createdstash) {
+    return FreeStash(params, id);
   }
 
   return 0;
 }
 
 static int PerformCommandZero(CommandParameters& params) {
-  if (params.cpos >= params.tokens.size()) {
-    LOG(ERROR) << "missing target blocks for zero";
-    return -1;
-  }
-
-  RangeSet tgt = RangeSet::Parse(params.tokens[params.cpos++]);
-  CHECK(static_cast<bool>(tgt));
+  const RangeSet& tgt = params.cmd->target().ranges();
 
   LOG(INFO) << "  zeroing " << tgt.blocks() << " blocks";
 
-  allocate(BLOCKSIZE, &params.buffer);
-  memset(params.buffer.data(), 0, BLOCKSIZE);
-
   if (params.canwrite) {
-    for (const auto& [begin, end] : tgt) {
-      off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-      size_t size = (end - begin) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size)) {
-        return -1;
-      }
-
-      if (!check_lseek(params.fd, offset, SEEK_SET)) {
-        return -1;
-      }
+    if (!discard_blocks(params.block_io.get(), tgt)) {
+      return -1;
+    }
 
-      for (size_t j = begin; j < end; ++j) {
-        if (!android::base::WriteFully(params.fd, params.buffer.data(), BLOCKSIZE)) {
-          failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-          PLOG(ERROR) << "Failed to write " << BLOCKSIZE << " bytes of data";
-          return -1;
-        }
-      }
+    if (!params.block_io->Zero(tgt)) {
+      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+      PLOG(ERROR) << "Failed to zero " << tgt.blocks() * BLOCKSIZE << " bytes of data";
+      return -1;
     }
   }
 
-  if (params.cmdname[0] == 'z') {
+  if (params.cmd->type() == Command::Type::ZERO) {
     // Update only for the zero command, as the erase command will call
     // this if DEBUG_ERASE is defined.
     params.written += tgt.blocks();
@@ -1318,32 +1570,27 @@ static int PerformCommandZero(CommandParameters& params) {
 }
 
 static int PerformCommandNew(CommandParameters& params) {
-  if (params.cpos >= params.tokens.size()) {
-    LOG(ERROR) << "missing target blocks for new";
-    return -1;
-  }
-
-  RangeSet tgt = RangeSet::Parse(params.tokens[params.cpos++]);
-  CHECK(static_cast<bool>(tgt));
+  const RangeSet& tgt = params.cmd->target().ranges();
 
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
-
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
+    RangeSinkWriter writer(params.block_io.get(), tgt);
+    while (!writer.Finished()) {
+      const uint8_t* data;
+      size_t size;
+      if (!params.new_data->Peek(&data, &size)) {
+        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - writer.BytesWritten())
                    << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
+      size_t write_now = std::min(size, writer.AvailableSpace());
+      if (writer.Write(data, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+        return -1;
+      }
+      params.new_data->Consume(write_now);
     }
-
-    pthread_mutex_unlock(&params.nti.mu);
   }
 
   params.written += tgt.blocks();
@@ -1351,68 +1598,94 @@ static int PerformCommandNew(CommandParameters& params) {
   return 0;
 }
 
-static int PerformCommandDiff(CommandParameters& params) {
-  // <offset> <length>
-  if (params.cpos + 1 >= params.tokens.size()) {
-    LOG(ERROR) << "missing patch offset or length for " << params.cmdname;
-    return -1;
-  }
-
-  size_t offset;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &offset)) {
-    LOG(ERROR) << "invalid patch offset";
-    return -1;
-  }
-
-  size_t len;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &len)) {
-    LOG(ERROR) << "invalid patch len";
-    return -1;
-  }
+// The state of a bsdiff/imgdiff command between loading its source blocks and writing out the
+// patched target blocks.
+struct PendingDiff {
+  const Command* cmd;
+  // The result of LoadSrcTgtVersion3(); 0 if the patch needs to be applied, or 1 if the target
+  // blocks already have the expected contents.
+  int status;
+  // The stash to be freed once the target blocks are written.
+  std::string freestash;
+  // The loaded source data and the patched result, only used when patching in parallel.
+  std::vector<uint8_t> source;
+  std::vector<uint8_t> output;
+};
 
-  RangeSet tgt;
-  size_t blocks = 0;
-  int status = LoadSrcTgtVersion3(params, &tgt, &blocks, false);
+// Loads the source blocks of the current bsdiff/imgdiff command into params.buffer.
+static int LoadDiffCommand(CommandParameters& params, PendingDiff* diff) {
+  diff->cmd = params.cmd;
+  diff->status = LoadSrcTgtVersion3(params);
 
-  if (status == -1) {
+  if (diff->status == -1) {
     LOG(ERROR) << "failed to read blocks for diff";
     return -1;
   }
 
-  if (status == 0) {
+  if (diff->status == 0) {
     params.foundwrites = true;
   } else {
     params.target_verified = true;
     if (params.foundwrites) {
-      LOG(WARNING) << "warning: commands executed out of order [" << params.cmdname << "]";
+      LOG(WARNING) << "warning: commands executed out of order [" << *params.cmd << "]";
     }
   }
 
+  diff->freestash = std::move(params.freestash);
+  params.freestash.clear();
+  return 0;
+}
+
+// Applies the patch of the given command to the loaded 'source' data, and writes the result via
+// 'sink'. It doesn't touch any global state, so that patches can be applied concurrently.
+static int ApplyDiffPatch(const CommandParameters& params, const PendingDiff& diff,
+                          const uint8_t* source, SinkFn sink) {
+  // Read the patch in place from the mmapped package instead of copying it out.
+  const PatchInfo& patch_info = diff.cmd->patch();
+  std::string_view patch(reinterpret_cast<const char*>(params.patch_start) + patch_info.offset(),
+                         patch_info.length());
+  size_t source_size = diff.cmd->source().blocks() * BLOCKSIZE;
+
+  if (diff.cmd->type() == Command::Type::IMGDIFF) {
+    if (ApplyImagePatch(source, source_size, patch, sink, nullptr, params.imgpatch_options) != 0) {
+      LOG(ERROR) << "Failed to apply image patch.";
+      return -1;
+    }
+  } else {
+    if (ApplyBSDiffPatch(source, source_size, patch, 0, sink) != 0) {
+      LOG(ERROR) << "Failed to apply bsdiff patch.";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void FinishDiffCommand(CommandParameters& params, const PendingDiff& diff) {
+  if (!diff.freestash.empty()) {
+    ReleaseStash(params, diff.freestash);
+  }
+
+  params.written += diff.cmd->target().blocks();
+}
+
+static int PerformCommandDiff(CommandParameters& params) {
+  PendingDiff diff;
+  if (LoadDiffCommand(params, &diff) == -1) {
+    return -1;
+  }
+
+  const RangeSet& tgt = params.cmd->target().ranges();
+  size_t src_blocks = params.cmd->source().blocks();
   if (params.canwrite) {
-    if (status == 0) {
-      LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
-      Value patch_value(
-          Value::Type::BLOB,
-          std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
-
-      RangeSinkWriter writer(params.fd, tgt);
-      if (params.cmdname[0] == 'i') {  // imgdiff
-        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
-                            std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                      std::placeholders::_2),
-                            nullptr) != 0) {
-          LOG(ERROR) << "Failed to apply image patch.";
-          failure_type = kPatchApplicationFailure;
-          return -1;
-        }
-      } else {
-        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value, 0,
-                             std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                       std::placeholders::_2)) != 0) {
-          LOG(ERROR) << "Failed to apply bsdiff patch.";
-          failure_type = kPatchApplicationFailure;
-          return -1;
-        }
+    if (diff.status == 0) {
+      LOG(INFO) << "patching " << src_blocks << " blocks to " << tgt.blocks();
+
+      RangeSinkWriter writer(params.block_io.get(), tgt);
+      if (ApplyDiffPatch(params, diff, params.buffer.data(),
+                         std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
+                                   std::placeholders::_2)) != 0) {
+        failure_type = kPatchApplicationFailure;
+        return -1;
       }
 
       // We expect the output of the patcher to fill the tgt ranges exactly.
@@ -1423,18 +1696,12 @@ static int PerformCommandDiff(CommandParameters& params) {
         return -1;
       }
     } else {
-      LOG(INFO) << "skipping " << blocks << " blocks already patched to " << tgt.blocks() << " ["
-                << params.cmdline << "]";
+      LOG(INFO) << "skipping " << src_blocks << " blocks already patched to " << tgt.blocks()
+                << " [" << params.cmd->cmdline() << "]";
     }
   }
 
-  if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
-    params.freestash.clear();
-  }
-
-  params.written += tgt.blocks();
-
+  FinishDiffCommand(params, diff);
   return 0;
 }
 
@@ -1454,23 +1721,12 @@ static int PerformCommandErase(CommandParameters& params) {
     return -1;
   }
 
-  if (params.cpos >= params.tokens.size()) {
-    LOG(ERROR) << "missing target blocks for erase";
-    return -1;
-  }
-
-  RangeSet tgt = RangeSet::Parse(params.tokens[params.cpos++]);
-  CHECK(static_cast<bool>(tgt));
-
+  const RangeSet& tgt = params.cmd->target().ranges();
   if (params.canwrite) {
     LOG(INFO) << " erasing " << tgt.blocks() << " blocks";
 
-    for (const auto& [begin, end] : tgt) {
-      off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-      size_t size = (end - begin) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size, true /* force */)) {
-        return -1;
-      }
+    if (!discard_blocks(params.block_io.get(), tgt, true /* force */)) {
+      return -1;
     }
   }
 
@@ -1491,42 +1747,25 @@ static int PerformCommandAbort(CommandParameters&) {
 //   salt_hex
 //   root_hash
 static int PerformCommandComputeHashTree(CommandParameters& params) {
-  if (params.cpos + 5 != params.tokens.size()) {
-    LOG(ERROR) << "Invaild arguments count in hash computation " << params.cmdline;
-    return -1;
-  }
-
-  // Expects the hash_tree data to be contiguous.
-  RangeSet hash_tree_ranges = RangeSet::Parse(params.tokens[params.cpos++]);
-  if (!hash_tree_ranges || hash_tree_ranges.size() != 1) {
-    LOG(ERROR) << "Invalid hash tree ranges in " << params.cmdline;
-    return -1;
-  }
-
-  RangeSet source_ranges = RangeSet::Parse(params.tokens[params.cpos++]);
-  if (!source_ranges) {
-    LOG(ERROR) << "Invalid source ranges in " << params.cmdline;
-    return -1;
-  }
+  // The ranges, and that the hash tree data is contiguous, were checked by Command::Parse().
+  const HashTreeInfo& hash_tree_info = params.cmd->hash_tree_info();
+  const RangeSet& hash_tree_ranges = hash_tree_info.hash_tree_ranges();
+  const RangeSet& source_ranges = hash_tree_info.source_ranges();
 
-  auto hash_function = HashTreeBuilder::HashFunction(params.tokens[params.cpos++]);
+  auto hash_function = HashTreeBuilder::HashFunction(hash_tree_info.hash_algorithm());
   if (hash_function == nullptr) {
-    LOG(ERROR) << "Invalid hash algorithm in " << params.cmdline;
+    LOG(ERROR) << "Invalid hash algorithm in " << params.cmd->cmdline();
     return -1;
   }
 
   std::vector<unsigned char> salt;
-  std::string salt_hex = params.tokens[params.cpos++];
-  if (salt_hex.empty() || !HashTreeBuilder::ParseBytesArrayFromString(salt_hex, &salt)) {
-    LOG(ERROR) << "Failed to parse salt in " << params.cmdline;
+  const std::string& salt_hex = hash_tree_info.salt_hex();
+  if (!HashTreeBuilder::ParseBytesArrayFromString(salt_hex, &salt)) {
+    LOG(ERROR) << "Failed to parse salt in " << params.cmd->cmdline();
     return -1;
   }
 
-  std::string expected_root_hash = params.tokens[params.cpos++];
-  if (expected_root_hash.empty()) {
-    LOG(ERROR) << "Invalid root hash in " << params.cmdline;
-    return -1;
-  }
+  const std::string& expected_root_hash = hash_tree_info.root_hash();
 
   // Starts the hash_tree computation.
   HashTreeBuilder builder(BLOCKSIZE, hash_function);
@@ -1540,13 +1779,9 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
   // accordingly.
   for (const auto& [begin, end] : source_ranges) {
     uint8_t buffer[BLOCKSIZE];
-    if (!check_lseek(params.fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      PLOG(ERROR) << "Failed to seek to block: " << begin;
-      return -1;
-    }
-
     for (size_t i = begin; i < end; i++) {
-      if (!android::base::ReadFully(params.fd, buffer, BLOCKSIZE)) {
+      if (!android::base::ReadFullyAtOffset(params.fd, buffer, BLOCKSIZE,
+                                            static_cast<off64_t>(i) * BLOCKSIZE)) {
         failure_type = errno == EIO ? kEioFailure : kFreadFailure;
         LOG(ERROR) << "Failed to read data in " << begin << ":" << end;
         return -1;
@@ -1582,6 +1817,248 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
   return 0;
 }
 
+// Prepares 'params' for executing 'cmd', which must outlive the execution. The data prefetched for
+// the commands before 'prefetch_from' is dropped.
+static void SetUpCommand(CommandParameters& params, const Command& cmd, size_t prefetch_from) {
+  params.cmd = &cmd;
+  params.target_verified = false;
+  if (params.prefetcher != nullptr) {
+    params.prefetcher->Advance(prefetch_from);
+  }
+}
+
+static void SetUpCommand(CommandParameters& params, const Command& cmd) {
+  SetUpCommand(params, cmd, cmd.index());
+}
+
+// Marks the command at 'cmdindex' as executed, and takes a checkpoint if enough data has been
+// written since the last one.
+static bool CommitCommand(CommandParameters& params, size_t cmdindex, const std::string& cmdline,
+                          const UpdaterInterface* updater, size_t total_blocks) {
+  CheckpointState& checkpoint = params.checkpoint;
+  checkpoint.pending = true;
+  checkpoint.cmdindex = cmdindex;
+  checkpoint.cmdline = cmdline;
+  if ((params.written - checkpoint.written) * BLOCKSIZE >= checkpoint.max_bytes &&
+      !Checkpoint(params)) {
+    failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+    return false;
+  }
+
+  updater->WriteToCommandPipe(
+      android::base::StringPrintf("set_progress %.4f",
+                                  static_cast<double>(params.written) / total_blocks),
+      true);
+  return true;
+}
+
+// A run of consecutive bsdiff/imgdiff commands whose patches are applied concurrently.
+struct DiffBatch {
+  std::vector<Command> commands;
+  // The indices (into 'commands') of the earlier commands of the batch that each command depends
+  // on, in ascending order, as computed by BuildCommandDependencies().
+  std::vector<std::vector<size_t>> dependencies;
+};
+
+// Collects a run of consecutive bsdiff/imgdiff commands starting from the command at 'first'. The
+// run is limited to 'max_commands' commands, and 'max_bytes' of source and target data. A command
+// that depends on earlier ones in the run can still be batched, as it's started once they finish,
+// but the run is only returned if at least one command in it can be patched while the one before it
+// is still in progress. Returns an empty batch otherwise.
+static DiffBatch CollectDiffBatch(const CompactTransferList& transfer_list, size_t first,
+                                  size_t max_commands, size_t max_bytes) {
+  // Check the types on the compact form first, so that only the commands of a possible batch are
+  // built in full.
+  std::vector<size_t> candidates;
+  for (size_t i = first; i < transfer_list.size() && candidates.size() < max_commands; i++) {
+    if (transfer_list.cmdline(i).empty()) continue;
+
+    Command::Type type = transfer_list.type(i);
+    if (type != Command::Type::BSDIFF && type != Command::Type::IMGDIFF) {
+      break;
+    }
+    candidates.push_back(i);
+  }
+  if (candidates.size() < 2) {
+    return {};
+  }
+
+  DiffBatch batch;
+  size_t bytes = 0;
+  for (size_t i : candidates) {
+    Command command = transfer_list.GetCommand(i);
+    size_t command_bytes = (command.source().blocks() + command.target().blocks()) * BLOCKSIZE;
+    if (!batch.commands.empty() && bytes + command_bytes > max_bytes) {
+      break;
+    }
+    bytes += command_bytes;
+    batch.commands.push_back(std::move(command));
+  }
+
+  batch.dependencies = BuildCommandDependencies(batch.commands);
+  for (size_t i = 1; i < batch.commands.size(); i++) {
+    const auto& dependencies = batch.dependencies[i];
+    if (dependencies.empty() || dependencies.back() + 1 < i) {
+      return batch;
+    }
+  }
+  // Each command needs the one right before it, so there's nothing to overlap.
+  return {};
+}
+
+// Executes the bsdiff/imgdiff commands in 'batch' (from CollectDiffBatch()). The source blocks are
+// loaded, and the results written out, on the calling thread; while the patches are applied
+// concurrently, one thread per command. A command is loaded and started as soon as the commands of
+// the batch it depends on have been written, i.e. the ones without dependencies right away. The
+// results are written, and each command committed individually, in order, which keeps the resume
+// semantics the same as executing them one by one: the commands that start together go through
+// CheckpointBeforeCommands() together, right before they start. On failure, returns false and sets
+// 'failed_command' to the index of the failed command.
+static bool PerformDiffBatch(CommandParameters& params, const CompactTransferList& transfer_list,
+                             const DiffBatch& batch, const UpdaterInterface* updater,
+                             size_t total_blocks, size_t* failed_command) {
+  const std::vector<Command>& commands = batch.commands;
+  std::vector<size_t> cmdindices;
+  for (const auto& cmd : commands) {
+    cmdindices.push_back(cmd.index());
+  }
+
+  std::vector<PendingDiff> diffs(commands.size());
+  std::vector<std::future<int>> results(commands.size());
+  std::vector<bool> started(commands.size(), false);
+  std::vector<bool> loaded(commands.size(), false);
+  // Nothing more is started once a command fails to load; it fails the batch when its turn comes.
+  bool load_failed = false;
+
+  // Loads the source of the i-th command, and starts applying its patch.
+  auto start = [&](size_t i) {
+    if (load_failed) return;
+    // Keep the data prefetched for the commands that are yet to start, some of which may come
+    // before this one.
+    size_t first_pending = std::find(started.begin(), started.end(), false) - started.begin();
+    started[i] = true;
+    SetUpCommand(params, commands[i], cmdindices[first_pending]);
+    PendingDiff& diff = diffs[i];
+    if (LoadDiffCommand(params, &diff) == -1) {
+      load_failed = true;
+      return;
+    }
+    diff.source.swap(params.buffer);
+    loaded[i] = true;
+    if (diff.status != 0) return;
+
+    results[i] = std::async(std::launch::async, [&params, &diff]() {
+      size_t capacity = diff.cmd->target().blocks() * BLOCKSIZE;
+      diff.output.reserve(capacity);
+      auto sink = [&diff, capacity](const uint8_t* data, size_t size) -> size_t {
+        if (diff.output.size() + size > capacity) {
+          LOG(ERROR) << "range sink write overrun; can't write " << size << " bytes";
+          return 0;
+        }
+        diff.output.insert(diff.output.end(), data, data + size);
+        return size;
+      };
+      return ApplyDiffPatch(params, diff, diff.source.data(), sink);
+    });
+  };
+
+  // Starts the given commands, which depend neither on each other nor on the started ones that are
+  // yet to be written, after taking a checkpoint if they need one. Returns false if that fails.
+  auto start_group = [&](const std::vector<size_t>& group) {
+    if (group.empty()) return true;
+    std::vector<size_t> group_cmdindices;
+    for (size_t i : group) {
+      group_cmdindices.push_back(cmdindices[i]);
+    }
+    if (!CheckpointBeforeCommands(params, transfer_list, group_cmdindices)) {
+      failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+      *failed_command = group_cmdindices.front();
+      return false;
+    }
+    for (size_t i : group) {
+      start(i);
+    }
+    return true;
+  };
+
+  std::vector<size_t> group;
+  for (size_t i = 0; i < commands.size(); i++) {
+    if (batch.dependencies[i].empty()) {
+      group.push_back(i);
+    }
+  }
+  if (!start_group(group)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < commands.size(); i++) {
+    if (!loaded[i]) {
+      *failed_command = cmdindices[i];
+      return false;
+    }
+
+    PendingDiff& diff = diffs[i];
+    const RangeSet& tgt = diff.cmd->target().ranges();
+    size_t src_blocks = diff.cmd->source().blocks();
+    if (diff.status == 0) {
+      LOG(INFO) << "patching " << src_blocks << " blocks to " << tgt.blocks() << " ["
+                << diff.cmd->cmdline() << "]";
+      if (results[i].get() != 0) {
+        failure_type = kPatchApplicationFailure;
+        *failed_command = cmdindices[i];
+        return false;
+      }
+      // We expect the output of the patcher to fill the tgt ranges exactly.
+      if (diff.output.size() != tgt.blocks() * BLOCKSIZE) {
+        LOG(ERROR) << "Failed to fully write target blocks (range sink underrun): Missing "
+                   << tgt.blocks() * BLOCKSIZE - diff.output.size() << " bytes";
+        failure_type = kPatchApplicationFailure;
+        *failed_command = cmdindices[i];
+        return false;
+      }
+      if (WriteBlocks(tgt, diff.output, params.block_io.get()) == -1) {
+        *failed_command = cmdindices[i];
+        return false;
+      }
+      std::vector<uint8_t>().swap(diff.source);
+      std::vector<uint8_t>().swap(diff.output);
+    } else {
+      LOG(INFO) << "skipping " << src_blocks << " blocks already patched to " << tgt.blocks()
+                << " [" << diff.cmd->cmdline() << "]";
+    }
+
+    FinishDiffCommand(params, diff);
+    if (!CommitCommand(params, cmdindices[i], diff.cmd->cmdline(), updater, total_blocks)) {
+      *failed_command = cmdindices[i];
+      return false;
+    }
+
+    // Start the commands whose last dependency was this one.
+    group.clear();
+    for (size_t j = i + 1; j < commands.size(); j++) {
+      if (!batch.dependencies[j].empty() && batch.dependencies[j].back() == i) {
+        group.push_back(j);
+      }
+    }
+    if (!start_group(group)) {
+      return false;
+    }
+
+    // A checkpoint, taken on committing this command or before starting the group, records the
+    // commands up to this one and clears the protected source blocks. Those of the commands that
+    // have started but are yet to be written need protecting again.
+    if (params.checkpoint.max_bytes != 0) {
+      for (size_t j = i + 1; j < commands.size(); j++) {
+        if (!started[j]) continue;
+        for (const auto& range : transfer_list.reads(cmdindices[j])) {
+          params.checkpoint.sources.Insert(range);
+        }
+      }
+    }
+  }
+  return true;
+}
+
 using CommandFunction = std::function<int(CommandParameters&)>;
 
 using CommandMap = std::unordered_map<Command::Type, CommandFunction>;
@@ -1623,11 +2100,181 @@ static bool Sha1DevicePath(const std::string& path, uint8_t digest[SHA_DIGEST_LE
   return true;
 }
 
+// Tunables for executing a transfer list. The defaults can be overridden with system properties
+// (e.g. ro.recovery.updater.prefetch_commands=0), for devices with unusual storage or memory
+// constraints.
+//
+// The buffers below are all carved out of a single memory budget by default, so that they can't
+// add up to more than it (see ApplyMemoryBudget()).
+struct BlockImageUpdateOptions {
+  // Memory to be shared by the prefetched data, the concurrent patches, the buffered new data, the
+  // stashes in memory and imgpatch. Defaults to a quarter of the free memory.
+  size_t memory_budget_bytes{ 0 };
+  // Number of upcoming commands to read the source blocks ahead for. 0 disables prefetching.
+  size_t prefetch_commands{ 16 };
+  // Maximum amount of prefetched data to be held in memory.
+  size_t prefetch_bytes{ 0 };
+  // Number of independent bsdiff/imgdiff commands to be patched concurrently. 1 disables it.
+  // Defaults to half the CPUs, between 1 and 4.
+  size_t patch_threads{ std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4) };
+  // Maximum amount of source and target data held in memory by a batch of concurrent patches.
+  // Defaults to a quarter of the memory budget, up to 64 MiB.
+  size_t patch_batch_bytes{ 0 };
+  // Number of threads to apply the chunks of a single imgdiff patch on. 1 disables it.
+  size_t imgpatch_threads{ std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 2) };
+  // How block data is read and written. io_uring falls back to pread/pwrite if unavailable.
+  BlockIo::Backend io_backend{ BlockIo::Backend::kIoUring };
+  // Amount of data to write before taking a checkpoint, i.e. fsync'ing the target and recording the
+  // progress for resuming. 0 takes a checkpoint after every command.
+  size_t checkpoint_bytes{ 64 * 1024 * 1024 };
+  // Amount of decompressed new data to be buffered ahead of the "new" commands.
+  size_t new_data_buffer_bytes{ 0 };
+  // Number of threads to decompress the frames of chunked brotli new data ("*.mbr").
+  size_t new_data_threads{ std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 4) };
+  // Whether to keep new stashes in a single preallocated file (StashArena), rather than one file
+  // per stash.
+  bool stash_arena{ false };
+  // Amount of memory to keep stashes in, so that the ones freed before the next checkpoint are
+  // never written to storage. 0 disables it.
+  size_t stash_memory_bytes{ 0 };
+  // Deflate chunks of imgdiff patches that expand to more than this are expanded into a file in the
+  // stash directory, rather than in memory. It's per thread, across the concurrent patches, and
+  // also bounds the patched chunks that each imgpatch thread buffers. 0 keeps them in memory
+  // regardless.
+  size_t imgpatch_memory_bytes{ 0 };
+};
+
+// Returns the amount of memory that is free or only used for caches, like fuse_sideload does.
+static uint64_t GetFreeMemory() {
+  std::string meminfo;
+  if (!android::base::ReadFileToString("/proc/meminfo", &meminfo)) {
+    PLOG(WARNING) << "Failed to read /proc/meminfo";
+    return 0;
+  }
+  uint64_t mem = 0;
+  for (const auto& line : android::base::Split(meminfo, "\n")) {
+    char key[64];
+    uint64_t kb;
+    if (sscanf(line.c_str(), "%63[^:]: %" SCNu64 " kB", key, &kb) == 2 &&
+        (strcmp(key, "MemFree") == 0 || strcmp(key, "Buffers") == 0 ||
+         strcmp(key, "Cached") == 0)) {
+      mem += kb * 1024;
+    }
+  }
+  return mem;
+}
+
+static size_t GetSizeProperty(const UpdaterRuntimeInterface* runtime, const std::string& key,
+                              size_t default_value) {
+  std::string value = runtime->GetProperty(key, "");
+  size_t result;
+  if (value.empty() ||
+      !android::base::ParseUint(value, &result, std::numeric_limits<size_t>::max(), true)) {
+    return default_value;
+  }
+  return result;
+}
+
+// Splits options->memory_budget_bytes between the buffers that use it, according to the number of
+// threads. Each buffer is also capped at the amount it can make use of.
+static void ApplyMemoryBudget(BlockImageUpdateOptions* options) {
+  constexpr size_t kMiB = 1024 * 1024;
+  size_t budget = options->memory_budget_bytes;
+  options->prefetch_bytes = std::min(budget / 8, 32 * kMiB);
+  options->patch_batch_bytes = std::min(budget / 4, 64 * kMiB);
+  options->new_data_buffer_bytes = std::min(budget / 16, 8 * kMiB);
+  options->stash_memory_bytes = budget / 4;
+  options->imgpatch_memory_bytes =
+      budget / 4 / std::max<size_t>(options->patch_threads * options->imgpatch_threads, 1);
+}
+
+static BlockImageUpdateOptions ReadBlockImageUpdateOptions(const UpdaterRuntimeInterface* runtime) {
+  BlockImageUpdateOptions options;
+  options.memory_budget_bytes =
+      std::min<uint64_t>(GetFreeMemory() / 4, std::numeric_limits<size_t>::max());
+  if (runtime == nullptr) {
+    ApplyMemoryBudget(&options);
+    return options;
+  }
+  options.memory_budget_bytes = GetSizeProperty(runtime, "ro.recovery.updater.memory_budget_bytes",
+                                                options.memory_budget_bytes);
+  options.patch_threads =
+      GetSizeProperty(runtime, "ro.recovery.updater.patch_threads", options.patch_threads);
+  options.imgpatch_threads =
+      GetSizeProperty(runtime, "ro.recovery.updater.imgpatch_threads", options.imgpatch_threads);
+  ApplyMemoryBudget(&options);
+
+  // The individual buffers can still be sized explicitly, at the risk of exceeding the budget.
+  options.prefetch_commands =
+      GetSizeProperty(runtime, "ro.recovery.updater.prefetch_commands", options.prefetch_commands);
+  options.prefetch_bytes =
+      GetSizeProperty(runtime, "ro.recovery.updater.prefetch_bytes", options.prefetch_bytes);
+  options.patch_batch_bytes =
+      GetSizeProperty(runtime, "ro.recovery.updater.patch_batch_bytes", options.patch_batch_bytes);
+  options.checkpoint_bytes =
+      GetSizeProperty(runtime, "ro.recovery.updater.checkpoint_bytes", options.checkpoint_bytes);
+  options.new_data_buffer_bytes = GetSizeProperty(
+      runtime, "ro.recovery.updater.new_data_buffer_bytes", options.new_data_buffer_bytes);
+  options.new_data_threads =
+      GetSizeProperty(runtime, "ro.recovery.updater.new_data_threads", options.new_data_threads);
+  options.stash_arena = runtime->GetProperty("ro.recovery.updater.stash_backend", "") == "arena";
+  options.stash_memory_bytes = GetSizeProperty(runtime, "ro.recovery.updater.stash_memory_bytes",
+                                               options.stash_memory_bytes);
+  options.imgpatch_memory_bytes = GetSizeProperty(
+      runtime, "ro.recovery.updater.imgpatch_memory_bytes", options.imgpatch_memory_bytes);
+  std::string io_backend = runtime->GetProperty("ro.recovery.updater.io_backend", "");
+  if (io_backend == "pread") {
+    options.io_backend = BlockIo::Backend::kPread;
+  } else if (io_backend == "io_uring") {
+    options.io_backend = BlockIo::Backend::kIoUring;
+  } else if (!io_backend.empty()) {
+    LOG(WARNING) << "Ignoring unknown I/O backend " << io_backend;
+  }
+  return options;
+}
+
+// Returns how many bytes imgpatch may spill into 'stash_dir', i.e. the free space there that the
+// stashes won't need, given that they may still take 'stash_bytes'.
+static size_t GetImagePatchSpillBudget(const std::string& stash_dir, size_t stash_bytes) {
+  struct statvfs sf;
+  if (statvfs(stash_dir.c_str(), &sf) == -1) {
+    PLOG(WARNING) << "Failed to statvfs " << stash_dir << "; not spilling imgpatch data";
+    return 0;
+  }
+  uint64_t free_bytes = static_cast<uint64_t>(sf.f_bavail) * sf.f_frsize;
+  if (free_bytes <= stash_bytes) {
+    return 0;
+  }
+  return std::min<uint64_t>(free_bytes - stash_bytes, std::numeric_limits<size_t>::max());
+}
+
+// The transfer lists that block_image_verify has verified, by block device, for the
+// block_image_update that usually follows on the same transfer list. See GetTransferList().
+static std::unordered_map<std::string, std::shared_ptr<const CompactTransferList>> transfer_lists;
+
+// Returns the parsed form of the transfer list in 'text' for 'block_device', or nullptr if it's
+// too short. The one kept by block_image_verify is taken if it's the same; otherwise 'text' is
+// parsed, and taken over on success.
+static std::shared_ptr<const CompactTransferList> GetTransferList(const std::string& block_device,
+                                                                  std::string* text) {
+  auto it = transfer_lists.find(block_device);
+  if (it != transfer_lists.end()) {
+    std::shared_ptr<const CompactTransferList> transfer_list = std::move(it->second);
+    transfer_lists.erase(it);
+    if (transfer_list->text() == *text) {
+      return transfer_list;
+    }
+  }
+  return CompactTransferList::Parse(std::move(*text));
+}
+
 static Value* PerformBlockImageUpdate(const char* name, State* state,
                                       const std::vector<std::unique_ptr<Expr>>& argv,
                                       const CommandMap& command_map, bool dryrun) {
   CommandParameters params{};
   stash_map.clear();
+  // Don't report the failure of an earlier call, e.g. of a verification that is retried.
+  failure_type = kNoCause;
   params.canwrite = !dryrun;
 
   LOG(INFO) << "performing " << (dryrun ? "verification" : "update");
@@ -1708,6 +2355,11 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
+  BlockImageUpdateOptions options = ReadBlockImageUpdateOptions(updater->GetRuntime());
+  params.block_io = BlockIo::Create(params.fd, BLOCKSIZE, options.io_backend);
+  LOG(INFO) << "Using " << params.block_io->backend() << " for block I/O";
+  params.checkpoint.max_bytes = options.checkpoint_bytes;
+
   uint8_t digest[SHA_DIGEST_LENGTH];
   if (!Sha1DevicePath(block_device_path, digest)) {
     return StringValue("");
@@ -1723,6 +2375,7 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     int result = stat(updated_marker.c_str(), &sb);
     if (result == 0) {
       LOG(INFO) << "Skipping already updated partition " << block_device_path << " based on marker";
+      transfer_lists.erase(block_device_path);
       return StringValue("t");
     }
   } else {
@@ -1734,13 +2387,18 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     }
   }
 
-  static constexpr size_t kTransferListHeaderLines = 4;
-  std::vector<std::string> lines = android::base::Split(transfer_list_value->data, "\n");
-  if (lines.size() < kTransferListHeaderLines) {
+  std::shared_ptr<const CompactTransferList> transfer_list =
+      GetTransferList(block_device_path, &transfer_list_value->data);
+  if (transfer_list == nullptr) {
+    const std::string& text = transfer_list_value->data;
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zu]",
-               lines.size());
+               static_cast<size_t>(std::count(text.begin(), text.end(), '\n') + 1));
     return StringValue("");
   }
+  std::vector<std::string> lines;
+  for (size_t i = 0; i < TransferList::kTransferListHeaderLines; i++) {
+    lines.emplace_back(transfer_list->line(i));
+  }
 
   // First line in transfer list is the version number.
   if (!android::base::ParseInt(lines[0], &params.version, 3, 4)) {
@@ -1778,29 +2436,36 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   }
   params.createdstash = res;
 
-  // Set up the new data writer.
-  if (params.canwrite) {
-    params.nti.za = za;
-    params.nti.entry = new_entry;
-    params.nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
-    if (params.nti.brotli_compressed) {
-      // Initialize brotli decoder state.
-      params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
-    }
-    params.nti.receiver_available = true;
-
-    pthread_mutex_init(&params.nti.mu, nullptr);
-    pthread_cond_init(&params.nti.cv, nullptr);
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-
-    int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
-    if (error != 0) {
-      LOG(ERROR) << "pthread_create failed: " << strerror(error);
+  // An existing stash keeps the layout it was created with, so that a retry finds its stashes.
+  std::string stash_dir = GetStashFileName(params.stashbase, "", "");
+  bool has_stash_files = false;
+  EnumerateStash(stash_dir, [&has_stash_files](const std::string&) { has_stash_files = true; });
+  if (!params.canwrite) {
+    // Verification only reads the stashes of an interrupted update, if it left an arena.
+    params.stash_arena = StashArena::OpenReadOnly(stash_dir, BLOCKSIZE);
+  } else if (StashArena::Exists(stash_dir) || (options.stash_arena && !has_stash_files)) {
+    params.stash_arena =
+        StashArena::Open(stash_dir, stash_max_blocks, BLOCKSIZE, AID_SYSTEM, AID_SYSTEM);
+    if (params.stash_arena == nullptr) {
+      ErrorAbort(state, kStashCreationFailure, "failed to open the stash arena in %s",
+                 stash_dir.c_str());
       return StringValue("");
     }
   }
+  if (params.canwrite && options.stash_memory_bytes > 0) {
+    LOG(INFO) << "keeping up to " << options.stash_memory_bytes << " bytes of stashes in memory";
+    params.stash_cache = std::make_unique<StashCache>(options.stash_memory_bytes);
+  }
+
+  // Set up the new data writer.
+  if (params.canwrite) {
+    size_t chunk_size = std::clamp<size_t>(options.new_data_buffer_bytes, BLOCKSIZE, 1024 * 1024);
+    params.new_data = std::make_unique<NewDataQueue>(
+        chunk_size, std::max<size_t>(options.new_data_buffer_bytes / chunk_size, 1));
+    auto decoder = NewDataDecoder::Create(NewDataDecoder::GetFormat(new_data_fn->data),
+                                          params.new_data.get(), options.new_data_threads);
+    params.new_data_thread = std::thread(unzip_new_data, za, new_entry, std::move(decoder));
+  }
 
   // When performing an update, save the index and cmdline of the current command into the
   // last_command_file.
@@ -1820,23 +2485,79 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     skip_executed_command = false;
   }
 
+  if (options.prefetch_commands > 0) {
+    // Stashes only need to be read ahead when updating; block_image_verify loads them from the
+    // source blocks saved in stash_map.
+    SourcePrefetcher::StashReader stash_reader;
+    if (params.canwrite && params.stash_arena != nullptr) {
+      stash_reader = [arena = params.stash_arena.get()](const std::string& id,
+                                                        std::vector<uint8_t>* buffer) {
+        size_t blocks;
+        if (!arena->Read(id, buffer, &blocks)) {
+          return false;
+        }
+        buffer->resize(blocks * BLOCKSIZE);
+        return true;
+      };
+    } else if (params.canwrite) {
+      stash_reader = [stashbase = params.stashbase](const std::string& id,
+                                                    std::vector<uint8_t>* buffer) {
+        std::string fn = GetStashFileName(stashbase, id, "");
+        android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY)));
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) == -1 || sb.st_size == 0 || sb.st_size % BLOCKSIZE != 0) {
+          return false;
+        }
+        buffer->resize(sb.st_size);
+        return android::base::ReadFully(fd, buffer->data(), buffer->size());
+      };
+    }
+    if (params.stash_cache != nullptr) {
+      stash_reader = [cache = params.stash_cache.get(), storage_reader = std::move(stash_reader)](
+                         const std::string& id, std::vector<uint8_t>* buffer) {
+        size_t size;
+        if (cache->Get(id, buffer, &size)) {
+          buffer->resize(size);
+          return true;
+        }
+        return storage_reader(id, buffer);
+      };
+    }
+    size_t start_index = 0;
+    if (params.canwrite && skip_executed_command) {
+      start_index = saved_last_command_index + 1;
+    }
+    params.prefetcher = std::make_unique<SourcePrefetcher>(
+        BlockIo::Create(params.fd, BLOCKSIZE, options.io_backend), options.prefetch_commands,
+        options.prefetch_bytes, std::move(stash_reader));
+    params.prefetcher->Start(transfer_list.get(), start_index);
+  }
+
+  if (params.canwrite) {
+    // The stashes in files may take up to the maximum stash size on top of what's there already,
+    // whereas the arena is allocated upfront, and CheckpointBeforeCommands() keeps it from growing.
+    size_t stash_bytes = params.stash_arena != nullptr ? 0 : stash_max_blocks * BLOCKSIZE;
+    params.imgpatch_spill_space =
+        std::make_unique<ImagePatchSpillSpace>(GetImagePatchSpillBudget(stash_dir, stash_bytes));
+    params.imgpatch_options.max_in_memory_bytes = options.imgpatch_memory_bytes;
+    params.imgpatch_options.spill_dir = stash_dir;
+    params.imgpatch_options.spill_space = params.imgpatch_spill_space.get();
+    params.imgpatch_options.threads = options.imgpatch_threads;
+  }
+
   int rc = -1;
 
   // Subsequent lines are all individual transfer commands
-  for (size_t i = kTransferListHeaderLines; i < lines.size(); i++) {
-    const std::string& line = lines[i];
+  for (size_t cmdindex = 0; cmdindex < transfer_list->size(); cmdindex++) {
+    std::string_view line = transfer_list->cmdline(cmdindex);
     if (line.empty()) continue;
 
-    size_t cmdindex = i - kTransferListHeaderLines;
-    params.tokens = android::base::Split(line, " ");
-    params.cpos = 0;
-    params.cmdname = params.tokens[params.cpos++];
-    params.cmdline = line;
-    params.target_verified = false;
-
-    Command::Type cmd_type = Command::ParseType(params.cmdname);
+    // The type is known for the commands that parsed successfully.
+    Command::Type cmd_type = transfer_list->type(cmdindex);
     if (cmd_type == Command::Type::LAST) {
-      LOG(ERROR) << "unexpected command [" << params.cmdname << "]";
+      std::string err;
+      Command::Parse(std::string(line), cmdindex, &err);
+      LOG(ERROR) << "failed to parse command [" << line << "]: " << err;
       goto pbiudone;
     }
 
@@ -1858,6 +2579,35 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       continue;
     }
 
+    // Apply the patches of consecutive bsdiff/imgdiff commands concurrently, as far as they don't
+    // depend on each other.
+    if (params.canwrite && options.patch_threads > 1 &&
+        (cmd_type == Command::Type::BSDIFF || cmd_type == Command::Type::IMGDIFF)) {
+      DiffBatch batch = CollectDiffBatch(*transfer_list, cmdindex, options.patch_threads,
+                                         options.patch_batch_bytes);
+      if (!batch.commands.empty()) {
+        size_t failed_command;
+        if (!PerformDiffBatch(params, *transfer_list, batch, updater, total_blocks,
+                              &failed_command)) {
+          LOG(ERROR) << "failed to execute command [" << transfer_list->cmdline(failed_command)
+                     << "]";
+          goto pbiudone;
+        }
+        cmdindex = batch.commands.back().index();
+        continue;
+      }
+    }
+
+    Command command = transfer_list->GetCommand(cmdindex);
+    SetUpCommand(params, command);
+
+    if (params.canwrite) {
+      if (!CheckpointBeforeCommands(params, *transfer_list, { cmdindex })) {
+        failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+        goto pbiudone;
+      }
+    }
+
     if (performer(params) == -1) {
       LOG(ERROR) << "failed to execute command [" << line << "]";
       if (cmd_type == Command::Type::COMPUTE_HASH_TREE && failure_type == kNoCause) {
@@ -1875,44 +2625,44 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
            cmd_type == Command::Type::IMGDIFF) &&
           !params.target_verified) {
         LOG(WARNING) << "Previously executed command " << saved_last_command_index << ": "
-                     << params.cmdline << " doesn't produce expected target blocks.";
+                     << command.cmdline() << " doesn't produce expected target blocks.";
         skip_executed_command = false;
         DeleteLastCommandFile();
       }
     }
 
-    if (params.canwrite) {
-      if (fsync(params.fd) == -1) {
-        failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
-        PLOG(ERROR) << "fsync failed";
-        goto pbiudone;
-      }
-
-      if (!UpdateLastCommandIndex(cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
-      }
-
-      updater->WriteToCommandPipe(
-          android::base::StringPrintf("set_progress %.4f",
-                                      static_cast<double>(params.written) / total_blocks),
-          true);
+    if (params.canwrite &&
+        !CommitCommand(params, cmdindex, command.cmdline(), updater, total_blocks)) {
+      goto pbiudone;
     }
   }
 
   rc = 0;
 
 pbiudone:
+  params.cmd = nullptr;
+  params.prefetcher.reset();
+
   if (params.canwrite) {
-    pthread_mutex_lock(&params.nti.mu);
-    if (params.nti.receiver_available) {
+    if (!params.new_data->Drained()) {
       LOG(WARNING) << "new data receiver is still available after executing all commands.";
     }
-    params.nti.receiver_available = false;
-    pthread_cond_broadcast(&params.nti.cv);
-    pthread_mutex_unlock(&params.nti.mu);
-    int ret = pthread_join(params.thread, nullptr);
-    if (ret != 0) {
-      LOG(WARNING) << "pthread join returned with " << strerror(ret);
+    params.new_data->Cancel();
+    params.new_data_thread.join();
+
+    // The blocks written since the last checkpoint have to be durable before the stash and the last
+    // command file are deleted, and the partition is marked as updated; otherwise a retry after a
+    // power loss would skip a partition that wasn't fully written.
+    if (rc == 0 && fsync(params.fd) == -1) {
+      failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+      PLOG(ERROR) << "fsync failed";
+      rc = -1;
+    }
+
+    // Record the progress of the commands executed since the last checkpoint, so that a retry can
+    // resume right after them.
+    if (rc != 0 && !Checkpoint(params)) {
+      LOG(WARNING) << "Failed to take a checkpoint before exiting";
     }
 
     if (rc == 0) {
@@ -1943,8 +2693,6 @@ pbiudone:
       }
     }
 
-    pthread_mutex_destroy(&params.nti.mu);
-    pthread_cond_destroy(&params.nti.cv);
   } else if (rc == 0) {
     LOG(INFO) << "verified partition contents; update may be resumed";
   }
@@ -1955,10 +2703,6 @@ pbiudone:
   }
   // params.fd will be automatically closed because it's a unique_fd.
 
-  if (params.nti.brotli_decoder_state != nullptr) {
-    BrotliDecoderDestroyInstance(params.nti.brotli_decoder_state);
-  }
-
   // Delete the last command file if the update cannot be resumed.
   if (params.isunresumable) {
     DeleteLastCommandFile();
@@ -1974,6 +2718,11 @@ pbiudone:
     state->cause_code = failure_type;
   }
 
+  // Keep the verified transfer list for the update. A failed verification isn't followed by one.
+  if (dryrun && rc == 0) {
+    transfer_lists[block_device_path] = std::move(transfer_list);
+  }
+
   return StringValue(rc == 0 ? "t" : "");
 }
 
@@ -2106,32 +2855,23 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
   RangeSet rs = RangeSet::Parse(ranges->data);
   CHECK(static_cast<bool>(rs));
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
-
+  Hasher hasher(HashAlgorithm::kSha1);
   std::vector<uint8_t> buffer(BLOCKSIZE);
   for (const auto& [begin, end] : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", block_device_path.c_str(),
-                 strerror(errno));
-      return StringValue("");
-    }
-
     for (size_t j = begin; j < end; ++j) {
-      if (!android::base::ReadFully(fd, buffer.data(), BLOCKSIZE)) {
+      if (!android::base::ReadFullyAtOffset(fd, buffer.data(), BLOCKSIZE,
+                                            static_cast<off64_t>(j) * BLOCKSIZE)) {
         CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
         ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
                    strerror(errno));
         return StringValue("");
       }
 
-      SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
+      hasher.Update(buffer.data(), BLOCKSIZE);
     }
   }
-  uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1_Final(digest, &ctx);
 
-  return StringValue(print_sha1(digest));
+  return StringValue(print_sha1(hasher.Final().data()));
 }
 
 // This function checks if a device has been remounted R/W prior to an incremental
@@ -2177,7 +2917,8 @@ Value* CheckFirstBlockFn(const char* name, State* state,
   RangeSet blk0(std::vector<Range>{ Range{ 0, 1 } });
   std::vector<uint8_t> block0_buffer(BLOCKSIZE);
 
-  if (ReadBlocks(blk0, &block0_buffer, fd) == -1) {
+  auto io = BlockIo::Create(fd, BLOCKSIZE, BlockIo::Backend::kPread);
+  if (ReadBlocks(blk0, &block0_buffer, io.get()) == -1) {
     CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
     ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
                strerror(errno));
@@ -19,9 +19,13 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
 #include <functional>
+#include <limits>
+#include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -30,6 +34,7 @@
 #include <android-base/strings.h>
 #include <openssl/sha.h>
 
+#include "otautil/hash.h"
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
 
@@ -37,6 +42,9 @@ using namespace std::string_literals;
 
 bool Command::abort_allowed_ = false;
 
+// The target hash of zero, new and erase, whose target isn't checked.
+static constexpr const char* kUnknownHash = "unknown-hash";
+
 Command::Command(Type type, size_t index, std::string cmdline, HashTreeInfo hash_tree_info)
     : type_(type),
       index_(index),
@@ -201,7 +209,6 @@ Command Command::Parse(const std::string& line, size_t index, std::string* err)
     if (!tgt_ranges) {
       return {};
     }
-    static const std::string kUnknownHash{ "unknown-hash" };
     target_info = TargetInfo(kUnknownHash, tgt_ranges);
   } else if (op == Type::STASH) {
     // stash <stash_id> <src_ranges>
@@ -366,12 +373,119 @@ void SourceInfo::DumpBuffer(const std::vector<uint8_t>& buffer, size_t block_siz
     CHECK_LE((buffer_index + 1) * block_size, buffer.size());
 
     uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + buffer_index * block_size, block_size, digest);
+    ComputeHash(HashAlgorithm::kSha1, buffer.data() + buffer_index * block_size, block_size,
+                digest);
     std::string hexdigest = print_sha1(digest);
     LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
   }
 }
 
+namespace {
+
+// The blocks and stashes accessed by a Command, which determine its dependencies.
+struct CommandFootprint {
+  RangeSet reads;
+  RangeSet writes;
+  // Ids of the stashes that are loaded.
+  std::vector<std::string> stashes_loaded;
+  // Ids of the stashes that are created or freed.
+  std::vector<std::string> stashes_modified;
+  bool reads_new_data{ false };
+  bool barrier{ false };
+};
+
+}  // namespace
+
+static CommandFootprint GetCommandFootprint(const Command& command) {
+  CommandFootprint result;
+  switch (command.type()) {
+    case Command::Type::ZERO:
+    case Command::Type::ERASE:
+      result.writes = command.target().ranges();
+      break;
+    case Command::Type::NEW:
+      result.writes = command.target().ranges();
+      result.reads_new_data = true;
+      break;
+    case Command::Type::MOVE:
+    case Command::Type::BSDIFF:
+    case Command::Type::IMGDIFF:
+      result.reads = command.source().ranges();
+      result.writes = command.target().ranges();
+      for (const auto& stash : command.source().stashes()) {
+        result.stashes_loaded.push_back(stash.id());
+      }
+      if (command.source().Overlaps(command.target())) {
+        result.stashes_modified.push_back(command.source().hash());
+      }
+      break;
+    case Command::Type::STASH:
+      result.reads = command.stash().ranges();
+      result.stashes_modified.push_back(command.stash().id());
+      break;
+    case Command::Type::FREE:
+      result.stashes_modified.push_back(command.stash().id());
+      break;
+    case Command::Type::COMPUTE_HASH_TREE:
+      result.reads = command.hash_tree_info().source_ranges();
+      result.writes = command.hash_tree_info().hash_tree_ranges();
+      break;
+    case Command::Type::ABORT:
+    case Command::Type::LAST:
+      result.barrier = true;
+      break;
+  }
+  return result;
+}
+
+static bool ContainsAny(const std::vector<std::string>& ids,
+                        const std::vector<std::string>& others) {
+  for (const auto& id : ids) {
+    if (std::find(others.cbegin(), others.cend(), id) != others.cend()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns whether the 'later' command must be executed after the 'earlier' one.
+static bool DependsOn(const CommandFootprint& later, const CommandFootprint& earlier) {
+  if (later.barrier || earlier.barrier) {
+    return true;
+  }
+  if (later.reads_new_data && earlier.reads_new_data) {
+    return true;
+  }
+  if (earlier.writes && (earlier.writes.Overlaps(later.reads) ||
+                         earlier.writes.Overlaps(later.writes))) {
+    return true;
+  }
+  if (earlier.reads && earlier.reads.Overlaps(later.writes)) {
+    return true;
+  }
+  return ContainsAny(earlier.stashes_modified, later.stashes_loaded) ||
+         ContainsAny(earlier.stashes_modified, later.stashes_modified) ||
+         ContainsAny(earlier.stashes_loaded, later.stashes_modified);
+}
+
+std::vector<std::vector<size_t>> BuildCommandDependencies(const std::vector<Command>& commands) {
+  std::vector<CommandFootprint> footprints;
+  footprints.reserve(commands.size());
+  for (const auto& command : commands) {
+    footprints.push_back(GetCommandFootprint(command));
+  }
+
+  std::vector<std::vector<size_t>> result(commands.size());
+  for (size_t i = 0; i < commands.size(); i++) {
+    for (size_t j = 0; j < i; j++) {
+      if (DependsOn(footprints[i], footprints[j])) {
+        result[i].push_back(j);
+      }
+    }
+  }
+  return result;
+}
+
 std::ostream& operator<<(std::ostream& os, const Command& command) {
   os << command.index() << ": " << command.cmdline();
   return os;
@@ -451,3 +565,177 @@ TransferList TransferList::Parse(const std::string& transfer_list_str, std::stri
 
   return result;
 }
+
+CompactTransferList::Slice CompactTransferList::AddRanges(const RangeSet& ranges) {
+  Slice slice{ static_cast<uint32_t>(ranges_.size()), 0 };
+  ranges_.insert(ranges_.end(), ranges.cbegin(), ranges.cend());
+  slice.end = static_cast<uint32_t>(ranges_.size());
+  return slice;
+}
+
+std::string_view CompactTransferList::line(size_t i) const {
+  return TextOf(lines_[i]);
+}
+
+std::unique_ptr<CompactTransferList> CompactTransferList::Parse(std::string&& transfer_list_str) {
+  if (transfer_list_str.size() > std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR) << "Transfer list too large: " << transfer_list_str.size() << " bytes";
+    return nullptr;
+  }
+
+  // Same as splitting on '\n', i.e. a trailing newline ends with an empty line.
+  std::vector<Slice> lines;
+  for (size_t begin = 0; begin <= transfer_list_str.size();) {
+    size_t end = std::min(transfer_list_str.find('\n', begin), transfer_list_str.size());
+    lines.push_back({ static_cast<uint32_t>(begin), static_cast<uint32_t>(end) });
+    begin = end + 1;
+  }
+  if (lines.size() < TransferList::kTransferListHeaderLines) {
+    return nullptr;
+  }
+
+  std::unique_ptr<CompactTransferList> result(
+      new CompactTransferList(std::move(transfer_list_str)));
+  const std::string& text = result->text_;
+  result->lines_ = std::move(lines);
+
+  size_t count = result->lines_.size() - TransferList::kTransferListHeaderLines;
+  result->commands_.resize(count);
+  std::vector<std::string_view> tokens;
+  for (size_t cmdindex = 0; cmdindex < count; cmdindex++) {
+    std::string_view line = result->cmdline(cmdindex);
+    if (line.empty()) continue;
+
+    std::string err;
+    Command command = Command::Parse(std::string(line), cmdindex, &err);
+    if (!command) continue;
+
+    // The same words as Command::Parse() split the line into, but as pieces of text_.
+    tokens.clear();
+    for (size_t begin = 0; begin <= line.size();) {
+      size_t end = std::min(line.find(' ', begin), line.size());
+      tokens.push_back(line.substr(begin, end - begin));
+      begin = end + 1;
+    }
+    CompactCommand& compact = result->commands_[cmdindex];
+    auto add_words = [&result, &text, &compact](std::initializer_list<std::string_view> words) {
+      compact.words.begin = static_cast<uint32_t>(result->words_.size());
+      for (std::string_view word : words) {
+        uint32_t begin = static_cast<uint32_t>(word.data() - text.data());
+        result->words_.push_back({ begin, static_cast<uint32_t>(begin + word.size()) });
+      }
+      compact.words.end = static_cast<uint32_t>(result->words_.size());
+    };
+
+    compact.type = command.type();
+    switch (command.type()) {
+      case Command::Type::MOVE:
+      case Command::Type::BSDIFF:
+      case Command::Type::IMGDIFF: {
+        compact.reads = result->AddRanges(command.source().ranges());
+        compact.writes = result->AddRanges(command.target().ranges());
+        compact.location = result->AddRanges(command.source().location());
+        compact.overlaps = command.source().Overlaps(command.target());
+        compact.patch = command.patch();
+        // move <hash> ..., or bsdiff/imgdiff <offset> <length> <srchash> <dsthash> ...
+        if (command.type() == Command::Type::MOVE) {
+          add_words({ tokens[1] });
+        } else {
+          add_words({ tokens[3], tokens[4] });
+        }
+        // The stashes are the last words, as <id>:<location>.
+        const auto& stashes = command.source().stashes();
+        compact.stash_ids.begin = static_cast<uint32_t>(result->stash_ids_.size());
+        for (size_t i = 0; i < stashes.size(); i++) {
+          std::string_view token = tokens[tokens.size() - stashes.size() + i];
+          result->stash_ids_.push_back(token.substr(0, token.find(':')));
+          result->stash_locations_.push_back(result->AddRanges(stashes[i].ranges()));
+        }
+        compact.stash_ids.end = static_cast<uint32_t>(result->stash_ids_.size());
+        break;
+      }
+      case Command::Type::STASH:
+        compact.reads = result->AddRanges(command.stash().ranges());
+        add_words({ tokens[1] });
+        break;
+      case Command::Type::FREE:
+        add_words({ tokens[1] });
+        break;
+      case Command::Type::NEW:
+      case Command::Type::ZERO:
+      case Command::Type::ERASE:
+        compact.writes = result->AddRanges(command.target().ranges());
+        break;
+      case Command::Type::COMPUTE_HASH_TREE:
+        compact.reads = result->AddRanges(command.hash_tree_info().source_ranges());
+        compact.writes = result->AddRanges(command.hash_tree_info().hash_tree_ranges());
+        // <hash_tree_ranges> <source_ranges> <hash_algorithm> <salt_hex> <root_hash>
+        add_words({ tokens[3], tokens[4], tokens[5] });
+        break;
+      default:
+        break;
+    }
+  }
+
+  result->commands_.shrink_to_fit();
+  result->ranges_.shrink_to_fit();
+  result->stash_ids_.shrink_to_fit();
+  result->stash_locations_.shrink_to_fit();
+  result->words_.shrink_to_fit();
+  return result;
+}
+
+template <typename Ranges>
+static RangeSet ToRangeSet(const Ranges& ranges) {
+  RangeSet result;
+  for (const auto& range : ranges) {
+    result.PushBack(range);
+  }
+  return result;
+}
+
+Command CompactTransferList::GetCommand(size_t cmdindex) const {
+  const CompactCommand& compact = commands_[cmdindex];
+  auto word = [this, &compact](size_t i) {
+    return std::string(TextOf(words_[compact.words.begin + i]));
+  };
+  std::string cmdline(this->cmdline(cmdindex));
+
+  switch (compact.type) {
+    case Command::Type::ZERO:
+    case Command::Type::NEW:
+    case Command::Type::ERASE:
+      return Command(compact.type, cmdindex, std::move(cmdline), {},
+                     TargetInfo(kUnknownHash, ToRangeSet(writes(cmdindex))), {}, {});
+    case Command::Type::STASH:
+      return Command(compact.type, cmdindex, std::move(cmdline), {}, {}, {},
+                     StashInfo(word(0), ToRangeSet(reads(cmdindex))));
+    case Command::Type::FREE:
+      return Command(compact.type, cmdindex, std::move(cmdline), {}, {}, {},
+                     StashInfo(word(0), {}));
+    case Command::Type::MOVE:
+    case Command::Type::BSDIFF:
+    case Command::Type::IMGDIFF: {
+      std::string src_hash = word(0);
+      std::string tgt_hash = compact.type == Command::Type::MOVE ? src_hash : word(1);
+      std::vector<StashInfo> stashes;
+      for (uint32_t i = compact.stash_ids.begin; i < compact.stash_ids.end; i++) {
+        stashes.emplace_back(std::string(stash_ids_[i]),
+                             ToRangeSet(RangesOf(stash_locations_[i])));
+      }
+      SourceInfo source(std::move(src_hash), ToRangeSet(reads(cmdindex)),
+                        ToRangeSet(RangesOf(compact.location)), std::move(stashes));
+      return Command(compact.type, cmdindex, std::move(cmdline), compact.patch,
+                     TargetInfo(std::move(tgt_hash), ToRangeSet(writes(cmdindex))),
+                     std::move(source), {});
+    }
+    case Command::Type::ABORT:
+      return Command(compact.type, cmdindex, std::move(cmdline), {}, {}, {}, {});
+    case Command::Type::COMPUTE_HASH_TREE:
+      return Command(compact.type, cmdindex, std::move(cmdline),
+                     HashTreeInfo(ToRangeSet(writes(cmdindex)), ToRangeSet(reads(cmdindex)),
+                                  word(0), word(1), word(2)));
+    default:
+      return {};
+  }
+}
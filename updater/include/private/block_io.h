@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <ostream>
+
+#include "otautil/rangeset.h"
+
+// BlockIo transfers all the ranges of a RangeSet between a block device (or an image file) and a
+// caller-provided buffer, in which the data of the ranges are laid out back to back in RangeSet
+// order. All I/O is offset based, i.e. it never moves the file offset of the underlying fd.
+//
+// An instance is not thread-safe. Threads that need to do I/O concurrently on the same fd should
+// create their own instances.
+class BlockIo {
+ public:
+  enum class Backend {
+    // Issues one pread(2) / pwrite(2) per range.
+    kPread,
+    // Submits the ranges as a batch of requests to an io_uring, one per run of adjacent blocks.
+    kIoUring,
+  };
+
+  virtual ~BlockIo() = default;
+
+  // Creates a BlockIo on 'fd' (which stays owned by the caller), for blocks of 'block_size' bytes.
+  // It falls back to Backend::kPread if the requested backend isn't available at runtime, e.g. on
+  // kernels without io_uring support. Check backend() for the one being used.
+  static std::unique_ptr<BlockIo> Create(int fd, size_t block_size, Backend backend);
+
+  // Reads the blocks in 'ranges' into 'buffer', which must be able to hold
+  // ranges.blocks() * block_size() bytes. Returns false and sets errno on failure.
+  virtual bool Read(const RangeSet& ranges, uint8_t* buffer) = 0;
+
+  // Writes ranges.blocks() * block_size() bytes from 'buffer' to the blocks in 'ranges'. Returns
+  // false and sets errno on failure.
+  virtual bool Write(const RangeSet& ranges, const uint8_t* buffer) = 0;
+
+  // Issues BLKDISCARD for the blocks in 'ranges'. Devices that don't support discard are treated
+  // as success.
+  bool Discard(const RangeSet& ranges);
+
+  // Fills the blocks in 'ranges' with zeros, in the cheapest way the underlying file supports:
+  // BLKZEROOUT for block devices, fallocate(2) for regular files (e.g. the fake block devices of
+  // the update simulator), and vectored writes of a shared zero page otherwise. Returns false and
+  // sets errno on failure.
+  bool Zero(const RangeSet& ranges);
+
+  virtual Backend backend() const = 0;
+
+  int fd() const {
+    return fd_;
+  }
+
+  size_t block_size() const {
+    return block_size_;
+  }
+
+ protected:
+  BlockIo(int fd, size_t block_size) : fd_(fd), block_size_(block_size) {}
+
+  const int fd_;
+  const size_t block_size_;
+
+ private:
+  enum class ZeroMethod {
+    kUnknown,
+    kBlkZeroOut,
+    kZeroRange,
+    kPunchHole,
+    kWrite,
+  };
+
+  bool ZeroBytes(off64_t offset, uint64_t size);
+  bool WriteZeros(off64_t offset, uint64_t size);
+
+  // The way to zero blocks, which is downgraded as the faster ones turn out to be unsupported.
+  ZeroMethod zero_method_{ ZeroMethod::kUnknown };
+};
+
+std::ostream& operator<<(std::ostream& os, BlockIo::Backend backend);
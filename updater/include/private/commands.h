@@ -19,8 +19,10 @@
 #include <stdint.h>
 
 #include <functional>
+#include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <gtest/gtest_prod.h>  // FRIEND_TEST
@@ -139,6 +141,19 @@ class SourceInfo {
     return blocks_;
   }
 
+  const RangeSet& ranges() const {
+    return ranges_;
+  }
+
+  // Where the blocks of ranges() go in the loaded data. Empty if they fill it in order.
+  const RangeSet& location() const {
+    return location_;
+  }
+
+  const std::vector<StashInfo>& stashes() const {
+    return stashes_;
+  }
+
   bool operator==(const SourceInfo& other) const {
     return hash_ == other.hash_ && ranges_ == other.ranges_ && location_ == other.location_ &&
            stashes_ == other.stashes_;
@@ -372,6 +387,7 @@ class Command {
   FRIEND_TEST(CommandsTest, ParseTargetInfoAndSourceInfo_StashesOnly);
   FRIEND_TEST(CommandsTest, ParseTargetInfoAndSourceInfo_SourceBlocksAndStashes);
   FRIEND_TEST(CommandsTest, ParseTargetInfoAndSourceInfo_SourceBlocksOnly);
+  FRIEND_TEST(CompactTransferListTest, GetCommand);
 
   // Parses the target and source info from the given 'tokens' vector. Saves the parsed info into
   // 'target' and 'source' objects. Returns the parsing result. Error message will be set in 'err'
@@ -407,6 +423,18 @@ class Command {
 
 std::ostream& operator<<(std::ostream& os, const Command& command);
 
+// Computes the dependencies among the given commands, which are expected to be consecutive ones
+// from a transfer list. Returns a vector where the i-th element holds the indices (into 'commands')
+// of the earlier commands that commands[i] must not be reordered with, i.e. the edges of a DAG.
+//
+// Command B depends on an earlier command A if B reads or writes any block that A writes, or B
+// writes any block that A reads. Stashes are tracked by their ids: commands that load a stash
+// depend on the ones that create or free it, and vice versa. A move/bsdiff/imgdiff command whose
+// source overlaps its target is considered to create (and free) the stash named after its source
+// hash. All "new" commands depend on each other since they consume the new data stream in order,
+// and an "abort" command depends on everything.
+std::vector<std::vector<size_t>> BuildCommandDependencies(const std::vector<Command>& commands);
+
 // TransferList represents the info for a transfer list, which is parsed from input text lines
 // containing commands to transfer data from one place to another on the target partition.
 //
@@ -473,3 +501,143 @@ class TransferList {
   // Commands in this transfer.
   std::vector<Command> commands_;
 };
+
+// CompactTransferList holds a transfer list that has been parsed once, so that the updater can look
+// up what each command reads and writes, and rebuild the full Command, without parsing it again,
+// e.g. in block_image_verify and then in block_image_update on the same transfer list. The lines
+// are kept as they are, and the ranges of all the commands are stored in a single flat array, with
+// the hashes and stash ids pointing into the lines. This takes a fraction of the memory of the
+// equivalent vector of Command objects, which matters for transfer lists with hundreds of
+// thousands of commands.
+//
+// Lines that aren't valid commands are kept with type LAST, and are left to the caller to report.
+class CompactTransferList {
+ public:
+  // A view of consecutive elements in one of the flat arrays.
+  template <typename T>
+  class Span {
+   public:
+    Span(const T* begin, const T* end) : begin_(begin), end_(end) {}
+
+    const T* begin() const {
+      return begin_;
+    }
+    const T* end() const {
+      return end_;
+    }
+    size_t size() const {
+      return end_ - begin_;
+    }
+    bool empty() const {
+      return begin_ == end_;
+    }
+
+   private:
+    const T* begin_;
+    const T* end_;
+  };
+
+  // Parses the commands in 'transfer_list_str', after the kTransferListHeaderLines header lines.
+  // The header itself is left to the caller. The text is taken over on success, and left as is
+  // otherwise. Returns nullptr if there are fewer lines than that, or if the transfer list is too
+  // large.
+  static std::unique_ptr<CompactTransferList> Parse(std::string&& transfer_list_str);
+
+  // The text that the object was parsed from.
+  const std::string& text() const {
+    return text_;
+  }
+
+  // Returns the i-th line of the text, header lines included.
+  std::string_view line(size_t i) const;
+
+  size_t line_count() const {
+    return lines_.size();
+  }
+
+  // The number of commands, including the empty and invalid lines.
+  size_t size() const {
+    return commands_.size();
+  }
+
+  Command::Type type(size_t cmdindex) const {
+    return commands_[cmdindex].type;
+  }
+
+  std::string_view cmdline(size_t cmdindex) const {
+    return line(cmdindex + TransferList::kTransferListHeaderLines);
+  }
+
+  // The blocks of the partition that command 'cmdindex' reads: the source blocks of move / bsdiff
+  // / imgdiff (excluding the stashed ones), the stashed blocks of stash, and the input of
+  // compute_hash_tree.
+  Span<Range> reads(size_t cmdindex) const {
+    return RangesOf(commands_[cmdindex].reads);
+  }
+
+  // The blocks of the partition that command 'cmdindex' writes.
+  Span<Range> writes(size_t cmdindex) const {
+    return RangesOf(commands_[cmdindex].writes);
+  }
+
+  // Whether the source blocks of a move / bsdiff / imgdiff command overlap its target blocks.
+  bool overlaps(size_t cmdindex) const {
+    return commands_[cmdindex].overlaps;
+  }
+
+  // The ids of the stashes loaded by a move / bsdiff / imgdiff command. They point into text().
+  Span<std::string_view> stash_ids(size_t cmdindex) const {
+    const auto& ids = commands_[cmdindex].stash_ids;
+    return Span<std::string_view>(stash_ids_.data() + ids.begin, stash_ids_.data() + ids.end);
+  }
+
+  // Returns command 'cmdindex' as Command::Parse() would, from the stored fields. Returns an empty
+  // Command for empty or invalid lines.
+  Command GetCommand(size_t cmdindex) const;
+
+ private:
+  // A range of indices into one of the flat arrays.
+  struct Slice {
+    uint32_t begin{ 0 };
+    uint32_t end{ 0 };
+  };
+
+  struct CompactCommand {
+    Command::Type type{ Command::Type::LAST };
+    bool overlaps{ false };
+    Slice reads;
+    Slice writes;
+    // Where the source blocks of a move / bsdiff / imgdiff go in the loaded data.
+    Slice location;
+    // Indices into stash_ids_ and stash_locations_.
+    Slice stash_ids;
+    // The words of the line that the Command keeps as strings, i.e. the hashes, the stash id, or
+    // the arguments of compute_hash_tree. Indices into words_.
+    Slice words;
+    PatchInfo patch;
+  };
+
+  explicit CompactTransferList(std::string text) : text_(std::move(text)) {}
+
+  Span<Range> RangesOf(const Slice& slice) const {
+    return Span<Range>(ranges_.data() + slice.begin, ranges_.data() + slice.end);
+  }
+
+  std::string_view TextOf(const Slice& slice) const {
+    return std::string_view(text_).substr(slice.begin, slice.end - slice.begin);
+  }
+
+  // Appends 'ranges' to ranges_, and returns where they are.
+  Slice AddRanges(const RangeSet& ranges);
+
+  std::string text_;
+  // The offsets of the lines in text_.
+  std::vector<Slice> lines_;
+  std::vector<CompactCommand> commands_;
+  std::vector<Range> ranges_;
+  std::vector<std::string_view> stash_ids_;
+  // The locations of the stashes in stash_ids_, as indices into ranges_.
+  std::vector<Slice> stash_locations_;
+  // The offsets of words in text_.
+  std::vector<Slice> words_;
+};
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// NewDataQueue is a bounded FIFO of decompressed chunks of the new data, which connects the thread
+// that extracts the new data from the package (the producer) to the main thread that writes it
+// out for the "new" commands (the consumer). The producer decompresses up to capacity() bytes ahead
+// of the consumer, which writes the data in chunk-sized pieces. The bytes that the producer holds
+// while it decompresses them count towards capacity() as well, once it reserves them.
+class NewDataQueue {
+ public:
+  NewDataQueue(size_t chunk_size, size_t max_chunks)
+      : chunk_size_(chunk_size), max_chunks_(max_chunks), capacity_(chunk_size * max_chunks) {}
+
+  // The preferred size of the chunks.
+  size_t chunk_size() const {
+    return chunk_size_;
+  }
+
+  // The most bytes that the queue and the producer may hold at once, i.e. 'max_chunks' chunks.
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // Returns an empty buffer with room for chunk_size() bytes, reusing the ones already consumed.
+  std::vector<uint8_t> GetBuffer();
+
+  // Appends a chunk to the queue, waiting while it's full. Returns false if the consumer has
+  // cancelled the queue, in which case the producer should stop.
+  bool Push(std::vector<uint8_t>&& chunk);
+
+  // Reserves 'size' bytes of the capacity, waiting until they're available. A reservation larger
+  // than capacity() is granted once the queue is empty. Returns false if the queue is cancelled.
+  bool Reserve(size_t size);
+
+  // Same as Reserve(), except that it returns false instead of waiting.
+  bool TryReserve(size_t size);
+
+  // Returns 'size' reserved bytes that won't be pushed.
+  void Release(size_t size);
+
+  // Appends a chunk whose size has been reserved, without waiting. Returns false if the queue is
+  // cancelled.
+  bool PushReserved(std::vector<uint8_t>&& chunk);
+
+  // The most bytes that have been queued or reserved at once.
+  size_t peak_bytes() const;
+
+  // Marks the end of the stream. 'success' should be false if the producer ran into an error.
+  void Close(bool success);
+
+  // Waits for the next available data, and returns the unconsumed part of the first chunk. Returns
+  // false if the queue is empty and closed.
+  bool Peek(const uint8_t** data, size_t* size);
+
+  // Consumes 'size' bytes that have been returned by Peek().
+  void Consume(size_t size);
+
+  // Stops the producer. Pending and future Push() calls return false.
+  void Cancel();
+
+  // Returns whether the producer has closed the stream, and the stream has been fully consumed.
+  bool Drained() const;
+
+  // Returns whether the producer closed the stream due to an error.
+  bool Failed() const;
+
+ private:
+  const size_t chunk_size_;
+  const size_t max_chunks_;
+  const size_t capacity_;
+
+  mutable std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<std::vector<uint8_t>> chunks_;
+  // The number of bytes consumed from chunks_.front().
+  size_t front_offset_{ 0 };
+  std::vector<std::vector<uint8_t>> free_buffers_;
+  // The bytes of the queued chunks, plus the ones reserved by the producer.
+  size_t bytes_{ 0 };
+  size_t peak_bytes_{ 0 };
+  bool closed_{ false };
+  bool failed_{ false };
+  bool cancelled_{ false };
+};
+
+// NewDataDecoder decompresses the new data as it's extracted from the package, in pieces of any
+// size, and pushes the result to a NewDataQueue.
+class NewDataDecoder {
+ public:
+  enum class Format {
+    // Uncompressed.
+    kRaw,
+    // A single brotli stream ("*.br").
+    kBrotli,
+    // A sequence of frames that are compressed independently, so that they can be decompressed on
+    // several cores ("*.mbr"). Each frame consists of
+    //   <compressed size: le32> <uncompressed size: le32> <brotli stream of compressed size bytes>
+    kChunkedBrotli,
+  };
+
+  virtual ~NewDataDecoder() = default;
+
+  // Returns the format of the new data file with the given name, based on its extension.
+  static Format GetFormat(const std::string& filename);
+
+  // Creates a decoder that pushes to 'queue', and decompresses kChunkedBrotli frames on up to
+  // 'threads' threads. Frames that don't fit in the capacity of the queue are decompressed as
+  // they're read instead, one at a time.
+  static std::unique_ptr<NewDataDecoder> Create(Format format, NewDataQueue* queue,
+                                                size_t threads);
+
+  // Decompresses the next piece of the input. Returns false on a decoding error, or if the queue
+  // has been cancelled.
+  virtual bool Feed(const uint8_t* data, size_t size) = 0;
+
+  // Flushes the output after the end of the input. Returns false if there's a decoding error or
+  // the input is truncated. The queue is closed either way.
+  virtual bool Finish() = 0;
+
+  // Closes the queue as failed, if the input can't be read.
+  virtual void Abort() = 0;
+};
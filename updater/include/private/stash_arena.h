@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "otautil/rangeset.h"
+#include "private/block_io.h"
+
+// StashArena stores the stashes of an update in a single preallocated file in the stash directory
+// (kArenaFile), instead of one file per stash. The blocks of the arena are handed out to stashes
+// by an in-memory allocator, and the mapping from stash ids to arena blocks is kept in an
+// append-only index file (kIndexFile) with one checksummed record per stash creation or removal:
+//
+//   stash <id> <arena ranges> <crc32>
+//   free <id> <crc32>
+//
+// Writing or freeing a stash only appends a record, without any fsync or directory change. Sync()
+// makes all the stashes so far durable. After a crash, the index is replayed up to the first
+// invalid record. A stash whose blocks have since been given to a later stash is dropped, and the
+// contents of the remaining ones are verified against their ids (i.e. SHA-1) on load as usual.
+//
+// An instance can be used from several threads.
+class StashArena {
+ public:
+  static constexpr const char* kArenaFile = "stash.arena";
+  static constexpr const char* kIndexFile = "stash.index";
+
+  // Returns whether 'dirname' holds an arena.
+  static bool Exists(const std::string& dirname);
+
+  // Opens the arena in 'dirname', or creates one if there's none. The arena is grown to hold at
+  // least 'max_blocks' blocks of 'block_size' bytes. New files are owned by 'uid' / 'gid'.
+  static std::unique_ptr<StashArena> Open(const std::string& dirname, size_t max_blocks,
+                                          size_t block_size, uid_t uid, gid_t gid);
+
+  // Opens the existing arena in 'dirname' without changing anything on disk, e.g. to verify an
+  // update before it's resumed. Write() and Free() fail on such an arena. Returns nullptr if
+  // 'dirname' holds no arena.
+  static std::unique_ptr<StashArena> OpenReadOnly(const std::string& dirname, size_t block_size);
+
+  // Returns the number of blocks of the stash 'id', or 0 if there's no such stash.
+  size_t GetBlocks(const std::string& id) const;
+
+  // Reads the stash 'id' into 'buffer', which is grown if it's too small, and sets 'blocks' to its
+  // number of blocks. Returns false and sets errno on failure, in particular ENOENT if there's no
+  // such stash.
+  bool Read(const std::string& id, std::vector<uint8_t>* buffer, size_t* blocks);
+
+  // Stores 'blocks' blocks from 'data' as the stash 'id', replacing any existing one. The arena
+  // grows if it's full. The stash isn't durable until the next Sync(). Returns false and sets errno
+  // on failure.
+  bool Write(const std::string& id, const uint8_t* data, size_t blocks);
+
+  // Removes the stash 'id' and makes its blocks available for reuse. Returns false if there's no
+  // such stash.
+  bool Free(const std::string& id);
+
+  // Flushes the stash data and the index to storage. Returns false and sets errno on failure.
+  bool Sync();
+
+  // The number of blocks in the arena, and the ones not used by any stash.
+  size_t total_blocks() const;
+  size_t free_blocks() const;
+
+ private:
+  StashArena(const std::string& dirname, size_t block_size, bool read_only,
+             android::base::unique_fd arena_fd, android::base::unique_fd index_fd,
+             std::unique_ptr<BlockIo> io)
+      : dirname_(dirname),
+        block_size_(block_size),
+        read_only_(read_only),
+        arena_fd_(std::move(arena_fd)),
+        index_fd_(std::move(index_fd)),
+        io_(std::move(io)) {}
+
+  // Rebuilds the stashes from the records in the index, and drops anything after the last valid
+  // one (from the file too, unless the arena is read-only).
+  bool LoadIndex();
+  // Rewrites the index with only the live stashes, if it's mostly made of obsolete records.
+  bool CompactIndex();
+  bool AppendRecord(const std::string& record);
+
+  // Extends the arena to 'blocks' blocks.
+  bool Grow(size_t blocks);
+  // Takes 'blocks' free blocks, preferring a single contiguous extent.
+  RangeSet Allocate(size_t blocks);
+  void Release(const RangeSet& ranges);
+  void RemoveLocked(const std::string& id);
+
+  const std::string dirname_;
+  const size_t block_size_;
+  const bool read_only_;
+  android::base::unique_fd arena_fd_;
+  android::base::unique_fd index_fd_;
+
+  mutable std::mutex mu_;
+  std::unique_ptr<BlockIo> io_;
+  size_t total_blocks_{ 0 };
+  // The free extents of the arena, as start block => end block (exclusive).
+  std::map<size_t, size_t> free_extents_;
+  size_t free_blocks_{ 0 };
+  // The arena blocks of each stash.
+  std::unordered_map<std::string, RangeSet> stashes_;
+  // The number of records in the index, and its size in bytes.
+  size_t index_records_{ 0 };
+  off64_t index_size_{ 0 };
+};
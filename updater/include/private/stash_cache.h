@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// StashCache keeps stashes in memory, within a budget of 'max_bytes'. A stash put into the cache is
+// "dirty" until it's written to storage with Flush(), and then stays cached ("clean") until room is
+// needed for new stashes. Only clean stashes are evicted, least recently used first; a stash that
+// doesn't fit otherwise is rejected, and has to be written to storage by the caller.
+//
+// The cache doesn't know about the storage itself. The updater flushes the dirty stashes that are
+// still alive at each checkpoint, so that a stash that's freed before the next checkpoint is never
+// written at all.
+//
+// An instance can be used from several threads.
+class StashCache {
+ public:
+  using Writer = std::function<bool(const std::string& id, const std::vector<uint8_t>& data)>;
+
+  explicit StashCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // Adds a dirty copy of the 'size' bytes at 'data' as the stash 'id'. Returns false if it doesn't
+  // fit in the budget even after evicting all the clean stashes. Does nothing if 'id' is already
+  // cached, as stash ids are the hashes of their contents.
+  bool Put(const std::string& id, const uint8_t* data, size_t size);
+
+  // Returns whether a new stash of 'size' bytes would fit in the budget along with the dirty
+  // stashes, i.e. whether Put() would accept it.
+  bool Fits(size_t size) const;
+
+  // Copies the stash 'id' into 'buffer', which is grown if it's too small, and sets 'size' to its
+  // size. Returns false if it's not cached.
+  bool Get(const std::string& id, std::vector<uint8_t>* buffer, size_t* size);
+
+  bool Contains(const std::string& id) const;
+
+  // Writes the stash 'id' with 'writer' if it's dirty, after which it's clean. Returns false if the
+  // writer fails.
+  bool Flush(const std::string& id, const Writer& writer);
+
+  // Returns the ids of the dirty stashes.
+  std::vector<std::string> GetDirtyIds() const;
+
+  // Returns the total size of the dirty stashes.
+  size_t GetDirtyBytes() const;
+
+  // Removes the stash 'id'. Returns true if it was dirty, i.e. it was never written to storage.
+  bool Erase(const std::string& id);
+
+  size_t max_bytes() const {
+    return max_bytes_;
+  }
+
+ private:
+  struct Entry {
+    std::string id;
+    std::vector<uint8_t> data;
+    bool dirty;
+  };
+
+  size_t DirtyBytesLocked() const;
+
+  const size_t max_bytes_;
+
+  mutable std::mutex mu_;
+  // The cached stashes, most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t bytes_{ 0 };
+};
@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/new_data.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <utility>
+
+#include <android-base/logging.h>
+#include <android-base/memory.h>
+#include <android-base/strings.h>
+#include <brotli/decode.h>
+
+std::vector<uint8_t> NewDataQueue::GetBuffer() {
+  std::vector<uint8_t> buffer;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!free_buffers_.empty()) {
+      buffer = std::move(free_buffers_.back());
+      free_buffers_.pop_back();
+    }
+  }
+  buffer.clear();
+  buffer.reserve(chunk_size_);
+  return buffer;
+}
+
+bool NewDataQueue::Push(std::vector<uint8_t>&& chunk) {
+  return chunk.empty() || (Reserve(chunk.size()) && PushReserved(std::move(chunk)));
+}
+
+bool NewDataQueue::Reserve(size_t size) {
+  std::unique_lock<std::mutex> lock(mu_);
+  cv_.wait(lock, [this, size] { return cancelled_ || bytes_ == 0 || bytes_ + size <= capacity_; });
+  if (cancelled_) {
+    return false;
+  }
+  bytes_ += size;
+  peak_bytes_ = std::max(peak_bytes_, bytes_);
+  return true;
+}
+
+bool NewDataQueue::TryReserve(size_t size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (cancelled_ || (bytes_ != 0 && bytes_ + size > capacity_)) {
+    return false;
+  }
+  bytes_ += size;
+  peak_bytes_ = std::max(peak_bytes_, bytes_);
+  return true;
+}
+
+void NewDataQueue::Release(size_t size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  CHECK_LE(size, bytes_);
+  bytes_ -= size;
+  cv_.notify_all();
+}
+
+bool NewDataQueue::PushReserved(std::vector<uint8_t>&& chunk) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (cancelled_) {
+    return false;
+  }
+  if (!chunk.empty()) {
+    chunks_.push_back(std::move(chunk));
+    cv_.notify_all();
+  }
+  return true;
+}
+
+size_t NewDataQueue::peak_bytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return peak_bytes_;
+}
+
+void NewDataQueue::Close(bool success) {
+  std::lock_guard<std::mutex> lock(mu_);
+  closed_ = true;
+  failed_ = !success;
+  cv_.notify_all();
+}
+
+bool NewDataQueue::Peek(const uint8_t** data, size_t* size) {
+  std::unique_lock<std::mutex> lock(mu_);
+  cv_.wait(lock, [this] { return !chunks_.empty() || closed_; });
+  if (chunks_.empty()) {
+    return false;
+  }
+  *data = chunks_.front().data() + front_offset_;
+  *size = chunks_.front().size() - front_offset_;
+  return true;
+}
+
+void NewDataQueue::Consume(size_t size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  CHECK(!chunks_.empty());
+  front_offset_ += size;
+  CHECK_LE(front_offset_, chunks_.front().size());
+  if (front_offset_ == chunks_.front().size()) {
+    bytes_ -= chunks_.front().size();
+    // Only chunk-sized buffers are reused, not the ones of whole decompressed frames.
+    if (free_buffers_.size() < max_chunks_ && chunks_.front().capacity() <= chunk_size_) {
+      free_buffers_.push_back(std::move(chunks_.front()));
+    }
+    chunks_.pop_front();
+    front_offset_ = 0;
+    cv_.notify_all();
+  }
+}
+
+void NewDataQueue::Cancel() {
+  std::lock_guard<std::mutex> lock(mu_);
+  cancelled_ = true;
+  cv_.notify_all();
+}
+
+bool NewDataQueue::Drained() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return closed_ && chunks_.empty();
+}
+
+bool NewDataQueue::Failed() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return failed_;
+}
+
+namespace {
+
+class RawDecoder : public NewDataDecoder {
+ public:
+  explicit RawDecoder(NewDataQueue* queue) : queue_(queue), buffer_(queue->GetBuffer()) {}
+
+  bool Feed(const uint8_t* data, size_t size) override {
+    while (size > 0) {
+      size_t copy = std::min(size, queue_->chunk_size() - buffer_.size());
+      buffer_.insert(buffer_.end(), data, data + copy);
+      data += copy;
+      size -= copy;
+      if (buffer_.size() == queue_->chunk_size()) {
+        if (!queue_->Push(std::move(buffer_))) {
+          return false;
+        }
+        buffer_ = queue_->GetBuffer();
+      }
+    }
+    return true;
+  }
+
+  bool Finish() override {
+    bool success = queue_->Push(std::move(buffer_));
+    queue_->Close(success);
+    return success;
+  }
+
+  void Abort() override {
+    queue_->Close(false);
+  }
+
+ private:
+  NewDataQueue* queue_;
+  std::vector<uint8_t> buffer_;
+};
+
+// Decompresses a brotli stream into chunks that it pushes to the queue, as the input arrives.
+class BrotliStream {
+ public:
+  explicit BrotliStream(NewDataQueue* queue)
+      : queue_(queue), state_(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr)) {}
+
+  ~BrotliStream() {
+    BrotliDecoderDestroyInstance(state_);
+  }
+
+  // Decompresses the input at '*data', and pushes each chunk that fills up. Stops at the end of the
+  // stream, leaving the input after it in '*data' and '*size'. Returns false on a decoding error,
+  // or if the queue has been cancelled.
+  bool Decode(const uint8_t** data, size_t* size) {
+    while (*size > 0 || BrotliDecoderHasMoreOutput(state_)) {
+      if (buffer_.capacity() == 0) {
+        buffer_ = queue_->GetBuffer();
+      }
+      // Decompress straight into the unused part of the current chunk.
+      size_t used = buffer_.size();
+      buffer_.resize(queue_->chunk_size());
+      size_t available_out = buffer_.size() - used;
+      uint8_t* next_out = buffer_.data() + used;
+
+      // The brotli decoder will update |data|, |size|, |next_out| and |available_out|.
+      BrotliDecoderResult result =
+          BrotliDecoderDecompressStream(state_, size, data, &available_out, &next_out, nullptr);
+      buffer_.resize(buffer_.size() - available_out);
+      decoded_size_ += buffer_.size() - used;
+
+      if (result == BROTLI_DECODER_RESULT_ERROR) {
+        LOG(ERROR) << "Decompression failed with "
+                   << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state_));
+        return false;
+      }
+
+      if (buffer_.size() == queue_->chunk_size() && !queue_->Push(std::move(buffer_))) {
+        return false;
+      }
+      if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+        break;
+      }
+    }
+    return true;
+  }
+
+  // Pushes the partially filled chunk, if any.
+  bool Flush() {
+    return queue_->Push(std::move(buffer_));
+  }
+
+  // Returns whether the end of the stream has been decoded.
+  bool Finished() const {
+    return BrotliDecoderIsFinished(state_);
+  }
+
+  // The number of bytes decoded so far.
+  uint64_t decoded_size() const {
+    return decoded_size_;
+  }
+
+ private:
+  NewDataQueue* queue_;
+  BrotliDecoderState* state_;
+  std::vector<uint8_t> buffer_;
+  uint64_t decoded_size_{ 0 };
+};
+
+class BrotliDecoder : public NewDataDecoder {
+ public:
+  explicit BrotliDecoder(NewDataQueue* queue) : queue_(queue), stream_(queue) {}
+
+  bool Feed(const uint8_t* data, size_t size) override {
+    // Anything after the end of the stream is ignored.
+    return stream_.Decode(&data, &size);
+  }
+
+  bool Finish() override {
+    // The input may have ended in the middle of the stream.
+    if (!stream_.Finished()) {
+      LOG(ERROR) << "Truncated brotli new data";
+      queue_->Close(false);
+      return false;
+    }
+    bool success = stream_.Flush();
+    queue_->Close(success);
+    return success;
+  }
+
+  void Abort() override {
+    queue_->Close(false);
+  }
+
+ private:
+  NewDataQueue* queue_;
+  BrotliStream stream_;
+};
+
+class ChunkedBrotliDecoder : public NewDataDecoder {
+ public:
+  ChunkedBrotliDecoder(NewDataQueue* queue, size_t threads)
+      : queue_(queue), threads_(std::max<size_t>(threads, 1)) {}
+
+  ~ChunkedBrotliDecoder() override {
+    // Wait for the decompression in progress, which refers to the frames.
+    for (auto& frame : frames_) {
+      if (frame.result.valid()) frame.result.wait();
+    }
+  }
+
+  bool Feed(const uint8_t* data, size_t size) override {
+    while (size > 0) {
+      // Read the header of the next frame.
+      if (header_.size() < kHeaderSize) {
+        size_t copy = std::min(size, kHeaderSize - header_.size());
+        header_.insert(header_.end(), data, data + copy);
+        data += copy;
+        size -= copy;
+        if (header_.size() < kHeaderSize) {
+          break;
+        }
+        if (!StartFrame()) {
+          return false;
+        }
+      }
+
+      size_t copy = std::min<size_t>(size, compressed_size_ - compressed_read_);
+      if (stream_) {
+        const uint8_t* next = data;
+        size_t left = copy;
+        if (!stream_->Decode(&next, &left)) {
+          return false;
+        }
+        if (left > 0 || stream_->decoded_size() > uncompressed_size_) {
+          LOG(ERROR) << "Frame of new data doesn't decompress to " << uncompressed_size_ << " bytes";
+          return false;
+        }
+      } else {
+        compressed_.insert(compressed_.end(), data, data + copy);
+      }
+      compressed_read_ += copy;
+      data += copy;
+      size -= copy;
+      if (compressed_read_ == compressed_size_ && !FinishFrame()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Finish() override {
+    bool success = true;
+    while (success && !frames_.empty()) {
+      success = PushFront();
+    }
+    if (success && !header_.empty()) {
+      LOG(ERROR) << "Truncated frame of new data";
+      success = false;
+    }
+    queue_->Close(success);
+    return success;
+  }
+
+  void Abort() override {
+    queue_->Close(false);
+  }
+
+ private:
+  static constexpr size_t kHeaderSize = 8;
+  static constexpr uint32_t kMaxFrameSize = 64 * 1024 * 1024;
+
+  struct Frame {
+    std::vector<uint8_t> compressed;
+    std::vector<uint8_t> uncompressed;
+    std::future<bool> result;
+  };
+
+  // Checks the header of the frame that's been read, and makes room for the frame. A frame whose
+  // compressed and uncompressed bytes fit in the capacity of the queue is read whole, and then
+  // decompressed on a thread, with its bytes reserved in the queue meanwhile. A bigger frame is
+  // decompressed as it's read, after the frames before it have been pushed.
+  bool StartFrame() {
+    compressed_size_ = android::base::get_unaligned<uint32_t>(header_.data());
+    uncompressed_size_ = android::base::get_unaligned<uint32_t>(header_.data() + 4);
+    compressed_read_ = 0;
+    if (compressed_size_ == 0 || compressed_size_ > kMaxFrameSize ||
+        uncompressed_size_ > kMaxFrameSize) {
+      LOG(ERROR) << "Invalid frame of new data: " << compressed_size_ << " compressed bytes, "
+                 << uncompressed_size_ << " uncompressed bytes";
+      return false;
+    }
+
+    size_t frame_bytes = size_t{ compressed_size_ } + uncompressed_size_;
+    if (frame_bytes > queue_->capacity()) {
+      while (!frames_.empty()) {
+        if (!PushFront()) {
+          return false;
+        }
+      }
+      stream_ = std::make_unique<BrotliStream>(queue_);
+      return true;
+    }
+
+    // Push the frames that are done to free up their threads and bytes, but wait for the queue to
+    // be drained only when there's nothing left to push.
+    while (frames_.size() >= threads_ || !queue_->TryReserve(frame_bytes)) {
+      if (frames_.empty()) {
+        if (!queue_->Reserve(frame_bytes)) {
+          return false;
+        }
+        break;
+      }
+      if (!PushFront()) {
+        return false;
+      }
+    }
+    compressed_.reserve(compressed_size_);
+    return true;
+  }
+
+  // Finishes the frame whose compressed bytes have all been read.
+  bool FinishFrame() {
+    header_.clear();
+    if (stream_) {
+      bool success = stream_->Finished() && stream_->decoded_size() == uncompressed_size_;
+      if (!success) {
+        LOG(ERROR) << "Failed to decompress a frame of " << compressed_size_ << " bytes";
+      }
+      success = success && stream_->Flush();
+      stream_.reset();
+      return success;
+    }
+    Dispatch();
+    return true;
+  }
+
+  // Starts decompressing the frame that has been read.
+  void Dispatch() {
+    frames_.emplace_back();
+    Frame& frame = frames_.back();
+    frame.compressed = std::move(compressed_);
+    frame.uncompressed.resize(uncompressed_size_);
+    compressed_.clear();
+    frame.result = std::async(std::launch::async, [&frame]() {
+      size_t decoded_size = frame.uncompressed.size();
+      if (BrotliDecoderDecompress(frame.compressed.size(), frame.compressed.data(), &decoded_size,
+                                  frame.uncompressed.data()) != BROTLI_DECODER_RESULT_SUCCESS ||
+          decoded_size != frame.uncompressed.size()) {
+        LOG(ERROR) << "Failed to decompress a frame of " << frame.compressed.size() << " bytes";
+        return false;
+      }
+      return true;
+    });
+  }
+
+  // Waits for the first frame and pushes it to the queue, in the bytes reserved for it.
+  bool PushFront() {
+    Frame& frame = frames_.front();
+    size_t compressed_size = frame.compressed.size();
+    size_t uncompressed_size = frame.uncompressed.size();
+    bool pushed = frame.result.get() && queue_->PushReserved(std::move(frame.uncompressed));
+    frames_.pop_front();
+    // The reservation of the pushed chunk goes with it.
+    queue_->Release(compressed_size + (pushed ? 0 : uncompressed_size));
+    return pushed;
+  }
+
+  NewDataQueue* queue_;
+  const size_t threads_;
+
+  // The frame being read.
+  std::vector<uint8_t> header_;
+  uint32_t compressed_size_{ 0 };
+  uint32_t uncompressed_size_{ 0 };
+  uint32_t compressed_read_{ 0 };
+  // The compressed bytes of the frame being read, unless it's decompressed by |stream_| as it's
+  // read.
+  std::vector<uint8_t> compressed_;
+  std::unique_ptr<BrotliStream> stream_;
+
+  // The frames being decompressed, in order.
+  std::deque<Frame> frames_;
+};
+
+}  // namespace
+
+NewDataDecoder::Format NewDataDecoder::GetFormat(const std::string& filename) {
+  if (android::base::EndsWith(filename, ".mbr")) {
+    return Format::kChunkedBrotli;
+  }
+  if (android::base::EndsWith(filename, ".br")) {
+    return Format::kBrotli;
+  }
+  return Format::kRaw;
+}
+
+std::unique_ptr<NewDataDecoder> NewDataDecoder::Create(Format format, NewDataQueue* queue,
+                                                       size_t threads) {
+  switch (format) {
+    case Format::kRaw:
+      return std::make_unique<RawDecoder>(queue);
+    case Format::kBrotli:
+      return std::make_unique<BrotliDecoder>(queue);
+    case Format::kChunkedBrotli:
+      return std::make_unique<ChunkedBrotliDecoder>(queue, threads);
+  }
+  return nullptr;
+}
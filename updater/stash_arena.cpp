@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/stash_arena.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <zlib.h>
+
+static std::string MakeRecord(const std::string& body) {
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(body.data()), body.size());
+  return android::base::StringPrintf("%s %08x\n", body.c_str(), crc);
+}
+
+// Returns the body of the record in 'line' (without the trailing newline), or an empty string if
+// the checksum doesn't match.
+static std::string CheckRecord(const std::string& line) {
+  size_t pos = line.rfind(' ');
+  uint32_t crc;
+  if (pos == std::string::npos ||
+      !android::base::ParseUint("0x" + line.substr(pos + 1), &crc)) {
+    return "";
+  }
+  std::string body = line.substr(0, pos);
+  if (crc != crc32(0, reinterpret_cast<const Bytef*>(body.data()), body.size())) {
+    return "";
+  }
+  return body;
+}
+
+static bool FsyncDir(const std::string& dirname) {
+  android::base::unique_fd dfd(TEMP_FAILURE_RETRY(open(dirname.c_str(), O_RDONLY | O_DIRECTORY)));
+  if (dfd == -1 || fsync(dfd) == -1) {
+    PLOG(ERROR) << "Failed to fsync " << dirname;
+    return false;
+  }
+  return true;
+}
+
+static android::base::unique_fd OpenFile(const std::string& path, int flags, uid_t uid,
+                                         gid_t gid) {
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CLOEXEC | flags, 0600)));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return {};
+  }
+  if (fchown(fd, uid, gid) != 0) {
+    PLOG(ERROR) << "Failed to chown " << path;
+    return {};
+  }
+  return fd;
+}
+
+bool StashArena::Exists(const std::string& dirname) {
+  return access((dirname + "/" + kIndexFile).c_str(), F_OK) == 0;
+}
+
+std::unique_ptr<StashArena> StashArena::Open(const std::string& dirname, size_t max_blocks,
+                                             size_t block_size, uid_t uid, gid_t gid) {
+  bool exists = Exists(dirname);
+  android::base::unique_fd arena_fd = OpenFile(dirname + "/" + kArenaFile, O_CREAT, uid, gid);
+  android::base::unique_fd index_fd = OpenFile(dirname + "/" + kIndexFile, O_CREAT, uid, gid);
+  if (arena_fd == -1 || index_fd == -1) {
+    return nullptr;
+  }
+
+  struct stat sb;
+  if (fstat(arena_fd, &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat the stash arena";
+    return nullptr;
+  }
+
+  auto io = BlockIo::Create(arena_fd, block_size, BlockIo::Backend::kPread);
+  std::unique_ptr<StashArena> arena(new StashArena(dirname, block_size, false,
+                                                   std::move(arena_fd), std::move(index_fd),
+                                                   std::move(io)));
+  arena->total_blocks_ = sb.st_size / block_size;
+  if (!arena->LoadIndex() || !arena->CompactIndex()) {
+    return nullptr;
+  }
+  if (max_blocks > arena->total_blocks_ && !arena->Grow(max_blocks)) {
+    return nullptr;
+  }
+  // Make the new files durable, so that the later records aren't lost with them.
+  if (!exists && (!arena->Sync() || !FsyncDir(dirname))) {
+    return nullptr;
+  }
+
+  LOG(INFO) << (exists ? "using existing" : "created") << " stash arena in " << dirname << " with "
+            << arena->stashes_.size() << " stashes, " << arena->free_blocks_ << " of "
+            << arena->total_blocks_ << " blocks free";
+  return arena;
+}
+
+std::unique_ptr<StashArena> StashArena::OpenReadOnly(const std::string& dirname,
+                                                     size_t block_size) {
+  if (!Exists(dirname)) {
+    return nullptr;
+  }
+  android::base::unique_fd arena_fd(TEMP_FAILURE_RETRY(
+      open((dirname + "/" + kArenaFile).c_str(), O_RDONLY | O_CLOEXEC)));
+  android::base::unique_fd index_fd(TEMP_FAILURE_RETRY(
+      open((dirname + "/" + kIndexFile).c_str(), O_RDONLY | O_CLOEXEC)));
+  struct stat sb;
+  if (arena_fd == -1 || index_fd == -1 || fstat(arena_fd, &sb) == -1) {
+    PLOG(ERROR) << "Failed to open the stash arena in " << dirname;
+    return nullptr;
+  }
+
+  auto io = BlockIo::Create(arena_fd, block_size, BlockIo::Backend::kPread);
+  std::unique_ptr<StashArena> arena(new StashArena(dirname, block_size, true,
+                                                   std::move(arena_fd), std::move(index_fd),
+                                                   std::move(io)));
+  arena->total_blocks_ = sb.st_size / block_size;
+  if (!arena->LoadIndex()) {
+    return nullptr;
+  }
+
+  LOG(INFO) << "reading stash arena in " << dirname << " with " << arena->stashes_.size()
+            << " stashes";
+  return arena;
+}
+
+bool StashArena::LoadIndex() {
+  struct stat sb;
+  if (fstat(index_fd_, &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat the stash index";
+    return false;
+  }
+  std::string content(sb.st_size, '\0');
+  if (!android::base::ReadFullyAtOffset(index_fd_, content.data(), content.size(), 0)) {
+    PLOG(ERROR) << "Failed to read the stash index";
+    return false;
+  }
+
+  // Replay the records up to the first incomplete or corrupted one, which (along with anything
+  // after it) was being written when the update was interrupted.
+  size_t offset = 0;
+  for (size_t end; (end = content.find('\n', offset)) != std::string::npos; offset = end + 1) {
+    std::vector<std::string> tokens =
+        android::base::Split(CheckRecord(content.substr(offset, end - offset)), " ");
+    if (tokens.size() == 3 && tokens[0] == "stash") {
+      RangeSet ranges = RangeSet::Parse(tokens[2]);
+      if (!ranges) {
+        break;
+      }
+      stashes_.erase(tokens[1]);
+      // The blocks may have been freed by a record that was lost, and then given to this stash.
+      for (auto it = stashes_.begin(); it != stashes_.end();) {
+        it = it->second.Overlaps(ranges) ? stashes_.erase(it) : std::next(it);
+      }
+      stashes_.emplace(tokens[1], std::move(ranges));
+    } else if (tokens.size() == 2 && tokens[0] == "free") {
+      stashes_.erase(tokens[1]);
+    } else {
+      break;
+    }
+    index_records_++;
+  }
+
+  if (offset != content.size()) {
+    LOG(WARNING) << "Dropping " << content.size() - offset << " bytes of invalid stash records";
+    if (!read_only_ && ftruncate(index_fd_, offset) == -1) {
+      PLOG(ERROR) << "Failed to truncate the stash index";
+      return false;
+    }
+  }
+  index_size_ = offset;
+
+  // The arena may have lost its trailing blocks, if it was being grown.
+  for (auto it = stashes_.begin(); it != stashes_.end();) {
+    bool in_arena = std::all_of(it->second.cbegin(), it->second.cend(),
+                                [this](const Range& r) { return r.second <= total_blocks_; });
+    it = in_arena ? std::next(it) : stashes_.erase(it);
+  }
+
+  // Everything that isn't used by a stash is free.
+  std::vector<Range> used;
+  for (const auto& [id, ranges] : stashes_) {
+    used.insert(used.end(), ranges.cbegin(), ranges.cend());
+  }
+  std::sort(used.begin(), used.end());
+  size_t next = 0;
+  for (const auto& [begin, end] : used) {
+    if (begin > next) {
+      free_extents_.emplace(next, begin);
+      free_blocks_ += begin - next;
+    }
+    next = end;
+  }
+  if (total_blocks_ > next) {
+    free_extents_.emplace(next, total_blocks_);
+    free_blocks_ += total_blocks_ - next;
+  }
+  return true;
+}
+
+bool StashArena::CompactIndex() {
+  if (index_records_ <= 2 * stashes_.size() + 64) {
+    return true;
+  }
+
+  std::string content;
+  for (const auto& [id, ranges] : stashes_) {
+    content += MakeRecord("stash " + id + " " + ranges.ToString());
+  }
+
+  std::string index_path = dirname_ + "/" + kIndexFile;
+  std::string tmp_path = index_path + ".tmp";
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  struct stat sb;
+  if (fd == -1 || fstat(index_fd_, &sb) == -1 || fchown(fd, sb.st_uid, sb.st_gid) != 0 ||
+      !android::base::WriteStringToFd(content, fd) || fsync(fd) == -1) {
+    PLOG(ERROR) << "Failed to write " << tmp_path;
+    return false;
+  }
+  if (rename(tmp_path.c_str(), index_path.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename " << tmp_path;
+    return false;
+  }
+  if (!FsyncDir(dirname_)) {
+    return false;
+  }
+
+  LOG(INFO) << "Compacted the stash index from " << index_records_ << " to " << stashes_.size()
+            << " records";
+  index_fd_ = std::move(fd);
+  index_records_ = stashes_.size();
+  index_size_ = content.size();
+  return true;
+}
+
+bool StashArena::AppendRecord(const std::string& record) {
+  if (!android::base::WriteFullyAtOffset(index_fd_, record.data(), record.size(), index_size_)) {
+    PLOG(ERROR) << "Failed to append to the stash index";
+    return false;
+  }
+  index_size_ += record.size();
+  index_records_++;
+  return true;
+}
+
+bool StashArena::Grow(size_t blocks) {
+  off64_t offset = static_cast<off64_t>(total_blocks_) * block_size_;
+  off64_t length = static_cast<off64_t>(blocks - total_blocks_) * block_size_;
+  // Reserve the space on the filesystem up front, so that writing a stash doesn't run out of it.
+  if (fallocate(arena_fd_, 0, offset, length) == -1) {
+    if (errno != EOPNOTSUPP) {
+      PLOG(ERROR) << "Failed to grow the stash arena to " << blocks << " blocks";
+      return false;
+    }
+    if (ftruncate(arena_fd_, offset + length) == -1) {
+      PLOG(ERROR) << "Failed to grow the stash arena to " << blocks << " blocks";
+      return false;
+    }
+  }
+  Release(RangeSet({ { total_blocks_, blocks } }));
+  total_blocks_ = blocks;
+  return true;
+}
+
+RangeSet StashArena::Allocate(size_t blocks) {
+  RangeSet result;
+  // Best fit: the smallest extent that holds all the blocks.
+  auto best = free_extents_.end();
+  for (auto it = free_extents_.begin(); it != free_extents_.end(); ++it) {
+    size_t size = it->second - it->first;
+    if (size >= blocks && (best == free_extents_.end() || size < best->second - best->first)) {
+      best = it;
+    }
+  }
+  if (best != free_extents_.end()) {
+    result.PushBack({ best->first, best->first + blocks });
+    if (best->second - best->first > blocks) {
+      free_extents_.emplace(best->first + blocks, best->second);
+    }
+    free_extents_.erase(best);
+    free_blocks_ -= blocks;
+    return result;
+  }
+
+  // Otherwise spread the stash over the extents, from the largest one.
+  std::vector<std::pair<size_t, size_t>> extents(free_extents_.begin(), free_extents_.end());
+  std::sort(extents.begin(), extents.end(), [](const auto& a, const auto& b) {
+    return a.second - a.first > b.second - b.first;
+  });
+  for (const auto& [begin, end] : extents) {
+    size_t take = std::min(blocks - result.blocks(), end - begin);
+    result.PushBack({ begin, begin + take });
+    free_extents_.erase(begin);
+    if (begin + take < end) {
+      free_extents_.emplace(begin + take, end);
+    }
+    if (result.blocks() == blocks) {
+      break;
+    }
+  }
+  free_blocks_ -= blocks;
+  return result;
+}
+
+void StashArena::Release(const RangeSet& ranges) {
+  for (const auto& [begin, end] : ranges) {
+    auto [it, inserted] = free_extents_.emplace(begin, end);
+    CHECK(inserted);
+    // Merge with the adjacent extents.
+    auto next = std::next(it);
+    if (next != free_extents_.end() && next->first == it->second) {
+      it->second = next->second;
+      free_extents_.erase(next);
+    }
+    if (it != free_extents_.begin()) {
+      auto prev = std::prev(it);
+      if (prev->second == it->first) {
+        prev->second = it->second;
+        free_extents_.erase(it);
+      }
+    }
+    free_blocks_ += end - begin;
+  }
+}
+
+void StashArena::RemoveLocked(const std::string& id) {
+  auto it = stashes_.find(id);
+  if (it != stashes_.end()) {
+    Release(it->second);
+    stashes_.erase(it);
+  }
+}
+
+size_t StashArena::GetBlocks(const std::string& id) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = stashes_.find(id);
+  return it == stashes_.end() ? 0 : it->second.blocks();
+}
+
+bool StashArena::Read(const std::string& id, std::vector<uint8_t>* buffer, size_t* blocks) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = stashes_.find(id);
+  if (it == stashes_.end()) {
+    errno = ENOENT;
+    return false;
+  }
+  *blocks = it->second.blocks();
+  if (buffer->size() < *blocks * block_size_) {
+    buffer->resize(*blocks * block_size_);
+  }
+  return io_->Read(it->second, buffer->data());
+}
+
+bool StashArena::Write(const std::string& id, const uint8_t* data, size_t blocks) {
+  if (read_only_) {
+    LOG(ERROR) << "Can't write stash " << id << " to a read-only stash arena";
+    errno = EROFS;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  RemoveLocked(id);
+  if (blocks > free_blocks_) {
+    LOG(WARNING) << "Growing the stash arena by " << blocks - free_blocks_ << " blocks";
+    if (!Grow(total_blocks_ + blocks - free_blocks_)) {
+      return false;
+    }
+  }
+
+  RangeSet ranges = Allocate(blocks);
+  // The data goes first, so that a record is never replayed for blocks that were never written;
+  // a stash with torn contents is caught when it's verified on load.
+  if (!io_->Write(ranges, data)) {
+    PLOG(ERROR) << "Failed to write " << blocks << " blocks of stash " << id;
+    Release(ranges);
+    return false;
+  }
+  if (!AppendRecord(MakeRecord("stash " + id + " " + ranges.ToString()))) {
+    Release(ranges);
+    return false;
+  }
+  stashes_.emplace(id, std::move(ranges));
+  return true;
+}
+
+bool StashArena::Free(const std::string& id) {
+  if (read_only_) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  if (stashes_.find(id) == stashes_.end()) {
+    return false;
+  }
+  RemoveLocked(id);
+  // A lost free record only leaks the blocks until the stash is deleted, so it's not synced.
+  if (!AppendRecord(MakeRecord("free " + id))) {
+    LOG(WARNING) << "Failed to record the removal of stash " << id;
+  }
+  return true;
+}
+
+bool StashArena::Sync() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (fdatasync(arena_fd_) == -1) {
+    PLOG(ERROR) << "Failed to sync the stash arena";
+    return false;
+  }
+  if (fdatasync(index_fd_) == -1) {
+    PLOG(ERROR) << "Failed to sync the stash index";
+    return false;
+  }
+  return true;
+}
+
+size_t StashArena::total_blocks() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return total_blocks_;
+}
+
+size_t StashArena::free_blocks() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return free_blocks_;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/stash_cache.h"
+
+#include <string.h>
+
+bool StashCache::Put(const std::string& id, const uint8_t* data, size_t size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (index_.find(id) != index_.end()) {
+    return true;
+  }
+  // Check that evicting the clean stashes would make enough room before evicting any of them.
+  if (size > max_bytes_ || DirtyBytesLocked() > max_bytes_ - size) {
+    return false;
+  }
+
+  for (auto it = entries_.end(); bytes_ + size > max_bytes_;) {
+    --it;
+    if (it->dirty) {
+      continue;
+    }
+    bytes_ -= it->data.size();
+    index_.erase(it->id);
+    it = entries_.erase(it);
+  }
+
+  entries_.push_front(Entry{ id, std::vector<uint8_t>(data, data + size), true });
+  index_[id] = entries_.begin();
+  bytes_ += size;
+  return true;
+}
+
+bool StashCache::Fits(size_t size) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return size <= max_bytes_ && DirtyBytesLocked() <= max_bytes_ - size;
+}
+
+size_t StashCache::DirtyBytesLocked() const {
+  size_t dirty_bytes = 0;
+  for (const auto& entry : entries_) {
+    if (entry.dirty) {
+      dirty_bytes += entry.data.size();
+    }
+  }
+  return dirty_bytes;
+}
+
+bool StashCache::Get(const std::string& id, std::vector<uint8_t>* buffer, size_t* size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = index_.find(id);
+  if (it == index_.end()) {
+    return false;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+
+  const auto& data = it->second->data;
+  if (buffer->size() < data.size()) {
+    buffer->resize(data.size());
+  }
+  memcpy(buffer->data(), data.data(), data.size());
+  *size = data.size();
+  return true;
+}
+
+bool StashCache::Contains(const std::string& id) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return index_.find(id) != index_.end();
+}
+
+bool StashCache::Flush(const std::string& id, const Writer& writer) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = index_.find(id);
+  if (it == index_.end() || !it->second->dirty) {
+    return true;
+  }
+  if (!writer(id, it->second->data)) {
+    return false;
+  }
+  it->second->dirty = false;
+  return true;
+}
+
+std::vector<std::string> StashCache::GetDirtyIds() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::vector<std::string> ids;
+  for (const auto& entry : entries_) {
+    if (entry.dirty) {
+      ids.push_back(entry.id);
+    }
+  }
+  return ids;
+}
+
+size_t StashCache::GetDirtyBytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return DirtyBytesLocked();
+}
+
+bool StashCache::Erase(const std::string& id) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = index_.find(id);
+  if (it == index_.end()) {
+    return false;
+  }
+  bool dirty = it->second->dirty;
+  bytes_ -= it->second->data.size();
+  entries_.erase(it->second);
+  index_.erase(it);
+  return dirty;
+}